@@ -0,0 +1,334 @@
+#ifndef CONCURRENT_HASH_H
+#define CONCURRENT_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <atomic>
+
+// A variant of SimpleHash (see blockchain.cpp) which any number of threads may insert into at the same time, while other
+// threads call find.
+//
+// Like SimpleHash, every entry lives in one pre-allocated array and the buckets are singly linked lists threaded through it;
+// nothing is ever allocated per insert.  The difference is how an entry gets into the table:
+//
+//   1. A slot in the entry array is claimed, either with a compare-and-swap on the entry count (insert, reserve) or because
+//      the caller already knows which slot the key belongs in (insertAt).  The count is only ever swapped to a value which
+//      fits, so a reservation which fails leaves the table as it was.  Slots are never shared, so the key is copied into its
+//      slot without any synchronization.
+//   2. The entry is pushed onto the front of its bucket with a compare-and-swap on the bucket head; on failure the new head
+//      is loaded into the entry's next pointer and the swap retried.  The swap is a release, so anybody who can reach the
+//      entry through a find also sees the key written in step 1.
+//
+// Because a bucket head is the only shared word an insert writes, inserters only contend when they land in the same bucket
+// at the same moment, which with millions of buckets is very rare; inserts scale with the number of threads until memory
+// bandwidth runs out.
+//
+// What the table does *not* do is reject duplicates; like SimpleHash it is up to the caller to find before inserting if that
+// matters.  Two threads inserting the same key at the same time both succeed and find returns whichever got in last.
+//
+// getKey(i) and size() refer to claimed slots.  A slot which another thread is still filling in must not be read; in practice
+// this means waiting for the inserters (joining them, or some other synchronization) before walking the table by index.
+// removeLast, like the inserts of SimpleHash, may only be called by one thread while nobody inserts; readers in find may
+// keep going since the removed entry is unlinked but left intact.
+
+template < class Key,
+	uint32_t hashTableSize = 512,		// *MUST* be a power of 2!
+	uint32_t hashTableEntries = 2048 >
+
+class ConcurrentHash
+{
+public:
+	class HashEntry
+	{
+	public:
+		HashEntry(void)
+		{
+			mNext.store(NULL,std::memory_order_relaxed);
+		}
+		Key							mKey;
+		std::atomic< HashEntry * >	mNext;
+	};
+
+	class Iterator
+	{
+		friend class ConcurrentHash;
+	public:
+		Iterator(void)
+		{
+			mHashIndex = 0;
+			mEntry = NULL;
+		}
+
+		Key * first(void) const
+		{
+			return mEntry ? &mEntry->mKey : NULL;
+		}
+
+		bool empty(void) const
+		{
+			return mEntry == NULL ? true : false;
+		}
+
+	private:
+		uint32_t	mHashIndex;
+		HashEntry	*mEntry;
+	};
+
+	inline Iterator begin(void) const
+	{
+		Iterator ret;
+		for (uint32_t i=0; i<hashTableSize; i++)
+		{
+			HashEntry *h = mHashTable[i].load(std::memory_order_acquire);
+			if ( h )
+			{
+				ret.mHashIndex = i;
+				ret.mEntry = h;
+				break;
+			}
+		}
+		return ret;
+	}
+
+	inline bool next(Iterator &iter) const
+	{
+		bool ret = false;
+
+		HashEntry *n = iter.mEntry ? iter.mEntry->mNext.load(std::memory_order_acquire) : NULL;
+		if ( n )
+		{
+			iter.mEntry = n;
+			ret = true;
+		}
+		else
+		{
+			iter.mEntry = NULL;
+			for (uint32_t i=iter.mHashIndex+1; i<hashTableSize; i++)
+			{
+				HashEntry *h = mHashTable[i].load(std::memory_order_acquire);
+				if ( h )
+				{
+					iter.mHashIndex = i;
+					iter.mEntry = h;
+					ret = true;
+					break;
+				}
+			}
+		}
+		return ret;
+	}
+
+	inline bool empty(void) const
+	{
+		return size() ? false : true;
+	}
+
+	ConcurrentHash(void)
+	{
+		mEntries = NULL;
+		mHashTableCount.store(0,std::memory_order_relaxed);
+		mHighWater = 0;
+		for (uint32_t i = 0; i < hashTableSize; i++)
+		{
+			mHashTable[i].store(NULL,std::memory_order_relaxed);
+		}
+	}
+
+	// Allocates the entry array.  Unlike the other methods this is not thread safe; insert calls it for convenience, but when
+	// several threads are about to insert, call it once up front.
+	inline void init(void)
+	{
+		if ( mEntries == NULL )
+		{
+			mEntries = new HashEntry[hashTableEntries];
+		}
+	}
+
+	~ConcurrentHash(void)
+	{
+		delete []mEntries;
+	}
+
+	inline uint32_t getIndex(const Key *k) const
+	{
+		assert(k);
+		HashEntry *h = (HashEntry *)k;
+		return (uint32_t)(h-mEntries);
+	}
+
+	inline Key * getKey(uint32_t i) const
+	{
+		Key *ret = NULL;
+		uint32_t count = mHashTableCount.load(std::memory_order_acquire);
+		assert( i < count );
+		if ( i < count )
+		{
+			ret = &mEntries[i].mKey;
+		}
+		return ret;
+	}
+
+	// Safe to call while other threads insert.
+	inline Key* find(const Key& key) const
+	{
+		Key* ret = NULL;
+		uint32_t hash = getHash(key);
+		HashEntry* h = mHashTable[hash].load(std::memory_order_acquire);
+		while (h)
+		{
+			if (h->mKey == key)
+			{
+				ret = &h->mKey;
+				break;
+			}
+			h = h->mNext.load(std::memory_order_acquire);
+		}
+		return ret;
+	}
+
+	// Claims 'count' consecutive slots and returns the index of the first; fill them in with insertAt.  This lets a thread
+	// which inserts a batch of keys pay for one atomic update instead of one per key, and lets the caller decide the order
+	// the keys end up in by index.  Returns 0xFFFFFFFF, and claims nothing, if the slots do not fit; smaller reservations
+	// made afterwards may still succeed.
+	inline uint32_t reserve(uint32_t count)
+	{
+		uint32_t ret = mHashTableCount.load(std::memory_order_relaxed);
+		do
+		{
+			if ( (uint64_t)ret+count > hashTableEntries )
+			{
+				assert(0); // we should never run out of hash entries
+				return 0xFFFFFFFF;
+			}
+		} while ( !mHashTableCount.compare_exchange_weak(ret,ret+count,std::memory_order_relaxed,std::memory_order_relaxed) );
+		return ret;
+	}
+
+	// Stores 'key' in slot 'index', which must have been claimed by this thread (see reserve), and links it into its bucket.
+	inline Key * insertAt(uint32_t index,const Key& key)
+	{
+		Key *ret = NULL;
+		assert( mEntries && index < hashTableEntries );
+		if ( index < hashTableEntries )
+		{
+			HashEntry *h = &mEntries[index];
+			h->mKey = key;
+			ret = &h->mKey;
+			std::atomic< HashEntry * > &head = mHashTable[getHash(key)];
+			HashEntry *first = head.load(std::memory_order_relaxed);
+			do
+			{
+				h->mNext.store(first,std::memory_order_relaxed);
+			} while ( !head.compare_exchange_weak(first,h,std::memory_order_release,std::memory_order_relaxed) );
+		}
+		return ret;
+	}
+
+	inline Key * insert(const Key& key)
+	{
+		Key *ret = NULL;
+		init(); // allocate the entries table
+		uint32_t index = reserve(1);
+		if ( index != 0xFFFFFFFF )
+		{
+			ret = insertAt(index,key);
+		}
+		return ret;
+	}
+
+	inline uint32_t size(void) const
+	{
+		uint32_t ret = mHashTableCount.load(std::memory_order_acquire);
+		return ret < hashTableEntries ? ret : hashTableEntries;
+	}
+
+	// Removes the entry in the highest slot.  With several inserters the newest slot is not necessarily at the head of its
+	// bucket any more, so the bucket is searched for it; buckets are short, so this is still close to constant time.  The
+	// entry is left intact for readers which may still be walking through it.
+	inline void removeLast(void)
+	{
+		uint32_t count = size();
+		assert( count );
+		if ( count )
+		{
+			if ( count > mHighWater )
+			{
+				mHighWater = count;	// only removing can lower the count, so this is the only place the peak can be missed
+			}
+			HashEntry *h = &mEntries[count-1];
+			std::atomic< HashEntry * > *link = &mHashTable[getHash(h->mKey)];
+			HashEntry *scan = link->load(std::memory_order_relaxed);
+			while ( scan && scan != h )
+			{
+				link = &scan->mNext;
+				scan = link->load(std::memory_order_relaxed);
+			}
+			assert( scan == h );
+			if ( scan == h )
+			{
+				link->store(h->mNext.load(std::memory_order_relaxed),std::memory_order_release);
+			}
+			mHashTableCount.store(count-1,std::memory_order_release);
+		}
+	}
+
+	// The most entries the table has held at once.  Like removeLast, not to be called while others insert.
+	inline uint32_t getHighWater(void) const
+	{
+		uint32_t count = size();
+		return count > mHighWater ? count : mHighWater;
+	}
+
+	inline const HashEntry *getEntries(void) const
+	{
+		return mEntries;
+	}
+
+	inline const void *getBuckets(void) const
+	{
+		return mHashTable;
+	}
+
+	// Counts the buckets holding 0, 1, .. histogramSize-2 entries, with the last slot counting everything longer.  Returns
+	// the longest chain.  Safe alongside inserts, though the counts are then only a close approximation.
+	inline uint32_t getChainHistogram(uint32_t *histogram,uint32_t histogramSize) const
+	{
+		uint32_t ret = 0;
+		for (uint32_t i=0; i<histogramSize; i++)
+		{
+			histogram[i] = 0;
+		}
+		for (uint32_t i=0; i<hashTableSize; i++)
+		{
+			uint32_t length = 0;
+			for (const HashEntry *h=mHashTable[i].load(std::memory_order_acquire); h; h=h->mNext.load(std::memory_order_acquire))
+			{
+				length++;
+			}
+			histogram[length < histogramSize-1 ? length : histogramSize-1]++;
+			ret = length > ret ? length : ret;
+		}
+		return ret;
+	}
+
+	enum
+	{
+		BUCKET_COUNT = hashTableSize,
+		ENTRY_CAPACITY = hashTableEntries
+	};
+
+private:
+
+	inline uint32_t getHash(const Key& key) const
+	{
+		return key.getHash() & (hashTableSize - 1);
+	}
+
+	std::atomic< HashEntry * >	mHashTable[hashTableSize];
+	std::atomic< uint32_t >		mHashTableCount;
+	uint32_t					mHighWater;		// largest count seen before a removeLast
+	HashEntry					*mEntries;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <atomic>
+
+// Buffered logging to the console and to 'blockchain.txt'.
+//
+// Logging a message only formats it and copies it into a lock-free ring buffer; a background writer thread drains the ring
+// and writes whole batches to stdout and the log file, flushing once per batch instead of once per message.  The threads
+// parsing blocks therefore never wait on the disk or the console, and never on each other.
+//
+// There are two kinds of message:
+//
+//   Report output (logMessage in blockchain.cpp, or logPrint with no site) is what the commands print.  It is always written,
+//   whatever the level or mode, and if the ring is full the caller waits for room rather than losing a line.
+//
+//   Site messages (the LOG_DEBUG .. LOG_ERROR macros) are diagnostics from a fixed place in the code.  Every site keeps its own
+//   counters, and messages below the current level, beyond the per site rate limit, or logged while in counters-only mode are
+//   counted but never formatted.  If the ring is full a site message is dropped (and counted) rather than stalling a parser.
+//   Warnings and errors are written with a 'Warning: ' or 'ERROR: ' prefix, so the message itself should not repeat it.
+//
+// Output from other threads, and from printf called directly, is only ordered relative to the log once logFlush returns.
+
+enum LogLevel
+{
+	LL_DEBUG,
+	LL_INFO,
+	LL_WARNING,
+	LL_ERROR,
+	LL_LAST
+};
+
+// One per call site, created by the LOG_ macros as a function-local static.  The constructor is constexpr so the site is
+// initialized before the program starts and using it costs no guard.  A site adds itself to the list logReport walks the
+// first time it is used.
+class LogSite
+{
+public:
+	constexpr LogSite(const char *file,uint32_t line,LogLevel level) :
+		mFile(file),
+		mLine(line),
+		mLevel(level),
+		mCount(0),
+		mWritten(0),
+		mSuppressed(0),
+		mPendingSuppressed(0),
+		mWindow(0),
+		mWindowCount(0),
+		mRegistered(false),
+		mNext(nullptr)
+	{
+	}
+
+	const char				*mFile;
+	uint32_t				mLine;
+	LogLevel				mLevel;
+	std::atomic< uint64_t >	mCount;				// every call through the site
+	std::atomic< uint64_t >	mWritten;			// how many of those were queued for output
+	std::atomic< uint64_t >	mSuppressed;		// not written because of the level, the rate limit, counters-only mode or a full ring
+	std::atomic< uint64_t >	mPendingSuppressed;	// rate limited since the site last wrote; reported with its next message
+	std::atomic< uint32_t >	mWindow;			// the second the rate limit is counting
+	std::atomic< uint32_t >	mWindowCount;		// messages written in that second
+	std::atomic< bool >		mRegistered;
+	LogSite					*mNext;
+};
+
+// Formats and queues a message.  'site' is NULL for report output.
+void logPrint(LogSite *site,const char *fmt,...);
+void logPrintV(LogSite *site,const char *fmt,va_list arg);
+
+// Site messages below this level are only counted.  The default is LL_INFO.
+void logSetLevel(LogLevel level);
+LogLevel logGetLevel(void);
+const char *logGetLevelName(LogLevel level);
+
+// When true, site messages are only counted, whatever their level.
+void logSetCountersOnly(bool state);
+bool logGetCountersOnly(void);
+
+// The most messages a single site writes per second; 0 means no limit.  The default is 20.
+void logSetRateLimit(uint32_t messagesPerSecond);
+uint32_t logGetRateLimit(void);
+
+// Waits until everything logged before the call is written and flushed.
+void logFlush(void);
+
+// Prints the settings, the ring buffer counters and the counters of every site which has been used.
+void logReport(void);
+
+// Flushes and stops the writer thread; logging after this starts it again.  Also runs at exit.
+void logShutdown(void);
+
+#define LOG_AT(level,...) \
+	do \
+	{ \
+		static LogSite _logSite(__FILE__,__LINE__,level); \
+		logPrint(&_logSite,__VA_ARGS__); \
+	} while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LL_DEBUG,__VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LL_INFO,__VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(LL_WARNING,__VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LL_ERROR,__VA_ARGS__)
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <atomic>
+
+// Where the time goes: every thread keeps its own tick, call and item counters for each stage of reading and processing
+// the chain, and 'profileReport' (the 'perf' command) adds them up.
+//
+// A stage is timed with PROFILE_SCOPE(stage), which reads the time stamp counter when the scope opens and again when it
+// closes, and adds the difference to the calling thread's counters.  The counters belong to the thread, so recording is a
+// plain load and store with no atomic read-modify-write and no shared cache line; other threads may read them at any time.
+// Ticks are converted to seconds when reported, against the steady clock over the whole run.
+//
+// Stages nest: parse includes txid hashing and hash160, process includes address lookups and map finds.  Build with
+// PROFILE_ENABLED defined as 0 to compile every scope away.
+
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PROFILE_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_RDTSC 1
+#else
+#include <chrono>
+#define PROFILE_RDTSC 0
+#endif
+
+enum ProfileStage
+{
+	PS_FILE_READ,			// reading a block from its data file, including the wait for the file
+	PS_PARSE,				// parsing a block into transactions, inputs and outputs
+	PS_TXID_HASH,			// double SHA256 of each transaction (and its wtxid if asked for)
+	PS_HASH160,				// hash160 of the public keys of a block's outputs
+	PS_MAP_INSERT,			// adding a block's transactions to the transaction hash map
+	PS_MAP_FIND,			// looking up the transaction an input spends
+	PS_ADDRESS_LOOKUP,		// finding or adding the address an output pays
+	PS_PROCESS,				// crediting and debiting a whole block's transactions to addresses
+	PS_GATHER_ADDRESSES,	// building the per address transaction lists
+	PS_STATISTICS,			// gathering and saving the balance and age statistics
+	PS_LAST
+};
+
+// One thread's counters.  Only the owning thread writes them.
+class ProfileCounters
+{
+public:
+	std::atomic< uint64_t >	mTicks[PS_LAST];
+	std::atomic< uint64_t >	mCalls[PS_LAST];
+	std::atomic< uint64_t >	mItems[PS_LAST];	// what a call worked through: bytes, transactions, keys, inputs, outputs
+	uint32_t				mThreadNumber;		// in the order threads first recorded something
+	std::atomic< bool >		mInUse;				// cleared when the thread exits, so the next new thread takes these over
+	ProfileCounters			*mNext;
+};
+
+extern thread_local ProfileCounters *gProfileCounters;
+
+// Finds or creates the calling thread's counters.
+ProfileCounters *profileRegisterThread(void);
+
+inline uint64_t profileTicks(void)
+{
+#if PROFILE_RDTSC
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+inline void profileAdd(ProfileStage stage,uint64_t ticks,uint64_t items)
+{
+	ProfileCounters *c = gProfileCounters;
+	if ( c == nullptr )
+	{
+		c = profileRegisterThread();
+	}
+	c->mTicks[stage].store(c->mTicks[stage].load(std::memory_order_relaxed)+ticks,std::memory_order_relaxed);
+	c->mCalls[stage].store(c->mCalls[stage].load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+	c->mItems[stage].store(c->mItems[stage].load(std::memory_order_relaxed)+items,std::memory_order_relaxed);
+}
+
+class ProfileScope
+{
+public:
+	ProfileScope(ProfileStage stage,uint64_t items=1)
+	{
+		mStage = stage;
+		mItems = items;
+		mStart = profileTicks();
+	}
+
+	~ProfileScope(void)
+	{
+		profileAdd(mStage,profileTicks()-mStart,mItems);
+	}
+
+	// For when the amount of work is only known at the end of the scope.
+	void setItems(uint64_t items)
+	{
+		mItems = items;
+	}
+
+private:
+	ProfileStage	mStage;
+	uint64_t		mItems;
+	uint64_t		mStart;
+};
+
+#if PROFILE_ENABLED
+#define PROFILE_SCOPE(stage) ProfileScope _profileScope(stage)
+#define PROFILE_SCOPE_ITEMS(stage,items) ProfileScope _profileScope(stage,items)
+#define PROFILE_SET_ITEMS(items) _profileScope.setItems(items)
+#else
+#define PROFILE_SCOPE(stage)
+#define PROFILE_SCOPE_ITEMS(stage,items)
+#define PROFILE_SET_ITEMS(items)
+#endif
+
+const char *profileGetStageName(ProfileStage stage);
+
+// Prints, through the log, every stage's calls, items and time summed over all threads, followed by each thread's share.
+void profileReport(void);
+
+// Starts counting from zero again, as far as profileReport and the stats file are concerned.
+void profileReset(void);
+
+// One stage's totals over every thread since the last reset, for programs which report them their own way.
+void profileGetStage(ProfileStage stage,uint64_t &calls,uint64_t &items,double &seconds);
+
+// Appends a line of JSON with every stage's totals to 'fileName' every 'seconds' seconds, from a thread of its own.  An
+// existing file is appended to, never truncated.  A NULL name or 0 seconds stops it.  Returns false if the file could not
+// be opened.
+bool profileSetStatsFile(const char *fileName,uint32_t seconds);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <stdint.h>
+
+// A local HTTP server which answers the two blockchain.info endpoints used by blockchain_info.py from the in-memory address
+// and unspent output state of a BlockChain:
+//
+//   GET /address/<address>?format=json[&limit=N][&offset=M]     (also /rawaddr/<address>)
+//   GET /unspent?active=<address>|<address>...[&limit=N]
+//
+// Connections are multiplexed by one epoll event loop thread; complete requests are handed to a pool of worker threads which
+// render the JSON straight into a per connection buffer and send it, together with the header, with a single writev.  The
+// buffers are kept for the life of the connection, so keep-alive clients do not allocate per request.  The server only binds
+// the loopback interface.
+
+class BlockChain;
+
+class QueryServer
+{
+public:
+	// Returns the port the server is listening on.
+	virtual uint16_t getPort(void) const = 0;
+
+	// Reports how many requests have been answered and how many connections are open.
+	virtual void getStats(uint64_t &requestCount,uint32_t &connectionCount) const = 0;
+
+	// Stops the event loop and the workers, closes every connection and frees the server.
+	virtual void release(void) = 0;
+
+protected:
+	virtual ~QueryServer(void)
+	{
+	}
+};
+
+// Starts serving 'blockChain' on 127.0.0.1:port with this many worker threads (0 picks one per core, up to 8).  Returns NULL
+// if the socket could not be bound or the platform is not supported.
+QueryServer *createQueryServer(BlockChain *blockChain,uint16_t port,uint32_t workerCount);
+
+#endif
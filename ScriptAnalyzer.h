@@ -0,0 +1,169 @@
+#ifndef SCRIPT_ANALYZER_H
+#define SCRIPT_ANALYZER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCRIPT_ANALYZER_SSE2 1
+#else
+#define SCRIPT_ANALYZER_SSE2 0
+#endif
+
+// The two scans analyzeSignature (see blockchain.cpp) makes over every input script, pulled out so they can be measured on
+// their own (see benchmarks/script_analyzer.cpp):
+//
+//   hasAsciiRun     Is there a run of ASCII_RUN_LENGTH or more printable characters?  People hide messages in input
+//                   scripts and coinbases.  Sixteen bytes are classified at once with SSE2 compares; a run can then only
+//                   be found inside a block if all sixteen bytes are printable, otherwise it has to straddle two blocks, so
+//                   it is enough to carry the number of printable bytes at the end of one block into the next.
+//   decodeDerShape  How far does the script follow the shape of a pushed DER encoded signature: the sequence tag, the two
+//                   integer tags and their lengths, and the lengths adding up to the sequence length?  Nothing is read past
+//                   the end of the script.  This reads a handful of header bytes, so it stays byte at a time; folding the two
+//                   tag checks into one word compare measured slower.
+//
+// hasAsciiRun has a plain byte at a time version as well, which is what the fast version is checked against.
+
+namespace SCRIPT_ANALYZER
+{
+
+#define ASCII_RUN_LENGTH 16
+
+// The characters counted as text; 32 (space) up to but not including 126 ('~').
+inline bool isPrintable(uint8_t c)
+{
+	return c >= 32 && c < 126;
+}
+
+inline bool hasAsciiRunScalar(const uint8_t *data,uint32_t length,uint32_t run=0)
+{
+	for (uint32_t i=0; i<length; i++)
+	{
+		if ( isPrintable(data[i]) )
+		{
+			run++;
+			if ( run >= ASCII_RUN_LENGTH )
+			{
+				return true;
+			}
+		}
+		else
+		{
+			run = 0;
+		}
+	}
+	return false;
+}
+
+// For a 16 bit mask which is not all ones: how many bits are set from the bottom up, and from the top (bit 15) down.
+inline uint32_t countLowOnes(uint32_t mask)
+{
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_ctz(~mask);
+#else
+	uint32_t ret = 0;
+	while ( mask & (1u << ret) )
+	{
+		ret++;
+	}
+	return ret;
+#endif
+}
+
+inline uint32_t countHighOnes(uint32_t mask)
+{
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_clz(~(mask << 16));
+#else
+	uint32_t ret = 0;
+	while ( mask & (0x8000u >> ret) )
+	{
+		ret++;
+	}
+	return ret;
+#endif
+}
+
+inline bool hasAsciiRun(const uint8_t *data,uint32_t length)
+{
+#if SCRIPT_ANALYZER_SSE2
+	const __m128i bias = _mm_set1_epi8(32);
+	const __m128i limit = _mm_set1_epi8(126-32-1);
+	uint32_t run = 0;	// printable bytes at the end of the previous block
+	uint32_t i = 0;
+	for (; i+16<=length; i+=16)
+	{
+		// c-32 <= 93 as an unsigned byte is 32 <= c < 126; SSE2 has no unsigned compare, but min does the same job
+		__m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(data+i)),bias);
+		uint32_t printable = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v,limit),v));
+		if ( printable == 0xFFFF )
+		{
+			return true;	// sixteen in a row
+		}
+		if ( run+countLowOnes(printable) >= ASCII_RUN_LENGTH )	// a run straddling the previous block and this one
+		{
+			return true;
+		}
+		run = countHighOnes(printable);
+	}
+	return hasAsciiRunScalar(data+i,length-i,run);
+#else
+	return hasAsciiRunScalar(data,length);
+#endif
+}
+
+// How much of a DER signature was recognized.  Each stage includes the ones before it.
+enum DerStage
+{
+	DER_NONE,		// not a DER sequence holding an integer
+	DER_X,			// sequence and first integer tags found; mXLength is valid
+	DER_Y,			// second integer tag found as well; mYLength is valid
+	DER_COMPLETE	// the integer lengths add up to the sequence length; mSigHashOffset is where the signature ends
+};
+
+struct DerShape
+{
+	uint32_t	mStage;				// DerStage
+	uint32_t	mSequenceLength;
+	uint32_t	mXLength;
+	uint32_t	mYLength;
+	uint32_t	mSigHashOffset;		// offset of the sighash type byte which follows the signature
+};
+
+// The part after the header: the second integer, and whether the lengths add up.
+inline uint32_t decodeDerIntegers(const uint8_t *script,uint32_t length,DerShape &shape)
+{
+	shape.mStage = DER_X;
+	uint32_t y = 5+shape.mXLength;
+	if ( shape.mXLength < shape.mSequenceLength && y+2 <= length && script[y] == 0x02 )
+	{
+		shape.mYLength = script[y+1];
+		shape.mStage = DER_Y;
+		uint32_t end = y+2+shape.mYLength;
+		if ( shape.mXLength+shape.mYLength+4 == shape.mSequenceLength && end < length )
+		{
+			shape.mSigHashOffset = end;
+			shape.mStage = DER_COMPLETE;
+		}
+	}
+	return shape.mStage;
+}
+
+// 'script' starts with the push of the signature: script[0] is the push length, then 0x30 <sequence length> 0x02 <x length>
+// <x> 0x02 <y length> <y>.
+inline uint32_t decodeDerShape(const uint8_t *script,uint32_t length,DerShape &shape)
+{
+	memset(&shape,0,sizeof(shape));
+	if ( length < 5 || script[1] != 0x30 || script[3] != 0x02 )
+	{
+		return shape.mStage;
+	}
+	shape.mSequenceLength = script[2];
+	shape.mXLength = script[4];
+	return decodeDerIntegers(script,length,shape);
+}
+
+}; // end of namespace
+
+#endif
@@ -0,0 +1,430 @@
+// Measures the hash and address codec primitives in blockchain.cpp that sit on hot paths - computeSHA256,
+// computeRIPEMD160, bitcoinPublicKeyToHash160, bitcoinPublicKeyToAddress, encodeBase58, decodeBase58 and
+// bitcoinAsciiToAddress - and checks each one against known answers before timing it.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=c++11 -O2 -pthread -I. benchmarks/crypto_codec.cpp blockchain.cpp logger.cpp profiler.cpp -o crypto_codec
+//   ./crypto_codec [megabytes]
+//
+// Every row hashes or converts about 'megabytes' of input (default 64; the base58 rows a fiftieth of that, they are far
+// slower).  Each primitive is timed across input sizes one buffer at a time, which is how the parser calls them.
+//
+// The batched rows time the scalar function called in a loop over a batch against the four lane hashes of
+// BLOCKCHAIN_HASH_LANES, which hash four equal length messages at once with SSE2; the block parser hashes the output
+// public keys of a block with hash160x4 (see hashOutputKeys).  The four lane rows are only timed when the lanes are
+// enabled, and the four lane versions are checked against the scalar ones on random input of every length from 0 to 300
+// bytes before anything is timed.
+//
+// Known answers: the SHA256 and RIPEMD160 test vectors from their specifications, the genesis block's public key and the
+// generator point's compressed and uncompressed keys with their addresses, the base58 vectors of the reference client,
+// and an address with one bad checksum byte, which must be rejected.  The run fails if any answer is wrong.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+// The primitives being measured, from blockchain.cpp
+namespace BLOCKCHAIN_RIPEMD160
+{
+	void computeRIPEMD160(const void *message,uint32_t length,uint8_t hashcode[20]);
+};
+
+namespace BLOCKCHAIN_SHA256
+{
+	void computeSHA256(const void *input,uint32_t size,uint8_t destHash[32]);
+};
+
+namespace BLOCKCHAIN_BASE58
+{
+	bool encodeBase58(const uint8_t *bigNumber,uint32_t length,bool littleEndian,char *output,uint32_t maxStrLen);
+	uint32_t decodeBase58(const char *string,uint8_t *output,uint32_t maxOutputLength,bool littleEndian);
+};
+
+namespace BLOCKCHAIN_BITCOIN_ADDRESS
+{
+	bool bitcoinPublicKeyToHash160(const uint8_t *input,uint32_t inputLength,uint8_t output[20]);
+	bool bitcoinPublicKeyToAddress(const uint8_t *input,uint32_t inputLength,uint8_t output[25]);
+	bool bitcoinAddressToAscii(const uint8_t address[25],char *output,uint32_t maxOutputLen);
+	bool bitcoinAsciiToAddress(const char *input,uint8_t output[25]);
+};
+
+namespace BLOCKCHAIN_HASH_LANES
+{
+	bool isEnabled(void);
+	void sha256x4(const uint8_t *const message[4],uint32_t length,uint8_t *const digest[4]);
+	void ripemd160x4(const uint8_t *const message[4],uint32_t length,uint8_t *const digest[4]);
+	void hash160x4(const uint8_t *const key[4],uint32_t length,uint8_t *const digest[4]);
+};
+
+static uint64_t splitMix(uint64_t &state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static void fillRandom(uint8_t *dest,uint32_t length,uint64_t &seed)
+{
+	for (uint32_t i=0; i<length; i++)
+	{
+		dest[i] = (uint8_t)splitMix(seed);
+	}
+}
+
+static uint32_t fromHex(const char *hex,uint8_t *dest)
+{
+	uint32_t length = (uint32_t)strlen(hex)/2;
+	for (uint32_t i=0; i<length; i++)
+	{
+		unsigned int v;
+		sscanf(hex+i*2,"%2x",&v);
+		dest[i] = (uint8_t)v;
+	}
+	return length;
+}
+
+static const char *toHex(const uint8_t *data,uint32_t length)
+{
+	static char scratch[1024];
+	for (uint32_t i=0; i<length && i*2+2 < sizeof(scratch); i++)
+	{
+		snprintf(scratch+i*2,3,"%02x",data[i]);
+	}
+	scratch[length*2 < sizeof(scratch) ? length*2 : sizeof(scratch)-1] = 0;
+	return scratch;
+}
+
+static uint32_t gErrors = 0;
+
+static void expect(bool ok,const char *what,const char *detail)
+{
+	if ( !ok )
+	{
+		printf("ERROR: %s : %s\n", what, detail );
+		gErrors++;
+	}
+}
+
+static void checkDigest(const char *what,const uint8_t *digest,uint32_t length,const char *expectedHex)
+{
+	const char *got = toHex(digest,length);
+	char detail[256];
+	snprintf(detail,sizeof(detail),"got %s, expected %s",got,expectedHex);
+	expect(strcmp(got,expectedHex) == 0,what,detail);
+}
+
+static void checkKnownAnswers(void)
+{
+	uint8_t digest[32];
+	std::vector< uint8_t > million(1000000,'a');
+
+	static const char *shaInputs[3] = { "", "abc", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq" };
+	static const char *shaAnswers[4] =
+	{
+		"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+		"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+		"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+		"cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+	};
+	for (uint32_t i=0; i<3; i++)
+	{
+		BLOCKCHAIN_SHA256::computeSHA256(shaInputs[i],(uint32_t)strlen(shaInputs[i]),digest);
+		checkDigest("computeSHA256",digest,32,shaAnswers[i]);
+	}
+	BLOCKCHAIN_SHA256::computeSHA256(&million[0],(uint32_t)million.size(),digest);
+	checkDigest("computeSHA256 million a",digest,32,shaAnswers[3]);
+
+	static const char *ripemdInputs[3] = { "", "abc", "message digest" };
+	static const char *ripemdAnswers[4] =
+	{
+		"9c1185a5c5e9fc54612808977ee8f548b2258d31",
+		"8eb208f7e05d987a9b044a8e98c6b087f15a0bfc",
+		"5d0689ef49d2fae572b881b123a85ffa21595f36",
+		"52783243c1697bdbe16d37f97f68f08325dc1528"
+	};
+	for (uint32_t i=0; i<3; i++)
+	{
+		BLOCKCHAIN_RIPEMD160::computeRIPEMD160(ripemdInputs[i],(uint32_t)strlen(ripemdInputs[i]),digest);
+		checkDigest("computeRIPEMD160",digest,20,ripemdAnswers[i]);
+	}
+	BLOCKCHAIN_RIPEMD160::computeRIPEMD160(&million[0],(uint32_t)million.size(),digest);
+	checkDigest("computeRIPEMD160 million a",digest,20,ripemdAnswers[3]);
+
+	// The genesis block's coinbase key, and the generator point uncompressed and compressed
+	static const char *keys[3] =
+	{
+		"04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f",
+		"0479be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8",
+		"0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"
+	};
+	static const char *addresses[3] = { "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa", "1EHNa6Q4Jz2uvNExL497mE43ikXhwF6kZm", "1BgGZ9tcN4rm9KBzDn7KprQz87SZ26SAMH" };
+	for (uint32_t i=0; i<3; i++)
+	{
+		uint8_t key[65];
+		uint32_t keyLength = fromHex(keys[i],key);
+		uint8_t address[25];
+		char ascii[64] = { 0 };
+		bool ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAddress(key,keyLength,address) &&
+			BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(address,ascii,sizeof(ascii));
+		char detail[256];
+		snprintf(detail,sizeof(detail),"got %s, expected %s", ascii, addresses[i] );
+		expect(ok && strcmp(ascii,addresses[i]) == 0,"bitcoinPublicKeyToAddress",detail);
+		uint8_t back[25];
+		expect(BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAsciiToAddress(addresses[i],back) && memcmp(back,address,25) == 0,"bitcoinAsciiToAddress",addresses[i]);
+		// The same address with the last checksum byte changed must be rejected
+		address[24]^=1;
+		if ( BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(address,ascii,sizeof(ascii)) )
+		{
+			expect(!BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAsciiToAddress(ascii,back),"bitcoinAsciiToAddress accepted a bad checksum",ascii);
+		}
+	}
+
+	// From the reference client's base58_encode_decode.json; the binary is big endian, which is what encodeBase58 and
+	// decodeBase58 call little endian (the flag means 'reverse the bytes for the big number code').
+	static const char *base58[][2] =
+	{
+		{ "", "" },
+		{ "61", "2g" },
+		{ "626262", "a3gV" },
+		{ "636363", "aPEr" },
+		{ "73696d706c792061206c6f6e6720737472696e67", "2cFupjhnEsSn59qHXstmK2ffpLv2" },
+		{ "00eb15231dfceb60925886b67d065299925915aeb172c06647", "1NS17iag9jJgTHD1VXjvLCEnZuQ3rJDE9L" },
+		{ "516b6fcd0f", "ABnLTmg" },
+		{ "bf4f89001e670274dd", "3SEo3LWLoPntC" },
+		{ "572e4794", "3EFU7m" },
+		{ "ecac89cad93923c02321", "EJDM8drfXA6uyA" },
+		{ "10c8511e", "Rt5zm" },
+		{ "00000000000000000000", "1111111111" }
+	};
+	for (uint32_t i=0; i<sizeof(base58)/sizeof(base58[0]); i++)
+	{
+		uint8_t binary[64];
+		uint32_t length = fromHex(base58[i][0],binary);
+		char ascii[128] = { 0 };
+		bool ok = BLOCKCHAIN_BASE58::encodeBase58(binary,length,true,ascii,sizeof(ascii));
+		char detail[256];
+		snprintf(detail,sizeof(detail),"%s : got '%s', expected '%s'", base58[i][0], ascii, base58[i][1] );
+		expect(ok && strcmp(ascii,base58[i][1]) == 0,"encodeBase58",detail);
+		uint8_t back[64];
+		uint32_t backLength = BLOCKCHAIN_BASE58::decodeBase58(base58[i][1],back,sizeof(back),true);
+		snprintf(detail,sizeof(detail),"'%s' : got %s, expected %s", base58[i][1], toHex(back,backLength), base58[i][0] );
+		expect(backLength == length && memcmp(back,binary,length) == 0,"decodeBase58",detail);
+	}
+
+	// The four lane versions against the scalar ones, for every length across the first few block boundaries; without SSE2
+	// they hash one lane at a time, which is checked all the same
+	uint64_t seed = 7;
+	std::vector< uint8_t > messages(4*300);
+	for (uint32_t length=0; length<=300; length++)
+	{
+		fillRandom(&messages[0],(uint32_t)messages.size(),seed);
+		const uint8_t *m[4] = { &messages[0], &messages[300], &messages[600], &messages[900] };
+		uint8_t sha[4][32];
+		uint8_t ripemd[4][20];
+		uint8_t hash160[4][20];
+		uint8_t *const shaDigests[4] = { sha[0], sha[1], sha[2], sha[3] };
+		uint8_t *const ripemdDigests[4] = { ripemd[0], ripemd[1], ripemd[2], ripemd[3] };
+		uint8_t *const hash160Digests[4] = { hash160[0], hash160[1], hash160[2], hash160[3] };
+		BLOCKCHAIN_HASH_LANES::sha256x4(m,length,shaDigests);
+		BLOCKCHAIN_HASH_LANES::ripemd160x4(m,length,ripemdDigests);
+		BLOCKCHAIN_HASH_LANES::hash160x4(m,length,hash160Digests);
+		for (uint32_t lane=0; lane<4; lane++)
+		{
+			uint8_t expected[32];
+			BLOCKCHAIN_SHA256::computeSHA256(m[lane],length,expected);
+			expect(memcmp(expected,sha[lane],32) == 0,"sha256x4 differs from computeSHA256",toHex(m[lane],length < 16 ? length : 16));
+			BLOCKCHAIN_RIPEMD160::computeRIPEMD160(m[lane],length,expected);
+			expect(memcmp(expected,ripemd[lane],20) == 0,"ripemd160x4 differs from computeRIPEMD160",toHex(m[lane],length < 16 ? length : 16));
+			BLOCKCHAIN_SHA256::computeSHA256(m[lane],length,expected);
+			BLOCKCHAIN_RIPEMD160::computeRIPEMD160(expected,32,expected);
+			expect(memcmp(expected,hash160[lane],20) == 0,"hash160x4 differs from RIPEMD160(SHA256)",toHex(m[lane],length < 16 ? length : 16));
+		}
+	}
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration< double >(std::chrono::steady_clock::now()-start).count();
+}
+
+static void printRow(const char *primitive,uint32_t size,const char *variant,uint64_t operations,uint64_t bytes,double elapsed)
+{
+	printf("%-22s %6u  %-14s %12.1f %12.1f %14.0f\n", primitive, size, variant, elapsed*1e9/(double)operations,
+		(double)bytes/(1024*1024)/elapsed, (double)operations/elapsed );
+}
+
+// Keeps results alive so the timed loops can not be optimized away.
+static uint32_t gSink = 0;
+
+int main(int argc,const char **argv)
+{
+	uint32_t megabytes = argc > 1 ? (uint32_t)atoi(argv[1]) : 64;
+	if ( megabytes == 0 )
+	{
+		printf("megabytes must be at least 1\n");
+		return 1;
+	}
+
+	checkKnownAnswers();
+	if ( gErrors )
+	{
+		printf("%u known answer checks failed\n", gErrors );
+		return 1;
+	}
+	printf("Known answer checks passed.  %u MB per row, four lane hashes %s\n", megabytes, BLOCKCHAIN_HASH_LANES::isEnabled() ? "on" : "off" );
+	printf("%-22s %6s  %-14s %12s %12s %14s\n", "primitive", "bytes", "variant", "ns/op", "MB/s", "ops/s" );
+
+	uint64_t seed = 1;
+	uint64_t budget = (uint64_t)megabytes*1024*1024;
+	std::vector< uint8_t > data(1024*1024+64);
+	fillRandom(&data[0],(uint32_t)data.size(),seed);
+
+	// One buffer at a time, across sizes; the message slides through the buffer so it is not always the same bytes
+	static const uint32_t sizes[] = { 32, 33, 65, 80, 256, 1024, 16384, 1024*1024 };
+	for (uint32_t s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		uint32_t size = sizes[s];
+		uint64_t count = budget/size;
+		uint8_t digest[32];
+		for (uint32_t mode=0; mode<2; mode++)
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (uint64_t i=0; i<count; i++)
+			{
+				const uint8_t *message = &data[(i*size)%(data.size()-size)];
+				if ( mode == 0 )
+				{
+					BLOCKCHAIN_SHA256::computeSHA256(message,size,digest);
+				}
+				else
+				{
+					BLOCKCHAIN_RIPEMD160::computeRIPEMD160(message,size,digest);
+				}
+				gSink+=digest[0];
+			}
+			printRow(mode == 0 ? "computeSHA256" : "computeRIPEMD160",size,"single",count,count*size,seconds(start));
+		}
+	}
+
+	// Batches of keys and hashes, the way a block's output keys are hashed: the scalar function in a loop against four lanes
+	static const uint32_t batchSizes[] = { 32, 33, 65 };
+	const uint32_t batch = 4096;
+	for (uint32_t s=0; s<sizeof(batchSizes)/sizeof(batchSizes[0]); s++)
+	{
+		uint32_t size = batchSizes[s];
+		std::vector< uint8_t > keys((size_t)batch*size);
+		fillRandom(&keys[0],(uint32_t)keys.size(),seed);
+		for (uint32_t i=0; i<batch; i++)
+		{
+			keys[(size_t)i*size] = size == 65 ? 0x04 : (uint8_t)(0x02+(i & 1));	// valid key prefixes for the hash160 rows
+		}
+		std::vector< uint8_t > digests((size_t)batch*32);
+		uint64_t rounds = budget/((uint64_t)batch*size)+1;
+		uint32_t modeCount = size == 32 ? 2 : 3;	// hash160 is only defined for keys
+		for (uint32_t mode=0; mode<modeCount; mode++)
+		{
+			static const char *names[3] = { "SHA256 batch", "RIPEMD160 batch", "hash160 batch" };
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (uint64_t r=0; r<rounds; r++)
+			{
+				for (uint32_t i=0; i<batch; i++)
+				{
+					const uint8_t *key = &keys[(size_t)i*size];
+					uint8_t *digest = &digests[(size_t)i*32];
+					switch ( mode )
+					{
+						case 0: BLOCKCHAIN_SHA256::computeSHA256(key,size,digest); break;
+						case 1: BLOCKCHAIN_RIPEMD160::computeRIPEMD160(key,size,digest); break;
+						case 2: BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToHash160(key,size,digest); break;
+					}
+				}
+				gSink+=digests[0];
+			}
+			printRow(names[mode],size,"scalar",rounds*batch,rounds*batch*size,seconds(start));
+			if ( !BLOCKCHAIN_HASH_LANES::isEnabled() )
+			{
+				continue;
+			}
+			start = std::chrono::steady_clock::now();
+			for (uint64_t r=0; r<rounds; r++)
+			{
+				for (uint32_t i=0; i<batch; i+=4)
+				{
+					const uint8_t *key[4] = { &keys[(size_t)i*size], &keys[(size_t)(i+1)*size], &keys[(size_t)(i+2)*size], &keys[(size_t)(i+3)*size] };
+					uint8_t *const digest[4] = { &digests[(size_t)i*32], &digests[(size_t)(i+1)*32], &digests[(size_t)(i+2)*32], &digests[(size_t)(i+3)*32] };
+					switch ( mode )
+					{
+						case 0: BLOCKCHAIN_HASH_LANES::sha256x4(key,size,digest); break;
+						case 1: BLOCKCHAIN_HASH_LANES::ripemd160x4(key,size,digest); break;
+						case 2: BLOCKCHAIN_HASH_LANES::hash160x4(key,size,digest); break;
+					}
+				}
+				gSink+=digests[0];
+			}
+			printRow(names[mode],size,"SSE2 x4",rounds*batch,rounds*batch*size,seconds(start));
+		}
+	}
+
+	// Address codecs; base58 works through a byte at a time big number, so these rows get a smaller budget
+	uint64_t codecCount = budget/50/25+1;
+	static const uint32_t keySizes[2] = { 33, 65 };
+	for (uint32_t s=0; s<2; s++)
+	{
+		uint32_t size = keySizes[s];
+		uint8_t key[65];
+		fillRandom(key,size,seed);
+		key[0] = size == 65 ? 0x04 : 0x02;
+		uint8_t address[25];
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (uint64_t i=0; i<codecCount*50; i++)
+		{
+			key[1+(i & 31)]++;
+			BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAddress(key,size,address);
+			gSink+=address[1];
+		}
+		printRow("publicKeyToAddress",size,"single",codecCount*50,codecCount*50*size,seconds(start));
+	}
+
+	static const uint32_t base58Sizes[] = { 1, 8, 21, 25, 32, 64 };
+	for (uint32_t s=0; s<sizeof(base58Sizes)/sizeof(base58Sizes[0]); s++)
+	{
+		uint32_t size = base58Sizes[s];
+		uint8_t binary[64];
+		fillRandom(binary,size,seed);
+		binary[0]|=1;	// no leading zero bytes, so every number has the same length
+		char ascii[128];
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (uint64_t i=0; i<codecCount; i++)
+		{
+			binary[size-1] = (uint8_t)i;
+			BLOCKCHAIN_BASE58::encodeBase58(binary,size,true,ascii,sizeof(ascii));
+			gSink+=(uint8_t)ascii[0];
+		}
+		printRow("encodeBase58",size,"single",codecCount,codecCount*size,seconds(start));
+		start = std::chrono::steady_clock::now();
+		for (uint64_t i=0; i<codecCount; i++)
+		{
+			gSink+=BLOCKCHAIN_BASE58::decodeBase58(ascii,binary,sizeof(binary),true);
+		}
+		printRow("decodeBase58",(uint32_t)strlen(ascii),"single",codecCount,codecCount*strlen(ascii),seconds(start));
+	}
+
+	{
+		char ascii[64] = "1A1zP1eP5QGefi2DMPTfTL5SLmv7DivfNa";
+		uint8_t address[25];
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (uint64_t i=0; i<codecCount; i++)
+		{
+			gSink+=BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAsciiToAddress(ascii,address) ? 1 : 0;
+		}
+		printRow("asciiToAddress",(uint32_t)strlen(ascii),"single",codecCount,codecCount*strlen(ascii),seconds(start));
+	}
+
+	printf("(%u)\n", gSink & 1 );
+	return 0;
+}
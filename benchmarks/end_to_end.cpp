@@ -0,0 +1,425 @@
+// Runs the whole pipeline the interactive commands drive - scan, build, process with statistics gathered by day, the final
+// statistics and the dump - on one data directory without asking anything, and writes what it measured as JSON so runs on
+// different commits can be compared.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=c++11 -O2 -pthread -I. benchmarks/end_to_end.cpp blockchain.cpp logger.cpp profiler.cpp -o end_to_end
+//   ./end_to_end [options] <data directory>
+//
+// This needs BlockChain.h, the interface blockchain.cpp implements, which is not part of this source tree; blockchain.cpp
+// itself does not compile without it either.  Put the header from the full BlockLens sources in the repository root.  It
+// has to declare the methods used here: createBlockChain, release, setProofOfWorkLimit, setAnalyzeInputSignatures,
+// readBlockHeaders, buildBlockChain, readBlock, processTransactions, getBlockTime, getInputLookupCounts, gatherStatistics,
+// saveStatistics and dump.
+//
+// The directory holds blk*.dat files; a synthetic chain from benchmarks/generate_blocks works as well as a real one, given
+// '-pow_limit 207fffff'.  Options (defaults in brackets):
+//
+//   -blocks <n>        most blocks to scan [500000]
+//   -pow_limit <hex>   easiest compact target a header may claim [the main network's]
+//   -period <days>     length of a statistics period, counted from 1970 in UTC [1]
+//   -zombie <days>     addresses unused for this long, relative to the block being processed, count as zombies [1095]
+//   -min_balance <btc> smallest balance the statistics file and the dump include [1]
+//   -no_stats          process blocks without gathering statistics; also skips the dump
+//   -no_dump           skip the dump
+//   -analyze           turn on input signature analysis while processing
+//   -quiet             count diagnostic messages instead of printing them
+//   -label <text>      copied into the JSON, to tell runs apart [none]
+//   -out <file>        where the JSON goes [end_to_end.json]
+//
+// Phases are timed on the wall clock.  'process' covers reading and processing blocks only; the statistics gathered at
+// every period boundary are timed as part of 'statistics', with the final gather and the save.  Statistics are also
+// gathered once before the first block, over no addresses at all, so that edge case runs on every benchmark.  Rates are
+// over the process phase.  inputs_resolved and inputs_failed are the lookups processTransactions itself counted (see
+// getInputLookupCounts); anything but 0 failed on a complete chain means inputs are not being resolved.  Peak RSS is the
+// process high water mark when each phase ends.  With PROFILE_ENABLED the per-stage totals of the profiler (see
+// Profiler.h) are included too; they overlap the phases and each other.
+//
+// The JSON is one object:
+//
+//   {"label":"..","data":"..","blocks":n,"transactions":n,"inputs":n,"inputs_resolved":n,"inputs_failed":n,"outputs":n,
+//    "blocks_per_second":x,"transactions_per_second":x,"inputs_resolved_per_second":x,"peak_rss_mb":x,"seconds":x,
+//    "phases":{"scan":{"seconds":x,"peak_rss_mb":x},"build":{..},"process":{..},"statistics":{..},"dump":{..}},
+//    "stages":{"file_read":{"calls":n,"items":n,"seconds":x},..}}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "../BlockChain.h"
+#include "../Logger.h"
+#include "../Profiler.h"
+
+enum Phase
+{
+	PH_SCAN,
+	PH_BUILD,
+	PH_PROCESS,
+	PH_STATISTICS,
+	PH_DUMP,
+	PH_LAST
+};
+
+static const char *gPhaseNames[PH_LAST] = { "scan", "build", "process", "statistics", "dump" };
+
+// The peak resident set size of the process so far, in MB.
+static double getPeakRSS(void)
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	return GetProcessMemoryInfo(GetCurrentProcess(),&counters,sizeof(counters)) ? (double)counters.PeakWorkingSetSize/(1024*1024) : 0;
+#else
+	struct rusage usage;
+	if ( getrusage(RUSAGE_SELF,&usage) != 0 )
+	{
+		return 0;
+	}
+#if defined(__APPLE__)
+	return (double)usage.ru_maxrss/(1024*1024);	// bytes
+#else
+	return (double)usage.ru_maxrss/1024;	// kilobytes
+#endif
+#endif
+}
+
+static double getSeconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration< double >(std::chrono::steady_clock::now()-start).count();
+}
+
+class Options
+{
+public:
+	Options(void)
+	{
+		mMaxBlocks = 500000;
+		mProofOfWorkLimit = 0;
+		mPeriodDays = 1;
+		mZombieDays = 365*3;
+		mMinBalance = 1;
+		mStatistics = true;
+		mDump = true;
+		mAnalyze = false;
+		mQuiet = false;
+		mLabel = "";
+		mOut = "end_to_end.json";
+		mDirectory = NULL;
+	}
+
+	bool parse(int argc,const char **argv)
+	{
+		bool ret = true;
+		for (int i=1; i<argc && ret; i++)
+		{
+			const char *name = argv[i];
+			const char *value = i+1 < argc ? argv[i+1] : NULL;
+			if ( name[0] != '-' )
+			{
+				ret = mDirectory == NULL;
+				mDirectory = name;
+			}
+			else if ( strcmp(name,"-no_stats") == 0 ) mStatistics = false;
+			else if ( strcmp(name,"-no_dump") == 0 ) mDump = false;
+			else if ( strcmp(name,"-analyze") == 0 ) mAnalyze = true;
+			else if ( strcmp(name,"-quiet") == 0 ) mQuiet = true;
+			else if ( value == NULL )
+			{
+				printf("Missing value for '%s'\n", name );
+				ret = false;
+			}
+			else
+			{
+				i++;
+				if ( strcmp(name,"-blocks") == 0 ) mMaxBlocks = (uint32_t)atoi(value);
+				else if ( strcmp(name,"-pow_limit") == 0 ) mProofOfWorkLimit = (uint32_t)strtoul(value,NULL,16);
+				else if ( strcmp(name,"-period") == 0 ) mPeriodDays = (uint32_t)atoi(value);
+				else if ( strcmp(name,"-zombie") == 0 ) mZombieDays = (uint32_t)atoi(value);
+				else if ( strcmp(name,"-min_balance") == 0 ) mMinBalance = (float)atof(value);
+				else if ( strcmp(name,"-label") == 0 ) mLabel = value;
+				else if ( strcmp(name,"-out") == 0 ) mOut = value;
+				else
+				{
+					printf("Unknown option '%s'\n", name );
+					ret = false;
+				}
+			}
+		}
+		if ( ret && mDirectory == NULL )
+		{
+			printf("No data directory given\n");
+			ret = false;
+		}
+		if ( ret && (mMaxBlocks == 0 || mPeriodDays == 0) )
+		{
+			printf("Option out of range\n");
+			ret = false;
+		}
+		return ret;
+	}
+
+	uint32_t	mMaxBlocks;
+	uint32_t	mProofOfWorkLimit;	// 0 keeps the default
+	uint32_t	mPeriodDays;
+	uint32_t	mZombieDays;
+	float		mMinBalance;
+	bool		mStatistics;
+	bool		mDump;
+	bool		mAnalyze;
+	bool		mQuiet;
+	const char	*mLabel;
+	const char	*mOut;
+	const char	*mDirectory;
+};
+
+class EndToEnd
+{
+public:
+	EndToEnd(const Options &options) : mOptions(options)
+	{
+		mBlockChain = NULL;
+		mBlockCount = 0;
+		mTransactionCount = 0;
+		mInputCount = 0;
+		mResolvedCount = 0;
+		mFailedCount = 0;
+		mOutputCount = 0;
+		mTotalSeconds = 0;
+		for (uint32_t i=0; i<PH_LAST; i++)
+		{
+			mSeconds[i] = 0;
+			mPeakRSS[i] = 0;
+		}
+	}
+
+	~EndToEnd(void)
+	{
+		if ( mBlockChain )
+		{
+			mBlockChain->release();
+		}
+	}
+
+	bool run(void)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		mBlockChain = createBlockChain(mOptions.mDirectory);
+		if ( mOptions.mProofOfWorkLimit )
+		{
+			mBlockChain->setProofOfWorkLimit(mOptions.mProofOfWorkLimit);
+		}
+		mBlockChain->setAnalyzeInputSignatures(mOptions.mAnalyze);
+		profileReset();
+
+		beginPhase();
+		uint32_t scanned = 0;
+		while ( mBlockChain->readBlockHeaders(mOptions.mMaxBlocks,scanned) );
+		endPhase(PH_SCAN);
+
+		beginPhase();
+		mBlockCount = mBlockChain->buildBlockChain();
+		endPhase(PH_BUILD);
+		if ( mBlockCount == 0 )
+		{
+			printf("No blocks found in '%s'\n", mOptions.mDirectory );
+			return false;
+		}
+
+		if ( mOptions.mStatistics )
+		{
+			// Statistics before any block is processed, as 'statistics' at the prompt right after 'build' would; every index is
+			// built over zero addresses
+			beginPhase();
+			mBlockChain->gatherStatistics(mBlockChain->getBlockTime(0),0,false);
+			endPhase(PH_STATISTICS);
+		}
+
+		process();
+
+		if ( mOptions.mStatistics )
+		{
+			beginPhase();
+			mBlockChain->gatherStatistics(mLastTime,getZombieDate(mLastTime),false);
+			mBlockChain->saveStatistics(false,mOptions.mMinBalance);
+			endPhase(PH_STATISTICS);
+			if ( mOptions.mDump )
+			{
+				beginPhase();
+				mBlockChain->dump(mOptions.mMinBalance);
+				endPhase(PH_DUMP);
+			}
+		}
+		logFlush();
+		mTotalSeconds = getSeconds(start);
+		return true;
+	}
+
+	bool writeJSON(void)
+	{
+		FILE *fph = fopen(mOptions.mOut,"wb");
+		if ( fph == NULL )
+		{
+			printf("Failed to open '%s' for writing\n", mOptions.mOut );
+			return false;
+		}
+		double process = mSeconds[PH_PROCESS] > 0 ? mSeconds[PH_PROCESS] : 1e-9;
+		fprintf(fph,"{\"label\":\"");
+		writeEscaped(fph,mOptions.mLabel);
+		fprintf(fph,"\",\"data\":\"");
+		writeEscaped(fph,mOptions.mDirectory);
+		fprintf(fph,"\",\"blocks\":%u,\"transactions\":%llu,\"inputs\":%llu,\"inputs_resolved\":%llu,\"inputs_failed\":%llu,\"outputs\":%llu,", mBlockCount,
+			(unsigned long long)mTransactionCount, (unsigned long long)mInputCount, (unsigned long long)mResolvedCount, (unsigned long long)mFailedCount,
+			(unsigned long long)mOutputCount );
+		fprintf(fph,"\"blocks_per_second\":%0.1f,\"transactions_per_second\":%0.1f,\"inputs_resolved_per_second\":%0.1f,\"peak_rss_mb\":%0.1f,\"seconds\":%0.3f,",
+			mBlockCount/process, mTransactionCount/process, mResolvedCount/process, getPeakRSS(), mTotalSeconds );
+		fprintf(fph,"\"phases\":{");
+		for (uint32_t i=0; i<PH_LAST; i++)
+		{
+			fprintf(fph,"%s\"%s\":{\"seconds\":%0.3f,\"peak_rss_mb\":%0.1f}", i ? "," : "", gPhaseNames[i], mSeconds[i], mPeakRSS[i] );
+		}
+		fprintf(fph,"},\"stages\":{");
+		for (uint32_t i=0; i<PS_LAST; i++)
+		{
+			uint64_t calls;
+			uint64_t items;
+			double seconds;
+			profileGetStage((ProfileStage)i,calls,items,seconds);
+			fprintf(fph,"%s\"%s\":{\"calls\":%llu,\"items\":%llu,\"seconds\":%0.6f}", i ? "," : "", profileGetStageName((ProfileStage)i),
+				(unsigned long long)calls, (unsigned long long)items, seconds );
+		}
+		fprintf(fph,"}}\n");
+		fclose(fph);
+		return true;
+	}
+
+	void report(void)
+	{
+		printf("%u blocks, %llu transactions, %llu inputs resolved, %llu failed in %0.3f seconds\n", mBlockCount, (unsigned long long)mTransactionCount,
+			(unsigned long long)mResolvedCount, (unsigned long long)mFailedCount, mTotalSeconds );
+		for (uint32_t i=0; i<PH_LAST; i++)
+		{
+			printf("  %-12s %10.3f s  %10.1f MB peak\n", gPhaseNames[i], mSeconds[i], mPeakRSS[i] );
+		}
+		printf("Wrote '%s'\n", mOptions.mOut );
+	}
+
+private:
+	void beginPhase(void)
+	{
+		mPhaseStart = std::chrono::steady_clock::now();
+	}
+
+	void endPhase(Phase phase)
+	{
+		mSeconds[phase]+=getSeconds(mPhaseStart);
+		mPeakRSS[phase] = getPeakRSS();
+	}
+
+	uint32_t getZombieDate(uint32_t t) const
+	{
+		uint32_t age = mOptions.mZombieDays*86400;
+		return t > age ? t-age : 0;
+	}
+
+	// Processes every block, gathering statistics whenever a block starts a new period, as 'by_day' does.
+	void process(void)
+	{
+		uint32_t period = mOptions.mPeriodDays*86400;
+		mLastTime = 0;
+		uint64_t resolvedBase;
+		uint64_t failedBase;
+		mBlockChain->getInputLookupCounts(resolvedBase,failedBase);
+		beginPhase();
+		for (uint32_t i=0; i<mBlockCount; i++)
+		{
+			const BlockChain::Block *block = mBlockChain->readBlock(i);
+			if ( block == NULL )
+			{
+				continue;
+			}
+			uint32_t time = mBlockChain->getBlockTime(i);
+			if ( mOptions.mStatistics )
+			{
+				if ( mLastTime && time/period != mLastTime/period )
+				{
+					std::chrono::steady_clock::time_point gather = std::chrono::steady_clock::now();
+					mBlockChain->gatherStatistics(mLastTime,getZombieDate(time),false);
+					double seconds = getSeconds(gather);
+					mSeconds[PH_STATISTICS]+=seconds;
+					mSeconds[PH_PROCESS]-=seconds;	// the process phase is timed around the whole loop
+				}
+				mLastTime = time;
+			}
+			mTransactionCount+=block->transactionCount;
+			mInputCount+=block->totalInputCount;
+			mOutputCount+=block->totalOutputCount;
+			mBlockChain->processTransactions(block);
+		}
+		endPhase(PH_PROCESS);
+		mBlockChain->getInputLookupCounts(mResolvedCount,mFailedCount);
+		mResolvedCount-=resolvedBase;
+		mFailedCount-=failedBase;
+		if ( mLastTime == 0 )
+		{
+			mLastTime = mBlockChain->getBlockTime(mBlockCount-1);
+		}
+	}
+
+	static void writeEscaped(FILE *fph,const char *text)
+	{
+		for (const char *c=text; *c; c++)
+		{
+			if ( *c == '"' || *c == '\\' )
+			{
+				fputc('\\',fph);
+			}
+			if ( (unsigned char)*c >= 0x20 )
+			{
+				fputc(*c,fph);
+			}
+		}
+	}
+
+	const Options							&mOptions;
+	BlockChain								*mBlockChain;
+	uint32_t								mBlockCount;
+	uint64_t								mTransactionCount;
+	uint64_t								mInputCount;
+	uint64_t								mResolvedCount;		// Inputs whose spent output processTransactions found
+	uint64_t								mFailedCount;		// Inputs whose spent output it could not find; 0 on a sound chain
+	uint64_t								mOutputCount;
+	uint32_t								mLastTime;			// Time of the last block processed, as 'by_day' keeps it
+	double									mSeconds[PH_LAST];
+	double									mPeakRSS[PH_LAST];
+	double									mTotalSeconds;
+	std::chrono::steady_clock::time_point	mPhaseStart;
+};
+
+int main(int argc,const char **argv)
+{
+	Options options;
+	if ( !options.parse(argc,argv) )
+	{
+		printf("Usage: end_to_end [options] <data directory>; see the top of benchmarks/end_to_end.cpp for the options.\n");
+		return 1;
+	}
+	logSetCountersOnly(options.mQuiet);
+	EndToEnd e(options);
+	bool ok = e.run() && e.writeJSON();
+	if ( ok )
+	{
+		e.report();
+	}
+	profileSetStatsFile(NULL,0);
+	logShutdown();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,1097 @@
+// Writes a synthetic block-chain as blk*.dat files, in the same format bitcoind stores blocks and BlockLens reads them, so
+// the parser can be benchmarked and regression tested without a full node's data directory.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=c++11 -O2 benchmarks/generate_blocks.cpp -o generate_blocks
+//   ./generate_blocks [options] <directory>
+//
+// Every record is the network magic, the block length, an 80 byte header and the transactions.  Headers chain by hash,
+// carry the real merkle root and are mined against -bits (default 0x207fffff, the regtest limit, so a nonce is found in a
+// couple of tries).  BlockLens only accepts headers at or under its proof-of-work limit, so before scanning the output
+// give it the same bits with the 'pow_limit' command.
+//
+// Each block starts with a coinbase paying the subsidy and the fees; the others spend one to -inputs unspent outputs of
+// earlier blocks, favouring recent ones, and pay one to -outputs addresses.  Coinbase outputs can be spent once they are
+// -maturity blocks old.  Outputs are P2PKH, P2PK (compressed or uncompressed keys), bare 1-of-2 and 2-of-3 multisig, and,
+// when asked for, P2SH, P2WPKH and P2TR.  Input scripts carry a DER shaped signature and, for P2PKH, the public key, so
+// signature analysis has something to look at.  Spending a P2SH output (a nested P2WPKH redeem script), a P2WPKH or a P2TR
+// output puts the signature in the witness instead, and those transactions are written in the segwit serialization, with
+// the txid hashed over the stripped form; blocks holding any carry the witness commitment in their coinbase.  By default
+// no witness addresses are made, so every transaction is legacy.  An address is identified by a number and its key bytes
+// are derived from that number, so a reused address repeats exactly the same script and the generator needs no memory per
+// address.
+//
+// Options (defaults in brackets):
+//
+//   -blocks <n>          blocks on the main chain [1000]
+//   -tx <n>              average transactions per block besides the coinbase; each block gets 0..2n [50]
+//   -inputs <n>          most inputs per transaction [3]
+//   -outputs <n>         most outputs per transaction [3]
+//   -reuse <percent>     outputs paying an address which has been paid before [40]
+//   -skew <x>            how strongly reuse favours the oldest addresses, as the exponent of a power law; 1 is uniform [3]
+//   -recent <x>          how strongly spends favour the most recent outputs, the same way [2]
+//   -p2pk <percent>      new addresses which are P2PK [10]
+//   -multisig <percent>  new addresses which are bare multisig [5]
+//   -p2sh <percent>      new addresses which are P2SH, spent as nested P2WPKH [0]
+//   -p2wpkh <percent>    new addresses which are native P2WPKH [0]
+//   -p2tr <percent>      new addresses which are P2TR, spent by key path [0]
+//   -maturity <n>        blocks before a coinbase output may be spent [100]
+//   -stale <percent>     heights at which a competing branch is also written; it never becomes the longest [0]
+//   -stale-depth <n>     longest competing branch [2]
+//   -reorder <percent>   blocks written after their child instead of before, as happens in real block files [0]
+//   -file-size <mb>      start a new blk file when the current one would pass this size [128]
+//   -bits <hex>          compact target of every header [207fffff]
+//   -time <seconds>      time stamp of the first block; blocks are 600 seconds apart [1231006505]
+//   -seed <n>            random seed; the same options and seed give the same files [1]
+//
+// Stale and reordered blocks are what BlockLens reports as skipped stale blocks and orphan headers.  The counts printed at
+// the end are for the main chain only, and count each coinbase as one input.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+#define MAGIC_ID 0xD9B4BEF9
+#define COIN 100000000ULL
+#define HALVING_INTERVAL 210000
+#define SCRIPT_HASH_SALT 0x2F1A3C5D7E9B8A6CULL	// Keeps a P2SH address's script hash apart from its key hash
+
+namespace SHA256
+{
+
+static const uint32_t gK[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotate(uint32_t x,uint32_t n)
+{
+	return (x >> n) | (x << (32-n));
+}
+
+static void transform(uint32_t state[8],const uint8_t *block)
+{
+	uint32_t w[64];
+	for (uint32_t i=0; i<16; i++)
+	{
+		w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) | ((uint32_t)block[i*4+2] << 8) | block[i*4+3];
+	}
+	for (uint32_t i=16; i<64; i++)
+	{
+		uint32_t s0 = rotate(w[i-15],7) ^ rotate(w[i-15],18) ^ (w[i-15] >> 3);
+		uint32_t s1 = rotate(w[i-2],17) ^ rotate(w[i-2],19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16]+s0+w[i-7]+s1;
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+	for (uint32_t i=0; i<64; i++)
+	{
+		uint32_t t1 = h+(rotate(e,6) ^ rotate(e,11) ^ rotate(e,25))+((e & f) ^ (~e & g))+gK[i]+w[i];
+		uint32_t t2 = (rotate(a,2) ^ rotate(a,13) ^ rotate(a,22))+((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d+t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1+t2;
+	}
+	state[0]+=a; state[1]+=b; state[2]+=c; state[3]+=d; state[4]+=e; state[5]+=f; state[6]+=g; state[7]+=h;
+}
+
+static void hash(const uint8_t *data,size_t length,uint8_t digest[32])
+{
+	uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	size_t done = 0;
+	for (; done+64 <= length; done+=64)
+	{
+		transform(state,data+done);
+	}
+	uint8_t tail[128];
+	size_t rest = length-done;
+	memcpy(tail,data+done,rest);
+	tail[rest] = 0x80;
+	size_t tailLength = rest < 56 ? 64 : 128;
+	memset(tail+rest+1,0,tailLength-rest-1);
+	uint64_t bits = (uint64_t)length*8;
+	for (uint32_t i=0; i<8; i++)
+	{
+		tail[tailLength-1-i] = (uint8_t)(bits >> (i*8));
+	}
+	transform(state,tail);
+	if ( tailLength == 128 )
+	{
+		transform(state,tail+64);
+	}
+	for (uint32_t i=0; i<8; i++)
+	{
+		digest[i*4] = (uint8_t)(state[i] >> 24);
+		digest[i*4+1] = (uint8_t)(state[i] >> 16);
+		digest[i*4+2] = (uint8_t)(state[i] >> 8);
+		digest[i*4+3] = (uint8_t)state[i];
+	}
+}
+
+static void doubleHash(const uint8_t *data,size_t length,uint8_t digest[32])
+{
+	uint8_t first[32];
+	hash(data,length,first);
+	hash(first,32,digest);
+}
+
+}; // end of namespace
+
+static uint64_t splitMix(uint64_t &state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// A uniform number in [0,1).
+static double uniform(uint64_t &state)
+{
+	return (double)(splitMix(state) >> 11)*(1.0/9007199254740992.0);
+}
+
+class Options
+{
+public:
+	Options(void)
+	{
+		mBlocks = 1000;
+		mTransactions = 50;
+		mInputs = 3;
+		mOutputs = 3;
+		mReuse = 40;
+		mSkew = 3;
+		mRecent = 2;
+		mP2PK = 10;
+		mMultisig = 5;
+		mP2SH = 0;
+		mP2WPKH = 0;
+		mP2TR = 0;
+		mMaturity = 100;
+		mStale = 0;
+		mStaleDepth = 2;
+		mReorder = 0;
+		mFileSize = 128;
+		mBits = 0x207fffff;
+		mTime = 1231006505;
+		mSeed = 1;
+		mDirectory = NULL;
+	}
+
+	bool parse(int argc,const char **argv)
+	{
+		bool ret = true;
+		for (int i=1; i<argc && ret; i++)
+		{
+			const char *name = argv[i];
+			const char *value = i+1 < argc ? argv[i+1] : NULL;
+			if ( name[0] != '-' )
+			{
+				ret = mDirectory == NULL;
+				mDirectory = name;
+				continue;
+			}
+			if ( value == NULL )
+			{
+				printf("Missing value for '%s'\n", name );
+				return false;
+			}
+			i++;
+			if ( strcmp(name,"-blocks") == 0 ) mBlocks = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-tx") == 0 ) mTransactions = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-inputs") == 0 ) mInputs = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-outputs") == 0 ) mOutputs = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-reuse") == 0 ) mReuse = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-skew") == 0 ) mSkew = atof(value);
+			else if ( strcmp(name,"-recent") == 0 ) mRecent = atof(value);
+			else if ( strcmp(name,"-p2pk") == 0 ) mP2PK = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-multisig") == 0 ) mMultisig = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-p2sh") == 0 ) mP2SH = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-p2wpkh") == 0 ) mP2WPKH = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-p2tr") == 0 ) mP2TR = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-maturity") == 0 ) mMaturity = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-stale") == 0 ) mStale = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-stale-depth") == 0 ) mStaleDepth = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-reorder") == 0 ) mReorder = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-file-size") == 0 ) mFileSize = (uint32_t)atoi(value);
+			else if ( strcmp(name,"-bits") == 0 ) mBits = (uint32_t)strtoul(value,NULL,16);
+			else if ( strcmp(name,"-time") == 0 ) mTime = (uint32_t)strtoul(value,NULL,10);
+			else if ( strcmp(name,"-seed") == 0 ) mSeed = strtoull(value,NULL,10);
+			else
+			{
+				printf("Unknown option '%s'\n", name );
+				ret = false;
+			}
+		}
+		if ( ret && mDirectory == NULL )
+		{
+			printf("No output directory given\n");
+			ret = false;
+		}
+		if ( ret && (mBlocks == 0 || mInputs == 0 || mOutputs == 0 || mStaleDepth == 0 || mFileSize == 0 || mSkew <= 0 || mRecent <= 0 ||
+			mReuse > 100 || mStale > 100 || mReorder > 100 || mP2PK+mMultisig+mP2SH+mP2WPKH+mP2TR > 100) )
+		{
+			printf("Option out of range\n");
+			ret = false;
+		}
+		return ret;
+	}
+
+	uint32_t	mBlocks;
+	uint32_t	mTransactions;
+	uint32_t	mInputs;
+	uint32_t	mOutputs;
+	uint32_t	mReuse;
+	double		mSkew;
+	double		mRecent;
+	uint32_t	mP2PK;
+	uint32_t	mMultisig;
+	uint32_t	mP2SH;
+	uint32_t	mP2WPKH;
+	uint32_t	mP2TR;
+	uint32_t	mMaturity;
+	uint32_t	mStale;
+	uint32_t	mStaleDepth;
+	uint32_t	mReorder;
+	uint32_t	mFileSize;
+	uint32_t	mBits;
+	uint32_t	mTime;
+	uint64_t	mSeed;
+	const char	*mDirectory;
+};
+
+class Writer
+{
+public:
+	void clear(void)
+	{
+		mData.clear();
+	}
+
+	void u8(uint8_t v)
+	{
+		mData.push_back(v);
+	}
+
+	void u32(uint32_t v)
+	{
+		for (uint32_t i=0; i<4; i++)
+		{
+			mData.push_back((uint8_t)(v >> (i*8)));
+		}
+	}
+
+	void u64(uint64_t v)
+	{
+		for (uint32_t i=0; i<8; i++)
+		{
+			mData.push_back((uint8_t)(v >> (i*8)));
+		}
+	}
+
+	void varint(uint64_t v)
+	{
+		if ( v < 0xFD )
+		{
+			u8((uint8_t)v);
+		}
+		else if ( v <= 0xFFFF )
+		{
+			u8(0xFD);
+			u8((uint8_t)v);
+			u8((uint8_t)(v >> 8));
+		}
+		else
+		{
+			u8(0xFE);
+			u32((uint32_t)v);
+		}
+	}
+
+	void bytes(const uint8_t *data,size_t length)
+	{
+		if ( length )
+		{
+			mData.insert(mData.end(),data,data+length);
+		}
+	}
+
+	// Overwrites four bytes already written.
+	void patch32(size_t offset,uint32_t v)
+	{
+		for (uint32_t i=0; i<4; i++)
+		{
+			mData[offset+i] = (uint8_t)(v >> (i*8));
+		}
+	}
+
+	std::vector< uint8_t >	mData;
+};
+
+class Output
+{
+public:
+	uint8_t		mTransaction[32];	// txid, in the byte order of a previous output reference
+	uint32_t	mIndex;
+	uint32_t	mAddress;
+	uint64_t	mValue;
+	bool		mSpent;
+};
+
+enum AddressType
+{
+	AT_P2PKH,
+	AT_P2PK_COMPRESSED,
+	AT_P2PK_UNCOMPRESSED,
+	AT_MULTISIG_1_OF_2,
+	AT_MULTISIG_2_OF_3,
+	AT_P2SH_P2WPKH,
+	AT_P2WPKH,
+	AT_P2TR
+};
+
+class Generator
+{
+public:
+	Generator(const Options &options) : mOptions(options)
+	{
+		mRandom = options.mSeed;
+		mAddressSeed = splitMix(mRandom);
+		mAddressCount = 0;
+		mSpentCount = 0;
+		mFile = NULL;
+		mFileIndex = 0;
+		mFileLength = 0;
+		mBytes = 0;
+		mTransactionCount = 0;
+		mInputCount = 0;
+		mWitnessInputCount = 0;
+		mOutputCount = 0;
+		mStaleCount = 0;
+		mReorderCount = 0;
+		mReuseCount = 0;
+		memset(mTip,0,sizeof(mTip));
+	}
+
+	~Generator(void)
+	{
+		if ( mFile )
+		{
+			fclose(mFile);
+		}
+	}
+
+	bool run(void)
+	{
+		bool ok = true;
+		std::vector< uint8_t > heldBack;	// a block to write after its child
+		for (uint32_t height=0; height<mOptions.mBlocks && ok; height++)
+		{
+			uint8_t parent[32];
+			memcpy(parent,mTip,32);
+			buildBlock(height,parent,true);
+			std::vector< uint8_t > block = mBlock.mData;
+			if ( !heldBack.empty() )
+			{
+				ok = writeBlock(block) && writeBlock(heldBack);
+				heldBack.clear();
+			}
+			else if ( height+1 < mOptions.mBlocks && percent(mOptions.mReorder) )
+			{
+				heldBack = block;
+				mReorderCount++;
+			}
+			else
+			{
+				ok = writeBlock(block);
+			}
+			// A competing branch off the same parent, written after the main chain block so that one is seen first.  It stops
+			// short enough that the main chain overtakes it.
+			if ( ok && height > 0 && percent(mOptions.mStale) )
+			{
+				uint32_t depth = 1+(uint32_t)(splitMix(mRandom)%mOptions.mStaleDepth);
+				if ( height+depth < mOptions.mBlocks )
+				{
+					uint8_t branch[32];
+					memcpy(branch,parent,32);
+					for (uint32_t i=0; i<depth && ok; i++)
+					{
+						buildBlock(height+i,branch,false);
+						ok = writeBlock(mBlock.mData);
+						memcpy(branch,mHash,32);
+						mStaleCount++;
+					}
+				}
+			}
+		}
+		if ( ok && !heldBack.empty() )
+		{
+			ok = writeBlock(heldBack);
+		}
+		return ok;
+	}
+
+	void report(double seconds)
+	{
+		printf("Wrote %u blocks to %u file(s) in %s, %0.1f MB in %0.2f seconds\n", mOptions.mBlocks, mFileIndex+1, mOptions.mDirectory, (double)mBytes/(1024*1024), seconds );
+		printf("  transactions  %llu\n", (unsigned long long)mTransactionCount );
+		printf("  inputs        %llu (%llu with a witness)\n", (unsigned long long)mInputCount, (unsigned long long)mWitnessInputCount );
+		printf("  outputs       %llu\n", (unsigned long long)mOutputCount );
+		printf("  addresses     %u (%llu outputs paid one again)\n", mAddressCount, (unsigned long long)mReuseCount );
+		printf("  unspent       %llu\n", (unsigned long long)(mUnspent.size()-mSpentCount+mImmature.size()) );
+		printf("  stale blocks  %u\n", mStaleCount );
+		printf("  reordered     %u\n", mReorderCount );
+		printf("Scan with 'pow_limit %08x' set.\n", mOptions.mBits );
+	}
+
+private:
+	bool percent(uint32_t p)
+	{
+		return p && (uint32_t)(splitMix(mRandom)%100) < p;
+	}
+
+	// A number in [0,count) drawn from a power law; the larger 'exponent', the more often it is near 0.
+	uint32_t powerLaw(uint32_t count,double exponent)
+	{
+		uint32_t ret = (uint32_t)(pow(uniform(mRandom),exponent)*count);
+		return ret < count ? ret : count-1;
+	}
+
+	AddressType getAddressType(uint32_t address) const
+	{
+		uint64_t state = mAddressSeed ^ ((uint64_t)address*0x9E3779B97F4A7C15ULL);
+		uint32_t p = (uint32_t)(splitMix(state)%100);
+		if ( p < mOptions.mP2PK )
+		{
+			return (p & 1) ? AT_P2PK_UNCOMPRESSED : AT_P2PK_COMPRESSED;
+		}
+		p-=mOptions.mP2PK;
+		if ( p < mOptions.mMultisig )
+		{
+			return (p & 1) ? AT_MULTISIG_2_OF_3 : AT_MULTISIG_1_OF_2;
+		}
+		p-=mOptions.mMultisig;
+		if ( p < mOptions.mP2SH )
+		{
+			return AT_P2SH_P2WPKH;
+		}
+		p-=mOptions.mP2SH;
+		if ( p < mOptions.mP2WPKH )
+		{
+			return AT_P2WPKH;
+		}
+		p-=mOptions.mP2WPKH;
+		if ( p < mOptions.mP2TR )
+		{
+			return AT_P2TR;
+		}
+		return AT_P2PKH;
+	}
+
+	static bool isWitness(AddressType type)
+	{
+		return type == AT_P2SH_P2WPKH || type == AT_P2WPKH || type == AT_P2TR;
+	}
+
+	// 'count' bytes standing in for a hash or key of the address; the same address and 'salt' always give the same bytes.
+	void appendHash(Writer &w,uint32_t address,uint64_t salt,uint32_t count)
+	{
+		uint64_t state = mAddressSeed ^ ((uint64_t)address << 8) ^ salt;
+		for (uint32_t i=0; i<count; i++)
+		{
+			w.u8((uint8_t)splitMix(state));
+		}
+	}
+
+	// Key 'key' of an address; the same address always gives the same bytes.
+	void appendKey(Writer &w,uint32_t address,uint32_t key,bool compressed)
+	{
+		uint64_t state = mAddressSeed ^ ((uint64_t)address << 8) ^ key ^ 0x5851F42D4C957F2DULL;
+		uint8_t length = compressed ? 33 : 65;
+		w.u8(length);
+		w.u8(compressed ? (uint8_t)(2+(splitMix(state) & 1)) : 4);
+		for (uint32_t i=1; i<length; i++)
+		{
+			w.u8((uint8_t)splitMix(state));
+		}
+	}
+
+	void appendOutputScript(Writer &w,uint32_t address)
+	{
+		Writer s;
+		switch ( getAddressType(address) )
+		{
+			case AT_P2PKH:
+				s.u8(0x76); s.u8(0xA9); s.u8(20);
+				appendHash(s,address,0,20);
+				s.u8(0x88); s.u8(0xAC);
+				break;
+			case AT_P2PK_COMPRESSED:
+			case AT_P2PK_UNCOMPRESSED:
+				appendKey(s,address,0,getAddressType(address) == AT_P2PK_COMPRESSED);
+				s.u8(0xAC);
+				break;
+			case AT_MULTISIG_1_OF_2:
+				s.u8(0x51);
+				appendKey(s,address,0,true);
+				appendKey(s,address,1,false);
+				s.u8(0x52); s.u8(0xAE);
+				break;
+			case AT_MULTISIG_2_OF_3:
+				s.u8(0x52);
+				appendKey(s,address,0,true);
+				appendKey(s,address,1,true);
+				appendKey(s,address,2,true);
+				s.u8(0x53); s.u8(0xAE);
+				break;
+			case AT_P2SH_P2WPKH:
+				s.u8(0xA9); s.u8(20);
+				appendHash(s,address,SCRIPT_HASH_SALT,20);
+				s.u8(0x87);
+				break;
+			case AT_P2WPKH:
+				s.u8(0x00); s.u8(20);
+				appendHash(s,address,0,20);
+				break;
+			case AT_P2TR:
+				s.u8(0x51); s.u8(32);
+				appendHash(s,address,0,32);
+				break;
+		}
+		w.varint(s.mData.size());
+		w.bytes(s.mData.data(),s.mData.size());
+	}
+
+	// <push> 30 <length> 02 <r> 02 <s> 01; r and s are 32 bytes, or 33 with a leading zero when the top bit is set.
+	void appendSignature(Writer &s)
+	{
+		uint8_t r[33];
+		uint8_t t[33];
+		uint32_t rLength = 32;
+		uint32_t tLength = 32;
+		for (uint32_t i=0; i<32; i++)
+		{
+			r[i+1] = (uint8_t)splitMix(mRandom);
+			t[i+1] = (uint8_t)splitMix(mRandom);
+		}
+		t[1]&=0x7F;	// low S
+		r[0] = 0;
+		if ( r[1] & 0x80 )
+		{
+			rLength = 33;
+		}
+		s.u8((uint8_t)(rLength+tLength+7));
+		s.u8(0x30);
+		s.u8((uint8_t)(rLength+tLength+4));
+		s.u8(0x02);
+		s.u8((uint8_t)rLength);
+		s.bytes(rLength == 33 ? r : r+1,rLength);
+		s.u8(0x02);
+		s.u8((uint8_t)tLength);
+		s.bytes(t+1,tLength);
+		s.u8(0x01);
+	}
+
+	// The input script, and for witness outputs the witness stack: the signature and key, or the Schnorr signature of a P2TR
+	// key path spend.  Pushes and witness items of under 0xFD bytes share the same length prefix, so appendSignature and
+	// appendKey serve both.
+	void appendInputScript(Writer &w,Writer &witness,uint32_t address)
+	{
+		Writer s;
+		switch ( getAddressType(address) )
+		{
+			case AT_P2SH_P2WPKH:
+				s.u8(22);	// push of the redeem script, 0 <20 byte key hash>
+				s.u8(0x00); s.u8(20);
+				appendHash(s,address,0,20);
+				// fall through
+			case AT_P2WPKH:
+				witness.u8(2);
+				appendSignature(witness);
+				appendKey(witness,address,0,true);
+				break;
+			case AT_P2TR:
+				witness.u8(1);
+				witness.u8(64);
+				for (uint32_t i=0; i<64; i++)
+				{
+					witness.u8((uint8_t)splitMix(mRandom));
+				}
+				break;
+			case AT_P2PKH:
+				appendSignature(s);
+				appendKey(s,address,0,(address & 3) != 0);
+				break;
+			case AT_P2PK_COMPRESSED:
+			case AT_P2PK_UNCOMPRESSED:
+				appendSignature(s);
+				break;
+			case AT_MULTISIG_1_OF_2:
+				s.u8(0x00);
+				appendSignature(s);
+				break;
+			case AT_MULTISIG_2_OF_3:
+				s.u8(0x00);
+				appendSignature(s);
+				appendSignature(s);
+				break;
+		}
+		w.varint(s.mData.size());
+		w.bytes(s.mData.data(),s.mData.size());
+	}
+
+	uint32_t pickAddress(void)
+	{
+		if ( mAddressCount && percent(mOptions.mReuse) )
+		{
+			mReuseCount++;
+			return powerLaw(mAddressCount,mOptions.mSkew);
+		}
+		return mAddressCount++;
+	}
+
+	// An unspent output of an earlier block, most likely a recent one; NULL when there are none left.
+	Output *pickUnspent(void)
+	{
+		uint32_t count = (uint32_t)mUnspent.size();
+		if ( mSpentCount == count )
+		{
+			return NULL;
+		}
+		uint32_t i = count-1-powerLaw(count,mOptions.mRecent);
+		while ( mUnspent[i].mSpent )
+		{
+			i = i ? i-1 : count-1;
+		}
+		mUnspent[i].mSpent = true;
+		mSpentCount++;
+		return &mUnspent[i];
+	}
+
+	// Drops the spent outputs once they are half the list, keeping the rest in the order they were created.
+	void compactUnspent(void)
+	{
+		if ( mSpentCount*2 > mUnspent.size() )
+		{
+			size_t keep = 0;
+			for (size_t i=0; i<mUnspent.size(); i++)
+			{
+				if ( !mUnspent[i].mSpent )
+				{
+					mUnspent[keep++] = mUnspent[i];
+				}
+			}
+			mUnspent.resize(keep);
+			mSpentCount = 0;
+		}
+	}
+
+	void addOutput(std::vector< Output > &list,const uint8_t txid[32],uint32_t index,uint32_t address,uint64_t value)
+	{
+		Output o;
+		memcpy(o.mTransaction,txid,32);
+		o.mIndex = index;
+		o.mAddress = address;
+		o.mValue = value;
+		o.mSpent = false;
+		list.push_back(o);
+	}
+
+	// Writes out a version 1 transaction whose inputs and outputs are serialized in 'body', with a zero lock time.  A non-empty
+	// 'witness' holds one stack per input and selects the segwit serialization; the txid always covers the stripped form.
+	void finishTransaction(const Writer &body,const Writer &witness,const std::vector< uint32_t > &addresses,const std::vector< uint64_t > &values,std::vector< Output > &created)
+	{
+		Writer &tx = mSerialized;
+		tx.clear();
+		tx.u32(1);
+		tx.bytes(body.mData.data(),body.mData.size());
+		tx.u32(0);
+		uint8_t txid[32];
+		SHA256::doubleHash(&tx.mData[0],tx.mData.size(),txid);
+		mTxids.insert(mTxids.end(),txid,txid+32);
+		if ( !witness.mData.empty() )
+		{
+			tx.clear();
+			tx.u32(1);
+			tx.u8(0x00);	// marker
+			tx.u8(0x01);	// flag
+			tx.bytes(body.mData.data(),body.mData.size());
+			tx.bytes(witness.mData.data(),witness.mData.size());
+			tx.u32(0);
+			uint8_t wtxid[32];
+			SHA256::doubleHash(&tx.mData[0],tx.mData.size(),wtxid);
+			mWitnessIds.insert(mWitnessIds.end(),wtxid,wtxid+32);
+			mBlockHasWitness = true;
+		}
+		else
+		{
+			mWitnessIds.insert(mWitnessIds.end(),txid,txid+32);
+		}
+		for (uint32_t i=0; i<addresses.size(); i++)
+		{
+			addOutput(created,txid,i,addresses[i],values[i]);
+		}
+		mTransactions.bytes(tx.mData.data(),tx.mData.size());
+	}
+
+	void buildBlock(uint32_t height,const uint8_t parent[32],bool mainChain)
+	{
+		mTransactions.clear();
+		mTxids.clear();
+		mWitnessIds.clear();
+		mBlockHasWitness = false;
+		std::vector< Output > created;
+		uint64_t fees = 0;
+		uint32_t txCount = 0;
+		uint32_t inputCount = 0;
+		uint32_t witnessInputCount = 0;
+		uint32_t outputCount = 0;
+
+		// Stale branches hold only their coinbase; their transactions would never be processed anyway.
+		uint32_t spendCount = mainChain && mOptions.mTransactions ? (uint32_t)(splitMix(mRandom)%(mOptions.mTransactions*2+1)) : 0;
+		Writer tx;
+		Writer witness;
+		Writer stack;
+		std::vector< uint32_t > addresses;
+		std::vector< uint64_t > values;
+		for (uint32_t t=0; t<spendCount; t++)
+		{
+			uint32_t wantInputs = 1+(uint32_t)(splitMix(mRandom)%mOptions.mInputs);
+			tx.clear();
+			witness.clear();
+			Output *spent[64];
+			uint32_t n = 0;
+			for (; n<wantInputs && n<64; n++)
+			{
+				spent[n] = pickUnspent();
+				if ( spent[n] == NULL )
+				{
+					break;
+				}
+			}
+			if ( n == 0 )
+			{
+				break;	// nothing left to spend
+			}
+			uint64_t total = 0;
+			uint32_t witnessInputs = 0;
+			tx.varint(n);
+			for (uint32_t i=0; i<n; i++)
+			{
+				tx.bytes(spent[i]->mTransaction,32);
+				tx.u32(spent[i]->mIndex);
+				stack.clear();
+				appendInputScript(tx,stack,spent[i]->mAddress);
+				tx.u32(0xFFFFFFFF);
+				total+=spent[i]->mValue;
+				if ( stack.mData.empty() )
+				{
+					witness.u8(0);	// an empty stack, in case another input has one
+				}
+				else
+				{
+					witness.bytes(stack.mData.data(),stack.mData.size());
+					witnessInputs++;
+				}
+			}
+			if ( witnessInputs == 0 )
+			{
+				witness.clear();
+			}
+			uint64_t fee = total > 20000 ? 1000+splitMix(mRandom)%9000 : 0;
+			uint64_t remaining = total-fee;
+			uint32_t outputs = 1+(uint32_t)(splitMix(mRandom)%mOptions.mOutputs);
+			if ( remaining < outputs )
+			{
+				outputs = 1;
+			}
+			addresses.clear();
+			values.clear();
+			tx.varint(outputs);
+			for (uint32_t i=0; i<outputs; i++)
+			{
+				uint64_t value = remaining;
+				if ( i+1 < outputs )
+				{
+					value = 1+(uint64_t)(uniform(mRandom)*(double)(remaining-(outputs-i-1))/(outputs-i)*2.0);
+					value = value < remaining-(outputs-i-1) ? value : remaining-(outputs-i-1);
+				}
+				remaining-=value;
+				uint32_t address = pickAddress();
+				tx.u64(value);
+				appendOutputScript(tx,address);
+				addresses.push_back(address);
+				values.push_back(value);
+			}
+			finishTransaction(tx,witness,addresses,values,created);
+			fees+=fee;
+			txCount++;
+			inputCount+=n;
+			witnessInputCount+=witnessInputs;
+			outputCount+=outputs;
+		}
+
+		// The coinbase goes first but is built last, once the fees are known.  The height push (BIP 34) keeps every coinbase
+		// unique; stale blocks add a byte so they differ from the main chain block at the same height.  If any transaction has
+		// a witness, the coinbase commits to the witness merkle root (BIP 141), in which its own wtxid counts as zero, and its
+		// witness is the 32 zero byte reserved value.
+		uint8_t commitment[32];
+		bool hasWitness = mBlockHasWitness;
+		if ( hasWitness )
+		{
+			static const uint8_t zero[32] = { 0 };
+			std::vector< uint8_t > ids(zero,zero+32);
+			ids.insert(ids.end(),mWitnessIds.begin(),mWitnessIds.end());
+			uint8_t reserved[64];
+			getMerkleRoot(ids,reserved);
+			memset(reserved+32,0,32);
+			SHA256::doubleHash(reserved,64,commitment);
+		}
+		std::vector< uint8_t > spends = mTransactions.mData;
+		std::vector< uint8_t > spendIds = mTxids;
+		mTransactions.clear();
+		mTxids.clear();
+		tx.clear();
+		witness.clear();
+		tx.varint(1);
+		static const uint8_t nullHash[32] = { 0 };
+		tx.bytes(nullHash,32);
+		tx.u32(0xFFFFFFFF);
+		tx.varint(mainChain ? 5 : 7);
+		tx.u8(4);
+		tx.u32(height);
+		if ( !mainChain )
+		{
+			tx.u8(1);
+			tx.u8((uint8_t)(mStaleCount+1));
+		}
+		tx.u32(0xFFFFFFFF);
+		uint64_t subsidy = (50*COIN) >> (height/HALVING_INTERVAL < 64 ? height/HALVING_INTERVAL : 63);
+		uint32_t address = mainChain ? pickAddress() : 0;
+		tx.varint(hasWitness ? 2 : 1);
+		tx.u64(subsidy+fees);
+		appendOutputScript(tx,address);
+		if ( hasWitness )
+		{
+			static const uint8_t header[6] = { 0x6A, 0x24, 0xAA, 0x21, 0xA9, 0xED };	// OP_RETURN, push 36, commitment tag
+			tx.u64(0);
+			tx.varint(38);
+			tx.bytes(header,6);
+			tx.bytes(commitment,32);
+			witness.u8(1);
+			witness.u8(32);
+			for (uint32_t i=0; i<32; i++)
+			{
+				witness.u8(0);
+			}
+		}
+		addresses.clear();
+		values.clear();
+		addresses.push_back(address);
+		values.push_back(subsidy+fees);
+		std::vector< Output > coinbase;
+		finishTransaction(tx,witness,addresses,values,coinbase);
+		mTransactions.bytes(spends.data(),spends.size());
+		mTxids.insert(mTxids.end(),spendIds.begin(),spendIds.end());
+
+		uint8_t merkleRoot[32];
+		getMerkleRoot(mTxids,merkleRoot);
+		mBlock.clear();
+		mBlock.u32(MAGIC_ID);
+		mBlock.u32(0);	// length, filled in below
+		size_t headerOffset = mBlock.mData.size();
+		mBlock.u32(1);
+		mBlock.bytes(parent,32);
+		mBlock.bytes(merkleRoot,32);
+		mBlock.u32(mOptions.mTime+height*600);
+		mBlock.u32(mOptions.mBits);
+		mBlock.u32(0);
+		mine(&mBlock.mData[headerOffset]);
+		mBlock.varint(txCount+1);
+		mBlock.bytes(mTransactions.mData.data(),mTransactions.mData.size());
+		mBlock.patch32(4,(uint32_t)(mBlock.mData.size()-headerOffset));
+
+		if ( mainChain )
+		{
+			memcpy(mTip,mHash,32);
+			compactUnspent();
+			mUnspent.insert(mUnspent.end(),created.begin(),created.end());
+			mImmature.push_back(coinbase[0]);
+			mImmatureHeight.push_back(height);
+			while ( !mImmature.empty() && mImmatureHeight[0]+mOptions.mMaturity <= height+1 )
+			{
+				mUnspent.push_back(mImmature[0]);
+				mImmature.erase(mImmature.begin());
+				mImmatureHeight.erase(mImmatureHeight.begin());
+			}
+			mTransactionCount+=txCount+1;
+			mInputCount+=inputCount+1;
+			mWitnessInputCount+=witnessInputCount;
+			mOutputCount+=outputCount+(hasWitness ? 2 : 1);
+		}
+	}
+
+	static void getMerkleRoot(const std::vector< uint8_t > &ids,uint8_t root[32])
+	{
+		std::vector< uint8_t > level = ids;
+		while ( level.size() > 32 )
+		{
+			if ( (level.size()/32) & 1 )
+			{
+				level.insert(level.end(),level.end()-32,level.end());
+			}
+			std::vector< uint8_t > next(level.size()/2);
+			for (size_t i=0; i<level.size()/64; i++)
+			{
+				SHA256::doubleHash(&level[i*64],64,&next[i*32]);
+			}
+			level.swap(next);
+		}
+		memcpy(root,&level[0],32);
+	}
+
+	// Tries nonces until the header hash, read as a little endian number, is at or under the target.
+	void mine(uint8_t *header)
+	{
+		uint8_t target[32];
+		memset(target,0,sizeof(target));
+		uint32_t exponent = mOptions.mBits >> 24;
+		uint32_t mantissa = mOptions.mBits & 0x007FFFFF;
+		for (uint32_t i=0; i<3; i++)
+		{
+			int32_t at = (int32_t)exponent-3+(int32_t)i;
+			if ( at >= 0 && at < 32 )
+			{
+				target[at] = (uint8_t)(mantissa >> (i*8));
+			}
+		}
+		for (uint32_t nonce=0;; nonce++)
+		{
+			header[76] = (uint8_t)nonce;
+			header[77] = (uint8_t)(nonce >> 8);
+			header[78] = (uint8_t)(nonce >> 16);
+			header[79] = (uint8_t)(nonce >> 24);
+			SHA256::doubleHash(header,80,mHash);
+			int32_t i = 31;
+			while ( i >= 0 && mHash[i] == target[i] )
+			{
+				i--;
+			}
+			if ( i < 0 || mHash[i] < target[i] )
+			{
+				break;
+			}
+		}
+	}
+
+	bool writeBlock(const std::vector< uint8_t > &block)
+	{
+		if ( mFile && mFileLength+block.size() > (uint64_t)mOptions.mFileSize*1024*1024 )
+		{
+			fclose(mFile);
+			mFile = NULL;
+			mFileIndex++;
+			mFileLength = 0;
+		}
+		if ( mFile == NULL )
+		{
+			char scratch[1024];
+			snprintf(scratch,sizeof(scratch),"%s/blk%05d.dat", mOptions.mDirectory, mFileIndex );
+			mFile = fopen(scratch,"wb");
+			if ( mFile == NULL )
+			{
+				printf("Failed to open '%s' for writing\n", scratch );
+				return false;
+			}
+		}
+		if ( fwrite(&block[0],block.size(),1,mFile) != 1 )
+		{
+			printf("Failed to write block file %d\n", mFileIndex );
+			return false;
+		}
+		mFileLength+=block.size();
+		mBytes+=block.size();
+		return true;
+	}
+
+	const Options			&mOptions;
+	uint64_t				mRandom;
+	uint64_t				mAddressSeed;		// Addresses' key bytes are derived from this and their number
+	uint32_t				mAddressCount;
+	std::vector< Output >	mUnspent;			// Oldest first; spent entries stay until compactUnspent
+	size_t					mSpentCount;		// Spent entries still in mUnspent
+	std::vector< Output >	mImmature;			// Coinbase outputs not yet old enough to spend
+	std::vector< uint32_t >	mImmatureHeight;
+	Writer					mTransactions;		// The serialized transactions of the block being built
+	std::vector< uint8_t >	mTxids;				// ...their txids
+	std::vector< uint8_t >	mWitnessIds;		// ...and their wtxids, which are the txids for legacy transactions
+	bool					mBlockHasWitness;	// Whether any transaction in the block being built has a witness
+	Writer					mSerialized;		// Scratch for finishTransaction
+	Writer					mBlock;
+	uint8_t					mHash[32];			// Hash of the header last mined
+	uint8_t					mTip[32];			// Hash of the main chain's last block
+	FILE					*mFile;
+	uint32_t				mFileIndex;
+	uint64_t				mFileLength;
+	uint64_t				mBytes;
+	uint64_t				mTransactionCount;
+	uint64_t				mInputCount;
+	uint64_t				mWitnessInputCount;
+	uint64_t				mOutputCount;
+	uint32_t				mStaleCount;
+	uint32_t				mReorderCount;
+	uint64_t				mReuseCount;
+};
+
+// Known answers, so a broken hash fails here instead of as a chain BlockLens can not link.
+static bool checkHash(void)
+{
+	uint8_t digest[32];
+	SHA256::hash((const uint8_t *)"abc",3,digest);
+	static const uint8_t abc[4] = { 0xBA, 0x78, 0x16, 0xBF };
+	bool ret = memcmp(digest,abc,4) == 0 && digest[31] == 0xAD;
+	const char *longer = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	SHA256::hash((const uint8_t *)longer,strlen(longer),digest);
+	static const uint8_t expected[4] = { 0x24, 0x8D, 0x6A, 0x61 };
+	return ret && memcmp(digest,expected,4) == 0 && digest[31] == 0xC1;
+}
+
+int main(int argc,const char **argv)
+{
+	Options options;
+	if ( !options.parse(argc,argv) )
+	{
+		printf("Usage: generate_blocks [options] <directory>; see the top of benchmarks/generate_blocks.cpp for the options.\n");
+		return 1;
+	}
+	if ( !checkHash() )
+	{
+		printf("ERROR: SHA256 self test failed\n");
+		return 1;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Generator generator(options);
+	bool ok = generator.run();
+	if ( ok )
+	{
+		generator.report(std::chrono::duration< double >(std::chrono::steady_clock::now()-start).count());
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+// Measures how inserts into ConcurrentHash (the transaction hash map) scale with the number of inserting threads, against
+// the same table with every insert serialized by a mutex, which is what sharing a SimpleHash between threads would take.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=c++11 -O2 -pthread benchmarks/hash_insert_scaling.cpp -o hash_insert_scaling
+//   ./hash_insert_scaling [keyCount] [maxThreads]
+//
+// keyCount defaults to 4 million (the table holds up to 8 million), maxThreads to 32.  The thread count doubles from 1 up
+// to maxThreads.  For each count three passes are timed on a fresh table:
+//
+//   mutex    - every thread calls insert under one shared mutex.
+//   insert   - every thread calls insert; one atomic add per key to claim a slot, one compare-and-swap to link it.
+//   batched  - every thread claims its whole range with reserve and fills it in with insertAt, the way blocks are inserted.
+//
+// After the batched pass the same threads look every key up again while one extra thread keeps inserting a second set of
+// keys, and the run fails if any key is missing or lands in the wrong slot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include "../ConcurrentHash.h"
+
+class Key256
+{
+public:
+	Key256(void)
+	{
+		mWord0 = mWord1 = mWord2 = mWord3 = 0;
+	}
+
+	// Same hash as Hash256 in blockchain.cpp
+	inline uint32_t getHash(void) const
+	{
+		const uint32_t *h = (const uint32_t *)&mWord0;
+		return h[0] ^ h[1] ^ h[2] ^ h[3] ^ h[4] ^ h[5] ^ h[6] ^ h[7];
+	}
+
+	inline bool operator==(const Key256 &k) const
+	{
+		return mWord0 == k.mWord0 && mWord1 == k.mWord1 && mWord2 == k.mWord2 && mWord3 == k.mWord3;
+	}
+
+	uint64_t	mWord0;
+	uint64_t	mWord1;
+	uint64_t	mWord2;
+	uint64_t	mWord3;
+	uint32_t	mIndex;		// stands in for FileLocation::mTransactionIndex
+};
+
+#define MAX_KEYS 8388608
+
+typedef ConcurrentHash< Key256, 4194304, MAX_KEYS > KeyHash;
+
+static uint64_t splitMix(uint64_t &state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static void makeKeys(std::vector< Key256 > &keys,uint32_t count,uint64_t seed)
+{
+	keys.resize(count);
+	for (uint32_t i=0; i<count; i++)
+	{
+		Key256 &k = keys[i];
+		k.mWord0 = splitMix(seed);
+		k.mWord1 = splitMix(seed);
+		k.mWord2 = splitMix(seed);
+		k.mWord3 = splitMix(seed);
+		k.mIndex = i;
+	}
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration< double >(std::chrono::steady_clock::now()-start).count();
+}
+
+enum InsertMode
+{
+	IM_MUTEX,
+	IM_INSERT,
+	IM_BATCHED
+};
+
+// Runs 'threadCount' threads over even slices of 'keys' and returns the elapsed seconds.
+static double timeInserts(KeyHash &table,const std::vector< Key256 > &keys,uint32_t threadCount,InsertMode mode)
+{
+	std::mutex lock;
+	std::vector< std::thread > threads;
+	uint32_t count = (uint32_t)keys.size();
+	table.init();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (uint32_t t=0; t<threadCount; t++)
+	{
+		uint32_t begin = (uint32_t)((uint64_t)count*t/threadCount);
+		uint32_t end = (uint32_t)((uint64_t)count*(t+1)/threadCount);
+		threads.push_back(std::thread([&table,&keys,&lock,begin,end,mode]()
+		{
+			switch ( mode )
+			{
+				case IM_MUTEX:
+					for (uint32_t i=begin; i<end; i++)
+					{
+						std::lock_guard< std::mutex > guard(lock);
+						table.insert(keys[i]);
+					}
+					break;
+				case IM_INSERT:
+					for (uint32_t i=begin; i<end; i++)
+					{
+						table.insert(keys[i]);
+					}
+					break;
+				case IM_BATCHED:
+					{
+						uint32_t base = table.reserve(end-begin);
+						for (uint32_t i=begin; base != 0xFFFFFFFF && i<end; i++)
+						{
+							table.insertAt(base+(i-begin),keys[i]);
+						}
+					}
+					break;
+			}
+		}));
+	}
+	for (size_t i=0; i<threads.size(); i++)
+	{
+		threads[i].join();
+	}
+	return seconds(start);
+}
+
+// Looks every key up with 'threadCount' threads while another thread inserts 'extra'.  Returns the number of keys which were
+// not found, or whose key did not match.
+static uint32_t verify(KeyHash &table,const std::vector< Key256 > &keys,const std::vector< Key256 > &extra,uint32_t threadCount,double &elapsed)
+{
+	std::atomic< uint32_t > missing(0);
+	std::vector< std::thread > threads;
+	uint32_t count = (uint32_t)keys.size();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	threads.push_back(std::thread([&table,&extra]()
+	{
+		for (size_t i=0; i<extra.size(); i++)
+		{
+			table.insert(extra[i]);
+		}
+	}));
+	for (uint32_t t=0; t<threadCount; t++)
+	{
+		uint32_t begin = (uint32_t)((uint64_t)count*t/threadCount);
+		uint32_t end = (uint32_t)((uint64_t)count*(t+1)/threadCount);
+		threads.push_back(std::thread([&table,&keys,&missing,begin,end]()
+		{
+			uint32_t bad = 0;
+			for (uint32_t i=begin; i<end; i++)
+			{
+				const Key256 *found = table.find(keys[i]);
+				if ( found == NULL || found->mIndex != keys[i].mIndex )
+				{
+					bad++;
+				}
+			}
+			missing+=bad;
+		}));
+	}
+	for (size_t i=0; i<threads.size(); i++)
+	{
+		threads[i].join();
+	}
+	elapsed = seconds(start);
+	// The extra keys have to be there as well once the inserter is done
+	for (size_t i=0; i<extra.size(); i++)
+	{
+		if ( table.find(extra[i]) == NULL )
+		{
+			missing++;
+		}
+	}
+	if ( table.size() != keys.size()+extra.size() )
+	{
+		missing++;
+	}
+	return missing;
+}
+
+int main(int argc,const char **argv)
+{
+	uint32_t keyCount = argc > 1 ? (uint32_t)atoi(argv[1]) : 4000000;
+	uint32_t maxThreads = argc > 2 ? (uint32_t)atoi(argv[2]) : 32;
+	if ( keyCount == 0 || keyCount > MAX_KEYS/2 )
+	{
+		printf("keyCount must be between 1 and %d\n", MAX_KEYS/2 );
+		return 1;
+	}
+	if ( maxThreads == 0 )
+	{
+		maxThreads = 1;
+	}
+
+	std::vector< Key256 > keys;
+	std::vector< Key256 > extra;
+	makeKeys(keys,keyCount,1);
+	makeKeys(extra,keyCount/4,2);
+
+	printf("%u keys, %u hardware threads\n", keyCount, std::thread::hardware_concurrency() );
+	printf("threads    mutex Mops/s   insert Mops/s  batched Mops/s  speedup  find+insert Mops/s\n");
+
+	double single = 0;
+	uint32_t failures = 0;
+	for (uint32_t threadCount=1; threadCount<=maxThreads; threadCount*=2)
+	{
+		double mops[3];
+		for (uint32_t mode=IM_MUTEX; mode<=IM_BATCHED; mode++)
+		{
+			KeyHash *table = new KeyHash;
+			double elapsed = timeInserts(*table,keys,threadCount,(InsertMode)mode);
+			mops[mode] = keyCount / elapsed / 1e6;
+			if ( mode == IM_BATCHED )
+			{
+				double findElapsed;
+				uint32_t missing = verify(*table,keys,extra,threadCount,findElapsed);
+				if ( missing )
+				{
+					printf("ERROR: %u keys missing or misplaced with %u threads\n", missing, threadCount );
+					failures++;
+				}
+				if ( threadCount == 1 )
+				{
+					single = mops[IM_BATCHED];
+				}
+				printf("%7u %14.2f %15.2f %15.2f %7.2fx %19.2f\n", threadCount, mops[IM_MUTEX], mops[IM_INSERT], mops[IM_BATCHED],
+					single > 0 ? mops[IM_BATCHED]/single : 0, keyCount / findElapsed / 1e6 );
+			}
+			delete table;
+		}
+	}
+	return failures ? 1 : 0;
+}
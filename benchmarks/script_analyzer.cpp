@@ -0,0 +1,208 @@
+// Measures the printable ASCII run detector analyzeSignature runs over every input script (see ScriptAnalyzer.h) against its
+// plain byte at a time version, with the DER signature shape decoder timed alongside for scale.
+//
+// Build and run from the repository root:
+//
+//   g++ -std=c++11 -O2 benchmarks/script_analyzer.cpp -o script_analyzer
+//   ./script_analyzer [scriptCount] [passes]
+//
+// scriptCount defaults to 1 million synthetic input scripts, passes to 20.  The scripts are a mix of what the chain holds:
+// ordinary signature + public key scripts with every DER length the analyzer flags, coinbases with and without a message,
+// long multisig style scripts, text with the run broken in every position, and random bytes.  Before timing, every script
+// and every prefix of a set of short ones is run through both versions of each scan, and the run fails if any answer
+// differs.  The DER decoder has only the one version; it is checked to never report a signature running past the end of
+// the script.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "../ScriptAnalyzer.h"
+
+static uint64_t splitMix(uint64_t &state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static void appendRandom(std::vector< uint8_t > &s,uint32_t count,uint64_t &seed)
+{
+	for (uint32_t i=0; i<count; i++)
+	{
+		s.push_back((uint8_t)splitMix(seed));
+	}
+}
+
+static void appendText(std::vector< uint8_t > &s,uint32_t count,uint64_t &seed)
+{
+	for (uint32_t i=0; i<count; i++)
+	{
+		s.push_back((uint8_t)(32+splitMix(seed)%94));
+	}
+}
+
+// <push> 0x30 <seq> 0x02 <x> ... 0x02 <y> ... <sighash> 0x21 <33 byte key>
+static void appendSignature(std::vector< uint8_t > &s,uint32_t xLength,uint32_t yLength,uint64_t &seed)
+{
+	s.push_back((uint8_t)(xLength+yLength+7));
+	s.push_back(0x30);
+	s.push_back((uint8_t)(xLength+yLength+4));
+	s.push_back(0x02);
+	s.push_back((uint8_t)xLength);
+	appendRandom(s,xLength,seed);
+	s.push_back(0x02);
+	s.push_back((uint8_t)yLength);
+	appendRandom(s,yLength,seed);
+	s.push_back(0x01);
+	s.push_back(0x21);
+	s.push_back(0x02 | (uint8_t)(splitMix(seed) & 1));
+	appendRandom(s,32,seed);
+}
+
+static void makeScript(std::vector< uint8_t > &s,uint64_t &seed)
+{
+	s.clear();
+	uint32_t kind = (uint32_t)(splitMix(seed)%100);
+	if ( kind < 70 )
+	{
+		appendSignature(s,30+(uint32_t)(splitMix(seed)%4),30+(uint32_t)(splitMix(seed)%4),seed);
+		if ( kind < 3 )
+		{
+			s[5+s[4]] = 0x03;	// broken second tag
+		}
+		else if ( kind < 6 )
+		{
+			s.resize(splitMix(seed)%s.size());	// truncated
+		}
+	}
+	else if ( kind < 80 )
+	{
+		appendRandom(s,4+(uint32_t)(splitMix(seed)%8),seed);	// coinbase
+		if ( kind < 75 )
+		{
+			appendText(s,8+(uint32_t)(splitMix(seed)%60),seed);
+		}
+	}
+	else if ( kind < 88 )
+	{
+		s.push_back(0x00);
+		for (uint32_t i=0; i<3; i++)
+		{
+			appendSignature(s,0x20,0x20,seed);
+		}
+	}
+	else if ( kind < 94 )
+	{
+		// text with one non-printable byte dropped into every stretch of 15
+		uint32_t length = 20+(uint32_t)(splitMix(seed)%200);
+		appendText(s,length,seed);
+		for (uint32_t i=(uint32_t)(splitMix(seed)%15); i<length; i+=15)
+		{
+			s[i] = 0x7F;
+		}
+	}
+	else
+	{
+		appendRandom(s,(uint32_t)(splitMix(seed)%300),seed);
+	}
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration< double >(std::chrono::steady_clock::now()-start).count();
+}
+
+static uint32_t check(const uint8_t *data,uint32_t length)
+{
+	uint32_t errors = 0;
+	if ( SCRIPT_ANALYZER::hasAsciiRun(data,length) != SCRIPT_ANALYZER::hasAsciiRunScalar(data,length) )
+	{
+		errors++;
+	}
+	SCRIPT_ANALYZER::DerShape shape;
+	if ( SCRIPT_ANALYZER::decodeDerShape(data,length,shape) == SCRIPT_ANALYZER::DER_COMPLETE && shape.mSigHashOffset >= length )
+	{
+		errors++;
+	}
+	return errors;
+}
+
+int main(int argc,const char **argv)
+{
+	uint32_t scriptCount = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000000;
+	uint32_t passes = argc > 2 ? (uint32_t)atoi(argv[2]) : 20;
+	if ( scriptCount == 0 || passes == 0 )
+	{
+		printf("scriptCount and passes must be at least 1\n");
+		return 1;
+	}
+
+	// All scripts back to back in one buffer, the way they sit in a block
+	std::vector< uint8_t > data;
+	std::vector< uint32_t > offsets;
+	std::vector< uint8_t > script;
+	uint64_t seed = 1;
+	for (uint32_t i=0; i<scriptCount; i++)
+	{
+		makeScript(script,seed);
+		offsets.push_back((uint32_t)data.size());
+		data.insert(data.end(),script.begin(),script.end());
+	}
+	offsets.push_back((uint32_t)data.size());
+
+	uint32_t errors = 0;
+	for (uint32_t i=0; i<scriptCount; i++)
+	{
+		errors+=check(&data[offsets[i]],offsets[i+1]-offsets[i]);
+	}
+	for (uint32_t i=0; i<10000; i++)
+	{
+		makeScript(script,seed);
+		for (uint32_t j=0; j<=script.size(); j++)
+		{
+			errors+=check(script.empty() ? NULL : &script[0],j);
+		}
+	}
+	if ( errors )
+	{
+		printf("ERROR: %u scripts where the fast and scalar scans disagree or a signature overruns its script\n", errors );
+		return 1;
+	}
+
+	printf("%u scripts, %0.1f MB, %u passes, SSE2 %s\n", scriptCount, (double)data.size()/(1024*1024), passes, SCRIPT_ANALYZER_SSE2 ? "on" : "off" );
+	printf("scan            scalar MB/s     fast MB/s   speedup   matches\n");
+
+	uint32_t hits[3] = { 0, 0, 0 };
+	double elapsed[3];
+	for (uint32_t mode=0; mode<3; mode++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		uint32_t count = 0;
+		for (uint32_t p=0; p<passes; p++)
+		{
+			for (uint32_t i=0; i<scriptCount; i++)
+			{
+				const uint8_t *s = &data[offsets[i]];
+				uint32_t length = offsets[i+1]-offsets[i];
+				SCRIPT_ANALYZER::DerShape shape;
+				switch ( mode )
+				{
+					case 0: count+=SCRIPT_ANALYZER::hasAsciiRunScalar(s,length) ? 1 : 0; break;
+					case 1: count+=SCRIPT_ANALYZER::hasAsciiRun(s,length) ? 1 : 0; break;
+					case 2: count+=SCRIPT_ANALYZER::decodeDerShape(s,length,shape) == SCRIPT_ANALYZER::DER_COMPLETE ? 1 : 0; break;
+				}
+			}
+		}
+		elapsed[mode] = seconds(start);
+		hits[mode] = count/passes;
+	}
+	double mb = (double)data.size()*passes/(1024*1024);
+	printf("ascii run    %13.1f %13.1f %8.2fx %9u\n", mb/elapsed[0], mb/elapsed[1], elapsed[0]/elapsed[1], hits[1] );
+	printf("der shape    %13.1f %13s %9s %9u\n", mb/elapsed[2], "-", "-", hits[2] );
+	return hits[0] == hits[1] ? 0 : 1;
+}
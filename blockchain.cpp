@@ -10,6 +10,23 @@
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "ConcurrentHash.h"
+#include "ScriptAnalyzer.h"
+#include "Logger.h"
+#include "Profiler.h"
 
 // Note, to minimize dynamic memory allocation this parser pre-allocates memory for the maximum ever expected number
 // of bitcoin addresses, transactions, inputs, outputs, and blocks.
@@ -46,14 +63,8 @@
 
 
 // Some globals for error reporting.
-static uint32_t	gBlockTime=0;
-static uint32_t gBlockIndex=0;
-static uint32_t gTransactionIndex=0;
-static uint32_t gOutputIndex=0;
-static bool		gIsWarning=false;
 static FILE		*gWeirdSignatureFile=NULL;
 static FILE		*gAsciiSignatureFile=NULL;
-static FILE		*gLogFile=NULL;
 
 static const char *getDateString(time_t t)
 {
@@ -65,23 +76,14 @@ static const char *getDateString(time_t t)
 }
 
 
+// Report output; queued for the logger's writer thread (see Logger.h), which prints it and copies it to 'blockchain.txt'.
+// Diagnostics from the parsing code use the LOG_ macros instead, so they can be filtered, rate limited and counted.
 static void logMessage(const char *fmt,...)
 {
-	char wbuff[2048];
 	va_list arg;
 	va_start( arg, fmt );
-	vsprintf(wbuff,fmt, arg);
+	logPrintV(NULL,fmt,arg);
 	va_end(arg);
-	printf("%s",wbuff);
-	if ( gLogFile == NULL )
-	{
-		gLogFile = fopen("blockchain.txt", "wb");
-	}
-	if ( gLogFile )
-	{
-		fprintf(gLogFile,"%s", wbuff );
-		fflush(gLogFile);
-	}
 }
 
 class Hash256
@@ -129,19 +131,212 @@ public:
 	uint64_t	mWord3;
 };
 
-static void printReverseHash(const uint8_t *hash)
+//*********** Begin of Source Code for proof-of-work validation *********************************
+//
+// A block hash is a 256 bit little-endian number; mWord3 holds the most significant 64 bits.  The 'bits' field in the block
+// header is the 'compact' encoding of the target the hash must be less than or equal to: the top byte is a base-256 exponent
+// and the low 23 bits are the mantissa, so target = mantissa * 256^(exponent-3).  Bit 23 is a sign bit; negative targets are invalid.
+
+#define POW_LIMIT_BITS 0x1d00ffff	// The easiest target ever allowed on the main network (the difficulty-1 target of the genesis block)
+
+// Accumulated chain work; an unsigned 256 bit integer stored as four 64 bit little-endian words.
+class ChainWork
+{
+public:
+	ChainWork(void)
+	{
+		mWord[0] = 0;
+		mWord[1] = 0;
+		mWord[2] = 0;
+		mWord[3] = 0;
+	}
+
+	inline void add(const ChainWork &w)
+	{
+		uint64_t carry = 0;
+		for (uint32_t i=0; i<4; i++)
+		{
+			uint64_t a = mWord[i];
+			uint64_t sum = a + w.mWord[i];
+			uint64_t c1 = sum < a ? 1 : 0;
+			sum+=carry;
+			uint64_t c2 = sum < carry ? 1 : 0;
+			mWord[i] = sum;
+			carry = c1 | c2;
+		}
+	}
+
+	// -1 less, 0 equal, +1 greater.
+	inline int32_t compare(const ChainWork &w) const
+	{
+		for (int32_t i=3; i>=0; i--)
+		{
+			if ( mWord[i] != w.mWord[i] )
+			{
+				return mWord[i] < w.mWord[i] ? -1 : 1;
+			}
+		}
+		return 0;
+	}
+
+	// Returns the approximate value as a double; only used for reporting.
+	double getDouble(void) const
+	{
+		double ret = 0;
+		for (int32_t i=3; i>=0; i--)
+		{
+			ret = ret*18446744073709551616.0 + (double)mWord[i];
+		}
+		return ret;
+	}
+
+	uint64_t	mWord[4];
+};
+
+// Decodes a compact 'bits' value into the full 256 bit target; returns false if the encoding is negative, zero, or overflows 256 bits.
+static bool decodeCompactTarget(uint32_t bits,Hash256 &target)
+{
+	bool ret = false;
+
+	uint32_t exponent = bits >> 24;
+	uint32_t mantissa = bits & 0x007FFFFF;
+
+	target.mWord0 = 0;
+	target.mWord1 = 0;
+	target.mWord2 = 0;
+	target.mWord3 = 0;
+
+	if ( mantissa && !(bits & 0x00800000) )
+	{
+		uint8_t *dest = (uint8_t *)&target.mWord0;
+		if ( exponent <= 3 )
+		{
+			mantissa >>= 8*(3-exponent);
+			dest[0] = (uint8_t)(mantissa);
+			dest[1] = (uint8_t)(mantissa>>8);
+			dest[2] = (uint8_t)(mantissa>>16);
+			ret = mantissa ? true : false;
+		}
+		else if ( exponent <= 32 || (exponent == 33 && mantissa <= 0xFFFF) || (exponent == 34 && mantissa <= 0xFF) )
+		{
+			for (uint32_t i=0; i<3; i++)
+			{
+				uint32_t index = exponent-3+i;
+				if ( index < 32 )
+				{
+					dest[index] = (uint8_t)(mantissa>>(8*i));
+				}
+			}
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+// Compares two 256 bit little-endian numbers; -1 less, 0 equal, +1 greater.
+// The four word compares are combined into two masks without branching on each word so the common case (the high word decides) stays cheap.
+static inline int32_t compareHash256(const Hash256 &a,const Hash256 &b)
+{
+	uint32_t less = (uint32_t)(a.mWord3 < b.mWord3) << 3 | (uint32_t)(a.mWord2 < b.mWord2) << 2 | (uint32_t)(a.mWord1 < b.mWord1) << 1 | (uint32_t)(a.mWord0 < b.mWord0);
+	uint32_t greater = (uint32_t)(a.mWord3 > b.mWord3) << 3 | (uint32_t)(a.mWord2 > b.mWord2) << 2 | (uint32_t)(a.mWord1 > b.mWord1) << 1 | (uint32_t)(a.mWord0 > b.mWord0);
+	if ( less == greater ) return 0; // both zero; every word is equal
+	return less > greater ? -1 : 1; // whichever mask has the highest differing word set wins
+}
+
+// Returns true if this block hash satisfies the target encoded in 'bits' and the target itself is no easier than the target encoded in 'limitBits'
+static bool checkProofOfWork(const Hash256 &blockHash,uint32_t bits,uint32_t limitBits)
+{
+	bool ret = false;
+	Hash256 target;
+	Hash256 limit;
+	if ( decodeCompactTarget(bits,target) && decodeCompactTarget(limitBits,limit) )
+	{
+		if ( compareHash256(target,limit) <= 0 && compareHash256(blockHash,target) <= 0 )
+		{
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+// Computes the expected number of hashes needed to find a block at this target, 2^256 / target.
+// This is within one unit of the 2^256/(target+1) used by the reference client, which is more than enough to rank competing chains.
+static void getBlockWork(uint32_t bits,ChainWork &work)
+{
+	work = ChainWork();
+
+	uint32_t mantissa = bits & 0x007FFFFF;
+	int32_t shift = 8*((int32_t)(bits>>24)-3);
+	if ( mantissa == 0 || (bits & 0x00800000) )
+	{
+		return;
+	}
+	if ( shift < 0 )
+	{
+		mantissa >>= -shift;
+		shift = 0;
+		if ( mantissa == 0 )
+		{
+			return;
+		}
+	}
+	if ( shift > 255 )
+	{
+		return;
+	}
+	// Long division of 2^(256-shift) by the 23 bit mantissa, one 32 bit limb at a time from the most significant end.
+	uint32_t dividend[9];
+	uint32_t quotient[9];
+	memset(dividend,0,sizeof(dividend));
+	uint32_t bit = 256-(uint32_t)shift;
+	dividend[bit/32] = 1u << (bit%32);
+	uint64_t remainder = 0;
+	for (int32_t i=8; i>=0; i--)
+	{
+		uint64_t current = (remainder << 32) | dividend[i];
+		quotient[i] = (uint32_t)(current / mantissa);
+		remainder = current % mantissa;
+	}
+	if ( quotient[8] ) // only possible for a target of one; saturate
+	{
+		for (uint32_t i=0; i<4; i++)
+		{
+			work.mWord[i] = 0xFFFFFFFFFFFFFFFFULL;
+		}
+	}
+	else
+	{
+		for (uint32_t i=0; i<4; i++)
+		{
+			work.mWord[i] = (uint64_t)quotient[i*2] | ((uint64_t)quotient[i*2+1] << 32);
+		}
+	}
+}
+
+// Writes the hash most significant byte first into 'dest', which must hold 65 characters.
+static const char *formatReverseHash(const uint8_t *hash,char *dest)
 {
+	static const char hex[] = "0123456789abcdef";
 	if ( hash )
 	{
 		for (uint32_t i=0; i<32; i++)
 		{
-			logMessage("%02x", hash[31-i] );
+			dest[i*2] = hex[hash[31-i] >> 4];
+			dest[i*2+1] = hex[hash[31-i] & 15];
 		}
+		dest[64] = 0;
 	}
 	else
 	{
-		logMessage("NULL HASH");
+		strcpy(dest,"NULL HASH");
 	}
+	return dest;
+}
+
+static void printReverseHash(const uint8_t *hash)
+{
+	char scratch[65];
+	logMessage("%s", formatReverseHash(hash,scratch) );
 }
 
 static void fprintReverseHash(FILE *fph,const uint8_t *hash)
@@ -159,6 +354,31 @@ static void fprintReverseHash(FILE *fph,const uint8_t *hash)
 	}
 }
 
+// Parses a hash printed by printReverseHash (most significant byte first) back into its 32 byte form.
+static bool parseReverseHash(const char *str,uint8_t *hash)
+{
+	bool ret = false;
+	if ( str && strlen(str) == 64 )
+	{
+		ret = true;
+		for (uint32_t i=0; i<32 && ret; i++)
+		{
+			uint32_t v = 0;
+			for (uint32_t j=0; j<2; j++)
+			{
+				char c = str[i*2+j];
+				v<<=4;
+				if ( c >= '0' && c <= '9' ) v|=(uint32_t)(c-'0');
+				else if ( c >= 'a' && c <= 'f' ) v|=(uint32_t)(c-'a'+10);
+				else if ( c >= 'A' && c <= 'F' ) v|=(uint32_t)(c-'A'+10);
+				else ret = false;
+			}
+			hash[31-i] = (uint8_t)v;
+		}
+	}
+	return ret;
+}
+
 class BlockHeader : public Hash256
 {
 public:
@@ -167,17 +387,328 @@ public:
 		mFileIndex = 0;
 		mFileOffset = 0;
 		mBlockLength = 0;
+		mBits = 0;
+		mTimeStamp = 0;
+		mHeight = 0xFFFFFFFF;
+		mParent = NULL;
+		mNextOrphan = NULL;
 	}
 	BlockHeader(const Hash256 &h) : Hash256(h)
 	{
 		mFileIndex = 0;
 		mFileOffset = 0;
 		mBlockLength = 0;
+		mBits = 0;
+		mTimeStamp = 0;
+		mHeight = 0xFFFFFFFF;
+		mParent = NULL;
+		mNextOrphan = NULL;
+	}
+
+	inline bool isConnected(void) const
+	{
+		return mHeight != 0xFFFFFFFF;
 	}
+
 	uint32_t	mFileIndex;
 	uint32_t	mFileOffset;
 	uint32_t	mBlockLength;
+	uint32_t	mBits;						// The compact proof-of-work target of this block
+	uint32_t	mTimeStamp;					// The block time stamp, as claimed by the miner
+	uint32_t	mHeight;					// Height of this header in the header tree; 0xFFFFFFFF while its parent has not been seen yet
 	uint8_t		mPreviousBlockHash[32];
+	ChainWork	mChainWork;					// Total work of this header and all of its ancestors
+	BlockHeader	*mParent;					// The previous block in the header tree
+	BlockHeader	*mNextOrphan;				// Next header waiting on the same missing parent
+};
+
+// Keyed by the hash of a parent block we have not seen yet; holds the list of headers waiting for it to show up.
+class OrphanHeaders : public Hash256
+{
+public:
+	OrphanHeaders(void)
+	{
+		mFirst = NULL;
+	}
+	OrphanHeaders(const Hash256 &h) : Hash256(h)
+	{
+		mFirst = NULL;
+	}
+	BlockHeader	*mFirst;
+};
+
+// Collects how much memory each pool and table has reserved, how much of it holds live elements, and how much the operating
+// system has actually backed with pages ('resident'; an array which is allocated but never written costs address space
+// only).  Everything here is pre-allocated for the worst case, so the gap between 'used' and 'reserved' and the high water
+// marks are what to look at before changing the MAX_ limits.  Resident pages are measured with mincore and are only
+// available on Linux.
+#define CHAIN_HISTOGRAM_SIZE 9	// bucket chains of 0..7 entries, and 8 or more
+
+class MemoryReport
+{
+public:
+	MemoryReport(void)
+	{
+		mTotalReserved = 0;
+		mTotalUsed = 0;
+		mTotalResident = 0;
+		mResidentKnown = false;
+		mRowOpen = false;
+	}
+
+	// Starts a row: 'capacity' elements of 'elementSize' bytes at 'data', of which 'count' are in use and at most 'highWater'
+	// ever were.  'data' may be NULL if the memory is somewhere else or not allocated yet.
+	void add(const char *name,const void *data,uint64_t elementSize,uint64_t capacity,uint64_t count,uint64_t highWater)
+	{
+		finishRow();
+		mName = name;
+		mElementSize = elementSize;
+		mCapacity = capacity;
+		mCount = count;
+		mHighWater = highWater > count ? highWater : count;
+		mReserved = 0;
+		mResident = 0;
+		mRowOpen = true;
+		addRegion(data,elementSize*capacity);
+	}
+
+	// More memory belonging to the current row, for pools made of several allocations.
+	void addRegion(const void *data,uint64_t bytes)
+	{
+		if ( data && bytes )
+		{
+			mReserved+=bytes;
+			mResident+=getResidentBytes(data,bytes);
+		}
+	}
+
+	// A row for a ScratchBuffer; all of its capacity counts as in use, since it is sized by the largest thing it ever held.
+	template < class Buffer > void addScratch(const char *name,const Buffer &buffer)
+	{
+		add(name,buffer.get(),sizeof(*buffer.get()),buffer.getCapacity(),buffer.getCapacity(),buffer.getCapacity());
+	}
+
+	// A row for the entry array of a hash table, one for its bucket heads, and the chain length histogram.
+	template < class Hash > void addHash(const char *name,const Hash &hash)
+	{
+		char scratch[512];
+		snprintf(scratch,sizeof(scratch),"%s entries",name);
+		add(scratch,NULL,sizeof(typename Hash::HashEntry),Hash::ENTRY_CAPACITY,hash.size(),hash.getHighWater());
+		addRegion(hash.getEntries(),sizeof(typename Hash::HashEntry)*(uint64_t)Hash::ENTRY_CAPACITY);
+		snprintf(scratch,sizeof(scratch),"%s buckets",name);
+		uint32_t histogram[CHAIN_HISTOGRAM_SIZE];
+		uint32_t longest = hash.getChainHistogram(histogram,CHAIN_HISTOGRAM_SIZE);
+		uint32_t usedBuckets = Hash::BUCKET_COUNT-histogram[0];
+		add(scratch,hash.getBuckets(),sizeof(void *),Hash::BUCKET_COUNT,usedBuckets,usedBuckets);
+		int n = snprintf(scratch,sizeof(scratch),"    %s chains:", name );
+		for (uint32_t i=0; i<CHAIN_HISTOGRAM_SIZE && n > 0 && n < (int)sizeof(scratch); i++)
+		{
+			n+=snprintf(scratch+n,sizeof(scratch)-n," %d%s:%u", i, i == CHAIN_HISTOGRAM_SIZE-1 ? "+" : "", histogram[i] );
+		}
+		if ( n > 0 && n < (int)sizeof(scratch) )
+		{
+			snprintf(scratch+n,sizeof(scratch)-n,"  longest %u, %0.2f per used bucket, load %0.2f", longest,
+				usedBuckets ? (double)hash.size()/usedBuckets : 0.0, (double)hash.size()/Hash::BUCKET_COUNT );
+		}
+		mHistograms.push_back(scratch);
+	}
+
+	void print(void)
+	{
+		finishRow();
+		logMessage("%-36s %8s %12s %12s %12s %11s %11s %11s\r\n", "Pool", "Element", "Capacity", "In use", "High water", "Reserved MB", "Used MB", "Resident MB" );
+		for (size_t i=0; i<mRows.size(); i++)
+		{
+			logMessage("%s\r\n", mRows[i].c_str() );
+		}
+		logMessage("%-36s %8s %12s %12s %12s %11.1f %11.1f %11s\r\n", "Total", "", "", "", "", toMB(mTotalReserved), toMB(mTotalUsed), mResidentKnown ? formatMB(mTotalResident) : "n/a" );
+		for (size_t i=0; i<mHistograms.size(); i++)
+		{
+			logMessage("%s\r\n", mHistograms[i].c_str() );
+		}
+#ifdef __linux__
+		// The whole process, for comparison; VmHWM is the peak resident size
+		FILE *fph = fopen("/proc/self/status","rb");
+		if ( fph )
+		{
+			char line[256];
+			while ( fgets(line,sizeof(line),fph) )
+			{
+				if ( strncmp(line,"VmRSS:",6) == 0 || strncmp(line,"VmHWM:",6) == 0 || strncmp(line,"VmSize:",7) == 0 )
+				{
+					logMessage("Process %s", line );
+				}
+			}
+			fclose(fph);
+		}
+#endif
+	}
+
+private:
+	static double toMB(uint64_t bytes)
+	{
+		return (double)bytes/(1024.0*1024.0);
+	}
+
+	const char *formatMB(uint64_t bytes)
+	{
+		snprintf(mScratch,sizeof(mScratch),"%0.1f",toMB(bytes));
+		return mScratch;
+	}
+
+	uint64_t getResidentBytes(const void *data,uint64_t bytes)
+	{
+		uint64_t ret = 0;
+#ifdef __linux__
+		uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+		uintptr_t begin = (uintptr_t)data & ~(uintptr_t)(pageSize-1);
+		uintptr_t end = ((uintptr_t)data+bytes+pageSize-1) & ~(uintptr_t)(pageSize-1);
+		std::vector< unsigned char > pages((end-begin)/pageSize);
+		if ( !pages.empty() && mincore((void *)begin,end-begin,&pages[0]) == 0 )
+		{
+			for (size_t i=0; i<pages.size(); i++)
+			{
+				ret+=(pages[i] & 1) ? pageSize : 0;
+			}
+			ret = ret < bytes ? ret : bytes;	// the first and last pages may be shared with other allocations
+			mResidentKnown = true;
+		}
+#else
+		(void)data;
+		(void)bytes;
+#endif
+		return ret;
+	}
+
+	void finishRow(void)
+	{
+		if ( mRowOpen )
+		{
+			char scratch[512];
+			uint64_t used = mElementSize*mCount;
+			snprintf(scratch,sizeof(scratch),"%-36s %8llu %12llu %12llu %12llu %11.1f %11.1f %11s", mName.c_str(),
+				(unsigned long long)mElementSize, (unsigned long long)mCapacity, (unsigned long long)mCount, (unsigned long long)mHighWater,
+				toMB(mReserved), toMB(used), mResidentKnown ? formatMB(mResident) : "n/a" );
+			mRows.push_back(scratch);
+			mTotalReserved+=mReserved;
+			mTotalUsed+=used;
+			mTotalResident+=mResident;
+			mRowOpen = false;
+		}
+	}
+
+	std::string					mName;
+	uint64_t					mElementSize;
+	uint64_t					mCapacity;
+	uint64_t					mCount;
+	uint64_t					mHighWater;
+	uint64_t					mReserved;
+	uint64_t					mResident;
+	bool						mRowOpen;
+	bool						mResidentKnown;
+	uint64_t					mTotalReserved;
+	uint64_t					mTotalUsed;
+	uint64_t					mTotalResident;
+	std::vector< std::string >	mRows;
+	std::vector< std::string >	mHistograms;
+	char						mScratch[64];
+};
+
+// Maps block height to time and back for the active chain.  Miners may stamp a block earlier than its parent, so each time is
+// corrected to the running maximum; the times are then sorted and the blocks covering any time window are found with a binary search.
+class BlockTimeIndex
+{
+public:
+	BlockTimeIndex(void)
+	{
+		mTimes = NULL;
+		mBlockCount = 0;
+	}
+
+	~BlockTimeIndex(void)
+	{
+		delete []mTimes;
+	}
+
+	// Rewrites the times of blocks [firstBlock,blockCount) from the active chain headers; the blocks below firstBlock are unchanged.
+	void update(BlockHeader **headers,uint32_t firstBlock,uint32_t blockCount)
+	{
+		if ( mTimes == NULL )
+		{
+			mTimes = new uint32_t[MAX_TOTAL_BLOCKS];
+		}
+		assert( blockCount <= MAX_TOTAL_BLOCKS );
+		if ( firstBlock > mBlockCount )
+		{
+			firstBlock = mBlockCount;
+		}
+		uint32_t previous = firstBlock ? mTimes[firstBlock-1] : 0;
+		for (uint32_t i=firstBlock; i<blockCount; i++)
+		{
+			uint32_t t = headers[i]->mTimeStamp;
+			if ( t < previous )
+			{
+				t = previous;
+			}
+			mTimes[i] = t;
+			previous = t;
+		}
+		mBlockCount = blockCount;
+	}
+
+	inline uint32_t getBlockCount(void) const
+	{
+		return mBlockCount;
+	}
+
+	void reportMemory(MemoryReport &report) const
+	{
+		report.add("block times",mTimes,sizeof(uint32_t),mTimes ? MAX_TOTAL_BLOCKS : 0,mBlockCount,mBlockCount);
+	}
+
+	inline uint32_t getBlockTime(uint32_t blockIndex) const
+	{
+		return blockIndex < mBlockCount ? mTimes[blockIndex] : 0;
+	}
+
+	// Returns the first block whose time is at or after this time, or the block count if there is none.
+	uint32_t getFirstBlock(uint32_t timeStamp) const
+	{
+		uint32_t lo = 0;
+		uint32_t hi = mBlockCount;
+		while ( lo < hi )
+		{
+			uint32_t mid = (lo+hi)/2;
+			if ( mTimes[mid] < timeStamp )
+			{
+				lo = mid+1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+	// Returns the last block whose time is at or before this time, or 0xFFFFFFFF if the chain starts later.
+	uint32_t getBlockAtTime(uint32_t timeStamp) const
+	{
+		uint32_t next = timeStamp == 0xFFFFFFFF ? mBlockCount : getFirstBlock(timeStamp+1);
+		return next ? next-1 : 0xFFFFFFFF;
+	}
+
+	// Returns the number of blocks with a time in [startTime,endTime) and the first of them.
+	uint32_t getBlockRange(uint32_t startTime,uint32_t endTime,uint32_t &firstBlock) const
+	{
+		firstBlock = getFirstBlock(startTime);
+		uint32_t lastBlock = getFirstBlock(endTime);
+		return lastBlock > firstBlock ? lastBlock-firstBlock : 0;
+	}
+
+private:
+	uint32_t	*mTimes;
+	uint32_t	mBlockCount;
 };
 
 struct BlockPrefix
@@ -341,9 +872,10 @@ public:
 	{
 		mEntries = NULL;
 		mHashTableCount = 0;
+		mHighWater = 0;
 		for (uint32_t i = 0; i < hashTableSize; i++)
 		{
-			mHashTable[i] = NULL;
+			mHashTable[i].store(NULL,std::memory_order_relaxed);
 		}
 	}
 
@@ -370,19 +902,21 @@ public:
 	inline Key * getKey(uint32_t i) const
 	{
 		Key *ret = NULL;
-		assert( i < mHashTableCount );
-		if ( i < mHashTableCount )
+		uint32_t count = mHashTableCount.load(std::memory_order_acquire);
+		assert( i < count );
+		if ( i < count )
 		{
 			ret = &mEntries[i].mKey;
 		}
 		return ret;
 	}
 
+	// Safe to call while another thread inserts; see insert.
 	inline Key* find(const Key& key)  const
 	{
 		Key* ret = NULL;
 		uint32_t hash = getHash(key);
-		HashEntry* h = mHashTable[hash];
+		HashEntry* h = mHashTable[hash].load(std::memory_order_acquire);
 		while (h)
 		{
 			if (h->mKey == key)
@@ -395,28 +929,23 @@ public:
 		return ret;
 	}
 
-	// Inserts are not thread safe; use a mutex
+	// Inserts are not thread safe; use a mutex.  A single inserter may run alongside readers using find, getKey and size
+	// though: the entry is filled in completely before it is published at the head of its bucket and counted, both with
+	// release stores.
 	inline Key * insert(const Key& key)
 	{
 		Key *ret = NULL;
 		init(); // allocate the entries table
-		if (mHashTableCount < hashTableEntries)
+		uint32_t count = mHashTableCount.load(std::memory_order_relaxed);
+		if (count < hashTableEntries)
 		{
-			HashEntry* h = &mEntries[mHashTableCount];
+			HashEntry* h = &mEntries[count];
 			h->mKey = key;
 			ret = &h->mKey;
-			mHashTableCount++;
 			uint32_t hash = getHash(key);
-			if (mHashTable[hash])
-			{
-				HashEntry* next = mHashTable[hash];
-				mHashTable[hash] = h;
-				h->mNext = next;
-			}
-			else
-			{
-				mHashTable[hash] = h;
-			}
+			h->mNext = mHashTable[hash].load(std::memory_order_relaxed);
+			mHashTable[hash].store(h,std::memory_order_release);
+			mHashTableCount.store(count+1,std::memory_order_release);
 		}
 		else
 		{
@@ -427,24 +956,90 @@ public:
 
 	inline uint32_t size(void) const
 	{
-		return mHashTableCount;
+		return mHashTableCount.load(std::memory_order_acquire);
 	}
-private:
 
-	inline uint32_t getHash(const Key& key) const
+	// Removes the most recently inserted entry.  Since inserts push onto the front of a bucket, the newest entry is always
+	// at the head of its bucket, so entries can be popped in reverse insertion order in constant time.  The entry itself is
+	// left intact for readers which may still be walking through it; its slot must not be inserted into again until they
+	// are done (see EpochManager::synchronize).
+	inline void removeLast(void)
 	{
-		return key.getHash() & (hashTableSize - 1);
+		uint32_t count = mHashTableCount.load(std::memory_order_relaxed);
+		assert( count );
+		if ( count )
+		{
+			if ( count > mHighWater )
+			{
+				mHighWater = count;	// only removing can lower the count, so this is the only place the peak can be missed
+			}
+			HashEntry *h = &mEntries[count-1];
+			uint32_t hash = getHash(h->mKey);
+			assert( mHashTable[hash].load(std::memory_order_relaxed) == h );
+			mHashTable[hash].store(h->mNext,std::memory_order_release);
+			mHashTableCount.store(count-1,std::memory_order_release);
+		}
 	}
 
+	// The most entries the table has held at once.
+	inline uint32_t getHighWater(void) const
+	{
+		uint32_t count = size();
+		return count > mHighWater ? count : mHighWater;
+	}
 
-	HashEntry*		mHashTable[hashTableSize];
-	unsigned int	mHashTableCount;
-	HashEntry		*mEntries;
-
-};
+	inline const HashEntry *getEntries(void) const
+	{
+		return mEntries;
+	}
 
+	inline const void *getBuckets(void) const
+	{
+		return mHashTable;
+	}
 
-class FileLocation : public Hash256
+	// Counts the buckets holding 0, 1, .. histogramSize-2 entries, with the last slot counting everything longer.  Returns
+	// the longest chain.  Walks every bucket, so this takes a while on the big tables.
+	inline uint32_t getChainHistogram(uint32_t *histogram,uint32_t histogramSize) const
+	{
+		uint32_t ret = 0;
+		memset(histogram,0,sizeof(uint32_t)*histogramSize);
+		for (uint32_t i=0; i<hashTableSize; i++)
+		{
+			uint32_t length = 0;
+			for (const HashEntry *h=mHashTable[i].load(std::memory_order_acquire); h; h=h->mNext)
+			{
+				length++;
+			}
+			histogram[length < histogramSize-1 ? length : histogramSize-1]++;
+			ret = length > ret ? length : ret;
+		}
+		return ret;
+	}
+
+	enum
+	{
+		BUCKET_COUNT = hashTableSize,
+		ENTRY_CAPACITY = hashTableEntries
+	};
+
+private:
+
+	inline uint32_t getHash(const Key& key) const
+	{
+		return key.getHash() & (hashTableSize - 1);
+	}
+
+
+	std::atomic< HashEntry * >	mHashTable[hashTableSize];
+	std::atomic< uint32_t >		mHashTableCount;
+	uint32_t					mHighWater;		// largest count seen before a removeLast
+	HashEntry					*mEntries;
+
+};
+
+
+class FileLocation : public Hash256
 {
 public:
 	FileLocation(void)
@@ -464,8 +1059,10 @@ public:
 	uint32_t	mTransactionIndex;
 };
 
-typedef SimpleHash< FileLocation, 4194304, MAX_TOTAL_TRANSACTIONS > TransactionHashMap;
+// Transactions are the one map which is filled from several threads at once (see ConcurrentHash.h)
+typedef ConcurrentHash< FileLocation, 4194304, MAX_TOTAL_TRANSACTIONS > TransactionHashMap;
 typedef SimpleHash< BlockHeader, 65536, MAX_TOTAL_BLOCKS > BlockHeaderMap;
+typedef SimpleHash< OrphanHeaders, 16384, MAX_TOTAL_BLOCKS > OrphanHeaderMap;
 
 //*********** Begin of Source Code for RIPEMD160 hash *********************************
 namespace BLOCKCHAIN_RIPEMD160
@@ -1323,9 +1920,346 @@ namespace BLOCKCHAIN_SHA256
 		sha256_finalize(&sc,destHash);
 	}
 
+	// Hashes three pieces as if they were one; used to hash a segwit transaction without its witness data.
+	void computeSHA256(const void *a,uint32_t aSize,const void *b,uint32_t bSize,const void *c,uint32_t cSize,uint8_t destHash[32])
+	{
+		sha256_ctx_t sc;
+		sha256_init(&sc);
+		sha256_update(&sc,a,aSize);
+		sha256_update(&sc,b,bSize);
+		sha256_update(&sc,c,cSize);
+		sha256_finalize(&sc,destHash);
+	}
+
 }; // End of the SHA-2556 namespace
 
 
+// Begin of the four lane hashes: four messages of the same length hashed side by side with SSE2, lane i of every vector
+// holding message i.  SHA256 and RIPEMD160 only use 32 bit adds, rotates and bitwise logic, all of which SSE2 has for four
+// lanes at once (rotates as two shifts and an or), and the messages are padded one block at a time exactly as the scalar
+// versions pad them.  Hashing a block's output keys this way is about twice as fast as one key at a time (see
+// benchmarks/crypto_codec.cpp, which also checks these against the scalar versions).
+//
+// Whether to use them is decided at run time: isEnabled is true when the lanes were compiled in, and setEnabled can turn
+// them off again, to compare or to rule them out.  Without SSE2 the x4 functions hash the four messages one at a time,
+// so callers never need to know which they got.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HASH_LANES_SSE2 1
+#else
+#define HASH_LANES_SSE2 0
+#endif
+
+namespace BLOCKCHAIN_HASH_LANES
+{
+
+static std::atomic< bool > gEnabled(HASH_LANES_SSE2 ? true : false);
+
+bool isEnabled(void)
+{
+	return gEnabled.load(std::memory_order_relaxed);
+}
+
+void setEnabled(bool state)
+{
+	gEnabled.store(state && HASH_LANES_SSE2,std::memory_order_relaxed);
+}
+
+#if HASH_LANES_SSE2
+
+static inline __m128i rotateRight(__m128i x,int n)
+{
+	return _mm_or_si128(_mm_srli_epi32(x,n),_mm_slli_epi32(x,32-n));
+}
+
+static inline __m128i rotateLeft(__m128i x,int n)
+{
+	return _mm_or_si128(_mm_slli_epi32(x,n),_mm_srli_epi32(x,32-n));
+}
+
+static inline __m128i add(__m128i a,__m128i b)
+{
+	return _mm_add_epi32(a,b);
+}
+
+static inline __m128i notBits(__m128i a)
+{
+	return _mm_xor_si128(a,_mm_set1_epi32(-1));
+}
+
+// Block 'block' of a message of 'length' bytes with its padding: the 0x80 byte after the message, zeros, and the bit
+// length in the last 8 bytes of the last block, big endian for SHA256 and little endian for RIPEMD160.
+static void getPaddedBlock(const uint8_t *message,uint32_t length,uint32_t block,bool bigEndianLength,uint8_t dest[64])
+{
+	uint32_t begin = block*64;
+	uint32_t copy = length > begin ? (length-begin < 64 ? length-begin : 64) : 0;
+	memcpy(dest,message+begin,copy);
+	memset(dest+copy,0,64-copy);
+	if ( length >= begin && length < begin+64 )
+	{
+		dest[length-begin] = 0x80;
+	}
+	uint32_t blockCount = (length+8)/64+1;
+	if ( block == blockCount-1 )
+	{
+		uint64_t bits = (uint64_t)length*8;
+		for (uint32_t i=0; i<8; i++)
+		{
+			dest[bigEndianLength ? 63-i : 56+i] = (uint8_t)(bits >> (i*8));
+		}
+	}
+}
+
+static const uint32_t gSHA256K[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t readBig(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint32_t readLittle(const uint8_t *p)
+{
+	return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static void sha256Transform(__m128i state[8],const uint8_t blocks[4][64])
+{
+	__m128i w[64];
+	for (uint32_t i=0; i<16; i++)
+	{
+		w[i] = _mm_set_epi32((int)readBig(blocks[3]+i*4),(int)readBig(blocks[2]+i*4),(int)readBig(blocks[1]+i*4),(int)readBig(blocks[0]+i*4));
+	}
+	for (uint32_t i=16; i<64; i++)
+	{
+		__m128i s0 = _mm_xor_si128(_mm_xor_si128(rotateRight(w[i-15],7),rotateRight(w[i-15],18)),_mm_srli_epi32(w[i-15],3));
+		__m128i s1 = _mm_xor_si128(_mm_xor_si128(rotateRight(w[i-2],17),rotateRight(w[i-2],19)),_mm_srli_epi32(w[i-2],10));
+		w[i] = add(add(w[i-16],s0),add(w[i-7],s1));
+	}
+	__m128i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+	for (uint32_t i=0; i<64; i++)
+	{
+		__m128i s1 = _mm_xor_si128(_mm_xor_si128(rotateRight(e,6),rotateRight(e,11)),rotateRight(e,25));
+		__m128i ch = _mm_xor_si128(_mm_and_si128(e,f),_mm_andnot_si128(e,g));
+		__m128i t1 = add(add(add(h,s1),add(ch,_mm_set1_epi32((int)gSHA256K[i]))),w[i]);
+		__m128i s0 = _mm_xor_si128(_mm_xor_si128(rotateRight(a,2),rotateRight(a,13)),rotateRight(a,22));
+		__m128i maj = _mm_xor_si128(_mm_xor_si128(_mm_and_si128(a,b),_mm_and_si128(a,c)),_mm_and_si128(b,c));
+		h = g;
+		g = f;
+		f = e;
+		e = add(d,t1);
+		d = c;
+		c = b;
+		b = a;
+		a = add(t1,add(s0,maj));
+	}
+	state[0] = add(state[0],a); state[1] = add(state[1],b); state[2] = add(state[2],c); state[3] = add(state[3],d);
+	state[4] = add(state[4],e); state[5] = add(state[5],f); state[6] = add(state[6],g); state[7] = add(state[7],h);
+}
+
+void sha256x4(const uint8_t *const message[4],uint32_t length,uint8_t *const digest[4])
+{
+	static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	__m128i state[8];
+	for (uint32_t i=0; i<8; i++)
+	{
+		state[i] = _mm_set1_epi32((int)init[i]);
+	}
+	uint32_t blockCount = (length+8)/64+1;
+	uint8_t blocks[4][64];
+	for (uint32_t b=0; b<blockCount; b++)
+	{
+		for (uint32_t lane=0; lane<4; lane++)
+		{
+			if ( (b+1)*64 <= length )
+			{
+				memcpy(blocks[lane],message[lane]+b*64,64);
+			}
+			else
+			{
+				getPaddedBlock(message[lane],length,b,true,blocks[lane]);
+			}
+		}
+		sha256Transform(state,blocks);
+	}
+	for (uint32_t i=0; i<8; i++)
+	{
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes,state[i]);
+		for (uint32_t lane=0; lane<4; lane++)
+		{
+			digest[lane][i*4] = (uint8_t)(lanes[lane] >> 24);
+			digest[lane][i*4+1] = (uint8_t)(lanes[lane] >> 16);
+			digest[lane][i*4+2] = (uint8_t)(lanes[lane] >> 8);
+			digest[lane][i*4+3] = (uint8_t)lanes[lane];
+		}
+	}
+}
+
+// Which message word each step reads and how far it rotates, for the left and right lines of RIPEMD160.
+static const uint8_t gR[80] =
+{
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	7, 4, 13, 1, 10, 6, 15, 3, 12, 0, 9, 5, 2, 14, 11, 8,
+	3, 10, 14, 4, 9, 15, 8, 1, 2, 7, 0, 6, 13, 11, 5, 12,
+	1, 9, 11, 10, 0, 8, 12, 4, 13, 3, 7, 15, 14, 5, 6, 2,
+	4, 0, 5, 9, 7, 12, 2, 10, 14, 1, 3, 8, 11, 6, 15, 13
+};
+
+static const uint8_t gRP[80] =
+{
+	5, 14, 7, 0, 9, 2, 11, 4, 13, 6, 15, 8, 1, 10, 3, 12,
+	6, 11, 3, 7, 0, 13, 5, 10, 14, 15, 8, 12, 4, 9, 1, 2,
+	15, 5, 1, 3, 7, 14, 6, 9, 11, 8, 12, 2, 10, 0, 4, 13,
+	8, 6, 4, 1, 3, 11, 15, 0, 5, 12, 2, 13, 9, 7, 10, 14,
+	12, 15, 10, 4, 1, 5, 8, 7, 6, 2, 13, 14, 0, 3, 9, 11
+};
+
+static const uint8_t gS[80] =
+{
+	11, 14, 15, 12, 5, 8, 7, 9, 11, 13, 14, 15, 6, 7, 9, 8,
+	7, 6, 8, 13, 11, 9, 7, 15, 7, 12, 15, 9, 11, 7, 13, 12,
+	11, 13, 6, 7, 14, 9, 13, 15, 14, 8, 13, 6, 5, 12, 7, 5,
+	11, 12, 14, 15, 14, 15, 9, 8, 9, 14, 5, 6, 8, 6, 5, 12,
+	9, 15, 5, 11, 6, 8, 13, 12, 5, 12, 13, 14, 11, 8, 5, 6
+};
+
+static const uint8_t gSP[80] =
+{
+	8, 9, 9, 11, 13, 15, 15, 5, 7, 7, 8, 11, 14, 14, 12, 6,
+	9, 13, 15, 7, 12, 8, 9, 11, 7, 7, 12, 7, 6, 15, 13, 11,
+	9, 7, 15, 11, 8, 6, 6, 14, 12, 13, 5, 14, 13, 13, 7, 5,
+	15, 5, 8, 11, 14, 14, 6, 14, 6, 9, 12, 9, 12, 5, 15, 8,
+	8, 5, 12, 9, 12, 5, 14, 6, 8, 13, 6, 5, 15, 13, 11, 11
+};
+
+static const uint32_t gK[5] = { 0x00000000, 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xA953FD4E };
+static const uint32_t gKP[5] = { 0x50A28BE6, 0x5C4DD124, 0x6D703EF3, 0x7A6D76E9, 0x00000000 };
+
+// The five boolean functions; the left line uses them in order, the right line in reverse.
+static inline __m128i ripemdF(uint32_t round,__m128i x,__m128i y,__m128i z)
+{
+	switch ( round )
+	{
+		case 0: return _mm_xor_si128(_mm_xor_si128(x,y),z);
+		case 1: return _mm_or_si128(_mm_and_si128(x,y),_mm_andnot_si128(x,z));
+		case 2: return _mm_xor_si128(_mm_or_si128(x,notBits(y)),z);
+		case 3: return _mm_or_si128(_mm_and_si128(x,z),_mm_andnot_si128(z,y));
+		default: return _mm_xor_si128(x,_mm_or_si128(y,notBits(z)));
+	}
+}
+
+static inline __m128i rotateLeftBy(__m128i x,uint32_t n)
+{
+	return _mm_or_si128(_mm_sll_epi32(x,_mm_cvtsi32_si128((int)n)),_mm_srl_epi32(x,_mm_cvtsi32_si128((int)(32-n))));
+}
+
+static void ripemd160Transform(__m128i state[5],const uint8_t blocks[4][64])
+{
+	__m128i x[16];
+	for (uint32_t i=0; i<16; i++)
+	{
+		x[i] = _mm_set_epi32((int)readLittle(blocks[3]+i*4),(int)readLittle(blocks[2]+i*4),(int)readLittle(blocks[1]+i*4),(int)readLittle(blocks[0]+i*4));
+	}
+	__m128i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	__m128i ap = a, bp = b, cp = c, dp = d, ep = e;
+	for (uint32_t j=0; j<80; j++)
+	{
+		uint32_t round = j/16;
+		__m128i t = add(add(a,ripemdF(round,b,c,d)),add(x[gR[j]],_mm_set1_epi32((int)gK[round])));
+		t = add(rotateLeftBy(t,gS[j]),e);
+		a = e;
+		e = d;
+		d = rotateLeft(c,10);
+		c = b;
+		b = t;
+		t = add(add(ap,ripemdF(4-round,bp,cp,dp)),add(x[gRP[j]],_mm_set1_epi32((int)gKP[round])));
+		t = add(rotateLeftBy(t,gSP[j]),ep);
+		ap = ep;
+		ep = dp;
+		dp = rotateLeft(cp,10);
+		cp = bp;
+		bp = t;
+	}
+	__m128i t = add(add(state[1],c),dp);
+	state[1] = add(add(state[2],d),ep);
+	state[2] = add(add(state[3],e),ap);
+	state[3] = add(add(state[4],a),bp);
+	state[4] = add(add(state[0],b),cp);
+	state[0] = t;
+}
+
+void ripemd160x4(const uint8_t *const message[4],uint32_t length,uint8_t *const digest[4])
+{
+	static const uint32_t init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	__m128i state[5];
+	for (uint32_t i=0; i<5; i++)
+	{
+		state[i] = _mm_set1_epi32((int)init[i]);
+	}
+	uint32_t blockCount = (length+8)/64+1;
+	uint8_t blocks[4][64];
+	for (uint32_t b=0; b<blockCount; b++)
+	{
+		for (uint32_t lane=0; lane<4; lane++)
+		{
+			getPaddedBlock(message[lane],length,b,false,blocks[lane]);
+		}
+		ripemd160Transform(state,blocks);
+	}
+	for (uint32_t i=0; i<5; i++)
+	{
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes,state[i]);
+		for (uint32_t lane=0; lane<4; lane++)
+		{
+			memcpy(&digest[lane][i*4],&lanes[lane],4);	// little endian, like the scalar version
+		}
+	}
+}
+
+#else
+
+void sha256x4(const uint8_t *const message[4],uint32_t length,uint8_t *const digest[4])
+{
+	for (uint32_t lane=0; lane<4; lane++)
+	{
+		BLOCKCHAIN_SHA256::computeSHA256(message[lane],length,digest[lane]);
+	}
+}
+
+void ripemd160x4(const uint8_t *const message[4],uint32_t length,uint8_t *const digest[4])
+{
+	for (uint32_t lane=0; lane<4; lane++)
+	{
+		BLOCKCHAIN_RIPEMD160::computeRIPEMD160(message[lane],length,digest[lane]);
+	}
+}
+
+#endif
+
+// RIPEMD160(SHA256(key)) of four keys of the same length.
+void hash160x4(const uint8_t *const key[4],uint32_t length,uint8_t *const digest[4])
+{
+	uint8_t sha[4][32];
+	uint8_t *const shaDigests[4] = { sha[0], sha[1], sha[2], sha[3] };
+	sha256x4(key,length,shaDigests);
+	const uint8_t *const shaMessages[4] = { sha[0], sha[1], sha[2], sha[3] };
+	ripemd160x4(shaMessages,32,digest);
+}
+
+}; // end of namespace
+
+
 // Begin of source to perform Base58 encode/decode
 namespace BLOCKCHAIN_BASE58
 {
@@ -1626,6 +2560,10 @@ bool CBDecodeBase58(BigNumber * bi,const char * str)
 	BigNumber bi2(NULL,1);
 
 	uint32_t slen = (uint32_t)strlen(str);
+	if ( slen == 0 )
+	{
+		return true; // the empty string is the empty number
+	}
 
 	for (uint32_t x = slen - 1;; x--)
 	{ // Working backwards
@@ -1705,6 +2643,11 @@ bool CBEncodeBase58(BigNumber * bi,char *str,uint32_t maxStrLen)
 		return false;
 	}
 	uint32_t x = 0;
+	if ( bi->length == 0 )
+	{
+		str[0] = 0;
+		return maxStrLen > 0;
+	}
 	// Zeros
 	for (uint32_t y = bi->length - 1;; y--)
 	{
@@ -1721,6 +2664,11 @@ bool CBEncodeBase58(BigNumber * bi,char *str,uint32_t maxStrLen)
 		}
 	}
 	uint32_t zeros = x;
+	if ( zeros == bi->length ) // nothing but zeros; every one is already a '1'
+	{
+		str[x] = '\0';
+		return true;
+	}
 	// Make temporary data store
 	uint8_t temp[MAX_BIG_NUMBER];
 	// Encode
@@ -1767,12 +2715,16 @@ bool encodeBase58(const uint8_t *bigNumber, // The block of memory corresponding
 					   char *output,			 // The address to store the output string.
 					   uint32_t maxStrLen)		 // the maximum length of the output string
 {
+	if ( length >= MAX_BIG_NUMBER )
+	{
+		return false;
+	}
 	// Before passing the hash into the base58 encoder; we need to reverse the byte order.
-	uint8_t hash[25];
+	uint8_t hash[MAX_BIG_NUMBER];
 	if ( littleEndian )
 	{
 		uint32_t index = length-1;
-		for (uint32_t i=0; i<25; i++)
+		for (uint32_t i=0; i<length; i++)
 		{
 			hash[i] = bigNumber[index];
 			index--;
@@ -1823,17 +2775,109 @@ uint32_t decodeBase58(const char *string,		// The base58 encoded string
 namespace BLOCKCHAIN_BITCOIN_ADDRESS
 {
 
-bool bitcoinPublicKeyToAddress(const uint8_t input[65], // The 65 bytes long ECDSA public key; first byte will always be 0x4 followed by two 32 byte components
+// A public key is 33 bytes when compressed (0x02 or 0x03 followed by the X coordinate) or 65 bytes when not (0x04 followed
+// by X and Y, or 0x06 and 0x07 for the 'hybrid' form a little early software wrote).  The key is hashed exactly as it
+// appears in the script, so the compressed and uncompressed forms of one key are two different addresses.
+bool isPublicKey(const uint8_t *input,uint32_t inputLength)
+{
+	if ( inputLength == 33 )
+	{
+		return input[0] == 0x02 || input[0] == 0x03;
+	}
+	if ( inputLength == 65 )
+	{
+		return input[0] == 0x04 || input[0] == 0x06 || input[0] == 0x07;
+	}
+	return false;
+}
+
+// Computes the RIPEMD160(SHA256(key)) hash an address is made of.  Returns false if this is not a public key.
+bool bitcoinPublicKeyToHash160(const uint8_t *input,uint32_t inputLength,uint8_t output[20])
+{
+	bool ret = false;
+
+	if ( isPublicKey(input,inputLength) )
+	{
+		uint8_t hash1[32];
+		BLOCKCHAIN_SHA256::computeSHA256(input,inputLength,hash1);	// Compute the SHA256 hash of the input public ECSDA signature
+		BLOCKCHAIN_RIPEMD160::computeRIPEMD160(hash1,32,output);	// Compute the RIPEMD160 (20 byte) hash of the SHA256 hash
+		ret = true;
+	}
+	return ret;
+}
+
+// Hashes many public keys to their hash160, four at a time on the four lane hashes when they are enabled.  The lanes need
+// keys of one length, so 33 and 65 byte keys queue separately; whatever is left in the queues when flush is called is
+// hashed one key at a time.  A key's output is only written once it is hashed, so the key and the output must stay put
+// until flush.
+class Hash160Batch
+{
+public:
+	Hash160Batch(void)
+	{
+		mLanes = BLOCKCHAIN_HASH_LANES::isEnabled();
+		mPending[0] = 0;
+		mPending[1] = 0;
+	}
+
+	~Hash160Batch(void)
+	{
+		flush();
+	}
+
+	// Returns false, and writes nothing, if this is not a public key.
+	bool add(const uint8_t *key,uint32_t keyLength,uint8_t output[20])
+	{
+		if ( !mLanes )
+		{
+			return bitcoinPublicKeyToHash160(key,keyLength,output);
+		}
+		if ( !isPublicKey(key,keyLength) )
+		{
+			return false;
+		}
+		uint32_t queue = keyLength == 33 ? 0 : 1;
+		uint32_t index = mPending[queue];
+		mKeys[queue][index] = key;
+		mOutputs[queue][index] = output;
+		if ( ++index == 4 )
+		{
+			BLOCKCHAIN_HASH_LANES::hash160x4(mKeys[queue],keyLength,mOutputs[queue]);
+			index = 0;
+		}
+		mPending[queue] = index;
+		return true;
+	}
+
+	void flush(void)
+	{
+		for (uint32_t queue=0; queue<2; queue++)
+		{
+			for (uint32_t i=0; i<mPending[queue]; i++)
+			{
+				bitcoinPublicKeyToHash160(mKeys[queue][i],queue == 0 ? 33 : 65,mOutputs[queue][i]);
+			}
+			mPending[queue] = 0;
+		}
+	}
+
+private:
+	bool			mLanes;
+	uint32_t		mPending[2];	// keys queued, 33 byte keys first and then 65
+	const uint8_t	*mKeys[2][4];
+	uint8_t			*mOutputs[2][4];
+};
+
+bool bitcoinPublicKeyToAddress(const uint8_t *input,	// The 33 or 65 bytes long ECDSA public key; see isPublicKey
+							   uint32_t inputLength,
 							   uint8_t output[25])		// A bitcoin address (in binary( is always 25 bytes long.
 {
 	bool ret = false;
 
-	if ( input[0] == 0x04)
+	if ( bitcoinPublicKeyToHash160(input,inputLength,&output[1]) )
 	{
 		uint8_t hash1[32]; // holds the intermediate SHA256 hash computations
-		BLOCKCHAIN_SHA256::computeSHA256(input,65,hash1);	// Compute the SHA256 hash of the input public ECSDA signature
 		output[0] = 0;	// Store a network byte of 0 (i.e. 'main' network)
-		BLOCKCHAIN_RIPEMD160::computeRIPEMD160(hash1,32,&output[1]);	// Compute the RIPEMD160 (20 byte) hash of the SHA256 hash
 		BLOCKCHAIN_SHA256::computeSHA256(output,21,hash1);	// Compute the SHA256 hash of the RIPEMD16 hash + the one byte header (for a checksum)
 		BLOCKCHAIN_SHA256::computeSHA256(hash1,32,hash1); // now compute the SHA256 hash of the previously computed SHA256 hash (for a checksum)
 		output[21] = hash1[0];	// Store the checksum in the last 4 bytes of the public key hash
@@ -1846,7 +2890,8 @@ bool bitcoinPublicKeyToAddress(const uint8_t input[65], // The 65 bytes long ECD
 }
 
 
-bool bitcoinPublicKeyToAscii(const uint8_t input[65], // The 65 bytes long ECDSA public key; first byte will always be 0x4 followed by two 32 byte components
+bool bitcoinPublicKeyToAscii(const uint8_t *input,	// The 33 or 65 bytes long ECDSA public key; see isPublicKey
+							 uint32_t inputLength,
 							 char *output,				// The output ascii representation.
 							 uint32_t maxOutputLen) // convert a binary bitcoin address into ASCII
 {
@@ -1856,7 +2901,7 @@ bool bitcoinPublicKeyToAscii(const uint8_t input[65], // The 65 bytes long ECDSA
 
 	uint8_t hash2[25];
 
-	if ( bitcoinPublicKeyToAddress(input,hash2))
+	if ( bitcoinPublicKeyToAddress(input,inputLength,hash2))
 	{
 		ret = BLOCKCHAIN_BASE58::encodeBase58(hash2,25,true,output,maxOutputLen);
 	}
@@ -1872,9 +2917,9 @@ bool bitcoinAsciiToAddress(const char *input,uint8_t output[25]) // convert an A
 		uint8_t checksum[32];
 		BLOCKCHAIN_SHA256::computeSHA256(output,21,checksum);
 		BLOCKCHAIN_SHA256::computeSHA256(checksum,32,checksum);
-		if ( output[21] == checksum[0] ||
-			 output[22] == checksum[1] ||
-			 output[23] == checksum[2] ||
+		if ( output[21] == checksum[0] &&
+			 output[22] == checksum[1] &&
+			 output[23] == checksum[2] &&
 			 output[24] == checksum[3] )
 		{
 			ret = true; // the cheksum matches!
@@ -1885,10 +2930,11 @@ bool bitcoinAsciiToAddress(const char *input,uint8_t output[25]) // convert an A
 
 
 
-void bitcoinRIPEMD160ToAddress(const uint8_t ripeMD160[20],uint8_t output[25])
+// The version byte is 0 for a pay-to-pubkey-hash address ('1...') and 5 for a pay-to-script-hash address ('3...').
+void bitcoinRIPEMD160ToAddress(const uint8_t ripeMD160[20],uint8_t output[25],uint8_t version=0)
 {
 	uint8_t hash1[32]; // holds the intermediate SHA256 hash computations
-	output[0] = 0;	// Store a network byte of 0 (i.e. 'main' network)
+	output[0] = version;	// Store the network/version byte (0 is a 'main' network public key hash)
 	memcpy(&output[1],ripeMD160,20); // copy the 20 byte of the public key address
 	BLOCKCHAIN_SHA256::computeSHA256(output,21,hash1);	// Compute the SHA256 hash of the RIPEMD16 hash + the one byte header (for a checksum)
 	BLOCKCHAIN_SHA256::computeSHA256(hash1,32,hash1); // now compute the SHA256 hash of the previously computed SHA256 hash (for a checksum)
@@ -1907,56 +2953,268 @@ bool bitcoinAddressToAscii(const uint8_t address[25],char *output,uint32_t maxOu
 	return ret;
 }
 
-}; // end of namespace
+// Segwit addresses (BIP173 and BIP350) are 'bc1' followed by the witness version and program, five bits to a character,
+// and a six character checksum.  Version 0 programs use the original bech32 checksum, later versions (taproot is 1) bech32m.
+static const char *gBech32Charset = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
 
+#define BECH32_CONSTANT 1
+#define BECH32M_CONSTANT 0x2bc830a3
 
-enum ScriptOpcodes
+static uint32_t bech32PolyMod(const uint8_t *values,uint32_t count,uint32_t chk)
 {
-	OP_0 			=  0x00,
-	OP_PUSHDATA1 	=  0x4c,
-	OP_PUSHDATA2 	=  0x4d,
-	OP_PUSHDATA4 	=  0x4e,
-	OP_1NEGATE 		=  0x4f,
-	OP_RESERVED 	=  0x50,
-	OP_1 			=  0x51,
-	OP_2 			=  0x52,
-	OP_3 			=  0x53,
-	OP_4 			=  0x54,
-	OP_5 			=  0x55,
-	OP_6 			=  0x56,
-	OP_7 			=  0x57,
-	OP_8 			=  0x58,
-	OP_9 			=  0x59,
-	OP_10 			=  0x5a,
-	OP_11 			=  0x5b,
-	OP_12 			=  0x5c,
-	OP_13 			=  0x5d,
-	OP_14 			=  0x5e,
-	OP_15 			=  0x5f,
-	OP_16 			=  0x60,
-	OP_NOP 			=  0x61,
-	OP_VER 			=  0x62,
-	OP_IF 			=  0x63,
-	OP_NOTIF 		=  0x64,
-	OP_VERIF 		=  0x65,
-	OP_VERNOTIF 	=  0x66,
-	OP_ELSE 		=  0x67,
-	OP_ENDIF 		=  0x68,
-	OP_VERIFY 		=  0x69,
-	OP_RETURN 		=  0x6a,
-	OP_TOALTSTACK 	=  0x6b,
-	OP_FROMALTSTACK =  0x6c,
-	OP_2DROP 		=  0x6d,
-	OP_2DUP 		=  0x6e,
-	OP_3DUP 		=  0x6f,
-	OP_2OVER 		=  0x70,
-	OP_2ROT 		=  0x71,
-	OP_2SWAP 		=  0x72,
-	OP_IFDUP 		=  0x73,
-	OP_DEPTH 		=  0x74,
-	OP_DROP 		=  0x75,
-	OP_DUP 			=  0x76,
-	OP_NIP 			=  0x77,
+	static const uint32_t generator[5] = { 0x3b6a57b2, 0x26508e6d, 0x1ea119fa, 0x3d4233dd, 0x2a1462b3 };
+	for (uint32_t i=0; i<count; i++)
+	{
+		uint32_t top = chk >> 25;
+		chk = ((chk & 0x1ffffff) << 5) ^ values[i];
+		for (uint32_t j=0; j<5; j++)
+		{
+			if ( (top >> j) & 1 )
+			{
+				chk^=generator[j];
+			}
+		}
+	}
+	return chk;
+}
+
+// The checksum state after the human readable part "bc" has been fed in; every mainnet address starts from it.
+static uint32_t bech32PrefixChecksum(void)
+{
+	static const uint8_t prefix[5] = { 'b' >> 5, 'c' >> 5, 0, 'b' & 31, 'c' & 31 };
+	return bech32PolyMod(prefix,5,1);
+}
+
+// Regroups a run of 'fromBits' wide values into 'toBits' wide ones.  Returns the number written, or zero if 'pad' is false
+// and there are leftover bits which are not zero (or too many of them), or the output would not fit.
+static uint32_t bech32ConvertBits(const uint8_t *input,uint32_t inputLength,uint32_t fromBits,uint32_t toBits,bool pad,uint8_t *output,uint32_t maxOutput)
+{
+	uint32_t acc = 0;
+	uint32_t bits = 0;
+	uint32_t ret = 0;
+	uint32_t maxValue = (1 << toBits)-1;
+	for (uint32_t i=0; i<inputLength; i++)
+	{
+		acc = (acc << fromBits) | input[i];
+		bits+=fromBits;
+		while ( bits >= toBits )
+		{
+			bits-=toBits;
+			if ( ret == maxOutput ) return 0;
+			output[ret++] = (uint8_t)((acc >> bits) & maxValue);
+		}
+	}
+	if ( pad )
+	{
+		if ( bits )
+		{
+			if ( ret == maxOutput ) return 0;
+			output[ret++] = (uint8_t)((acc << (toBits-bits)) & maxValue);
+		}
+	}
+	else if ( bits >= fromBits || ((acc << (toBits-bits)) & maxValue) )
+	{
+		return 0;
+	}
+	return ret;
+}
+
+// Encodes a witness program (2 to 40 bytes) of this witness version as a mainnet 'bc1' address.
+bool bitcoinWitnessProgramToAscii(uint8_t version,const uint8_t *program,uint32_t programLength,char *output,uint32_t maxOutputLen)
+{
+	bool ret = false;
+	uint8_t data[1+64+6];
+	if ( version <= 16 && programLength >= 2 && programLength <= 40 )
+	{
+		data[0] = version;
+		uint32_t count = 1+bech32ConvertBits(program,programLength,8,5,true,&data[1],64);
+		uint32_t chk = bech32PolyMod(data,count,bech32PrefixChecksum());
+		static const uint8_t zero[6] = { 0, 0, 0, 0, 0, 0 };
+		chk = bech32PolyMod(zero,6,chk) ^ (version ? BECH32M_CONSTANT : BECH32_CONSTANT);
+		for (uint32_t i=0; i<6; i++)
+		{
+			data[count+i] = (uint8_t)((chk >> (5*(5-i))) & 31);
+		}
+		count+=6;
+		if ( 3+count < maxOutputLen )
+		{
+			output[0] = 'b';
+			output[1] = 'c';
+			output[2] = '1';
+			for (uint32_t i=0; i<count; i++)
+			{
+				output[3+i] = gBech32Charset[data[i]];
+			}
+			output[3+count] = 0;
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+// Decodes a mainnet 'bc1' address into its witness version and program.  Returns false if it is not one, or if the checksum
+// (bech32 for version 0, bech32m otherwise) does not match.
+bool bitcoinAsciiToWitnessProgram(const char *input,uint8_t &version,uint8_t program[40],uint32_t &programLength)
+{
+	uint32_t len = (uint32_t)strlen(input);
+	if ( len < 3+1+6 || len > 90 ) return false;
+	bool lower = false;
+	bool upper = false;
+	uint8_t data[90];
+	uint32_t count = 0;
+	for (uint32_t i=0; i<len; i++)
+	{
+		char c = input[i];
+		if ( c >= 'a' && c <= 'z' ) lower = true;
+		if ( c >= 'A' && c <= 'Z' )
+		{
+			upper = true;
+			c = (char)(c-'A'+'a');
+		}
+		if ( i < 3 )
+		{
+			if ( c != "bc1"[i] ) return false;
+			continue;
+		}
+		const char *found = strchr(gBech32Charset,c);
+		if ( found == NULL ) return false;
+		data[count++] = (uint8_t)(found-gBech32Charset);
+	}
+	if ( lower && upper ) return false;
+	version = data[0];
+	if ( version > 16 ) return false;
+	uint32_t chk = bech32PolyMod(data,count,bech32PrefixChecksum());
+	if ( chk != (version ? BECH32M_CONSTANT : BECH32_CONSTANT) ) return false;
+	programLength = bech32ConvertBits(&data[1],count-1-6,5,8,false,program,40);
+	if ( programLength < 2 ) return false;
+	if ( version == 0 && programLength != 20 && programLength != 32 ) return false;
+	return true;
+}
+
+// Renders the address an output key belongs to, given the script type it was found in (see classifyOutputScript) and the
+// key: a 20 byte hash, a 32 byte witness program or a 33 or 65 byte public key.  Returns false if there is no address form.
+bool bitcoinKeyToAscii(uint32_t scriptType,const uint8_t *key,uint32_t keyLength,char *output,uint32_t maxOutputLen)
+{
+	bool ret = false;
+	output[0] = 0;
+	uint8_t address[25];
+	switch ( scriptType )
+	{
+		case BlockChain::ST_P2PK:
+		case BlockChain::ST_P2PKH:
+		case BlockChain::ST_MULTISIG:
+		case BlockChain::ST_NONSTANDARD:
+			if ( keyLength == 20 )
+			{
+				bitcoinRIPEMD160ToAddress(key,address);
+				ret = bitcoinAddressToAscii(address,output,maxOutputLen);
+			}
+			else
+			{
+				ret = bitcoinPublicKeyToAscii(key,keyLength,output,maxOutputLen);
+			}
+			break;
+		case BlockChain::ST_P2SH:
+			if ( keyLength == 20 )
+			{
+				bitcoinRIPEMD160ToAddress(key,address,5);
+				ret = bitcoinAddressToAscii(address,output,maxOutputLen);
+			}
+			break;
+		case BlockChain::ST_P2WPKH:
+		case BlockChain::ST_P2WSH:
+			ret = bitcoinWitnessProgramToAscii(0,key,keyLength,output,maxOutputLen);
+			break;
+		case BlockChain::ST_P2TR:
+			ret = bitcoinWitnessProgramToAscii(1,key,keyLength,output,maxOutputLen);
+			break;
+	}
+	return ret;
+}
+
+// The reverse of bitcoinKeyToAscii for the address forms which are tracked: base58 '1' and '3' addresses and segwit version
+// 0 and 1 addresses.  'key' receives the 20 byte hash or 32 byte witness program.
+bool bitcoinAsciiToKey(const char *input,uint32_t &scriptType,uint8_t key[40],uint32_t &keyLength)
+{
+	bool ret = false;
+	uint8_t address[25];
+	uint8_t version;
+	if ( bitcoinAsciiToWitnessProgram(input,version,key,keyLength) )
+	{
+		if ( version == 0 )
+		{
+			scriptType = keyLength == 20 ? BlockChain::ST_P2WPKH : BlockChain::ST_P2WSH;
+			ret = true;
+		}
+		else if ( version == 1 && keyLength == 32 )
+		{
+			scriptType = BlockChain::ST_P2TR;
+			ret = true;
+		}
+	}
+	else if ( bitcoinAsciiToAddress(input,address) )
+	{
+		if ( address[0] == 0 || address[0] == 5 )
+		{
+			scriptType = address[0] ? BlockChain::ST_P2SH : BlockChain::ST_P2PKH;
+			memcpy(key,&address[1],20);
+			keyLength = 20;
+			ret = true;
+		}
+	}
+	return ret;
+}
+
+}; // end of namespace
+
+
+enum ScriptOpcodes
+{
+	OP_0 			=  0x00,
+	OP_PUSHDATA1 	=  0x4c,
+	OP_PUSHDATA2 	=  0x4d,
+	OP_PUSHDATA4 	=  0x4e,
+	OP_1NEGATE 		=  0x4f,
+	OP_RESERVED 	=  0x50,
+	OP_1 			=  0x51,
+	OP_2 			=  0x52,
+	OP_3 			=  0x53,
+	OP_4 			=  0x54,
+	OP_5 			=  0x55,
+	OP_6 			=  0x56,
+	OP_7 			=  0x57,
+	OP_8 			=  0x58,
+	OP_9 			=  0x59,
+	OP_10 			=  0x5a,
+	OP_11 			=  0x5b,
+	OP_12 			=  0x5c,
+	OP_13 			=  0x5d,
+	OP_14 			=  0x5e,
+	OP_15 			=  0x5f,
+	OP_16 			=  0x60,
+	OP_NOP 			=  0x61,
+	OP_VER 			=  0x62,
+	OP_IF 			=  0x63,
+	OP_NOTIF 		=  0x64,
+	OP_VERIF 		=  0x65,
+	OP_VERNOTIF 	=  0x66,
+	OP_ELSE 		=  0x67,
+	OP_ENDIF 		=  0x68,
+	OP_VERIFY 		=  0x69,
+	OP_RETURN 		=  0x6a,
+	OP_TOALTSTACK 	=  0x6b,
+	OP_FROMALTSTACK =  0x6c,
+	OP_2DROP 		=  0x6d,
+	OP_2DUP 		=  0x6e,
+	OP_3DUP 		=  0x6f,
+	OP_2OVER 		=  0x70,
+	OP_2ROT 		=  0x71,
+	OP_2SWAP 		=  0x72,
+	OP_IFDUP 		=  0x73,
+	OP_DEPTH 		=  0x74,
+	OP_DROP 		=  0x75,
+	OP_DUP 			=  0x76,
+	OP_NIP 			=  0x77,
 	OP_OVER 		=  0x78,
 	OP_PICK 		=  0x79,
 	OP_ROLL 		=  0x7a,
@@ -2030,24 +3288,208 @@ enum ScriptOpcodes
 	OP_INVALIDOPCODE =  0xff
 };
 
+// The fixed layout output scripts: their exact length, the bytes they must have at fixed offsets and where in them the key
+// (a public key, a 20 byte hash or a 32 byte witness program) is.  The first check is always the first opcode.
+struct ScriptTemplate
+{
+	uint8_t		mLength;
+	uint8_t		mType;
+	uint8_t		mKeyOffset;
+	uint8_t		mKeyLength;
+	uint8_t		mCheckCount;
+	uint8_t		mChecks[5][2];	// offset, expected byte
+};
+
+static const ScriptTemplate gScriptTemplates[] =
+{
+	{ 25, BlockChain::ST_P2PKH,		3, 20, 5, { { 0, OP_DUP }, { 1, OP_HASH160 }, { 2, 20 }, { 23, OP_EQUALVERIFY }, { 24, OP_CHECKSIG } } },
+	{ 23, BlockChain::ST_P2SH,		2, 20, 3, { { 0, OP_HASH160 }, { 1, 20 }, { 22, OP_EQUAL } } },
+	{ 22, BlockChain::ST_P2WPKH,	2, 20, 2, { { 0, OP_0 }, { 1, 20 } } },
+	{ 34, BlockChain::ST_P2WSH,		2, 32, 2, { { 0, OP_0 }, { 1, 32 } } },
+	{ 34, BlockChain::ST_P2TR,		2, 32, 2, { { 0, OP_1 }, { 1, 32 } } },
+	{ 67, BlockChain::ST_P2PK,		1, 65, 2, { { 0, 65 }, { 66, OP_CHECKSIG } } },
+	{ 35, BlockChain::ST_P2PK,		1, 33, 2, { { 0, 33 }, { 34, OP_CHECKSIG } } },
+};
+
+#define SCRIPT_TEMPLATE_COUNT (sizeof(gScriptTemplates)/sizeof(gScriptTemplates[0]))
+
+// Bare multisig: OP_m <key>... OP_n OP_CHECKMULTISIG, where the keys are 33 or 65 byte pushes.  The first key is returned.
+static bool matchMultisig(const uint8_t *script,uint32_t length,const uint8_t *&key,uint32_t &keyLength)
+{
+	if ( length < 3+34 || script[length-1] != OP_CHECKMULTISIG ) return false;
+	uint32_t required = script[0]-OP_1+1;
+	uint32_t total = script[length-2]-OP_1+1;
+	if ( script[length-2] < OP_1 || script[length-2] > OP_16 || required > total ) return false;
+	const uint8_t *scan = script+1;
+	const uint8_t *end = script+length-2;
+	uint32_t count = 0;
+	while ( scan < end )
+	{
+		uint32_t push = scan[0];
+		if ( (push != 33 && push != 65) || (uint32_t)(end-scan) < push+1 ) return false;
+		if ( count == 0 )
+		{
+			key = scan+1;
+			keyLength = push;
+		}
+		scan+=push+1;
+		count++;
+	}
+	return count == total;
+}
+
+// Old transactions sometimes wrapped a pay-to-pubkey-hash in extra opcodes.  Looks for OP_DUP OP_HASH160 <20 bytes>
+// OP_EQUALVERIFY OP_CHECKSIG anywhere in the script; only tried on scripts which match nothing else.
+static const uint8_t *findEmbeddedKeyHash(const uint8_t *script,uint32_t length)
+{
+	for (uint32_t i=0; i+25<=length; i++)
+	{
+		const uint8_t *scan = &script[i];
+		if ( scan[0] == OP_DUP &&
+			 scan[1] == OP_HASH160 &&
+			 scan[2] == 20 &&
+			 scan[23] == OP_EQUALVERIFY &&
+			 scan[24] == OP_CHECKSIG )
+		{
+			return &scan[3];
+		}
+	}
+	return NULL;
+}
+
+// Works out which standard form an output script takes and where its key is.  The fixed layouts are matched against the
+// template table by length and first opcode, so a standard script costs a handful of byte compares.  'key' is left NULL
+// (and 'keyLength' zero) for OP_RETURN outputs and for non-standard scripts with no recognizable key.
+static BlockChain::ScriptType classifyOutputScript(const uint8_t *script,uint32_t length,const uint8_t *&key,uint32_t &keyLength)
+{
+	key = NULL;
+	keyLength = 0;
+	if ( length == 0 )
+	{
+		return BlockChain::ST_NONSTANDARD;
+	}
+	uint8_t first = script[0];
+	for (uint32_t i=0; i<SCRIPT_TEMPLATE_COUNT; i++)
+	{
+		const ScriptTemplate &t = gScriptTemplates[i];
+		if ( t.mLength != length || t.mChecks[0][1] != first ) continue;
+		bool match = true;
+		for (uint32_t j=1; j<t.mCheckCount; j++)
+		{
+			if ( script[t.mChecks[j][0]] != t.mChecks[j][1] )
+			{
+				match = false;
+				break;
+			}
+		}
+		if ( match )
+		{
+			key = script+t.mKeyOffset;
+			keyLength = t.mKeyLength;
+			return (BlockChain::ScriptType)t.mType;
+		}
+	}
+	if ( first == OP_RETURN )
+	{
+		return BlockChain::ST_NULL_DATA;
+	}
+	if ( first >= OP_1 && first <= OP_16 && matchMultisig(script,length,key,keyLength) )
+	{
+		return BlockChain::ST_MULTISIG;
+	}
+	key = NULL;
+	keyLength = 0;
+	if ( length > 25 )
+	{
+		key = findEmbeddedKeyHash(script,length);
+		keyLength = key ? 20 : 0;
+	}
+	return BlockChain::ST_NONSTANDARD;
+}
+
+// The kind of address an output of this script type pays: pay-to-pubkey and multisig outputs, and non-standard scripts with
+// an embedded key hash, are credited to the P2PKH address of their key.
+static inline uint8_t getAddressScriptType(uint32_t scriptType)
+{
+	switch ( scriptType )
+	{
+		case BlockChain::ST_P2SH:
+		case BlockChain::ST_P2WPKH:
+		case BlockChain::ST_P2WSH:
+		case BlockChain::ST_P2TR:
+			return (uint8_t)scriptType;
+	}
+	return BlockChain::ST_P2PKH;
+}
+
+static const char *getScriptTypeName(uint32_t scriptType)
+{
+	static const char *names[BlockChain::ST_COUNT] = { "NonStandard", "P2PK", "P2PKH", "P2SH", "P2WPKH", "P2WSH", "P2TR", "Multisig", "NullData" };
+	return scriptType < BlockChain::ST_COUNT ? names[scriptType] : "Unknown";
+}
+
 #define MAGIC_ID 0xD9B4BEF9
 #define ONE_BTC 100000000
 #define ONE_MBTC (ONE_BTC/1000)
 
 #define MAX_BLOCK_FILES	512	// As of July 6, 2013 there are only about 70 .dat files; so it will be a long time before this overflows
 
-// These defines set the limits this parser expects to ever encounter on the blockchain data stream.
-// In a debug build there are asserts to make sure these limits are never exceeded.
-// These limits work for the blockchain current as of July 1, 2013.
-// The limits can be revised when and if necessary.
+// A sanity limit on the length field of a block header; anything larger is taken to be a corrupt file.  There are no limits
+// on the number of transactions, inputs or outputs in a block: the parser counts them before it reads a block and sizes its
+// buffers (see ScratchBuffer) to fit.
 #define MAX_BLOCK_SIZE (1024*1024)*10	// never expect to have a block larger than 10mb
-#define MAX_BLOCK_TRANSACTION 8192		// never expect more than 8192 transactions per block.
-#define MAX_BLOCK_INPUTS 32768			// never expect more than 32768 total inputs
-#define MAX_BLOCK_OUTPUTS 32768			// never expect more than 32768 total outputs
 
-#define MAX_REASONABLE_SCRIPT_LENGTH (1024*8) // would never expect any script to be more than 8k in size; that would be very unusual!
-#define MAX_REASONABLE_INPUTS 4096				// really can't imagine any transaction ever having more than 4096 inputs
-#define MAX_REASONABLE_OUTPUTS 4096				// really can't imagine any transaction ever having more than 4096 outputs
+// A buffer which grows to the largest size asked of it and then stays that size, so it can be reused block after block
+// without allocating once the biggest block so far has been seen.
+template < class T >
+class ScratchBuffer
+{
+public:
+	ScratchBuffer(void)
+	{
+		mData = NULL;
+		mCapacity = 0;
+	}
+
+	~ScratchBuffer(void)
+	{
+		delete []mData;
+	}
+
+	// Returns room for at least 'count' items.  The contents are not kept when the buffer has to grow.
+	inline T *reserve(uint32_t count)
+	{
+		if ( count > mCapacity )
+		{
+			uint32_t capacity = mCapacity ? mCapacity : 64;
+			while ( capacity < count )
+			{
+				capacity = capacity < 0x80000000 ? capacity*2 : count;
+			}
+			delete []mData;
+			mData = new T[capacity];
+			mCapacity = capacity;
+		}
+		return mData;
+	}
+
+	inline T *get(void) const
+	{
+		return mData;
+	}
+
+	inline uint32_t getCapacity(void) const
+	{
+		return mCapacity;
+	}
+
+private:
+	ScratchBuffer(const ScratchBuffer &);
+	ScratchBuffer &operator=(const ScratchBuffer &);
+
+	T			*mData;
+	uint32_t	mCapacity;
+};
 
 class SignatureStat
 {
@@ -2059,70 +3501,189 @@ public:
 		mValue = 0;
 	}
 	uint32_t	mFlags;
-	uint32_t	mCount;
+	uint64_t	mCount;
 	uint64_t	mValue;
 };
 
-#define MAX_SIGNATURE_STAT 256
+#define MAX_SIGNATURE_STAT 512
+#define SIGNATURE_STAT_TABLE_SIZE 1024	// *MUST* be a power of 2, and at least twice MAX_SIGNATURE_STAT
 
-static uint32_t			gSignatureStatCount=0;
-static SignatureStat	gSignatureStats[MAX_SIGNATURE_STAT];
-
-
-//********************************************
-//********************************************
-
-class BlockImpl : public BlockChain::Block
+// The number of inputs seen with each signature format (the SF_ flag word) and the value they spent, as an open addressed
+// hash table on the flag word.  Only a few hundred distinct formats ever turn up, so a lookup is nearly always one probe.
+// Every block carries one, filled in by whichever thread parses the block, and it is merged into the chain wide table as
+// the block is applied; so no two threads ever count into the same table.
+class SignatureStatTable
 {
 public:
-
-	// Read one byte from the block-chain input stream.
-	inline uint8_t readU8(void)
+	SignatureStatTable(void)
 	{
-		assert( (mBlockRead+sizeof(uint8_t)) <= mBlockEnd );
-		uint8_t ret = *(uint8_t *)mBlockRead;
-		mBlockRead+=sizeof(uint8_t);
-		return ret;
+		clear();
 	}
 
-	// Read two bytes from the block-chain input stream.
-	inline uint16_t readU16(void)
+	void clear(void)
 	{
-		assert( (mBlockRead+sizeof(uint16_t)) <= mBlockEnd );
-		uint16_t ret = *(uint16_t *)mBlockRead;
-		mBlockRead+=sizeof(uint16_t);
-		return ret;
+		memset(mSlots,0,sizeof(mSlots));
+		mStatCount = 0;
+		mDroppedCount = 0;
 	}
 
-	// Read four bytes from the block-chain input stream.
-	inline uint32_t readU32(void)
+	inline void add(uint32_t flags,uint64_t count,uint64_t value)
 	{
-		assert( (mBlockRead+sizeof(uint32_t)) <= mBlockEnd );
-		uint32_t ret = *(uint32_t *)mBlockRead;
-		mBlockRead+=sizeof(uint32_t);
-		return ret;
+		uint32_t slot = (flags*0x9E3779B1) >> 22;	// top 10 bits; see SIGNATURE_STAT_TABLE_SIZE
+		while ( mSlots[slot] )
+		{
+			SignatureStat &s = mStats[mSlots[slot]-1];
+			if ( s.mFlags == flags )
+			{
+				s.mCount+=count;
+				s.mValue+=value;
+				return;
+			}
+			slot = (slot+1) & (SIGNATURE_STAT_TABLE_SIZE-1);
+		}
+		if ( mStatCount < MAX_SIGNATURE_STAT )
+		{
+			SignatureStat &s = mStats[mStatCount++];
+			s.mFlags = flags;
+			s.mCount = count;
+			s.mValue = value;
+			mSlots[slot] = (uint16_t)mStatCount;
+		}
+		else
+		{
+			mDroppedCount+=count;
+		}
 	}
 
-	// Read eight bytes from the block-chain input stream.
-	inline uint64_t readU64(void)
+	void merge(const SignatureStatTable &t)
 	{
-		assert( (mBlockRead+sizeof(uint64_t)) <= mBlockEnd );
-		uint64_t ret = *(uint64_t *)mBlockRead;
-		mBlockRead+=sizeof(uint64_t);
-		return ret;
+		for (uint32_t i=0; i<t.mStatCount; i++)
+		{
+			add(t.mStats[i].mFlags,t.mStats[i].mCount,t.mStats[i].mValue);
+		}
+		mDroppedCount+=t.mDroppedCount;
 	}
 
-	// Return the current stream pointer representing a 32byte hash and advance the read pointer accordingly
-	inline const uint8_t *readHash(void)
+	// Takes back a merge of these stats, the most recent merge first.  Formats the merge added are removed again once they
+	// count nothing, which restores the table exactly: they are the newest entries, so no other entry probed past them.
+	// Stats the merge found no room for come off the dropped count.
+	void unmerge(const SignatureStat *stats,uint32_t statCount,uint64_t droppedCount)
 	{
-		const uint8_t *ret = mBlockRead;
-		assert( (mBlockRead+32) <= mBlockEnd );
-		mBlockRead+=32;
+		for (uint32_t i=statCount; i--; )
+		{
+			uint32_t slot = (stats[i].mFlags*0x9E3779B1) >> 22;
+			while ( mSlots[slot] && mStats[mSlots[slot]-1].mFlags != stats[i].mFlags )
+			{
+				slot = (slot+1) & (SIGNATURE_STAT_TABLE_SIZE-1);
+			}
+			if ( mSlots[slot] == 0 )
+			{
+				mDroppedCount-=stats[i].mCount;
+				continue;
+			}
+			SignatureStat &s = mStats[mSlots[slot]-1];
+			s.mCount-=stats[i].mCount;
+			s.mValue-=stats[i].mValue;
+			if ( s.mCount == 0 && mSlots[slot] == mStatCount )
+			{
+				mSlots[slot] = 0;
+				mStatCount--;
+			}
+		}
+		mDroppedCount-=droppedCount;
+	}
+
+	// Formats are kept in the order they were first seen.
+	uint32_t size(void) const
+	{
+		return mStatCount;
+	}
+
+	const SignatureStat &get(uint32_t i) const
+	{
+		return mStats[i];
+	}
+
+	// Inputs not counted because the table already held MAX_SIGNATURE_STAT formats.
+	uint64_t getDroppedCount(void) const
+	{
+		return mDroppedCount;
+	}
+
+private:
+	SignatureStat	mStats[MAX_SIGNATURE_STAT];
+	uint16_t		mSlots[SIGNATURE_STAT_TABLE_SIZE];	// index+1 into mStats, zero when empty
+	uint32_t		mStatCount;
+	uint64_t		mDroppedCount;
+};
+
+static SignatureStatTable	gSignatureStats;		// Every applied block; only touched by the thread reading blocks
+static std::mutex			gSignatureFileMutex;	// Guards WeirdSignature.csv and AsciiSignature.csv, which the parse threads write
+
+
+//********************************************
+//********************************************
+
+#define SCRATCH_REGION_COUNT 4	// transactions, inputs, outputs and key hashes; see BlockImpl::getScratchRegions
+
+class BlockImpl : public BlockChain::Block
+{
+public:
+	BlockImpl(void)
+	{
+		mComputeWitnessHashes = false;
+		mAnalyzeSignatures = false;
+		memset(mScriptTypeCounts,0,sizeof(mScriptTypeCounts));
+	}
+
+	// Read one byte from the block-chain input stream.
+	inline uint8_t readU8(void)
+	{
+		assert( (mBlockRead+sizeof(uint8_t)) <= mBlockEnd );
+		uint8_t ret = *(uint8_t *)mBlockRead;
+		mBlockRead+=sizeof(uint8_t);
+		return ret;
+	}
+
+	// Read two bytes from the block-chain input stream.
+	inline uint16_t readU16(void)
+	{
+		assert( (mBlockRead+sizeof(uint16_t)) <= mBlockEnd );
+		uint16_t ret = *(uint16_t *)mBlockRead;
+		mBlockRead+=sizeof(uint16_t);
+		return ret;
+	}
+
+	// Read four bytes from the block-chain input stream.
+	inline uint32_t readU32(void)
+	{
+		assert( (mBlockRead+sizeof(uint32_t)) <= mBlockEnd );
+		uint32_t ret = *(uint32_t *)mBlockRead;
+		mBlockRead+=sizeof(uint32_t);
+		return ret;
+	}
+
+	// Read eight bytes from the block-chain input stream.
+	inline uint64_t readU64(void)
+	{
+		assert( (mBlockRead+sizeof(uint64_t)) <= mBlockEnd );
+		uint64_t ret = *(uint64_t *)mBlockRead;
+		mBlockRead+=sizeof(uint64_t);
+		return ret;
+	}
+
+	// Return the current stream pointer representing a 32byte hash and advance the read pointer accordingly
+	inline const uint8_t *readHash(void)
+	{
+		const uint8_t *ret = mBlockRead;
+		assert( (mBlockRead+32) <= mBlockEnd );
+		mBlockRead+=32;
 		return ret;
 	}
 
 	// reads a variable length integer.
 	// See the documentation from here:  https://en.bitcoin.it/wiki/Protocol_specification#Variable_length_integer
+	// The first byte is either the value itself or says whether a 2, 4 or 8 byte value follows (0xFD, 0xFE and 0xFF).
 	inline uint32_t readVariableLengthInteger(void)
 	{
 		uint32_t ret = 0;
@@ -2132,29 +3693,155 @@ public:
 		{
 			ret = (uint32_t)v;
 		}
+		else if ( v == 0xFD )
+		{
+			ret = (uint32_t)readU16();
+		}
+		else if ( v == 0xFE )
+		{
+			ret = readU32();
+		}
 		else
 		{
-			uint16_t v = readU16();
-			if ( v < 0xFFFF )
+			uint64_t v = readU64();
+			assert( v <= 0xFFFFFFFF ); // never expect to actually encounter a 64bit integer in the block-chain stream; it's outside of any reasonable expected value
+			ret = (uint32_t)v;
+		}
+		return ret;
+	}
+
+	// The same as readVariableLengthInteger for the counting pass, which has to check every read against the end of the block
+	// since it runs before anything is known about the block.
+	static inline bool scanVariableLengthInteger(const uint8_t *&scan,const uint8_t *end,uint32_t &value)
+	{
+		if ( scan >= end )
+		{
+			return false;
+		}
+		uint8_t v = *scan++;
+		uint32_t size = v < 0xFD ? 0 : v == 0xFD ? 2 : v == 0xFE ? 4 : 8;
+		if ( (uint32_t)(end-scan) < size )
+		{
+			return false;
+		}
+		uint64_t ret = v;
+		if ( size )
+		{
+			ret = 0;
+			for (uint32_t i=0; i<size; i++)
 			{
-				ret = (uint32_t)v;
+				ret|=(uint64_t)scan[i] << (i*8);
 			}
-			else
+			scan+=size;
+		}
+		value = (uint32_t)ret;
+		return ret <= 0xFFFFFFFF;
+	}
+
+	static inline bool scanSkip(const uint8_t *&scan,const uint8_t *end,uint32_t length)
+	{
+		if ( (uint32_t)(end-scan) < length )
+		{
+			return false;
+		}
+		scan+=length;
+		return true;
+	}
+
+	// A segwit transaction (BIP 144) has a zero byte where the input count would be, since a transaction can not have zero
+	// inputs, followed by a non-zero flag byte.
+	static inline bool isWitnessMarker(const uint8_t *scan,const uint8_t *end)
+	{
+		return (end-scan) >= 2 && scan[0] == 0 && scan[1] != 0;
+	}
+
+	// Skips the witness data of 'inputCount' inputs: for each input a count of stack items, each a length and the bytes.
+	static inline bool skipWitness(const uint8_t *&scan,const uint8_t *end,uint32_t inputCount)
+	{
+		for (uint32_t i=0; i<inputCount; i++)
+		{
+			uint32_t itemCount;
+			if ( !scanVariableLengthInteger(scan,end,itemCount) )
 			{
-				uint32_t v = readU32();
-				if ( v < 0xFFFFFFFF )
-				{
-					ret = (uint32_t)v;
-				}
-				else
+				return false;
+			}
+			for (uint32_t j=0; j<itemCount; j++)
+			{
+				uint32_t length;
+				if ( !scanVariableLengthInteger(scan,end,length) || !scanSkip(scan,end,length) )
 				{
-					assert(0); // never expect to actually encounter a 64bit integer in the block-chain stream; it's outside of any reasonable expected value
-					uint64_t v = readU64();
-					ret = (uint32_t)v;
+					return false;
 				}
 			}
 		}
-		return ret;
+		return true;
+	}
+
+	// Walks one transaction without storing anything, adding its inputs and outputs to the counts.  Returns false if the
+	// transaction runs past 'end'.
+	static bool countTransaction(const uint8_t *&scan,const uint8_t *end,uint32_t &inputCount,uint32_t &outputCount)
+	{
+		uint32_t count;
+		uint32_t length;
+		if ( !scanSkip(scan,end,4) ) // version
+		{
+			return false;
+		}
+		bool witness = isWitnessMarker(scan,end);
+		if ( witness )
+		{
+			scan+=2;
+		}
+		if ( !scanVariableLengthInteger(scan,end,count) )
+		{
+			return false;
+		}
+		uint32_t transactionInputs = count;
+		inputCount+=count;
+		for (uint32_t i=0; i<count; i++)
+		{
+			if ( !scanSkip(scan,end,32+4) || !scanVariableLengthInteger(scan,end,length) || !scanSkip(scan,end,length) || !scanSkip(scan,end,4) )
+			{
+				return false;
+			}
+		}
+		if ( !scanVariableLengthInteger(scan,end,count) )
+		{
+			return false;
+		}
+		outputCount+=count;
+		for (uint32_t i=0; i<count; i++)
+		{
+			if ( !scanSkip(scan,end,8) || !scanVariableLengthInteger(scan,end,length) || !scanSkip(scan,end,length) )
+			{
+				return false;
+			}
+		}
+		if ( witness && !skipWitness(scan,end,transactionInputs) )
+		{
+			return false;
+		}
+		return scanSkip(scan,end,4); // lock time
+	}
+
+	// The counting pass: finds out how many transactions, inputs and outputs the block starting at 'scan' (just past the
+	// header) holds, so the buffers can be sized before parsing, when pointers into them are handed out.
+	static bool countBlock(const uint8_t *scan,const uint8_t *end,uint32_t &transactionCount,uint32_t &inputCount,uint32_t &outputCount)
+	{
+		inputCount = 0;
+		outputCount = 0;
+		if ( !scanVariableLengthInteger(scan,end,transactionCount) )
+		{
+			return false;
+		}
+		for (uint32_t i=0; i<transactionCount; i++)
+		{
+			if ( !countTransaction(scan,end,inputCount,outputCount) )
+			{
+				return false;
+			}
+		}
+		return true;
 	}
 
 	// Get the current read buffer address and advance the stream buffer by this length; used to get the address of input/output scripts
@@ -2175,12 +3862,13 @@ public:
 		input.transactionHash = readHash();	// read the transaction hash
 		input.transactionIndex = readU32();	// read the transaction index
 		input.responseScriptLength = readVariableLengthInteger();	// read the length of the script
-		assert( input.responseScriptLength < MAX_REASONABLE_SCRIPT_LENGTH );
 
-		if ( input.responseScriptLength < MAX_REASONABLE_SCRIPT_LENGTH )
+		if ( input.responseScriptLength <= (uint32_t)(mBlockEnd-mBlockRead) )
 		{
 			input.responseScript = input.responseScriptLength ? getReadBufferAdvance(input.responseScriptLength) : NULL;	// get the script buffer pointer; and advance the read location
 			input.sequenceNumber = readU32();
+			input.signatureFormat = 0;	// filled in by signature analysis, if it is on
+			input.inputValue = 0;		// not known to the parser
 		}
 		else
 		{
@@ -2196,75 +3884,18 @@ public:
 
 		output.value = readU64();	// Read the value of the transaction
 		output.publicKey = NULL;
+		output.keyLength = 0;
+		output.keyHash = NULL;
+		output.scriptType = BlockChain::ST_NONSTANDARD;
 		blockReward+=output.value;
 		output.challengeScriptLength = readVariableLengthInteger();
-		assert ( output.challengeScriptLength < MAX_REASONABLE_SCRIPT_LENGTH );
 
-		if ( output.challengeScriptLength < MAX_REASONABLE_SCRIPT_LENGTH )
+		if ( output.challengeScriptLength <= (uint32_t)(mBlockEnd-mBlockRead) )
 		{
 			output.challengeScript = output.challengeScriptLength ? getReadBufferAdvance(output.challengeScriptLength) : NULL; // get the script buffer pointer and advance the read location
-			if ( output.challengeScriptLength == 67 && output.challengeScript[0] == 65  && output.challengeScript[66]== OP_CHECKSIG )
-			{
-				output.publicKey = output.challengeScript+1;
-				output.isRipeMD160 = false;
-			}
-			else if ( output.challengeScriptLength == 66 && output.challengeScript[65]== OP_CHECKSIG )
-			{
-				output.publicKey = output.challengeScript;
-				output.isRipeMD160 = false;
-			}
-			else if ( output.challengeScriptLength >= 25 && 
-					  output.challengeScript[0] == OP_DUP &&
-					  output.challengeScript[1] == OP_HASH160 && 
-					  output.challengeScript[2] == 20 )
-			{
-				output.publicKey = output.challengeScript+3;
-				output.isRipeMD160 = true;
-			}
-			else if ( output.challengeScriptLength == 5 && 
-					  output.challengeScript[0] == OP_DUP &&
-					  output.challengeScript[1] == OP_HASH160 &&
-					  output.challengeScript[2] == OP_0 && 
-					  output.challengeScript[3] == OP_EQUALVERIFY &&
-					  output.challengeScript[4] == OP_CHECKSIG )
-			{
-				logMessage("WARNING: Unusual but expected output script. Block %s : Transaction: %s : OutputIndex: %s\r\n", formatNumber(gBlockIndex), formatNumber(gTransactionIndex), formatNumber(gOutputIndex) );
-				gIsWarning = true;
-			}
-			else
-			{
-				// Ok..we are going to scan for this pattern.. OP_DUP, OP_HASH160, 0x14 then exactly 20 bytes after 0x88,0xAC
-				// 25...
-				if ( output.challengeScriptLength > 25 )
-				{
-					uint32_t endIndex = output.challengeScriptLength-25;
-
-					for (uint32_t i=0; i<endIndex; i++)
-					{
-						const uint8_t *scan = &output.challengeScript[i];
-						if ( scan[0] == OP_DUP &&
-							 scan[1] == OP_HASH160 &&
-							 scan[2] == 20 &&
-							 scan[23] == OP_EQUALVERIFY &&
-							 scan[24] == OP_CHECKSIG )
-						{
-							output.publicKey = &scan[3];
-							output.isRipeMD160 = true;
-							logMessage("WARNING: Unusual output script. Block %s : Transaction: %s : OutputIndex: %s\r\n", formatNumber(gBlockIndex), formatNumber(gTransactionIndex), formatNumber(gOutputIndex) );
-							gIsWarning = true;
-							break;
-						}
-					}
-				}
-				if ( !output.publicKey )
-				{
-					if ( output.challengeScriptLength >= 66 && output.challengeScript[output.challengeScriptLength-1] == OP_CHECKSIG )
-					{
-						logMessage("WARNING: Failed to decode public key in output script. Block %s : Transaction: %s : OutputIndex: %s\r\n", formatNumber(gBlockIndex), formatNumber(gTransactionIndex), formatNumber(gOutputIndex) );
-						gIsWarning = true;
-					}
-				}
-			}
+			output.scriptType = classifyOutputScript(output.challengeScript,output.challengeScriptLength,output.publicKey,output.keyLength);
+			output.isRipeMD160 = output.keyLength == 20;
+			mScriptTypeCounts[output.scriptType]++;
 		}
 		else
 		{
@@ -2289,15 +3920,22 @@ public:
 		}
 		else
 		{
-			gIsWarning = true;
-			logMessage("Encountered unusual and unexpected transaction version number of [%d] for transaction #%d\r\n", transaction.transactionVersionNumber, tindex );
+			warning = true;
+			LOG_WARNING("Encountered unusual and unexpected transaction version number of [%d] for transaction #%d\r\n", transaction.transactionVersionNumber, tindex );
 		}
+		// The marker and flag of a segwit transaction are not part of the transaction id; the hash skips from the version to
+		// the input count.
+		bool witness = isWitnessMarker(mBlockRead,mBlockEnd);
+		if ( witness )
+		{
+			mBlockRead+=2;
+		}
+		const uint8_t *strippedBegin = mBlockRead;
 		transaction.inputCount = readVariableLengthInteger();
-		assert( transaction.inputCount < MAX_REASONABLE_INPUTS );
-		transaction.inputs = &mInputs[totalInputCount];
+		transaction.inputs = mInputs.get()+totalInputCount;
 		totalInputCount+=transaction.inputCount;
-		assert( totalInputCount < MAX_BLOCK_INPUTS );
-		if ( totalInputCount < MAX_BLOCK_INPUTS )
+		assert( totalInputCount <= mInputs.getCapacity() ); // the counting pass sized the buffer
+		if ( totalInputCount <= mInputs.getCapacity() )
 		{
 			for (uint32_t i=0; i<transaction.inputCount; i++)
 			{
@@ -2316,15 +3954,13 @@ public:
 		if ( ret )
 		{
 			transaction.outputCount = readVariableLengthInteger();
-			assert( transaction.outputCount < MAX_REASONABLE_OUTPUTS );
-			transaction.outputs = &mOutputs[totalOutputCount];
+			transaction.outputs = mOutputs.get()+totalOutputCount;
 			totalOutputCount+=transaction.outputCount;
-			assert( totalOutputCount < MAX_BLOCK_OUTPUTS );
-			if ( totalOutputCount < MAX_BLOCK_OUTPUTS )
+			assert( totalOutputCount <= mOutputs.getCapacity() );
+			if ( totalOutputCount <= mOutputs.getCapacity() )
 			{
 				for (uint32_t i=0; i<transaction.outputCount; i++)
 				{
-					gOutputIndex = i;
 					BlockChain::BlockOutput &output = transaction.outputs[i];
 					ret = readOutput(output);
 					if ( !ret )
@@ -2333,7 +3969,15 @@ public:
 					}
 				}
 
-				transaction.lockTime = readU32();
+				// The witness stacks come after the outputs; nothing in them is used here, so they are only walked past.
+				const uint8_t *strippedEnd = mBlockRead;
+				if ( ret && witness )
+				{
+					ret = skipWitness(mBlockRead,mBlockEnd,transaction.inputCount);
+				}
+				transaction.witnessLength = witness ? (uint32_t)(mBlockRead-strippedEnd)+2 : 0;
+
+				transaction.lockTime = ret ? readU32() : 0;
 
 				if ( ret )
 				{
@@ -2342,8 +3986,30 @@ public:
 					transaction.fileOffset = fileOffset + (uint32_t)(transactionBegin-mBlockData);
 					transaction.transactionIndex = transactionIndex;
 					transactionIndex++;
-					BLOCKCHAIN_SHA256::computeSHA256(transactionBegin,transaction.transactionLength,transaction.transactionHash);
+					PROFILE_SCOPE_ITEMS(PS_TXID_HASH,transaction.transactionLength);
+					if ( witness )
+					{
+						// txid = hash of version, inputs and outputs, lock time; the witness data is left out
+						BLOCKCHAIN_SHA256::computeSHA256(transactionBegin,4,strippedBegin,(uint32_t)(strippedEnd-strippedBegin),mBlockRead-4,4,transaction.transactionHash);
+					}
+					else
+					{
+						BLOCKCHAIN_SHA256::computeSHA256(transactionBegin,transaction.transactionLength,transaction.transactionHash);
+					}
 					BLOCKCHAIN_SHA256::computeSHA256(transaction.transactionHash,32,transaction.transactionHash);
+					if ( mComputeWitnessHashes )
+					{
+						// wtxid = hash of the whole serialization; the same as the txid if there is no witness
+						if ( witness )
+						{
+							BLOCKCHAIN_SHA256::computeSHA256(transactionBegin,transaction.transactionLength,transaction.witnessHash);
+							BLOCKCHAIN_SHA256::computeSHA256(transaction.witnessHash,32,transaction.witnessHash);
+						}
+						else
+						{
+							memcpy(transaction.witnessHash,transaction.transactionHash,32);
+						}
+					}
 				}
 
 			}
@@ -2382,23 +4048,34 @@ public:
 	//Step #9 Read the LockTime; a value currently always hard-coded to zero
 	bool processBlockData(const void *blockData,uint32_t blockLength,uint32_t &transactionIndex)
 	{
-		bool ret = true;
+		bool ret = false;
 		mBlockData = (const uint8_t *)blockData;
 		mBlockRead = mBlockData;	// Set the block-read scan pointer.
 		mBlockEnd = &mBlockData[blockLength]; // Mark the end of block pointer
+		warning = false;
+		transactionCount = 0;
+		memset(mScriptTypeCounts,0,sizeof(mScriptTypeCounts));
+		if ( blockLength < 4+32+32+4+4+4 )
+		{
+			return false;
+		}
 		blockFormatVersion = readU32();	// Read the format version
 		previousBlockHash = readHash();  // get the address of the hash
 		merkleRoot = readHash();	// Get the address of the merkle root hash
-		gBlockTime = timeStamp = readU32();	// Get the timestamp
+		timeStamp = readU32();	// Get the timestamp
 		bits = readU32();	// Get the bits field
 		nonce = readU32();	// Get the 'nonce' random number.
-		transactionCount = readVariableLengthInteger();	// Read the number of transactions
-		if ( transactionCount < MAX_BLOCK_TRANSACTION )
+		uint32_t inputCount;
+		uint32_t outputCount;
+		if ( countBlock(mBlockRead,mBlockEnd,transactionCount,inputCount,outputCount) )
 		{
-			transactions = mTransactions;	// Assign the transactions buffer pointer
+			ret = true;
+			transactionCount = readVariableLengthInteger();	// Read the number of transactions
+			transactions = mTransactions.reserve(transactionCount);	// Assign the transactions buffer pointer
+			mInputs.reserve(inputCount);
+			mOutputs.reserve(outputCount);
 			for (uint32_t i=0; i<transactionCount; i++)
 			{
-				gTransactionIndex = i;
 				BlockChain::BlockTransaction &b = transactions[i];
 				if ( !readTransaction(b,transactionIndex,i) )	// Read the transaction; if it failed; then abort processing the block chain
 				{
@@ -2406,6 +4083,10 @@ public:
 					break;
 				}
 			}
+			if ( ret )
+			{
+				hashOutputKeys(outputCount);
+			}
 		}
 
 		return ret;
@@ -2414,30 +4095,124 @@ public:
 	const BlockChain::BlockTransaction *processTransactionData(const void *transactionData,uint32_t transactionLength)
 	{
 		uint32_t transactionIndex=0;
-		BlockChain::BlockTransaction *ret = &mTransactions[0];
+		BlockChain::BlockTransaction *ret = NULL;
 		mBlockData = (const uint8_t *)transactionData;
 		mBlockRead = mBlockData;	// Set the block-read scan pointer.
 		mBlockEnd = &mBlockData[transactionLength]; // Mark the end of block pointer
-		if ( !readTransaction(*ret,transactionIndex,0) )	// Read the transaction; if it failed; then abort processing the block chain
+		const uint8_t *scan = mBlockData;
+		uint32_t inputCount = 0;
+		uint32_t outputCount = 0;
+		if ( countTransaction(scan,mBlockEnd,inputCount,outputCount) )
+		{
+			ret = mTransactions.reserve(1);
+			mInputs.reserve(inputCount);
+			mOutputs.reserve(outputCount);
+			if ( !readTransaction(*ret,transactionIndex,0) )	// Read the transaction; if it failed; then abort processing the block chain
+			{
+				ret = NULL;
+			}
+			else
+			{
+				hashOutputKeys(outputCount);
+			}
+		}
+		return ret;
+	}
+
+	// Hashes the public key of every pay-to-pubkey and multisig output just read, all in one pass and four keys at a time
+	// where it can (see Hash160Batch), and points keyHash at the result.  This runs wherever the block is parsed, which for the block loader is one of its worker threads, so
+	// crediting the outputs to addresses later is just a lookup.  Keys which are not valid 33 or 65 byte public keys are
+	// left with no hash, rather than hashing whatever bytes are there into an address nobody can spend from.
+	void hashOutputKeys(uint32_t outputCount)
+	{
+		PROFILE_SCOPE(PS_HASH160);
+		BlockChain::BlockOutput *outputs = mOutputs.get();
+		uint32_t keyCount = 0;
+		for (uint32_t i=0; i<outputCount; i++)
+		{
+			if ( outputs[i].keyLength == 33 || outputs[i].keyLength == 65 )
+			{
+				keyCount++;
+			}
+		}
+		uint8_t *hash = mKeyHashes.reserve(keyCount*20);
+		PROFILE_SET_ITEMS(keyCount);
+		BLOCKCHAIN_BITCOIN_ADDRESS::Hash160Batch batch;
+		for (uint32_t i=0; i<outputCount; i++)
+		{
+			BlockChain::BlockOutput &o = outputs[i];
+			if ( (o.keyLength == 33 || o.keyLength == 65) && batch.add(o.publicKey,o.keyLength,hash) )
+			{
+				o.keyHash = hash;
+				hash+=20;
+			}
+		}
+		batch.flush();
+	}
+
+	// The parse buffers as where they start and how many bytes they hold.  Only the thread parsing into this block may call
+	// it; BlockParsePool copies the result while it holds its lock.
+	void getScratchRegions(const void *regions[SCRATCH_REGION_COUNT],uint64_t bytes[SCRATCH_REGION_COUNT]) const
+	{
+		regions[0] = mTransactions.get();
+		bytes[0] = sizeof(BlockChain::BlockTransaction)*(uint64_t)mTransactions.getCapacity();
+		regions[1] = mInputs.get();
+		bytes[1] = sizeof(BlockChain::BlockInput)*(uint64_t)mInputs.getCapacity();
+		regions[2] = mOutputs.get();
+		bytes[2] = sizeof(BlockChain::BlockOutput)*(uint64_t)mOutputs.getCapacity();
+		regions[3] = mKeyHashes.get();
+		bytes[3] = mKeyHashes.getCapacity();
+	}
+
+	// The bytes of the parse buffers, and their pages for the resident count of the current row.
+	uint64_t getScratchBytes(void) const
+	{
+		const void *regions[SCRATCH_REGION_COUNT];
+		uint64_t bytes[SCRATCH_REGION_COUNT];
+		getScratchRegions(regions,bytes);
+		uint64_t ret = 0;
+		for (uint32_t i=0; i<SCRATCH_REGION_COUNT; i++)
 		{
-			ret = NULL;
+			ret+=bytes[i];
 		}
 		return ret;
 	}
 
+	void addScratchRegions(MemoryReport &report) const
+	{
+		const void *regions[SCRATCH_REGION_COUNT];
+		uint64_t bytes[SCRATCH_REGION_COUNT];
+		getScratchRegions(regions,bytes);
+		for (uint32_t i=0; i<SCRATCH_REGION_COUNT; i++)
+		{
+			report.addRegion(regions[i],bytes[i]);
+		}
+	}
+
+	// Everything a parse touches lives in the BlockImpl, so blocks can be parsed on several threads at once as long as each
+	// has its own.
+	uint32_t						mScriptTypeCounts[BlockChain::ST_COUNT];	// Outputs of each script type in this block
+	bool							mComputeWitnessHashes;		// Fill in witnessHash (the wtxid) of each transaction as well
+	bool							mAnalyzeSignatures;			// The block was loaded with signature analysis on
+	SignatureStatTable				mSignatureStats;			// Signature formats of this block's inputs, when analyzed
 
 	const uint8_t					*mBlockRead;				// The current read buffer address in the block
 	const uint8_t					*mBlockEnd;					// The EOF marker for the block
 	const uint8_t					*mBlockData;
-	BlockChain::BlockTransaction	mTransactions[MAX_BLOCK_TRANSACTION];	// Holds the array of transactions
-	BlockChain::BlockInput			mInputs[MAX_BLOCK_INPUTS];	// The input arrays
-	BlockChain::BlockOutput			mOutputs[MAX_BLOCK_OUTPUTS]; // The output arrays
+	ScratchBuffer< BlockChain::BlockTransaction >	mTransactions;	// Holds the array of transactions
+	ScratchBuffer< BlockChain::BlockInput >			mInputs;		// The input arrays
+	ScratchBuffer< BlockChain::BlockOutput >		mOutputs;		// The output arrays
+	ScratchBuffer< uint8_t >						mKeyHashes;		// The 20 byte hashes keyHash points at
 
 };
 
 class Transaction;
 
-// Contains a hash of just the 20 byte RIPEMD160 key; does not have the header or footer; which can be calculated.
+// Contains a hash of just the 20 byte RIPEMD160 key; does not have the header or footer; which can be calculated.  The script
+// type says which kind of address the key is for (P2PKH, P2SH, P2WPKH, P2WSH or P2TR; pay-to-pubkey and multisig outputs
+// are credited to the P2PKH address of the key) and is part of the identity, since the same 20 bytes as a P2SH hash are a
+// different address.  For P2WSH and P2TR the key is the first 20 bytes of the 32 byte witness program; the whole program is
+// kept in a WitnessProgramStore.
 class BitcoinAddress 
 {
 public:
@@ -2455,8 +4230,6 @@ public:
 		mWord1 = 0;
 		mWord2 = 0;
 		mTransactionCount = 0;
-		mTransactionIndex = 0xFFFFFFFF;
-		mTransactions = NULL;
 		mTotalReceived = 0;
 		mTotalSent = 0;
 		mLastInputTime = 0;
@@ -2465,16 +4238,15 @@ public:
 		mInputCount = 0;
 		mOutputCount = 0;
 		mBitcoinAddressFlags = 0;
+		mScriptType = BlockChain::ST_P2PKH;
 	}
 
-	BitcoinAddress(const uint8_t address[20]) 
+	BitcoinAddress(const uint8_t address[20],uint8_t scriptType=BlockChain::ST_P2PKH) 
 	{
 		mWord0 = *(const uint64_t *)(address);
 		mWord1 = *(const uint64_t *)(address+8);
 		mWord2 = *(const uint32_t *)(address+16);
 		mTransactionCount = 0;
-		mTransactionIndex = 0xFFFFFFFF;
-		mTransactions = NULL;
 		mTotalReceived = 0;
 		mTotalSent = 0;
 		mLastInputTime = 0;
@@ -2483,11 +4255,18 @@ public:
 		mInputCount = 0;
 		mOutputCount = 0;
 		mBitcoinAddressFlags = 0;
+		mScriptType = scriptType;
 	}
 
 	bool operator==(const BitcoinAddress &a) const
 	{
-		return mWord0 == a.mWord0 && mWord1 == a.mWord1 && mWord2 == a.mWord2;
+		return mWord0 == a.mWord0 && mWord1 == a.mWord1 && mWord2 == a.mWord2 && mScriptType == a.mScriptType;
+	}
+
+	// True for the address types whose key is a 32 byte witness program.
+	bool hasWideKey(void) const
+	{
+		return mScriptType == BlockChain::ST_P2WSH || mScriptType == BlockChain::ST_P2TR;
 	}
 
 	bool isCoinBase(void) const
@@ -2508,7 +4287,7 @@ public:
 	uint32_t getHash(void) const
 	{
 		const uint32_t *h = (const uint32_t *)&mWord0;
-		return h[0] ^ h[1] ^ h[2] ^ h[3] ^ h[4];
+		return h[0] ^ h[1] ^ h[2] ^ h[3] ^ h[4] ^ mScriptType;
 	}
 
 	uint32_t getLastUsedTime(void) const
@@ -2572,10 +4351,9 @@ public:
 
 	uint32_t	mInputCount;
 	uint32_t	mOutputCount;
-	uint32_t	mTransactionIndex;
-	uint32_t	mTransactionCount;
+	uint32_t	mTransactionCount;	// Number of transactions this address appears in as either input, output or (sometimes) both; see AddressTransactionIndex
 	uint8_t		mBitcoinAddressFlags;
-	Transaction	**mTransactions;	// The array of transactions associated with this bitcoin-address as either inputs or outputs or (sometimes) both.
+	uint8_t		mScriptType;		// BlockChain::ScriptType of the address; fits in the padding after the flags
 };
 
 
@@ -2591,9 +4369,11 @@ public:
 	{
 		mValue = 0;
 		mAddress = 0;
+		mSpentBy = 0xFFFFFFFF;
 	}
 	uint64_t	mValue;		// value of the output.
 	uint32_t	mAddress;	// address of the output. 
+	uint32_t	mSpentBy;	// index of the transaction which spent this output, 0xFFFFFFFF if it is unspent
 };
 
 class TransactionInput
@@ -2629,22 +4409,605 @@ public:
 
 typedef SimpleHash< BitcoinAddress, 4194304, MAX_BITCOIN_ADDRESSES > BitcoinAddressHashMap;
 
-enum AgeMarker
+// The whole 32 byte witness program of each P2WSH and P2TR address, by address index; BitcoinAddress only has room for the
+// first 20 bytes.  Addresses are only ever added at the end of the table and removed from the end, so the entries stay
+// sorted by address index and are found with a binary search.  Entries live in fixed chunks which are never moved, so
+// readers may look programs up while the block thread adds them, the same as with the address table.
+class WitnessProgramStore
 {
-	AM_ONE_DAY,
-	AM_ONE_WEEK,
-	AM_ONE_MONTH,
-	AM_THREE_MONTHS,
-	AM_SIX_MONTHS,
-	AM_ONE_YEAR,
-	AM_TWO_YEARS,
-	AM_THREE_YEARS,
-	AM_FOUR_YEARS,
-	AM_FIVE_YEARS,
-	AM_LAST
-};
-
-const char * getAgeString(AgeMarker m)
+public:
+	WitnessProgramStore(void)
+	{
+		mCount.store(0,std::memory_order_relaxed);
+		memset(mChunks,0,sizeof(mChunks));
+	}
+
+	~WitnessProgramStore(void)
+	{
+		for (uint32_t i=0; i<MAX_CHUNKS; i++)
+		{
+			delete []mChunks[i];
+		}
+	}
+
+	// Only called by the block thread, with an address index above any already stored.
+	bool add(uint32_t address,const uint8_t program[32])
+	{
+		uint32_t count = mCount.load(std::memory_order_relaxed);
+		uint32_t chunk = count / CHUNK_SIZE;
+		if ( chunk >= MAX_CHUNKS )
+		{
+			return false;
+		}
+		if ( mChunks[chunk] == NULL )
+		{
+			mChunks[chunk] = new Entry[CHUNK_SIZE];
+		}
+		Entry &e = mChunks[chunk][count % CHUNK_SIZE];
+		e.mAddress = address;
+		memcpy(e.mProgram,program,32);
+		mCount.store(count+1,std::memory_order_release);
+		return true;
+	}
+
+	const uint8_t *find(uint32_t address) const
+	{
+		uint32_t count = mCount.load(std::memory_order_acquire);
+		uint32_t low = 0;
+		uint32_t high = count;
+		while ( low < high )
+		{
+			uint32_t mid = (low+high)/2;
+			if ( getEntry(mid).mAddress < address )
+			{
+				low = mid+1;
+			}
+			else
+			{
+				high = mid;
+			}
+		}
+		return (low < count && getEntry(low).mAddress == address) ? getEntry(low).mProgram : NULL;
+	}
+
+	// Forgets the programs of every address index from 'addressCount' up; used when blocks are disconnected.
+	void truncate(uint32_t addressCount)
+	{
+		uint32_t count = mCount.load(std::memory_order_relaxed);
+		while ( count && getEntry(count-1).mAddress >= addressCount )
+		{
+			count--;
+		}
+		mCount.store(count,std::memory_order_release);
+	}
+
+	uint32_t size(void) const
+	{
+		return mCount.load(std::memory_order_acquire);
+	}
+
+	// Chunks are allocated as they fill, so the capacity is that of the chunks allocated so far.
+	void reportMemory(MemoryReport &report) const
+	{
+		uint32_t chunkCount = 0;
+		for (uint32_t i=0; i<MAX_CHUNKS; i++)
+		{
+			chunkCount+= mChunks[i] ? 1 : 0;
+		}
+		report.add("witness programs",NULL,sizeof(Entry),(uint64_t)chunkCount*CHUNK_SIZE,size(),size());
+		for (uint32_t i=0; i<MAX_CHUNKS; i++)
+		{
+			report.addRegion(mChunks[i],sizeof(Entry)*(uint64_t)CHUNK_SIZE);
+		}
+	}
+
+private:
+	enum
+	{
+		CHUNK_SIZE = 65536,
+		MAX_CHUNKS = MAX_BITCOIN_ADDRESSES/CHUNK_SIZE+1
+	};
+
+	struct Entry
+	{
+		uint32_t	mAddress;
+		uint8_t		mProgram[32];
+	};
+
+	inline const Entry &getEntry(uint32_t i) const
+	{
+		return mChunks[i/CHUNK_SIZE][i%CHUNK_SIZE];
+	}
+
+	Entry					*mChunks[MAX_CHUNKS];
+	std::atomic< uint32_t >	mCount;
+};
+
+// A small query engine over the address table.  A query is a list of space separated terms, all of which must hold:
+//
+//   balance>10  received>=100  sent<1  txcount>=3  inputs=0  outputs>5     (BTC values for balance/received/sent)
+//   firstused<2012-01-01  lastused>=1356998400  age>365                    (dates as YYYY-MM-DD or seconds, age in days)
+//   coinbase:50  coinbase:25  coinbase:multiple  coinbase:any  sends:yes  sends:no
+//   address=1BT66EoaGySkbY9J6MugvQRhMMXDwPxPya
+//   sort:balance  sort:lastused:asc  limit:100  explain                    (limit is at most QUERY_MAX_LIMIT rows)
+//
+// The parser turns terms into predicates, the planner picks an access path (a hash lookup when an address is given, otherwise
+// a scan) and orders the predicates so the cheapest and most selective run first.  Selectivity is measured by running each
+// predicate over a sample of QUERY_SAMPLE_ROWS rows spread evenly across the table; the parser's fixed guesses are only used
+// for a point lookup, where there is nothing worth ordering.  The executor scans rows in batches of
+// QUERY_BATCH_SIZE with a selection vector: each predicate gathers its column for the surviving rows, compares them in one
+// tight loop and compacts the selection.  Survivors go into a bounded heap of 'limit' rows, so only the result is ever sorted.
+// Transaction counts and coinbase flags are those computed by the last statistics gather.
+
+#define QUERY_BATCH_SIZE 1024
+#define QUERY_MAX_PREDICATES 32
+#define QUERY_MAX_LIMIT 100000
+#define QUERY_SAMPLE_ROWS 4096
+
+class AddressQuery
+{
+public:
+	enum Field
+	{
+		QF_BALANCE,
+		QF_RECEIVED,
+		QF_SENT,
+		QF_TRANSACTION_COUNT,
+		QF_INPUT_COUNT,
+		QF_OUTPUT_COUNT,
+		QF_FIRST_USED,
+		QF_LAST_USED,
+		QF_AGE,
+		QF_FLAGS,
+		QF_COUNT
+	};
+
+	enum Op
+	{
+		QO_LESS,
+		QO_LESS_EQUAL,
+		QO_GREATER,
+		QO_GREATER_EQUAL,
+		QO_EQUAL,
+		QO_NOT_EQUAL,
+		QO_ALL_BITS,	// (value & mask) == mask
+		QO_NO_BITS,		// (value & mask) == 0
+		QO_ANY_BITS		// (value & mask) != 0
+	};
+
+	class Predicate
+	{
+	public:
+		Field		mField;
+		Op			mOp;
+		uint64_t	mValue;
+		float		mSelectivity;	// Planner estimate of the fraction of rows which pass
+	};
+
+	AddressQuery(void)
+	{
+		mPredicateCount = 0;
+		mSortField = QF_BALANCE;
+		mSortAscending = false;
+		mLimit = 25;
+		mExplain = false;
+		mAddress[0] = 0;
+		mReferenceTime = 0;
+	}
+
+	// Returns false (and logs why) if the expression has a term we do not understand.
+	bool parse(const char *expression,uint32_t referenceTime)
+	{
+		mReferenceTime = referenceTime;
+		char scratch[512];
+		const char *scan = expression;
+		while ( scan && *scan )
+		{
+			while ( *scan == ' ' || *scan == '\t' ) scan++;
+			if ( *scan == 0 ) break;
+			uint32_t len = 0;
+			while ( scan[len] && scan[len] != ' ' && scan[len] != '\t' && len < sizeof(scratch)-1 )
+			{
+				scratch[len] = scan[len];
+				len++;
+			}
+			scratch[len] = 0;
+			scan+=len;
+			while ( *scan && *scan != ' ' && *scan != '\t' ) scan++; // skip the rest of an over long term
+			if ( !parseTerm(scratch) )
+			{
+				logMessage("Unrecognized query term: %s\r\n", scratch );
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Orders predicates by estimated selectivity, cheapest flag tests first on ties.  Scans first measure the selectivity
+	// of each predicate on a sample of the rowCount rows of the table.
+	void plan(BitcoinAddressHashMap &table,uint32_t rowCount)
+	{
+		uint32_t sampleCount = 0;
+		if ( mAddress[0] == 0 && mPredicateCount )
+		{
+			sampleCount = sample(table,rowCount);
+		}
+		for (uint32_t i=1; i<mPredicateCount; i++)
+		{
+			Predicate p = mPredicates[i];
+			uint32_t j = i;
+			while ( j > 0 && isBefore(p,mPredicates[j-1]) )
+			{
+				mPredicates[j] = mPredicates[j-1];
+				j--;
+			}
+			mPredicates[j] = p;
+		}
+		if ( mExplain )
+		{
+			static const char *fieldNames[QF_COUNT] = { "balance", "received", "sent", "txcount", "inputs", "outputs", "firstused", "lastused", "age", "flags" };
+			static const char *opNames[9] = { "<", "<=", ">", ">=", "=", "!=", "has", "lacks", "has any" };
+			logMessage("Query plan: %s, top %d by %s %s, selectivity sampled from %d rows\r\n", mAddress[0] ? "address hash lookup" : "full scan", mLimit, fieldNames[mSortField], mSortAscending ? "ascending" : "descending", sampleCount );
+			for (uint32_t i=0; i<mPredicateCount; i++)
+			{
+				const Predicate &p = mPredicates[i];
+				logMessage("    filter %d : %s %s %llu (estimated selectivity %0.2f)\r\n", i+1, fieldNames[p.mField], opNames[p.mOp], (unsigned long long)p.mValue, p.mSelectivity );
+			}
+		}
+	}
+
+	// Runs the query over rows [0,rowCount) of the table, or over the single row 'pointRow' if it is not 0xFFFFFFFF.
+	// Fills 'results' with at most mLimit row indices in sort order and returns the total number of matching rows.
+	uint32_t execute(BitcoinAddressHashMap &table,uint32_t rowCount,uint32_t pointRow,std::vector< uint32_t > &results) const
+	{
+		uint32_t matchCount = 0;
+		uint32_t selection[QUERY_BATCH_SIZE];
+		uint64_t values[QUERY_BATCH_SIZE];
+		std::vector< std::pair< uint64_t, uint32_t > > heap;
+		heap.reserve(mLimit+1);
+
+		uint32_t begin = 0;
+		uint32_t end = rowCount;
+		if ( pointRow != 0xFFFFFFFF )
+		{
+			begin = pointRow;
+			end = pointRow < rowCount ? pointRow+1 : pointRow;
+		}
+		for (uint32_t base=begin; base<end; base+=QUERY_BATCH_SIZE)
+		{
+			uint32_t count = end-base < QUERY_BATCH_SIZE ? end-base : QUERY_BATCH_SIZE;
+			for (uint32_t i=0; i<count; i++)
+			{
+				selection[i] = base+i;
+			}
+			for (uint32_t p=0; p<mPredicateCount && count; p++)
+			{
+				const Predicate &pred = mPredicates[p];
+				gather(table,pred.mField,selection,count,values);
+				count = filter(pred,selection,values,count);
+			}
+			if ( count == 0 ) continue;
+			matchCount+=count;
+			gather(table,mSortField,selection,count,values);
+			for (uint32_t i=0; i<count; i++)
+			{
+				// The heap keeps the best mLimit rows seen so far with the worst on top; ascending sorts invert the key.
+				uint64_t key = mSortAscending ? ~values[i] : values[i];
+				std::pair< uint64_t, uint32_t > entry(key,~selection[i]); // earlier rows win ties
+				if ( heap.size() < mLimit )
+				{
+					heap.push_back(entry);
+					std::push_heap(heap.begin(),heap.end(),std::greater< std::pair< uint64_t, uint32_t > >());
+				}
+				else if ( mLimit && entry > heap.front() )
+				{
+					std::pop_heap(heap.begin(),heap.end(),std::greater< std::pair< uint64_t, uint32_t > >());
+					heap.back() = entry;
+					std::push_heap(heap.begin(),heap.end(),std::greater< std::pair< uint64_t, uint32_t > >());
+				}
+			}
+		}
+		std::sort_heap(heap.begin(),heap.end(),std::greater< std::pair< uint64_t, uint32_t > >());
+		results.clear();
+		for (size_t i=0; i<heap.size(); i++)
+		{
+			results.push_back(~heap[i].second);
+		}
+		return matchCount;
+	}
+
+	const char *getAddress(void) const
+	{
+		return mAddress[0] ? mAddress : NULL;
+	}
+
+private:
+	// Sets the selectivity of every predicate to the fraction of up to QUERY_SAMPLE_ROWS evenly spaced rows which pass it on
+	// its own; returns the number of rows sampled.  Half a row is added on top so a predicate nothing in the sample passes
+	// still orders by sample size rather than all tying at zero.
+	uint32_t sample(BitcoinAddressHashMap &table,uint32_t rowCount)
+	{
+		uint32_t sampleCount = rowCount < QUERY_SAMPLE_ROWS ? rowCount : QUERY_SAMPLE_ROWS;
+		if ( sampleCount == 0 ) return 0;
+		uint32_t selection[QUERY_BATCH_SIZE];
+		uint64_t values[QUERY_BATCH_SIZE];
+		uint32_t passed[QUERY_MAX_PREDICATES];
+		for (uint32_t p=0; p<mPredicateCount; p++)
+		{
+			passed[p] = 0;
+		}
+		for (uint32_t base=0; base<sampleCount; base+=QUERY_BATCH_SIZE)
+		{
+			uint32_t count = sampleCount-base < QUERY_BATCH_SIZE ? sampleCount-base : QUERY_BATCH_SIZE;
+			for (uint32_t p=0; p<mPredicateCount; p++)
+			{
+				for (uint32_t i=0; i<count; i++)
+				{
+					selection[i] = (uint32_t)((uint64_t)(base+i)*rowCount/sampleCount);
+				}
+				gather(table,mPredicates[p].mField,selection,count,values);
+				passed[p]+=filter(mPredicates[p],selection,values,count);
+			}
+		}
+		for (uint32_t p=0; p<mPredicateCount; p++)
+		{
+			mPredicates[p].mSelectivity = ((float)passed[p]+0.5f)/((float)sampleCount+1.0f);
+		}
+		return sampleCount;
+	}
+
+	static bool isBefore(const Predicate &a,const Predicate &b)
+	{
+		if ( a.mSelectivity != b.mSelectivity )
+		{
+			return a.mSelectivity < b.mSelectivity;
+		}
+		return a.mField == QF_FLAGS && b.mField != QF_FLAGS;
+	}
+
+	bool addPredicate(Field f,Op op,uint64_t value,float selectivity)
+	{
+		if ( mPredicateCount >= QUERY_MAX_PREDICATES ) return false;
+		Predicate &p = mPredicates[mPredicateCount++];
+		p.mField = f;
+		p.mOp = op;
+		p.mValue = value;
+		p.mSelectivity = selectivity;
+		return true;
+	}
+
+	static bool getField(const char *name,Field &f)
+	{
+		static const char *names[QF_FLAGS] = { "balance", "received", "sent", "txcount", "inputs", "outputs", "firstused", "lastused", "age" };
+		for (uint32_t i=0; i<QF_FLAGS; i++)
+		{
+			if ( strcmp(name,names[i]) == 0 )
+			{
+				f = (Field)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Days since 1970-01-01 of a civil date (proleptic Gregorian).
+	static int64_t daysFromCivil(int64_t y,uint32_t m,uint32_t d)
+	{
+		y-= m <= 2;
+		int64_t era = (y >= 0 ? y : y-399) / 400;
+		uint32_t yoe = (uint32_t)(y - era * 400);
+		uint32_t doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d-1;
+		uint32_t doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+		return era * 146097 + (int64_t)doe - 719468;
+	}
+
+	bool parseValue(Field f,const char *str,uint64_t &value) const
+	{
+		char *end = NULL;
+		switch ( f )
+		{
+			case QF_BALANCE:
+			case QF_RECEIVED:
+			case QF_SENT:
+				{
+					double btc = strtod(str,&end);
+					if ( end == str || btc < 0 ) return false;
+					value = (uint64_t)(btc*ONE_BTC+0.5);
+				}
+				break;
+			case QF_FIRST_USED:
+			case QF_LAST_USED:
+				{
+					uint32_t y,m,d;
+					if ( strchr(str,'-') && sscanf(str,"%u-%u-%u",&y,&m,&d) == 3 && m >= 1 && m <= 12 && d >= 1 && d <= 31 )
+					{
+						value = (uint64_t)(daysFromCivil(y,m,d)*86400);
+						return true;
+					}
+					value = strtoull(str,&end,10);
+					if ( end == str ) return false;
+				}
+				break;
+			default:
+				value = strtoull(str,&end,10);
+				if ( end == str ) return false;
+				break;
+		}
+		return true;
+	}
+
+	bool parseTerm(const char *term)
+	{
+		if ( strcmp(term,"explain") == 0 )
+		{
+			mExplain = true;
+			return true;
+		}
+		if ( strncmp(term,"limit:",6) == 0 )
+		{
+			const char *digits = term+6;
+			if ( *digits < '0' || *digits > '9' ) return false; // empty, negative or signed
+			char *end = NULL;
+			unsigned long limit = strtoul(digits,&end,10);
+			if ( *end ) return false;
+			if ( limit > QUERY_MAX_LIMIT )
+			{
+				logMessage("Query limit %s is more than %d; showing at most %d rows.\r\n", digits, QUERY_MAX_LIMIT, QUERY_MAX_LIMIT );
+				limit = QUERY_MAX_LIMIT;
+			}
+			mLimit = (uint32_t)limit;
+			return true;
+		}
+		if ( strncmp(term,"sort:",5) == 0 )
+		{
+			char name[64];
+			strncpy(name,term+5,sizeof(name)-1);
+			name[sizeof(name)-1] = 0;
+			char *dir = strchr(name,':');
+			mSortAscending = false;
+			if ( dir )
+			{
+				*dir++ = 0;
+				if ( strcmp(dir,"asc") == 0 ) mSortAscending = true;
+				else if ( strcmp(dir,"desc") != 0 ) return false;
+			}
+			return getField(name,mSortField);
+		}
+		if ( strncmp(term,"coinbase:",9) == 0 )
+		{
+			const char *v = term+9;
+			if ( strcmp(v,"50") == 0 ) return addPredicate(QF_FLAGS,QO_ALL_BITS,BitcoinAddress::BAT_COINBASE_50,0.01f);
+			if ( strcmp(v,"25") == 0 ) return addPredicate(QF_FLAGS,QO_ALL_BITS,BitcoinAddress::BAT_COINBASE_25,0.01f);
+			if ( strcmp(v,"multiple") == 0 ) return addPredicate(QF_FLAGS,QO_ALL_BITS,BitcoinAddress::BAT_COINBASE_MULTIPLE,0.005f);
+			if ( strcmp(v,"any") == 0 ) return addPredicate(QF_FLAGS,QO_ANY_BITS,BitcoinAddress::BAT_COINBASE_50 | BitcoinAddress::BAT_COINBASE_25,0.02f);
+			return false;
+		}
+		if ( strncmp(term,"sends:",6) == 0 )
+		{
+			if ( strcmp(term+6,"yes") == 0 ) return addPredicate(QF_FLAGS,QO_ALL_BITS,BitcoinAddress::BAT_HAS_SENDS,0.5f);
+			if ( strcmp(term+6,"no") == 0 ) return addPredicate(QF_FLAGS,QO_NO_BITS,BitcoinAddress::BAT_HAS_SENDS,0.5f);
+			return false;
+		}
+		if ( strncmp(term,"address=",8) == 0 )
+		{
+			strncpy(mAddress,term+8,sizeof(mAddress)-1);
+			mAddress[sizeof(mAddress)-1] = 0;
+			return mAddress[0] != 0;
+		}
+		// field op value
+		const char *op = term;
+		while ( *op && *op != '<' && *op != '>' && *op != '=' && *op != '!' ) op++;
+		if ( *op == 0 || op == term || (size_t)(op-term) >= 64 ) return false;
+		char name[64];
+		memcpy(name,term,op-term);
+		name[op-term] = 0;
+		Field f;
+		if ( !getField(name,f) ) return false;
+		Op o;
+		float selectivity = 0.33f; // a guess; plan measures the real figure when it scans
+		const char *value = op+1;
+		if ( op[0] == '<' && op[1] == '=' ) { o = QO_LESS_EQUAL; value++; }
+		else if ( op[0] == '>' && op[1] == '=' ) { o = QO_GREATER_EQUAL; value++; }
+		else if ( op[0] == '!' && op[1] == '=' ) { o = QO_NOT_EQUAL; value++; selectivity = 0.9f; }
+		else if ( op[0] == '<' ) o = QO_LESS;
+		else if ( op[0] == '>' ) o = QO_GREATER;
+		else if ( op[0] == '=' ) { o = QO_EQUAL; selectivity = 0.05f; }
+		else return false;
+		uint64_t v;
+		if ( !parseValue(f,value,v) ) return false;
+		return addPredicate(f,o,v,selectivity);
+	}
+
+	// Loads one column for the selected rows; the field switch is outside the row loop.
+	void gather(BitcoinAddressHashMap &table,Field f,const uint32_t *selection,uint32_t count,uint64_t *values) const
+	{
+		switch ( f )
+		{
+			case QF_BALANCE:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->getBalance();
+				break;
+			case QF_RECEIVED:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mTotalReceived;
+				break;
+			case QF_SENT:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mTotalSent;
+				break;
+			case QF_TRANSACTION_COUNT:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mTransactionCount;
+				break;
+			case QF_INPUT_COUNT:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mInputCount;
+				break;
+			case QF_OUTPUT_COUNT:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mOutputCount;
+				break;
+			case QF_FIRST_USED:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mFirstOutputTime;
+				break;
+			case QF_LAST_USED:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->getLastUsedTime();
+				break;
+			case QF_AGE:
+				for (uint32_t i=0; i<count; i++)
+				{
+					uint32_t lastUsed = table.getKey(selection[i])->getLastUsedTime();
+					values[i] = (lastUsed && mReferenceTime > lastUsed) ? (mReferenceTime-lastUsed)/86400 : 0;
+				}
+				break;
+			case QF_FLAGS:
+				for (uint32_t i=0; i<count; i++) values[i] = table.getKey(selection[i])->mBitcoinAddressFlags;
+				break;
+			default:
+				break;
+		}
+	}
+
+	// Compacts the selection down to the rows which pass; the op switch is outside the row loop.
+	static uint32_t filter(const Predicate &p,uint32_t *selection,const uint64_t *values,uint32_t count)
+	{
+		uint32_t out = 0;
+		uint64_t v = p.mValue;
+		switch ( p.mOp )
+		{
+			case QO_LESS:			for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= values[i] < v; } break;
+			case QO_LESS_EQUAL:		for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= values[i] <= v; } break;
+			case QO_GREATER:		for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= values[i] > v; } break;
+			case QO_GREATER_EQUAL:	for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= values[i] >= v; } break;
+			case QO_EQUAL:			for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= values[i] == v; } break;
+			case QO_NOT_EQUAL:		for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= values[i] != v; } break;
+			case QO_ALL_BITS:		for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= (values[i] & v) == v; } break;
+			case QO_NO_BITS:		for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= (values[i] & v) == 0; } break;
+			case QO_ANY_BITS:		for (uint32_t i=0; i<count; i++) { selection[out] = selection[i]; out+= (values[i] & v) != 0; } break;
+		}
+		return out;
+	}
+
+	Predicate	mPredicates[QUERY_MAX_PREDICATES];
+	uint32_t	mPredicateCount;
+	Field		mSortField;
+	bool		mSortAscending;
+	bool		mExplain;
+	uint32_t	mLimit;
+	uint32_t	mReferenceTime;		// Time 'age' is measured from
+	char		mAddress[64];		// address= term; answered with a hash lookup instead of a scan
+};
+
+enum AgeMarker
+{
+	AM_ONE_DAY,
+	AM_ONE_WEEK,
+	AM_ONE_MONTH,
+	AM_THREE_MONTHS,
+	AM_SIX_MONTHS,
+	AM_ONE_YEAR,
+	AM_TWO_YEARS,
+	AM_THREE_YEARS,
+	AM_FOUR_YEARS,
+	AM_FIVE_YEARS,
+	AM_LAST
+};
+
+const char * getAgeString(AgeMarker m)
 {
 	const char *ret = "UNKNOWN";
 	switch ( m )
@@ -2886,142 +5249,2517 @@ private:
 				itself*/
 				root = swapIdx;
 			}
-			else
+			else
+			{
+				break;
+			}
+		}
+		return;
+	}
+
+	void heapify(void **arr, int32_t low, int32_t high)
+	{
+		/*Start with middle element. Middle element is chosen in
+		such a way that the last element of array is either its
+		left child or right child*/
+		int32_t midIdx = (high - low -1)/2;
+		while (midIdx >= 0)
+		{
+			shiftRight(arr, midIdx, high);
+			--midIdx;
+		}
+		return;
+	}
+
+
+};
+
+
+
+class SortByBalance : public HeapSortPointers
+{
+public:
+	SortByBalance(BitcoinAddress **addresses,uint32_t count)
+	{
+		HeapSortPointers::heapSort((void **)addresses,(int32_t)count);
+	}
+
+	// -1 less, 0 equal, +1 greater.
+	virtual int32_t compare(void *p1,void *p2)
+	{
+		BitcoinAddress *a1 = (BitcoinAddress *)p1;
+		BitcoinAddress *a2 = (BitcoinAddress *)p2;
+		uint64_t balance1 = a1->mTotalReceived-a1->mTotalSent;
+		uint64_t balance2 = a2->mTotalReceived-a2->mTotalSent;
+		if ( balance1 == balance2 ) return 0;
+		return balance1 > balance2 ? -1 : 1;
+	}
+};
+
+class SortByAge : public HeapSortPointers
+{
+public:
+	SortByAge(BitcoinAddress **addresses,uint32_t count)
+	{
+		HeapSortPointers::heapSort((void **)addresses,(int32_t)count);
+	}
+
+	// -1 less, 0 equal, +1 greater.
+	virtual int32_t compare(void *p1,void *p2)
+	{
+		BitcoinAddress *a1 = (BitcoinAddress *)p1;
+		BitcoinAddress *a2 = (BitcoinAddress *)p2;
+		uint32_t age1 = a1->getDaysSinceLastUsed(0);
+		uint32_t age2 = a2->getDaysSinceLastUsed(0);
+		if ( age1 == age2 ) return 0;
+		return age1 > age2 ? -1 : 1;
+	}
+
+};
+
+static void logSignatureFormat(uint32_t ret,FILE *fph)
+{
+	if ( ret & BlockChain::SF_ABNORMAL ) fprintf(fph,"SF_ABNORMAL ");
+	if ( ret & BlockChain::SF_COINBASE ) fprintf(fph,"SF_COINBASE ");
+	if ( ret & BlockChain::SF_DER_ONLY ) fprintf(fph,"SF_DER_ONLY ");
+	if ( ret & BlockChain::SF_SIGHASH_ZERO ) fprintf(fph,"SF_SIGHASH_ZERO ");
+	if ( ret & BlockChain::SF_SIGHASH_ALL ) fprintf(fph,"SF_SIGHASH_ALL ");
+	if ( ret & BlockChain::SF_SIGHASH_NONE ) fprintf(fph,"SF_SIGHASH_NONE ");
+	if ( ret & BlockChain::SF_WEIRD_90_00 ) fprintf(fph,"SF_WEIRD_90_00 ");
+	if ( ret & BlockChain::SF_NORMAL_SIGNATURE_PUSH41 ) fprintf(fph,"SF_NORMAL_SIGNATURE_PUSH41 ");
+	if ( ret & BlockChain::SF_NORMAL_SIGNATURE_PUSH21 ) fprintf(fph,"SF_NORMAL_SIGNATURE_PUSH21 ");
+	if ( ret & BlockChain::SF_SIGNATURE_LEADING_ZERO ) fprintf(fph,"SF_SIGNATURE_LEADING_ZERO ");
+	if ( ret & BlockChain::SF_SIGNATURE_LEADING_STRANGE ) fprintf(fph,"SF_SIGNATURE_LEADING_STRANGE ");
+	if ( ret & BlockChain::SF_SIGNATURE_21 ) fprintf(fph,"SF_SIGNATURE_21 ");
+	if ( ret & BlockChain::SF_SIGNATURE_41 ) fprintf(fph,"SF_SIGNATURE_41 ");
+	if ( ret & BlockChain::SF_PUSHDATA1 ) fprintf(fph,"SF_PUSHDATA1 ");
+	if ( ret & BlockChain::SF_PUSHDATA0 ) fprintf(fph,"SF_PUSHDATA0 ");
+	if ( ret & BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH ) fprintf(fph,"SF_UNUSUAL_SIGNATURE_LENGTH ");
+	if ( ret & BlockChain::SF_EXTRA_STUFF ) fprintf(fph,"SF_EXTRA_STUFF ");
+	if ( ret & BlockChain::SF_SIGHASH_PAY_ANY_ALL ) fprintf(fph,"SF_SIGHASH_PAY_ANY_ALL ");
+	if ( ret & BlockChain::SF_SIGHASH_PAY_ANY_SINGLE ) fprintf(fph,"SF_SIGHASH_PAY_ANY_SINGLE ");
+	if ( ret & BlockChain::SF_SIGHASH_SINGLE ) fprintf(fph,"SF_SIGHASH_SINGLE ");
+	if ( ret & BlockChain::SF_SIGHASH_PAY_ANY_NONE ) fprintf(fph,"SF_SIGHASH_PAY_ANY_NONE ");
+	if ( ret & BlockChain::SF_TRANSACTION_MALLEABILITY ) fprintf(fph,"**** SF_TRANSACTION_MALLEABILITY **** ");
+	if ( ret & BlockChain::SF_PUSHDATA2 ) fprintf(fph,"SF_PUSHDATA2 ");
+	if ( ret & BlockChain::SF_ASCII ) fprintf(fph,"SF_ASCII ");
+
+	if ( ret & BlockChain::SF_DER_X_1E ) fprintf(fph,"SF_DER_X_1E ");
+	if ( ret & BlockChain::SF_DER_X_1F ) fprintf(fph,"SF_DER_X_1F ");
+	if ( ret & BlockChain::SF_DER_X_20 ) fprintf(fph,"SF_DER_X_20 ");
+	if ( ret & BlockChain::SF_DER_X_21 ) fprintf(fph,"SF_DER_X_21 ");
+
+	if ( ret & BlockChain::SF_DER_Y_1E ) fprintf(fph,"SF_DER_Y_1E ");
+	if ( ret & BlockChain::SF_DER_Y_1F ) fprintf(fph,"SF_DER_Y_1F ");
+	if ( ret & BlockChain::SF_DER_Y_20 ) fprintf(fph,"SF_DER_Y_20 ");
+	if ( ret & BlockChain::SF_DER_Y_21 ) fprintf(fph,"SF_DER_Y_21 ");
+}
+
+class ZombieFinder
+{
+public:
+	ZombieFinder(void)
+	{
+		mLastBalance = NULL;
+		mLastAge = 0;
+		mLastDate = 0;
+		mAddress = NULL;
+	}
+	uint64_t		mLastBalance;
+	uint32_t		mLastDate;
+	uint32_t		mLastAge;
+	BitcoinAddress	*mAddress;
+};
+
+// The undo journal keeps enough information about the most recently processed blocks to disconnect them again without replaying
+// the block-chain.  For each block it records where the transaction, input, output and address pools stood before the block was
+// applied, plus one entry per balance change: which address, how much, which output was spent and the address times it overwrote.
+// Both the block records and the entries are ring buffers; once a ring wraps, the oldest blocks can no longer be undone.
+
+#if SMALL_MEMORY_PROFILE
+#define MAX_UNDO_ENTRIES (1024*1024)
+#else
+#define MAX_UNDO_ENTRIES (1024*1024*4)
+#endif
+#define MAX_UNDO_BLOCKS 288	// Two days worth of blocks; far deeper than any reorganization seen on the main network
+
+class UndoEntry
+{
+public:
+	uint32_t	mAddress;			// The address index whose balance changed
+	uint32_t	mOutput;			// The output which was spent, or 0xFFFFFFFF if this entry records a receive
+	uint64_t	mValue;				// The value received or sent
+	uint32_t	mPreviousTime;		// The address mLastOutputTime (receive) or mLastInputTime (spend) before this change
+	uint32_t	mPreviousFirstTime;	// The address mFirstOutputTime before this change
+};
+
+class BlockUndo
+{
+public:
+	uint32_t	mBlock;				// The block index this record undoes
+	uint32_t	mTransactionBase;	// Pool counts before the block was applied
+	uint32_t	mInputBase;
+	uint32_t	mOutputBase;
+	uint32_t	mAddressBase;
+	uint64_t	mEntryBegin;		// Sequence number of the first journal entry for this block
+	uint64_t	mEntryEnd;			// One past the sequence number of the last journal entry
+};
+
+class BlockUndoJournal
+{
+public:
+	BlockUndoJournal(void)
+	{
+		mEntries = NULL;
+		mBlockBegin = 0;
+		mBlockCount = 0;
+		mEntryWrite = 0;
+	}
+
+	~BlockUndoJournal(void)
+	{
+		delete []mEntries;
+	}
+
+	BlockUndo & beginBlock(void)
+	{
+		if ( mEntries == NULL )
+		{
+			mEntries = new UndoEntry[MAX_UNDO_ENTRIES];
+		}
+		if ( mBlockCount == MAX_UNDO_BLOCKS )
+		{
+			dropOldest();
+		}
+		BlockUndo &b = mBlocks[(mBlockBegin+mBlockCount)%MAX_UNDO_BLOCKS];
+		mBlockCount++;
+		b.mEntryBegin = mEntryWrite;
+		b.mEntryEnd = mEntryWrite;
+		return b;
+	}
+
+	inline UndoEntry & addEntry(void)
+	{
+		UndoEntry &e = mEntries[mEntryWrite%MAX_UNDO_ENTRIES];
+		mEntryWrite++;
+		// If the ring just wrapped onto the oldest block record, that block can no longer be undone.
+		while ( mBlockCount && (mEntryWrite-mBlocks[mBlockBegin].mEntryBegin) > MAX_UNDO_ENTRIES )
+		{
+			dropOldest();
+		}
+		assert( mBlockCount );
+		mBlocks[(mBlockBegin+mBlockCount-1)%MAX_UNDO_BLOCKS].mEntryEnd = mEntryWrite;
+		return e;
+	}
+
+	// Returns the most recent block record, or NULL if there is nothing left to undo.
+	BlockUndo * getLast(void)
+	{
+		return mBlockCount ? &mBlocks[(mBlockBegin+mBlockCount-1)%MAX_UNDO_BLOCKS] : NULL;
+	}
+
+	inline UndoEntry & getEntry(uint64_t sequence)
+	{
+		return mEntries[sequence%MAX_UNDO_ENTRIES];
+	}
+
+	// Forgets the most recent block record once it has been undone; its entries are reused by the next block.
+	void popLast(void)
+	{
+		assert( mBlockCount );
+		if ( mBlockCount )
+		{
+			mBlockCount--;
+			mEntryWrite = mBlocks[(mBlockBegin+mBlockCount)%MAX_UNDO_BLOCKS].mEntryBegin;
+		}
+	}
+
+	uint32_t getDepth(void) const
+	{
+		return mBlockCount;
+	}
+
+	void reportMemory(MemoryReport &report) const
+	{
+		uint64_t live = mBlockCount ? mEntryWrite-mBlocks[mBlockBegin].mEntryBegin : 0;
+		uint64_t written = mEntryWrite < MAX_UNDO_ENTRIES ? mEntryWrite : MAX_UNDO_ENTRIES;
+		report.add("undo journal entries",mEntries,sizeof(UndoEntry),mEntries ? MAX_UNDO_ENTRIES : 0,live,written);
+	}
+
+private:
+	void dropOldest(void)
+	{
+		mBlockBegin = (mBlockBegin+1)%MAX_UNDO_BLOCKS;
+		mBlockCount--;
+	}
+
+	UndoEntry	*mEntries;
+	uint64_t	mEntryWrite;
+	uint32_t	mBlockBegin;
+	uint32_t	mBlockCount;
+	BlockUndo	mBlocks[MAX_UNDO_BLOCKS];
+};
+
+// What the most recently applied blocks added to the chain wide statistics, the output script type totals and the signature
+// formats, so disconnecting a block takes them back off.  Kept for as many blocks as the undo journal can hold; the records
+// are a ring whose signature lists are reused, so applying a block allocates nothing once the ring has gone round.
+class BlockStatJournal
+{
+public:
+	BlockStatJournal(void)
+	{
+		mBlockBegin = 0;
+		mBlockCount = 0;
+	}
+
+	void push(uint32_t block,const uint32_t *scriptTypeCounts,const SignatureStatTable *signatureStats)
+	{
+		if ( mBlockCount == MAX_UNDO_BLOCKS )
+		{
+			mBlockBegin = (mBlockBegin+1)%MAX_UNDO_BLOCKS;
+			mBlockCount--;
+		}
+		Record &r = mRecords[(mBlockBegin+mBlockCount)%MAX_UNDO_BLOCKS];
+		mBlockCount++;
+		r.mBlock = block;
+		memcpy(r.mScriptTypeCounts,scriptTypeCounts,sizeof(r.mScriptTypeCounts));
+		r.mSignatureStats.clear();
+		r.mDroppedCount = 0;
+		if ( signatureStats )
+		{
+			for (uint32_t i=0; i<signatureStats->size(); i++)
+			{
+				r.mSignatureStats.push_back(signatureStats->get(i));
+			}
+			r.mDroppedCount = signatureStats->getDroppedCount();
+		}
+	}
+
+	// Takes the newest block's contribution back off the totals.  Returns false if there is no record of this block.
+	bool pop(uint32_t block,uint64_t *scriptTypeTotals,SignatureStatTable &signatureStats)
+	{
+		if ( mBlockCount == 0 || mRecords[(mBlockBegin+mBlockCount-1)%MAX_UNDO_BLOCKS].mBlock != block )
+		{
+			return false;
+		}
+		mBlockCount--;
+		const Record &r = mRecords[(mBlockBegin+mBlockCount)%MAX_UNDO_BLOCKS];
+		for (uint32_t i=0; i<BlockChain::ST_COUNT; i++)
+		{
+			scriptTypeTotals[i]-=r.mScriptTypeCounts[i];
+		}
+		if ( !r.mSignatureStats.empty() || r.mDroppedCount )
+		{
+			signatureStats.unmerge(r.mSignatureStats.empty() ? NULL : &r.mSignatureStats[0],(uint32_t)r.mSignatureStats.size(),r.mDroppedCount);
+		}
+		return true;
+	}
+
+private:
+	class Record
+	{
+	public:
+		uint32_t						mBlock;
+		uint32_t						mScriptTypeCounts[BlockChain::ST_COUNT];
+		std::vector< SignatureStat >	mSignatureStats;	// Empty if signatures were not analyzed
+		uint64_t						mDroppedCount;
+	};
+
+	uint32_t	mBlockBegin;
+	uint32_t	mBlockCount;
+	Record		mRecords[MAX_UNDO_BLOCKS];
+};
+
+// The address history index answers 'what was the balance of this address at the end of block N' without replaying the
+// block-chain.  For each address it holds one point (block, balance) per block in which the balance changed.  The points of a
+// block are appended as soon as the block has been processed and taken back off when it is disconnected, so the index is
+// always current.  Each group of points has an uncompressed header (first block and balance) followed by up to
+// HISTORY_GROUP_BYTES of delta encoded varints (block delta, zig-zag balance delta) for the points after the first.  The
+// groups of an address are contiguous, so a query binary searches the headers and then decodes at most one group.
+//
+// The groups of an address are a range of one shared array; when the range is full it moves to the end of the array with
+// twice the room, so an address is copied a bounded number of times however many points it gets.  Delta bytes are only
+// allocated once a group gets its second point, so the many addresses used just once cost a single header.  Space given up
+// by a moved range, or by points a disconnect took back off, is not reused; reorganizations are shallow.
+
+#define HISTORY_GROUP_BYTES 64
+#define HISTORY_NO_BYTES 0xFFFFFFFFFFFFFFFFULL
+
+class AddressHistoryGroup
+{
+public:
+	uint64_t	mFirstBalance;	// Balance at the end of mFirstBlock
+	uint64_t	mByteOffset;	// Where the delta encoded points after the first start; HISTORY_NO_BYTES until there are any
+	uint32_t	mFirstBlock;	// Block of the first point in this group
+	uint16_t	mPointCount;	// Number of points in this group
+	uint16_t	mByteCount;		// Bytes of delta encoded points written
+};
+
+class AddressHistory
+{
+public:
+	uint32_t	mGroupBegin;	// First group of this address in the shared group array
+	uint32_t	mGroupCount;
+	uint32_t	mGroupCapacity;	// Groups reserved for this address starting at mGroupBegin
+	uint32_t	mLastBlock;		// Block of the newest point, if mGroupCount is not zero
+};
+
+class AddressHistoryIndex
+{
+public:
+	AddressHistoryIndex(void)
+	{
+		mHistory = NULL;
+		mGroups = NULL;
+		mBytes = NULL;
+		mAddressCount = 0;
+		mAddressCapacity = 0;
+		mGroupCount = 0;
+		mGroupCapacity = 0;
+		mByteCount = 0;
+		mByteCapacity = 0;
+		mPointCount = 0;
+	}
+
+	~AddressHistoryIndex(void)
+	{
+		delete []mHistory;
+		delete []mGroups;
+		delete []mBytes;
+	}
+
+	// Gives every address index below 'count' a history, empty for new addresses.  A smaller count forgets the histories of
+	// the addresses a disconnect removed from the address table; their points must have been removed first.
+	void resize(uint32_t count)
+	{
+		if ( count > mAddressCapacity )
+		{
+			uint32_t capacity = mAddressCapacity ? mAddressCapacity : 65536;
+			while ( capacity < count )
+			{
+				capacity = capacity < MAX_BITCOIN_ADDRESSES/2 ? capacity*2 : MAX_BITCOIN_ADDRESSES;
+			}
+			AddressHistory *history = new AddressHistory[capacity];
+			if ( mAddressCount )
+			{
+				memcpy(history,mHistory,sizeof(AddressHistory)*mAddressCount);
+			}
+			delete []mHistory;
+			mHistory = history;
+			mAddressCapacity = capacity;
+		}
+		for (uint32_t i=mAddressCount; i<count; i++)
+		{
+			AddressHistory &h = mHistory[i];
+			h.mGroupBegin = 0;
+			h.mGroupCount = 0;
+			h.mGroupCapacity = 0;
+			h.mLastBlock = 0;
+		}
+		mAddressCount = count;
+	}
+
+	// Records the balance of address id 'adr' (address index + 1) at the end of this block.  Blocks must be appended in order
+	// and only once the whole block has been applied; an address touched several times in a block gets its point on the
+	// first call and later calls for the same block are ignored.
+	void append(uint32_t adr,uint32_t block,uint64_t balance)
+	{
+		if ( adr == 0 || adr > mAddressCount ) return;
+		AddressHistory &h = mHistory[adr-1];
+		if ( h.mGroupCount )
+		{
+			if ( h.mLastBlock >= block ) return;
+			AddressHistoryGroup &g = mGroups[h.mGroupBegin+h.mGroupCount-1];
+			uint32_t lastBlock;
+			uint64_t lastBalance;
+			decodeLast(g,lastBlock,lastBalance);
+			uint64_t blockDelta = block - lastBlock;
+			uint64_t balanceDelta = zigzag((int64_t)(balance - lastBalance));
+			uint32_t size = getVarintSize(blockDelta)+getVarintSize(balanceDelta);
+			if ( g.mByteCount+size <= HISTORY_GROUP_BYTES )
+			{
+				if ( g.mByteOffset == HISTORY_NO_BYTES )
+				{
+					g.mByteOffset = allocateBytes();
+				}
+				uint8_t *dest = &mBytes[g.mByteOffset+g.mByteCount];
+				dest = writeVarint(dest,blockDelta);
+				writeVarint(dest,balanceDelta);
+				g.mByteCount = (uint16_t)(g.mByteCount+size);
+				g.mPointCount++;
+				h.mLastBlock = block;
+				mPointCount++;
+				return;
+			}
+		}
+		AddressHistoryGroup &g = addGroup(h);
+		g.mFirstBalance = balance;
+		g.mByteOffset = HISTORY_NO_BYTES;
+		g.mFirstBlock = block;
+		g.mPointCount = 1;
+		g.mByteCount = 0;
+		h.mLastBlock = block;
+		mPointCount++;
+	}
+
+	// Takes the point for this block off the history of address id 'adr', if it has one.  The block must be the newest one
+	// appended; calling this more than once for an address in the same block is harmless.
+	void remove(uint32_t adr,uint32_t block)
+	{
+		if ( adr == 0 || adr > mAddressCount ) return;
+		AddressHistory &h = mHistory[adr-1];
+		if ( h.mGroupCount == 0 || h.mLastBlock != block ) return;
+		AddressHistoryGroup &g = mGroups[h.mGroupBegin+h.mGroupCount-1];
+		uint64_t balance;
+		if ( g.mPointCount == 1 )
+		{
+			h.mGroupCount--;
+			if ( h.mGroupCount )
+			{
+				decodeLast(mGroups[h.mGroupBegin+h.mGroupCount-1],h.mLastBlock,balance);
+			}
+		}
+		else
+		{
+			g.mPointCount--;
+			g.mByteCount = (uint16_t)decodeLast(g,h.mLastBlock,balance);
+		}
+		mPointCount--;
+	}
+
+	// 'adr' is an address id (address index + 1) as stored in TransactionOutput.  Returns false if the address had no
+	// activity at or before this block, in which case the balance is zero.
+	bool getBalanceAtBlock(uint32_t adr,uint32_t block,uint64_t &balance) const
+	{
+		balance = 0;
+		if ( adr == 0 || adr > mAddressCount ) return false;
+
+		const AddressHistory &h = mHistory[adr-1];
+		uint32_t lo = h.mGroupBegin;
+		uint32_t hi = h.mGroupBegin+h.mGroupCount;
+		if ( lo == hi || mGroups[lo].mFirstBlock > block ) return false;
+
+		// find the last group which starts at or before this block
+		while ( (hi-lo) > 1 )
+		{
+			uint32_t mid = (lo+hi)/2;
+			if ( mGroups[mid].mFirstBlock <= block )
+			{
+				lo = mid;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+
+		const AddressHistoryGroup &g = mGroups[lo];
+		uint32_t b = g.mFirstBlock;
+		balance = g.mFirstBalance;
+		const uint8_t *scan = g.mPointCount > 1 ? &mBytes[g.mByteOffset] : NULL;
+		for (uint32_t i=1; i<g.mPointCount; i++)
+		{
+			uint64_t blockDelta = readVarint(scan);
+			uint64_t balanceDelta = readVarint(scan);
+			b+=(uint32_t)blockDelta;
+			if ( b > block )
+			{
+				break;
+			}
+			balance+=(uint64_t)unzigzag(balanceDelta);
+		}
+		return true;
+	}
+
+	uint64_t getPointCount(void) const
+	{
+		return mPointCount;
+	}
+
+	void reportMemory(MemoryReport &report) const
+	{
+		report.add("address history",mHistory,sizeof(AddressHistory),mAddressCapacity,mAddressCount,mAddressCount);
+		report.add("address history groups",mGroups,sizeof(AddressHistoryGroup),mGroupCapacity,mGroupCount,mGroupCount);
+		report.add("address history bytes",mBytes,1,mByteCapacity,mByteCount,mByteCount);
+	}
+
+private:
+	// Appends a group to the history, moving the address' range to the end of the group array if it is full.  Extends the
+	// range in place when it already is the last one.
+	AddressHistoryGroup & addGroup(AddressHistory &h)
+	{
+		if ( h.mGroupCount == h.mGroupCapacity )
+		{
+			if ( h.mGroupCapacity && h.mGroupBegin+h.mGroupCapacity == mGroupCount )
+			{
+				reserveGroups(h.mGroupCapacity);
+				mGroupCount+=h.mGroupCapacity;
+				h.mGroupCapacity*=2;
+			}
+			else
+			{
+				uint32_t capacity = h.mGroupCapacity ? h.mGroupCapacity*2 : 1;
+				reserveGroups(capacity);
+				if ( h.mGroupCount )
+				{
+					memcpy(&mGroups[mGroupCount],&mGroups[h.mGroupBegin],sizeof(AddressHistoryGroup)*h.mGroupCount);
+				}
+				h.mGroupBegin = mGroupCount;
+				h.mGroupCapacity = capacity;
+				mGroupCount+=capacity;
+			}
+		}
+		AddressHistoryGroup &ret = mGroups[h.mGroupBegin+h.mGroupCount];
+		h.mGroupCount++;
+		return ret;
+	}
+
+	// Makes room for 'count' more groups at the end of the group array; doubles so appending stays amortized constant time.
+	void reserveGroups(uint32_t count)
+	{
+		assert( (uint64_t)mGroupCount+count <= 0xFFFFFFFF );
+		if ( mGroupCount+count > mGroupCapacity )
+		{
+			uint32_t capacity = mGroupCapacity ? mGroupCapacity : 1024*1024;
+			while ( capacity < mGroupCount+count )
+			{
+				capacity = capacity < 0x80000000 ? capacity*2 : 0xFFFFFFFF;
+			}
+			AddressHistoryGroup *groups = new AddressHistoryGroup[capacity];
+			if ( mGroupCount )
+			{
+				memcpy(groups,mGroups,sizeof(AddressHistoryGroup)*mGroupCount);
+			}
+			delete []mGroups;
+			mGroups = groups;
+			mGroupCapacity = capacity;
+		}
+	}
+
+	// Returns the offset of HISTORY_GROUP_BYTES fresh bytes for a group's delta encoded points.
+	uint64_t allocateBytes(void)
+	{
+		if ( mByteCount+HISTORY_GROUP_BYTES > mByteCapacity )
+		{
+			uint64_t capacity = mByteCapacity ? mByteCapacity*2 : 16*1024*1024;
+			uint8_t *bytes = new uint8_t[capacity];
+			if ( mByteCount )
+			{
+				memcpy(bytes,mBytes,mByteCount);
+			}
+			delete []mBytes;
+			mBytes = bytes;
+			mByteCapacity = capacity;
+		}
+		uint64_t ret = mByteCount;
+		mByteCount+=HISTORY_GROUP_BYTES;
+		return ret;
+	}
+
+	// Decodes the mPointCount points of the group; returns the block and balance of the last one, and how many delta
+	// encoded bytes the points take.
+	uint32_t decodeLast(const AddressHistoryGroup &g,uint32_t &block,uint64_t &balance) const
+	{
+		block = g.mFirstBlock;
+		balance = g.mFirstBalance;
+		uint32_t ret = 0;
+		if ( g.mPointCount > 1 )
+		{
+			const uint8_t *begin = &mBytes[g.mByteOffset];
+			const uint8_t *scan = begin;
+			for (uint32_t i=1; i<g.mPointCount; i++)
+			{
+				block+=(uint32_t)readVarint(scan);
+				balance+=(uint64_t)unzigzag(readVarint(scan));
+			}
+			ret = (uint32_t)(scan-begin);
+		}
+		return ret;
+	}
+
+	static inline uint64_t zigzag(int64_t v)
+	{
+		return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	}
+
+	static inline int64_t unzigzag(uint64_t v)
+	{
+		return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+	}
+
+	static inline uint32_t getVarintSize(uint64_t v)
+	{
+		uint32_t ret = 1;
+		while ( v >= 0x80 )
+		{
+			v>>=7;
+			ret++;
+		}
+		return ret;
+	}
+
+	static inline uint8_t * writeVarint(uint8_t *dest,uint64_t v)
+	{
+		while ( v >= 0x80 )
+		{
+			*dest++ = (uint8_t)(v | 0x80);
+			v>>=7;
+		}
+		*dest++ = (uint8_t)v;
+		return dest;
+	}
+
+	static inline uint64_t readVarint(const uint8_t *&scan)
+	{
+		uint64_t ret = 0;
+		uint32_t shift = 0;
+		for (;;)
+		{
+			uint8_t c = *scan++;
+			ret|=(uint64_t)(c & 0x7F) << shift;
+			if ( (c & 0x80) == 0 ) break;
+			shift+=7;
+		}
+		return ret;
+	}
+
+	AddressHistory		*mHistory;			// One entry per address index
+	AddressHistoryGroup	*mGroups;			// The groups of every address; each address owns a range
+	uint8_t				*mBytes;			// Delta encoded points, HISTORY_GROUP_BYTES per group with more than one point
+	uint32_t			mAddressCount;
+	uint32_t			mAddressCapacity;
+	uint32_t			mGroupCount;
+	uint32_t			mGroupCapacity;
+	uint64_t			mByteCount;
+	uint64_t			mByteCapacity;
+	uint64_t			mPointCount;
+};
+
+// Runs func(begin,end) over [0,count) split into one contiguous range per thread.
+template < class F > static void parallelFor(uint32_t count,uint32_t threadCount,F func)
+{
+	if ( threadCount < 2 || count < 65536 )
+	{
+		func(0,count);
+		return;
+	}
+	std::vector< std::thread > threads;
+	uint32_t stride = (count+threadCount-1)/threadCount;
+	for (uint32_t i=0; i<threadCount; i++)
+	{
+		uint32_t begin = i*stride;
+		uint32_t end = begin+stride < count ? begin+stride : count;
+		if ( begin >= end ) break;
+		threads.push_back(std::thread(func,begin,end));
+	}
+	for (size_t i=0; i<threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+// Turns values[0..count) into their exclusive prefix sum, values[count] receives the total.  Each thread sums its range,
+// the range totals are scanned serially and each thread then writes its offsets.
+static uint64_t parallelPrefixSum(uint64_t *values,uint32_t count,uint32_t threadCount)
+{
+	if ( count == 0 ) // no addresses yet; there is no range to divide up
+	{
+		values[0] = 0;
+		return 0;
+	}
+	if ( threadCount < 2 || count < 65536 )
+	{
+		threadCount = 1;
+	}
+	uint32_t stride = (count+threadCount-1)/threadCount;
+	std::vector< uint64_t > totals(threadCount+1,0);
+	parallelFor(count,threadCount,[&](uint32_t begin,uint32_t end)
+	{
+		uint64_t sum = 0;
+		for (uint32_t i=begin; i<end; i++)
+		{
+			sum+=values[i];
+		}
+		totals[begin/stride+1] = sum;
+	});
+	for (uint32_t i=1; i<=threadCount; i++)
+	{
+		totals[i]+=totals[i-1];
+	}
+	parallelFor(count,threadCount,[&](uint32_t begin,uint32_t end)
+	{
+		uint64_t sum = totals[begin/stride];
+		for (uint32_t i=begin; i<end; i++)
+		{
+			uint64_t v = values[i];
+			values[i] = sum;
+			sum+=v;
+		}
+	});
+	values[count] = totals[threadCount];
+	return totals[threadCount];
+}
+
+// Walks the transaction list of one address; transaction indices are stored ascending as varint deltas.
+class AddressTransactionIterator
+{
+public:
+	AddressTransactionIterator(const uint8_t *scan,uint32_t count)
+	{
+		mScan = scan;
+		mRemaining = count;
+		mLast = 0;
+	}
+
+	inline bool next(uint32_t &transaction)
+	{
+		if ( mRemaining == 0 ) return false;
+		uint32_t v = 0;
+		uint32_t shift = 0;
+		for (;;)
+		{
+			uint8_t c = *mScan++;
+			v|=(uint32_t)(c & 0x7F) << shift;
+			if ( (c & 0x80) == 0 ) break;
+			shift+=7;
+		}
+		mLast+=v;
+		transaction = mLast;
+		mRemaining--;
+		return true;
+	}
+
+private:
+	const uint8_t	*mScan;
+	uint32_t		mRemaining;
+	uint32_t		mLast;
+};
+
+// Transactions appended to an address transaction index after it was built, so readers never have to scan for them.  Each
+// address has a newest-first list of postings threaded through one append-only pool.  The writer fills a posting in before
+// it links it at the head of its address with a release store, so readers may walk the lists while the writer appends; they
+// skip postings newer than the state they are reading.  Heads and postings live in chunks which are allocated on demand
+// and never move.
+// Transactions processed since the address transaction index was built are appended to its tail; past this many the
+// index is rebuilt instead.
+#define MAX_UNINDEXED_TRANSACTIONS (1024*1024)
+#define TAIL_CHUNK_SIZE 65536
+#define MAX_TAIL_POSTINGS (MAX_UNINDEXED_TRANSACTIONS*8)
+#define TAIL_NONE 0xFFFFFFFF
+
+class AddressTransactionTail
+{
+public:
+	AddressTransactionTail(void)
+	{
+		mPostingCount = 0;
+		for (uint32_t i=0; i<HEAD_CHUNKS; i++)
+		{
+			mHeads[i].store(NULL,std::memory_order_relaxed);
+		}
+		for (uint32_t i=0; i<POSTING_CHUNKS; i++)
+		{
+			mPostings[i].store(NULL,std::memory_order_relaxed);
+		}
+	}
+
+	~AddressTransactionTail(void)
+	{
+		for (uint32_t i=0; i<HEAD_CHUNKS; i++)
+		{
+			delete []mHeads[i].load(std::memory_order_relaxed);
+		}
+		for (uint32_t i=0; i<POSTING_CHUNKS; i++)
+		{
+			delete []mPostings[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	// Lists this transaction under address index 'index'; the transaction must not precede any appended before.  Returns
+	// false if the pool is full.
+	bool append(uint32_t index,uint32_t transaction)
+	{
+		assert( index < MAX_BITCOIN_ADDRESSES );
+		std::atomic< uint32_t > *heads = mHeads[index/TAIL_CHUNK_SIZE].load(std::memory_order_relaxed);
+		if ( heads == NULL )
+		{
+			heads = new std::atomic< uint32_t >[TAIL_CHUNK_SIZE];
+			for (uint32_t i=0; i<TAIL_CHUNK_SIZE; i++)
+			{
+				heads[i].store(TAIL_NONE,std::memory_order_relaxed);
+			}
+			mHeads[index/TAIL_CHUNK_SIZE].store(heads,std::memory_order_release);
+		}
+		uint32_t head = heads[index%TAIL_CHUNK_SIZE].load(std::memory_order_relaxed);
+		if ( head != TAIL_NONE && getPosting(head).mTransaction == transaction )
+		{
+			return true;
+		}
+		if ( mPostingCount == MAX_TAIL_POSTINGS )
+		{
+			return false;
+		}
+		Posting *chunk = mPostings[mPostingCount/TAIL_CHUNK_SIZE].load(std::memory_order_relaxed);
+		if ( chunk == NULL )
+		{
+			chunk = new Posting[TAIL_CHUNK_SIZE];
+			mPostings[mPostingCount/TAIL_CHUNK_SIZE].store(chunk,std::memory_order_release);
+		}
+		Posting &p = chunk[mPostingCount%TAIL_CHUNK_SIZE];
+		p.mTransaction = transaction;
+		p.mAddress = index;
+		p.mPrevious = head;
+		heads[index%TAIL_CHUNK_SIZE].store(mPostingCount,std::memory_order_release);
+		mPostingCount++;
+		return true;
+	}
+
+	// Unlinks every posting of a transaction at or after this index.  No reader may be walking the lists.
+	void truncate(uint32_t transactionCount)
+	{
+		while ( mPostingCount && getPosting(mPostingCount-1).mTransaction >= transactionCount )
+		{
+			const Posting &p = getPosting(mPostingCount-1);
+			mHeads[p.mAddress/TAIL_CHUNK_SIZE].load(std::memory_order_relaxed)[p.mAddress%TAIL_CHUNK_SIZE].store(p.mPrevious,std::memory_order_relaxed);
+			mPostingCount--;
+		}
+	}
+
+	// Appends to 'list', ascending, the transactions in [begin,end) address index 'index' appears in.  Safe while the writer
+	// appends.
+	void getTransactions(uint32_t index,uint32_t begin,uint32_t end,std::vector< uint32_t > &list) const
+	{
+		if ( index >= MAX_BITCOIN_ADDRESSES ) return;
+		const std::atomic< uint32_t > *heads = mHeads[index/TAIL_CHUNK_SIZE].load(std::memory_order_acquire);
+		if ( heads == NULL ) return;
+		size_t first = list.size();
+		for (uint32_t p=heads[index%TAIL_CHUNK_SIZE].load(std::memory_order_acquire); p != TAIL_NONE; )
+		{
+			const Posting &posting = getPosting(p);
+			if ( posting.mTransaction < begin )
+			{
+				break;
+			}
+			if ( posting.mTransaction < end )
+			{
+				list.push_back(posting.mTransaction);
+			}
+			p = posting.mPrevious;
+		}
+		std::reverse(list.begin()+first,list.end());
+	}
+
+	uint64_t getMemoryUsed(void) const
+	{
+		uint64_t ret = 0;
+		for (uint32_t i=0; i<HEAD_CHUNKS; i++)
+		{
+			ret+= mHeads[i].load(std::memory_order_relaxed) ? TAIL_CHUNK_SIZE*sizeof(uint32_t) : 0;
+		}
+		for (uint32_t i=0; i<POSTING_CHUNKS; i++)
+		{
+			ret+= mPostings[i].load(std::memory_order_relaxed) ? TAIL_CHUNK_SIZE*sizeof(Posting) : 0;
+		}
+		return ret;
+	}
+
+private:
+	enum
+	{
+		HEAD_CHUNKS = MAX_BITCOIN_ADDRESSES/TAIL_CHUNK_SIZE+1,
+		POSTING_CHUNKS = MAX_TAIL_POSTINGS/TAIL_CHUNK_SIZE
+	};
+
+	class Posting
+	{
+	public:
+		uint32_t	mTransaction;
+		uint32_t	mAddress;		// Address index this posting is listed under
+		uint32_t	mPrevious;		// Next older posting of the same address, or TAIL_NONE
+	};
+
+	inline const Posting &getPosting(uint32_t p) const
+	{
+		return mPostings[p/TAIL_CHUNK_SIZE].load(std::memory_order_acquire)[p%TAIL_CHUNK_SIZE];
+	}
+
+	std::atomic< std::atomic< uint32_t > * >	mHeads[HEAD_CHUNKS];		// Newest posting of each address index
+	std::atomic< Posting * >					mPostings[POSTING_CHUNKS];
+	uint32_t									mPostingCount;				// Writer only
+};
+
+// The list of transactions each address appears in, as a compressed sparse row table: the transactions of address index a are
+// encoded in mBytes[mByteBegin[a],mByteBegin[a+1]).  Built in parallel: an atomic histogram of distinct addresses per
+// transaction, a prefix sum, an atomic scatter of 32-bit transaction indices, a per-address sort, then the delta encoding.
+// Transactions processed after the build are appended to a tail (see AddressTransactionTail) until the next build.
+class AddressTransactionIndex
+{
+public:
+	AddressTransactionIndex(void)
+	{
+		mAddressCount = 0;
+		mCounts = NULL;
+		mByteBegin = NULL;
+		mBytes = NULL;
+		mEnd = 0;
+	}
+
+	~AddressTransactionIndex(void)
+	{
+		release();
+	}
+
+	void release(void)
+	{
+		delete []mCounts;
+		delete []mByteBegin;
+		delete []mBytes;
+		mCounts = NULL;
+		mByteBegin = NULL;
+		mBytes = NULL;
+		mAddressCount = 0;
+	}
+
+	void build(const Transaction *transactions,uint32_t transactionCount,uint32_t addressCount,uint32_t threadCount)
+	{
+		release();
+		mAddressCount = addressCount;
+		mCounts = new uint32_t[addressCount ? addressCount : 1];
+		mByteBegin = new uint64_t[addressCount+1];
+
+		std::atomic< uint32_t > *cursor = new std::atomic< uint32_t >[addressCount ? addressCount : 1];
+		parallelFor(addressCount,threadCount,[&](uint32_t begin,uint32_t end)
+		{
+			for (uint32_t i=begin; i<end; i++)
+			{
+				cursor[i].store(0,std::memory_order_relaxed);
+			}
+		});
+
+		// histogram
+		parallelFor(transactionCount,threadCount,[&](uint32_t begin,uint32_t end)
+		{
+			std::vector< uint32_t > addresses;
+			for (uint32_t i=begin; i<end; i++)
+			{
+				getAddresses(transactions[i],addresses);
+				for (size_t j=0; j<addresses.size(); j++)
+				{
+					cursor[addresses[j]-1].fetch_add(1,std::memory_order_relaxed);
+				}
+			}
+		});
+
+		uint64_t *rowBegin = new uint64_t[addressCount+1];
+		parallelFor(addressCount,threadCount,[&](uint32_t begin,uint32_t end)
+		{
+			for (uint32_t i=begin; i<end; i++)
+			{
+				mCounts[i] = cursor[i].load(std::memory_order_relaxed);
+				rowBegin[i] = mCounts[i];
+				cursor[i].store(0,std::memory_order_relaxed);
+			}
+		});
+		uint64_t total = parallelPrefixSum(rowBegin,addressCount,threadCount);
+
+		// scatter
+		uint32_t *rows = new uint32_t[total ? total : 1];
+		parallelFor(transactionCount,threadCount,[&](uint32_t begin,uint32_t end)
+		{
+			std::vector< uint32_t > addresses;
+			for (uint32_t i=begin; i<end; i++)
+			{
+				getAddresses(transactions[i],addresses);
+				for (size_t j=0; j<addresses.size(); j++)
+				{
+					uint32_t a = addresses[j]-1;
+					rows[ rowBegin[a] + cursor[a].fetch_add(1,std::memory_order_relaxed) ] = i;
+				}
+			}
+		});
+		delete []cursor;
+
+		// sort each row and measure its encoded size
+		parallelFor(addressCount,threadCount,[&](uint32_t begin,uint32_t end)
+		{
+			for (uint32_t a=begin; a<end; a++)
+			{
+				uint32_t *row = &rows[rowBegin[a]];
+				std::sort(row,row+mCounts[a]);
+				uint64_t bytes = 0;
+				uint32_t last = 0;
+				for (uint32_t j=0; j<mCounts[a]; j++)
+				{
+					bytes+=getVarintSize(row[j]-last);
+					last = row[j];
+				}
+				mByteBegin[a] = bytes;
+			}
+		});
+		uint64_t byteCount = parallelPrefixSum(mByteBegin,addressCount,threadCount);
+
+		mBytes = new uint8_t[byteCount ? byteCount : 1];
+		parallelFor(addressCount,threadCount,[&](uint32_t begin,uint32_t end)
+		{
+			for (uint32_t a=begin; a<end; a++)
+			{
+				const uint32_t *row = &rows[rowBegin[a]];
+				uint8_t *dest = &mBytes[mByteBegin[a]];
+				uint32_t last = 0;
+				for (uint32_t j=0; j<mCounts[a]; j++)
+				{
+					uint32_t v = row[j]-last;
+					last = row[j];
+					while ( v >= 0x80 )
+					{
+						*dest++ = (uint8_t)(v | 0x80);
+						v>>=7;
+					}
+					*dest++ = (uint8_t)v;
+				}
+			}
+		});
+		delete []rows;
+		delete []rowBegin;
+		mEnd = transactionCount;
+	}
+
+	// Adds the transaction following the ones already covered to the tail.  Returns false, adding nothing, if it does not
+	// follow on or the tail is full; the index then stops growing and must be rebuilt to cover more.
+	bool append(const Transaction &t,uint32_t transaction,std::vector< uint32_t > &addresses)
+	{
+		if ( transaction != mEnd ) return false;
+		getAddresses(t,addresses);
+		for (size_t j=0; j<addresses.size(); j++)
+		{
+			if ( !mTail.append(addresses[j]-1,transaction) )
+			{
+				mTail.truncate(transaction);
+				return false;
+			}
+		}
+		mEnd++;
+		return true;
+	}
+
+	// Forgets transactions at and after this index.  No reader may be using the index.
+	void truncate(uint32_t transactionCount)
+	{
+		mTail.truncate(transactionCount);
+		if ( mEnd > transactionCount )
+		{
+			mEnd = transactionCount;
+		}
+	}
+
+	// Number of transactions, built and appended, the index covers.
+	inline uint32_t getEnd(void) const
+	{
+		return mEnd;
+	}
+
+	// Appends to 'list' the transactions of address index 'index' in [begin,end) which were appended after the build.
+	inline void getAppended(uint32_t index,uint32_t begin,uint32_t end,std::vector< uint32_t > &list) const
+	{
+		mTail.getTransactions(index,begin,end,list);
+	}
+
+	inline uint32_t getCount(uint32_t index) const
+	{
+		return index < mAddressCount ? mCounts[index] : 0;
+	}
+
+	// Returns an iterator over the ascending transaction indices of this address index.
+	inline AddressTransactionIterator getTransactions(uint32_t index) const
+	{
+		if ( index < mAddressCount )
+		{
+			return AddressTransactionIterator(&mBytes[mByteBegin[index]],mCounts[index]);
+		}
+		return AddressTransactionIterator(NULL,0);
+	}
+
+	uint64_t getMemoryUsed(void) const
+	{
+		uint64_t ret = mAddressCount ? mByteBegin[mAddressCount] + (uint64_t)mAddressCount*(sizeof(uint32_t)+sizeof(uint64_t)) : 0;
+		return ret+mTail.getMemoryUsed();
+	}
+
+private:
+	static inline uint32_t getVarintSize(uint32_t v)
+	{
+		uint32_t ret = 1;
+		while ( v >= 0x80 )
+		{
+			v>>=7;
+			ret++;
+		}
+		return ret;
+	}
+
+	// The distinct address ids a transaction sends from or to.
+	static void getAddresses(const Transaction &t,std::vector< uint32_t > &addresses)
+	{
+		addresses.clear();
+		for (uint32_t j=0; j<t.mOutputCount; j++)
+		{
+			if ( t.mOutputs[j].mAddress )
+			{
+				addresses.push_back(t.mOutputs[j].mAddress);
+			}
+		}
+		for (uint32_t j=0; j<t.mInputCount; j++)
+		{
+			const TransactionOutput *o = t.mInputs[j].mOutput;
+			if ( o && o->mAddress )
+			{
+				addresses.push_back(o->mAddress);
+			}
+		}
+		if ( addresses.size() > 1 )
+		{
+			std::sort(addresses.begin(),addresses.end());
+			addresses.erase(std::unique(addresses.begin(),addresses.end()),addresses.end());
+		}
+	}
+
+	uint32_t	mAddressCount;
+	uint32_t	*mCounts;		// Number of transactions per address index
+	uint64_t	*mByteBegin;	// mAddressCount+1 byte offsets into mBytes
+	uint8_t		*mBytes;		// Delta varint encoded transaction indices
+	uint32_t	mEnd;			// Transactions covered: those built from plus those appended to mTail since
+	AddressTransactionTail	mTail;
+};
+
+// Epoch based reclamation, so threads can read shared state without locks while the main thread keeps changing it.  A reader
+// publishes the global epoch in a slot of its own for as long as it holds pointers to shared objects.  The writer replaces an
+// object by publishing its successor, advancing the epoch and retiring the old one under the epoch before the advance; it is
+// freed once no reader slot holds that epoch or an older one.  synchronize() waits for that to happen instead.  Readers
+// beyond the MAX_EPOCH_READERS lock free slots are not turned away: they record their epoch in an overflow list under a
+// mutex, which the writer only looks at while the list is in use.
+#define MAX_EPOCH_READERS 64
+
+class EpochManager
+{
+public:
+	EpochManager(void)
+	{
+		mEpoch = 1;
+		mOverflowCount = 0;
+		for (uint32_t i=0; i<MAX_EPOCH_READERS; i++)
+		{
+			mSlots[i].mEpoch = 0;
+		}
+	}
+
+	// Marks the calling thread as reading; returns the slot to hand back to leave.  Never waits for another reader; when
+	// every slot is busy the reader takes an overflow entry, numbered from MAX_EPOCH_READERS up.
+	uint32_t enter(void)
+	{
+		for (uint32_t i=0; i<MAX_EPOCH_READERS; i++)
+		{
+			uint64_t expected = 0;
+			if ( mSlots[i].mEpoch.load(std::memory_order_relaxed) == 0 && mSlots[i].mEpoch.compare_exchange_strong(expected,mEpoch.load()) )
+			{
+				return i;
+			}
+		}
+		std::lock_guard< std::mutex > lock(mOverflowMutex);
+		mOverflowCount++; // before reading the epoch, so a writer which sees no overflow readers also sees them start later
+		uint64_t epoch = mEpoch.load();
+		for (uint32_t i=0; i<mOverflow.size(); i++)
+		{
+			if ( mOverflow[i] == 0 )
+			{
+				mOverflow[i] = epoch;
+				return MAX_EPOCH_READERS+i;
+			}
+		}
+		mOverflow.push_back(epoch);
+		return MAX_EPOCH_READERS+(uint32_t)(mOverflow.size()-1);
+	}
+
+	inline void leave(uint32_t slot)
+	{
+		if ( slot < MAX_EPOCH_READERS )
+		{
+			mSlots[slot].mEpoch.store(0,std::memory_order_release);
+		}
+		else
+		{
+			std::lock_guard< std::mutex > lock(mOverflowMutex);
+			mOverflow[slot-MAX_EPOCH_READERS] = 0;
+			mOverflowCount--;
+		}
+	}
+
+	// Advances the epoch; anything unpublished before the call and retired under the returned epoch may still be in use by
+	// readers until getOldestEpoch() is greater than it.
+	inline uint64_t advance(void)
+	{
+		return mEpoch.fetch_add(1);
+	}
+
+	// Returns the oldest epoch any reader is in, or the current epoch if there are no readers.
+	uint64_t getOldestEpoch(void) const
+	{
+		uint64_t ret = mEpoch.load();
+		for (uint32_t i=0; i<MAX_EPOCH_READERS; i++)
+		{
+			uint64_t e = mSlots[i].mEpoch.load();
+			if ( e && e < ret )
+			{
+				ret = e;
+			}
+		}
+		if ( mOverflowCount.load() )
+		{
+			std::lock_guard< std::mutex > lock(mOverflowMutex);
+			for (size_t i=0; i<mOverflow.size(); i++)
+			{
+				uint64_t e = mOverflow[i];
+				if ( e && e < ret )
+				{
+					ret = e;
+				}
+			}
+		}
+		return ret;
+	}
+
+	// Waits until every reader which might have seen state unpublished before this call has finished.
+	void synchronize(void)
+	{
+		uint64_t retired = advance();
+		while ( getOldestEpoch() <= retired )
+		{
+			std::this_thread::yield();
+		}
+	}
+
+private:
+	class Slot
+	{
+	public:
+		std::atomic< uint64_t >	mEpoch;		// zero when the slot is free
+		char					mPad[56];	// one slot per cache line
+	};
+
+	std::atomic< uint64_t >	mEpoch;
+	Slot					mSlots[MAX_EPOCH_READERS];
+	std::atomic< uint32_t >	mOverflowCount;		// Readers holding an overflow entry
+	mutable std::mutex		mOverflowMutex;
+	std::vector< uint64_t >	mOverflow;			// Epoch of each overflow reader; zero when the entry is free
+};
+
+// The balance columns of the address table as of the end of one block, for readers on other threads.  The columns are split
+// into pages which are shared between snapshots and the writer's working copy, and copied by the writer before it changes a
+// page that a published snapshot still refers to.  A snapshot also pins the address transaction index that was current when
+// it was published.  Published snapshots are never changed.
+#define SNAPSHOT_PAGE_SIZE 128
+
+class AddressBalance
+{
+public:
+	uint64_t	mTotalReceived;
+	uint64_t	mTotalSent;
+};
+
+class AddressBalancePage
+{
+public:
+	AddressBalance	mBalances[SNAPSHOT_PAGE_SIZE];
+	uint32_t		mShareCount;	// The working copy plus every snapshot holding this page; changed by the writer only
+};
+
+class AddressSnapshot
+{
+public:
+	AddressSnapshot(void)
+	{
+		mGeneration = 0;
+		mBlockCount = 0;
+		mTransactionCount = 0;
+		mAddressCount = 0;
+		mPageCount = 0;
+		mPages = NULL;
+		mAddressTransactions = NULL;
+		mIndexedCount = 0;
+	}
+
+	// Balance of an address index (address id - 1) in this snapshot.
+	inline bool getBalance(uint32_t index,uint64_t &received,uint64_t &sent) const
+	{
+		if ( index >= mAddressCount ) return false;
+		const AddressBalance &b = mPages[index/SNAPSHOT_PAGE_SIZE]->mBalances[index%SNAPSHOT_PAGE_SIZE];
+		received = b.mTotalReceived;
+		sent = b.mTotalSent;
+		return true;
+	}
+
+	uint64_t						mGeneration;		// Writer generation this was taken at
+	uint32_t						mBlockCount;		// Blocks processed
+	uint32_t						mTransactionCount;	// Transactions [0,mTransactionCount) and their outputs belong to the snapshot
+	uint32_t						mAddressCount;
+	uint32_t						mPageCount;
+	AddressBalancePage				**mPages;
+	const AddressTransactionIndex	*mAddressTransactions;	// May be NULL
+	uint32_t						mIndexedCount;		// Transactions covered by mAddressTransactions
+};
+
+// Writer side of the snapshots: the working pages, publishing, and freeing what readers are done with.
+class AddressSnapshots
+{
+public:
+	AddressSnapshots(void)
+	{
+		mCurrent = NULL;
+		mPublishedIndex = NULL;
+		mEnabled = false;
+		mWanted = false;
+		mGeneration = 1;
+		mPublishedGeneration = 0;
+	}
+
+	~AddressSnapshots(void)
+	{
+		AddressSnapshot *s = mCurrent.exchange(NULL);
+		if ( s )
+		{
+			retire(s,NULL);
+		}
+		for (size_t i=0; i<mRetired.size(); i++)
+		{
+			release(mRetired[i]);
+		}
+		for (size_t i=0; i<mWorking.size(); i++)
+		{
+			releasePage(mWorking[i]);
+		}
+		delete mPublishedIndex;
+	}
+
+	inline bool isEnabled(void) const
+	{
+		return mEnabled;
+	}
+
+	// Starts mirroring balances; until then the writer pays nothing for snapshots.
+	void enable(BitcoinAddressHashMap &addresses)
+	{
+		mEnabled = true;
+		for (uint32_t i=0; i<addresses.size(); i++)
+		{
+			BitcoinAddress *ba = addresses.getKey(i);
+			update(i,ba->mTotalReceived,ba->mTotalSent);
+		}
+	}
+
+	// Mirrors the balance of an address index into the working pages.
+	inline void update(uint32_t index,uint64_t received,uint64_t sent)
+	{
+		if ( !mEnabled ) return;
+		uint32_t p = index/SNAPSHOT_PAGE_SIZE;
+		growPages(p+1);
+		AddressBalancePage *page = mWorking[p];
+		if ( page->mShareCount > 1 )
+		{
+			AddressBalancePage *copy = new AddressBalancePage(*page);
+			copy->mShareCount = 1;
+			page->mShareCount--;
+			mWorking[p] = page = copy;
+		}
+		AddressBalance &b = page->mBalances[index%SNAPSHOT_PAGE_SIZE];
+		b.mTotalReceived = received;
+		b.mTotalSent = sent;
+	}
+
+	// Called when the state the snapshots describe has changed.
+	inline void bumpGeneration(void)
+	{
+		mGeneration.fetch_add(1);
+	}
+
+	inline bool isStale(void) const
+	{
+		return mPublishedGeneration.load() != mGeneration.load();
+	}
+
+	// Readers ask for fresh snapshots; the writer only publishes while someone is asking.
+	inline void request(void)
+	{
+		mWanted.store(true,std::memory_order_relaxed);
+	}
+
+	inline bool takeRequest(void)
+	{
+		return mWanted.load(std::memory_order_relaxed) && mWanted.exchange(false);
+	}
+
+	void publish(uint32_t blockCount,uint32_t transactionCount,uint32_t addressCount,const AddressTransactionIndex *index,uint32_t indexedCount)
+	{
+		assert(mEnabled);
+		growPages((addressCount+SNAPSHOT_PAGE_SIZE-1)/SNAPSHOT_PAGE_SIZE);
+		AddressSnapshot *s = new AddressSnapshot;
+		s->mGeneration = mGeneration.load();
+		s->mBlockCount = blockCount;
+		s->mTransactionCount = transactionCount;
+		s->mAddressCount = addressCount;
+		s->mPageCount = (addressCount+SNAPSHOT_PAGE_SIZE-1)/SNAPSHOT_PAGE_SIZE;
+		s->mPages = new AddressBalancePage *[s->mPageCount ? s->mPageCount : 1];
+		for (uint32_t i=0; i<s->mPageCount; i++)
+		{
+			s->mPages[i] = mWorking[i];
+			mWorking[i]->mShareCount++;
+		}
+		s->mAddressTransactions = index;
+		s->mIndexedCount = indexedCount;
+		AddressSnapshot *old = mCurrent.exchange(s);
+		const AddressTransactionIndex *oldIndex = mPublishedIndex != index ? mPublishedIndex : NULL;
+		mPublishedIndex = index;
+		mPublishedGeneration.store(s->mGeneration);
+		if ( old || oldIndex )
+		{
+			retire(old,oldIndex);
+		}
+		reclaim();
+	}
+
+	// Withdraws the current snapshot and waits until no reader is using any snapshot, transaction or hash map entry; used
+	// before state is rolled back in place.  Readers which find no snapshot wait for the writer.
+	void retract(void)
+	{
+		AddressSnapshot *old = mCurrent.exchange(NULL);
+		mPublishedGeneration.store(0);
+		if ( old )
+		{
+			retire(old,NULL);
+		}
+		mEpochs.synchronize();
+		reclaim();
+	}
+
+	// Hands over an address transaction index which has been replaced.  A published one is retired along with the snapshot
+	// which refers to it, when the next snapshot is published; one that was never published is freed right away.
+	void retireIndex(const AddressTransactionIndex *index)
+	{
+		if ( index != mPublishedIndex )
+		{
+			delete index;
+		}
+	}
+
+	inline uint32_t enterRead(void)
+	{
+		return mEpochs.enter();
+	}
+
+	inline void leaveRead(uint32_t slot)
+	{
+		mEpochs.leave(slot);
+	}
+
+	// Only valid between enterRead and leaveRead.
+	inline const AddressSnapshot *getCurrent(void) const
+	{
+		return mCurrent.load();
+	}
+
+private:
+	class Retired
+	{
+	public:
+		uint64_t						mEpoch;
+		AddressSnapshot					*mSnapshot;
+		const AddressTransactionIndex	*mIndex;
+	};
+
+	void growPages(uint32_t pageCount)
+	{
+		while ( mWorking.size() < pageCount )
+		{
+			AddressBalancePage *page = new AddressBalancePage;
+			memset(page->mBalances,0,sizeof(page->mBalances));
+			page->mShareCount = 1;
+			mWorking.push_back(page);
+		}
+	}
+
+	void retire(AddressSnapshot *s,const AddressTransactionIndex *index)
+	{
+		Retired r;
+		r.mEpoch = mEpochs.advance();
+		r.mSnapshot = s;
+		r.mIndex = index;
+		mRetired.push_back(r);
+	}
+
+	void reclaim(void)
+	{
+		uint64_t oldest = mEpochs.getOldestEpoch();
+		size_t keep = 0;
+		for (size_t i=0; i<mRetired.size(); i++)
+		{
+			if ( mRetired[i].mEpoch < oldest )
+			{
+				release(mRetired[i]);
+			}
+			else
+			{
+				mRetired[keep++] = mRetired[i];
+			}
+		}
+		mRetired.resize(keep);
+	}
+
+	void release(Retired &r)
+	{
+		if ( r.mSnapshot )
+		{
+			for (uint32_t i=0; i<r.mSnapshot->mPageCount; i++)
+			{
+				releasePage(r.mSnapshot->mPages[i]);
+			}
+			delete []r.mSnapshot->mPages;
+			delete r.mSnapshot;
+		}
+		delete r.mIndex;
+	}
+
+	static void releasePage(AddressBalancePage *page)
+	{
+		if ( --page->mShareCount == 0 )
+		{
+			delete page;
+		}
+	}
+
+	EpochManager						mEpochs;
+	std::atomic< AddressSnapshot * >	mCurrent;
+	const AddressTransactionIndex		*mPublishedIndex;
+	std::vector< AddressBalancePage * >	mWorking;			// The writer's copy, always up to date while enabled
+	std::vector< Retired >				mRetired;
+	bool								mEnabled;
+	std::atomic< bool >					mWanted;
+	std::atomic< uint64_t >				mGeneration;
+	std::atomic< uint64_t >				mPublishedGeneration;
+};
+
+// Groups addresses into clusters which are very likely controlled by the same wallet, using the common-input heuristic: every
+// address spending into the same transaction had to be signed for by whoever built it.  This is a union-find forest over address
+// indices (address id - 1).  Roots are always the smallest address index of their cluster, so cluster ids are deterministic no
+// matter in which order unions happen, and partial forests built over separate block ranges can be merged into one.
+
+#define CLUSTER_FILE_VERSION 1
+
+class AddressClusters
+{
+public:
+	AddressClusters(void)
+	{
+		mParent = NULL;
+		mCapacity = 0;
+		mCount = 0;
+		mUnionCount = 0;
+	}
+
+	~AddressClusters(void)
+	{
+		delete []mParent;
+	}
+
+	// Makes sure every address index below 'count' has an entry; new addresses start out as a cluster of their own.  The
+	// first allocation is exactly 'count' entries, later ones double, so a forest which keeps growing copies each entry a
+	// bounded number of times.
+	void grow(uint32_t count)
+	{
+		assert( count <= MAX_BITCOIN_ADDRESSES );
+		if ( count > mCapacity )
+		{
+			uint32_t capacity = mCapacity ? mCapacity : count;
+			while ( capacity < count )
+			{
+				capacity = capacity < MAX_BITCOIN_ADDRESSES/2 ? capacity*2 : MAX_BITCOIN_ADDRESSES;
+			}
+			uint32_t *parent = new uint32_t[capacity];
+			if ( mCount )
+			{
+				memcpy(parent,mParent,sizeof(uint32_t)*mCount);
+			}
+			delete []mParent;
+			mParent = parent;
+			mCapacity = capacity;
+		}
+		for (uint32_t i=mCount; i<count; i++)
+		{
+			mParent[i] = i;
+		}
+		if ( count > mCount )
+		{
+			mCount = count;
+		}
+	}
+
+	void reset(void)
+	{
+		mCount = 0;
+		mUnionCount = 0;
+	}
+
+	// Returns the root of this address index; halves the path on the way up so later lookups are shorter.
+	inline uint32_t find(uint32_t i)
+	{
+		while ( mParent[i] != i )
+		{
+			mParent[i] = mParent[mParent[i]];
+			i = mParent[i];
+		}
+		return i;
+	}
+
+	inline void unite(uint32_t a,uint32_t b)
+	{
+		if ( a >= mCount || b >= mCount )
+		{
+			grow( (a > b ? a : b) + 1 );
+		}
+		a = find(a);
+		b = find(b);
+		if ( a != b )
+		{
+			if ( a < b )
+			{
+				mParent[b] = a;
+			}
+			else
+			{
+				mParent[a] = b;
+			}
+			mUnionCount++;
+		}
+	}
+
+	// Applies the common-input heuristic to one transaction.
+	void addTransaction(const Transaction &t)
+	{
+		uint32_t first = 0;
+		for (uint32_t j=0; j<t.mInputCount; j++)
+		{
+			const TransactionOutput *o = t.mInputs[j].mOutput;
+			if ( o && o->mAddress )
+			{
+				if ( first == 0 )
+				{
+					first = o->mAddress;
+				}
+				else if ( o->mAddress != first )
+				{
+					unite(first-1,o->mAddress-1);
+				}
+			}
+		}
+	}
+
+	// Folds another forest into this one; used to combine forests built over separate block ranges.
+	void mergeFrom(AddressClusters &other)
+	{
+		grow(other.mCount);
+		for (uint32_t i=0; i<other.mCount; i++)
+		{
+			if ( other.mParent[i] != i )
+			{
+				unite(i,other.mParent[i]);
+			}
+		}
+	}
+
+	// The number of address indices the inputs of these transactions reach, which is all a forest over them needs.
+	static uint32_t getInputAddressCount(const Transaction *transactions,uint32_t begin,uint32_t end)
+	{
+		uint32_t ret = 0;
+		for (uint32_t i=begin; i<end; i++)
+		{
+			const Transaction &t = transactions[i];
+			for (uint32_t j=0; j<t.mInputCount; j++)
+			{
+				const TransactionOutput *o = t.mInputs[j].mOutput;
+				if ( o && o->mAddress > ret )
+				{
+					ret = o->mAddress;	// address ids are index+1
+				}
+			}
+		}
+		return ret;
+	}
+
+	// Rebuilds the forest from the processed transactions.  The transactions are split into contiguous ranges, each
+	// range is clustered on its own thread into a private forest sized to the addresses its inputs reach, and the forests
+	// are then merged.
+	void build(const Transaction *transactions,uint32_t transactionCount,uint32_t addressCount,uint32_t threadCount)
+	{
+		reset();
+		grow(addressCount);
+		if ( threadCount < 2 || transactionCount < 100000 )
+		{
+			for (uint32_t i=0; i<transactionCount; i++)
+			{
+				addTransaction(transactions[i]);
+			}
+			return;
+		}
+		AddressClusters *partial = new AddressClusters[threadCount];
+		std::thread **threads = new std::thread *[threadCount];
+		uint32_t stride = (transactionCount+threadCount-1)/threadCount;
+		for (uint32_t i=0; i<threadCount; i++)
+		{
+			uint32_t begin = i*stride;
+			uint32_t end = begin+stride < transactionCount ? begin+stride : transactionCount;
+			AddressClusters *c = &partial[i];
+			threads[i] = new std::thread([c,transactions,begin,end]()
+			{
+				c->grow(getInputAddressCount(transactions,begin,end));
+				for (uint32_t j=begin; j<end; j++)
+				{
+					c->addTransaction(transactions[j]);
+				}
+			});
+		}
+		for (uint32_t i=0; i<threadCount; i++)
+		{
+			threads[i]->join();
+			delete threads[i];
+			mergeFrom(partial[i]);
+		}
+		delete []threads;
+		delete []partial;
+	}
+
+	inline uint32_t getClusterId(uint32_t i)
+	{
+		return i < mCount ? find(i) : i;
+	}
+
+	uint32_t getAddressCount(void) const
+	{
+		return mCount;
+	}
+
+	// Every union joins two clusters, so the number of clusters is the number of addresses less the successful unions.
+	uint32_t getClusterCount(void) const
+	{
+		return mCount - mUnionCount;
+	}
+
+	void reportMemory(MemoryReport &report) const
+	{
+		report.add("address clusters",mParent,sizeof(uint32_t),mCapacity,mCount,mCount);
+	}
+
+	// Writes the cluster id of every address index.
+	bool save(const char *fname)
+	{
+		bool ret = false;
+		FILE *fph = fopen(fname,"wb");
+		if ( fph )
+		{
+			uint32_t header[3] = { CLUSTER_FILE_VERSION, mCount, mUnionCount };
+			ret = fwrite(header,sizeof(header),1,fph) == 1;
+			for (uint32_t i=0; i<mCount && ret; i++)
+			{
+				uint32_t id = find(i);
+				ret = fwrite(&id,sizeof(id),1,fph) == 1;
+			}
+			fclose(fph);
+		}
+		return ret;
+	}
+
+	// Reads cluster ids written by save and replaces the whole forest with them: every address starts out on its own and is
+	// then united with its saved cluster.  Address indices are assigned in processing order, so the file is only meaningful
+	// for the same chain; ids for addresses not yet seen are ignored.  If the file can not be read the forest is left as it
+	// was.
+	bool load(const char *fname,uint32_t addressCount)
+	{
+		AddressClusters loaded;
+		bool ret = loaded.read(fname,addressCount);
+		if ( ret )
+		{
+			uint32_t *parent = mParent;
+			mParent = loaded.mParent;
+			loaded.mParent = parent;
+			uint32_t capacity = mCapacity;
+			mCapacity = loaded.mCapacity;
+			loaded.mCapacity = capacity;
+			mCount = loaded.mCount;
+			mUnionCount = loaded.mUnionCount;
+		}
+		return ret;
+	}
+
+private:
+	// Fills this forest, which must be empty, from a file written by save.
+	bool read(const char *fname,uint32_t addressCount)
+	{
+		bool ret = false;
+		FILE *fph = fopen(fname,"rb");
+		if ( fph )
+		{
+			uint32_t header[3];
+			if ( fread(header,sizeof(header),1,fph) == 1 && header[0] == CLUSTER_FILE_VERSION )
+			{
+				grow(addressCount);
+				ret = true;
+				for (uint32_t i=0; i<header[1]; i++)
+				{
+					uint32_t id;
+					if ( fread(&id,sizeof(id),1,fph) != 1 )
+					{
+						ret = false;
+						break;
+					}
+					if ( i < addressCount && id < addressCount )
+					{
+						unite(i,id);
+					}
+				}
+			}
+			fclose(fph);
+		}
+		return ret;
+	}
+
+	uint32_t	*mParent;		// Parent address index of each address index; a root is its own parent
+	uint32_t	mCapacity;		// Entries allocated in mParent
+	uint32_t	mCount;			// Number of address indices in the forest
+	uint32_t	mUnionCount;	// Number of unions which joined two different clusters
+};
+
+// Follows value through the spend graph from one transaction, either forward (where did the coins go) or backward (where did
+// they come from).  The transaction pool already is a compressed sparse row graph: each transaction owns a contiguous run of
+// inputs and outputs, inputs point at the output they spend and outputs record the transaction which spent them.  The only
+// extra structure is the row offset array mapping an output back to the transaction which created it.
+//
+// A trace is a breadth first search one hop per level.  A frontier item says 'this many tainted satoshis arrive at this slot of
+// this transaction' (an input going forward, an output going backward).  Expanding a transaction distributes the taint on one
+// side over the other side according to the policy:
+//
+// poison  : any taint at all taints every coin on the other side in full.
+// haircut : every coin on the other side is tainted by the fraction of tainted value coming in.
+// fifo    : both sides are laid out as intervals on one value line, in slot order, with the taint of each slot at the front of
+//           its interval; a coin is tainted by how much of its interval overlaps tainted intervals.
+//
+// Levels are sorted by transaction so each transaction is expanded once per level, then split into ranges of whole transactions
+// which are expanded in parallel into per-thread next frontiers and merged.
+//
+// Going forward the results are where the coins ended up: outputs nobody has spent yet.  Going backward every address the
+// coins passed through is a result, along with the newly mined coins they started from.  Taint too small to follow, or still
+// in flight when the hops run out, is counted as dropped.  The frontier and the results are both bounded; past a bound the
+// smallest items are dropped and the trace is reported as truncated.  A thread trims its share of the next frontier as soon as
+// it reaches twice the bound, so a level which fans out widely never holds much more than that.
+
+enum TaintPolicy
+{
+	TP_POISON,
+	TP_HAIRCUT,
+	TP_FIFO
+};
+
+class TaintItem
+{
+public:
+	uint32_t	mTransaction;	// The transaction the taint arrives at
+	uint32_t	mSlot;			// Input (forward) or output (backward) index within that transaction
+	uint64_t	mAmount;		// Tainted satoshis
+};
+
+class TaintResult
+{
+public:
+	enum Flags
+	{
+		TR_UNSPENT	= (1<<0),	// Forward: the tainted coins are still unspent at this address
+		TR_COINBASE	= (1<<1),	// Backward: the tainted coins were newly mined
+	};
+	uint32_t	mAddress;		// Address id which received (forward) or supplied (backward) the tainted coins; 0 if unknown
+	uint32_t	mFlags;
+	uint64_t	mAmount;
+};
+
+// What expanding part of one level produces; each thread has its own.
+class TaintWork
+{
+public:
+	TaintWork(void)
+	{
+		mDropped = 0;
+		mTrimmed = false;
+	}
+
+	std::vector< TaintItem >	mNext;		// Items of the next level
+	std::vector< TaintResult >	mResults;
+	uint64_t					mDropped;	// Tainted satoshis not followed any further
+	bool						mTrimmed;	// mNext hit the frontier bound and lost its smallest items
+};
+
+class TaintTracer
+{
+public:
+	TaintTracer(const Transaction *transactions,uint32_t transactionCount,const TransactionInput *inputs,const TransactionOutput *outputs,const uint32_t *outputBegin)
+	{
+		mTransactions = transactions;
+		mTransactionCount = transactionCount;
+		mInputs = inputs;
+		mOutputs = outputs;
+		mOutputBegin = outputBegin;
+		mPolicy = TP_HAIRCUT;
+		mForward = true;
+		mMinAmount = 1;
+		mMaxFrontier = 0;
+		mHopCount = 0;
+		mExpandedCount = 0;
+		mTruncated = false;
+		mDroppedAmount = 0;
+	}
+
+	// Traces from one output of a transaction, or every output if outputIndex is 0xFFFFFFFF.  At most maxFrontier items are
+	// carried from one hop to the next and at most maxResults results kept.
+	void trace(uint32_t transaction,uint32_t outputIndex,bool forward,TaintPolicy policy,uint32_t maxHops,uint32_t maxFrontier,uint32_t maxResults,uint64_t minAmount,uint32_t threadCount)
+	{
+		mForward = forward;
+		mPolicy = policy;
+		mMinAmount = minAmount ? minAmount : 1;
+		mMaxFrontier = maxFrontier ? maxFrontier : 1;
+		mHopCount = 0;
+		mExpandedCount = 0;
+		mTruncated = false;
+		mDroppedAmount = 0;
+		mResults.clear();
+		if ( transaction >= mTransactionCount ) return;
+
+		std::vector< TaintItem > frontier;
+		std::vector< uint8_t > visited;
+		if ( policy == TP_POISON )
+		{
+			visited.resize((mTransactionCount+7)/8,0);
+		}
+
+		// Seed with the chosen outputs at full value.
+		const Transaction &t = mTransactions[transaction];
+		TaintWork seed;
+		for (uint32_t j=0; j<t.mOutputCount; j++)
+		{
+			if ( outputIndex != 0xFFFFFFFF && outputIndex != j ) continue;
+			if ( forward )
+			{
+				emitOutput(transaction,j,t.mOutputs[j].mValue,seed);
+			}
+			else
+			{
+				TaintItem item;
+				item.mTransaction = transaction;
+				item.mSlot = j;
+				item.mAmount = t.mOutputs[j].mValue;
+				seed.mNext.push_back(item);
+			}
+		}
+		frontier.swap(seed.mNext);
+		mResults.swap(seed.mResults);
+		mDroppedAmount+=seed.mDropped;
+
+		TaintWork *work = new TaintWork[threadCount ? threadCount : 1];
+		while ( !frontier.empty() && mHopCount < maxHops )
+		{
+			mHopCount++;
+			std::sort(frontier.begin(),frontier.end(),compareItem);
+			if ( policy == TP_POISON ) // a poisoned transaction is fully tainted the first time; expanding it again adds nothing
+			{
+				size_t write = 0;
+				size_t i = 0;
+				while ( i < frontier.size() )
+				{
+					uint32_t tx = frontier[i].mTransaction;
+					bool seen = (visited[tx>>3] & (1<<(tx&7))) != 0;
+					visited[tx>>3]|=(uint8_t)(1<<(tx&7));
+					for (; i<frontier.size() && frontier[i].mTransaction == tx; i++)
+					{
+						if ( !seen )
+						{
+							frontier[write++] = frontier[i];
+						}
+					}
+				}
+				frontier.resize(write);
+			}
+			for (size_t i=0; i<frontier.size(); i++)
+			{
+				if ( i == 0 || frontier[i].mTransaction != frontier[i-1].mTransaction )
+				{
+					mExpandedCount++;
+				}
+			}
+
+			// split the level into ranges of whole transactions, one per thread
+			uint32_t useThreads = (threadCount > 1 && frontier.size() > 4096) ? threadCount : 1;
+			size_t bounds[65];
+			if ( useThreads > 64 ) useThreads = 64;
+			bounds[0] = 0;
+			for (uint32_t i=1; i<useThreads; i++)
+			{
+				size_t b = frontier.size()*i/useThreads;
+				if ( b < bounds[i-1] ) b = bounds[i-1];
+				while ( b > 0 && b < frontier.size() && frontier[b].mTransaction == frontier[b-1].mTransaction )
+				{
+					b++;
+				}
+				bounds[i] = b;
+			}
+			bounds[useThreads] = frontier.size();
+
+			if ( useThreads == 1 )
+			{
+				expandRange(frontier,0,frontier.size(),work[0]);
+			}
+			else
+			{
+				std::vector< std::thread > threads;
+				for (uint32_t i=0; i<useThreads; i++)
+				{
+					threads.push_back(std::thread(&TaintTracer::expandRange,this,std::cref(frontier),bounds[i],bounds[i+1],std::ref(work[i])));
+				}
+				for (uint32_t i=0; i<useThreads; i++)
+				{
+					threads[i].join();
+				}
+			}
+
+			frontier.clear();
+			for (uint32_t i=0; i<useThreads; i++)
+			{
+				TaintWork &w = work[i];
+				frontier.insert(frontier.end(),w.mNext.begin(),w.mNext.end());
+				mResults.insert(mResults.end(),w.mResults.begin(),w.mResults.end());
+				mDroppedAmount+=w.mDropped;
+				mTruncated|=w.mTrimmed;
+				w.mNext.clear();
+				w.mResults.clear();
+				w.mDropped = 0;
+				w.mTrimmed = false;
+			}
+			if ( trimFrontier(frontier,mMaxFrontier,mDroppedAmount) )
+			{
+				mTruncated = true;
+			}
+			if ( mResults.size() > maxResults )
+			{
+				mergeResults(); // many results are usually the same few addresses
+				if ( mResults.size() > maxResults )
+				{
+					for (size_t i=maxResults; i<mResults.size(); i++)
+					{
+						mDroppedAmount+=mResults[i].mAmount;
+					}
+					mResults.resize(maxResults);
+					mTruncated = true;
+				}
+			}
+		}
+		if ( !frontier.empty() )
+		{
+			mTruncated = true; // ran out of hops
+			for (size_t i=0; i<frontier.size(); i++)
+			{
+				mDroppedAmount+=frontier[i].mAmount;
+			}
+		}
+		delete []work;
+		mergeResults();
+	}
+
+	const std::vector< TaintResult > & getResults(void) const
+	{
+		return mResults;
+	}
+
+	uint32_t getHopCount(void) const
+	{
+		return mHopCount;
+	}
+
+	uint64_t getExpandedCount(void) const
+	{
+		return mExpandedCount;
+	}
+
+	bool isTruncated(void) const
+	{
+		return mTruncated;
+	}
+
+	uint64_t getDroppedAmount(void) const
+	{
+		return mDroppedAmount;
+	}
+
+private:
+	static bool compareItem(const TaintItem &a,const TaintItem &b)
+	{
+		return a.mTransaction < b.mTransaction || (a.mTransaction == b.mTransaction && a.mSlot < b.mSlot);
+	}
+
+	static bool compareAmount(const TaintItem &a,const TaintItem &b)
+	{
+		return a.mAmount > b.mAmount;
+	}
+
+	static bool compareResultAddress(const TaintResult &a,const TaintResult &b)
+	{
+		return a.mAddress < b.mAddress || (a.mAddress == b.mAddress && a.mFlags < b.mFlags);
+	}
+
+	static bool compareResultAmount(const TaintResult &a,const TaintResult &b)
+	{
+		return a.mAmount > b.mAmount;
+	}
+
+	// Sums the results per address, largest first.
+	void mergeResults(void)
+	{
+		std::sort(mResults.begin(),mResults.end(),compareResultAddress);
+		size_t write = 0;
+		for (size_t i=0; i<mResults.size(); i++)
+		{
+			if ( write && mResults[write-1].mAddress == mResults[i].mAddress && mResults[write-1].mFlags == mResults[i].mFlags )
+			{
+				mResults[write-1].mAmount+=mResults[i].mAmount;
+			}
+			else
+			{
+				mResults[write++] = mResults[i];
+			}
+		}
+		mResults.resize(write);
+		std::sort(mResults.begin(),mResults.end(),compareResultAmount);
+	}
+
+	// Keeps the 'count' largest items; returns true if any had to go.
+	static bool trimFrontier(std::vector< TaintItem > &items,size_t count,uint64_t &dropped)
+	{
+		bool ret = false;
+		if ( items.size() > count )
+		{
+			std::nth_element(items.begin(),items.begin()+count,items.end(),compareAmount);
+			for (size_t i=count; i<items.size(); i++)
+			{
+				dropped+=items[i].mAmount;
+			}
+			items.resize(count);
+			ret = true;
+		}
+		return ret;
+	}
+
+	// Returns the transaction which created this output; transactions own contiguous, ascending runs of outputs.
+	uint32_t getOutputOwner(uint32_t output) const
+	{
+		const uint32_t *found = std::upper_bound(mOutputBegin,mOutputBegin+mTransactionCount,output);
+		return (uint32_t)(found-mOutputBegin)-1;
+	}
+
+	// Forward: tainted coins arrive at output j of a transaction; they either rest there, which makes a result, or flow into
+	// the spender.
+	void emitOutput(uint32_t transaction,uint32_t j,uint64_t amount,TaintWork &work) const
+	{
+		const TransactionOutput &o = mTransactions[transaction].mOutputs[j];
+		if ( o.mSpentBy == 0xFFFFFFFF || o.mSpentBy >= mTransactionCount )
+		{
+			TaintResult r;
+			r.mAddress = o.mAddress;
+			r.mFlags = TaintResult::TR_UNSPENT;
+			r.mAmount = amount;
+			work.mResults.push_back(r);
+			return;
+		}
+		if ( amount >= mMinAmount )
+		{
+			const Transaction &spender = mTransactions[o.mSpentBy];
+			for (uint32_t k=0; k<spender.mInputCount; k++)
+			{
+				if ( spender.mInputs[k].mOutput == &o )
+				{
+					TaintItem item;
+					item.mTransaction = o.mSpentBy;
+					item.mSlot = k;
+					item.mAmount = amount;
+					work.mNext.push_back(item);
+					return;
+				}
+			}
+		}
+		work.mDropped+=amount;
+	}
+
+	// Backward: tainted coins left through input i of a transaction; they came from the output it spends.
+	void emitInput(uint32_t transaction,uint32_t i,uint64_t amount,TaintWork &work) const
+	{
+		const TransactionOutput *o = mTransactions[transaction].mInputs[i].mOutput;
+		if ( o == NULL ) return;
+		TaintResult r;
+		r.mAddress = o->mAddress;
+		r.mFlags = 0;
+		r.mAmount = amount;
+		work.mResults.push_back(r);
+		if ( amount >= mMinAmount )
+		{
+			uint32_t index = (uint32_t)(o-mOutputs);
+			TaintItem item;
+			item.mTransaction = getOutputOwner(index);
+			item.mSlot = index - mOutputBegin[item.mTransaction];
+			item.mAmount = amount;
+			work.mNext.push_back(item);
+		}
+	}
+
+	static inline uint64_t inputValue(const TransactionInput &input)
+	{
+		return input.mOutput ? input.mOutput->mValue : 0;
+	}
+
+	// Expands the transactions in frontier[begin,end); items are sorted so each transaction is one contiguous group.
+	void expandRange(const std::vector< TaintItem > &frontier,size_t begin,size_t end,TaintWork &work)
+	{
+		std::vector< uint64_t > valueIn,taintIn,valueOut,taintOut;
+		size_t i = begin;
+		while ( i < end )
+		{
+			uint32_t tx = frontier[i].mTransaction;
+			const Transaction &t = mTransactions[tx];
+			uint32_t countIn = mForward ? t.mInputCount : t.mOutputCount;
+			uint32_t countOut = mForward ? t.mOutputCount : t.mInputCount;
+			valueIn.assign(countIn,0);
+			taintIn.assign(countIn,0);
+			valueOut.assign(countOut,0);
+			taintOut.assign(countOut,0);
+			for (uint32_t k=0; k<countIn; k++)
+			{
+				valueIn[k] = mForward ? inputValue(t.mInputs[k]) : t.mOutputs[k].mValue;
+			}
+			for (uint32_t k=0; k<countOut; k++)
+			{
+				valueOut[k] = mForward ? t.mOutputs[k].mValue : inputValue(t.mInputs[k]);
+			}
+			uint64_t arriving = 0;
+			for (; i<end && frontier[i].mTransaction == tx; i++)
+			{
+				uint32_t slot = frontier[i].mSlot;
+				if ( slot < countIn )
+				{
+					taintIn[slot]+=frontier[i].mAmount;
+					if ( taintIn[slot] > valueIn[slot] )
+					{
+						taintIn[slot] = valueIn[slot];
+					}
+				}
+				arriving+=frontier[i].mAmount;
+			}
+
+			bool coinbase = t.mInputCount && t.mInputs[0].mOutput == NULL;
+			if ( !mForward && coinbase )
+			{
+				TaintResult r;
+				r.mAddress = 0;
+				r.mFlags = TaintResult::TR_COINBASE;
+				r.mAmount = arriving;
+				work.mResults.push_back(r);
+				continue;
+			}
+
+			distribute(countIn ? &valueIn[0] : NULL,countIn ? &taintIn[0] : NULL,countIn,countOut ? &valueOut[0] : NULL,countOut ? &taintOut[0] : NULL,countOut);
+			for (uint32_t k=0; k<countOut; k++)
+			{
+				if ( taintOut[k] )
+				{
+					if ( mForward )
+					{
+						emitOutput(tx,k,taintOut[k],work);
+					}
+					else
+					{
+						emitInput(tx,k,taintOut[k],work);
+					}
+				}
+			}
+			if ( work.mNext.size() > (size_t)mMaxFrontier*2 && trimFrontier(work.mNext,mMaxFrontier,work.mDropped) )
 			{
-				break;
+				work.mTrimmed = true;
 			}
 		}
-		return;
 	}
 
-	void heapify(void **arr, int32_t low, int32_t high)
+	void distribute(const uint64_t *valueIn,const uint64_t *taintIn,uint32_t countIn,const uint64_t *valueOut,uint64_t *taintOut,uint32_t countOut) const
 	{
-		/*Start with middle element. Middle element is chosen in
-		such a way that the last element of array is either its
-		left child or right child*/
-		int32_t midIdx = (high - low -1)/2;
-		while (midIdx >= 0)
+		uint64_t totalValue = 0;
+		uint64_t totalTaint = 0;
+		for (uint32_t k=0; k<countIn; k++)
 		{
-			shiftRight(arr, midIdx, high);
-			--midIdx;
+			totalValue+=valueIn[k];
+			totalTaint+=taintIn[k];
+		}
+		if ( totalTaint == 0 ) return;
+		switch ( mPolicy )
+		{
+			case TP_POISON:
+				for (uint32_t k=0; k<countOut; k++)
+				{
+					taintOut[k] = valueOut[k];
+				}
+				break;
+			case TP_HAIRCUT:
+				if ( totalValue )
+				{
+					double fraction = (double)totalTaint / (double)totalValue;
+					for (uint32_t k=0; k<countOut; k++)
+					{
+						uint64_t v = (uint64_t)((double)valueOut[k]*fraction);
+						taintOut[k] = v < valueOut[k] ? v : valueOut[k];
+					}
+				}
+				break;
+			case TP_FIFO:
+				{
+					// Walk both sides along the value line; [taintBegin,taintEnd) is the tainted front of input slot a.
+					uint32_t a = 0;
+					uint64_t aBegin = 0;
+					uint64_t outBegin = 0;
+					for (uint32_t k=0; k<countOut; k++)
+					{
+						uint64_t outEnd = outBegin+valueOut[k];
+						uint64_t tainted = 0;
+						while ( a < countIn )
+						{
+							uint64_t taintBegin = aBegin;
+							uint64_t taintEnd = aBegin+taintIn[a];
+							uint64_t lo = taintBegin > outBegin ? taintBegin : outBegin;
+							uint64_t hi = taintEnd < outEnd ? taintEnd : outEnd;
+							if ( hi > lo )
+							{
+								tainted+=hi-lo;
+							}
+							if ( aBegin+valueIn[a] > outEnd )
+							{
+								break; // this input slot continues into the next output
+							}
+							aBegin+=valueIn[a];
+							a++;
+						}
+						taintOut[k] = tainted;
+						outBegin = outEnd;
+					}
+				}
+				break;
 		}
-		return;
 	}
 
-
+	const Transaction			*mTransactions;
+	uint32_t					mTransactionCount;
+	const TransactionInput		*mInputs;
+	const TransactionOutput		*mOutputs;
+	const uint32_t				*mOutputBegin;	// Index of the first output of each transaction
+	TaintPolicy					mPolicy;
+	bool						mForward;
+	uint64_t					mMinAmount;		// Taint below this many satoshis is not followed any further
+	uint32_t					mMaxFrontier;	// Most items carried from one hop to the next
+	uint32_t					mHopCount;
+	uint64_t					mExpandedCount;
+	bool						mTruncated;
+	uint64_t					mDroppedAmount;
+	std::vector< TaintResult >	mResults;
 };
 
-
-
-class SortByBalance : public HeapSortPointers
+// Appends JSON text into a caller supplied buffer.  Text past the end of the buffer is counted but not stored, so a caller
+// whose buffer was too small can grow it to getLength() bytes and render again.
+class JsonBuffer
 {
 public:
-	SortByBalance(BitcoinAddress **addresses,uint32_t count)
+	JsonBuffer(char *dest,uint32_t destSize)
 	{
-		HeapSortPointers::heapSort((void **)addresses,(int32_t)count);
+		mDest = dest;
+		mDestSize = destSize;
+		mLength = 0;
 	}
 
-	// -1 less, 0 equal, +1 greater.
-	virtual int32_t compare(void *p1,void *p2)
+	inline void append(const char *str)
 	{
-		BitcoinAddress *a1 = (BitcoinAddress *)p1;
-		BitcoinAddress *a2 = (BitcoinAddress *)p2;
-		uint64_t balance1 = a1->mTotalReceived-a1->mTotalSent;
-		uint64_t balance2 = a2->mTotalReceived-a2->mTotalSent;
-		if ( balance1 == balance2 ) return 0;
-		return balance1 > balance2 ? -1 : 1;
+		while ( *str )
+		{
+			put(*str++);
+		}
 	}
-};
 
-class SortByAge : public HeapSortPointers
-{
-public:
-	SortByAge(BitcoinAddress **addresses,uint32_t count)
+	void appendf(const char *fmt,...)
 	{
-		HeapSortPointers::heapSort((void **)addresses,(int32_t)count);
+		char scratch[256];
+		va_list arg;
+		va_start(arg,fmt);
+		vsnprintf(scratch,sizeof(scratch),fmt,arg);
+		va_end(arg);
+		append(scratch);
 	}
 
-	// -1 less, 0 equal, +1 greater.
-	virtual int32_t compare(void *p1,void *p2)
+	void appendHex(const uint8_t *data,uint32_t len,bool reverse)
 	{
-		BitcoinAddress *a1 = (BitcoinAddress *)p1;
-		BitcoinAddress *a2 = (BitcoinAddress *)p2;
-		uint32_t age1 = a1->getDaysSinceLastUsed(0);
-		uint32_t age2 = a2->getDaysSinceLastUsed(0);
-		if ( age1 == age2 ) return 0;
-		return age1 > age2 ? -1 : 1;
+		static const char *hex = "0123456789abcdef";
+		for (uint32_t i=0; i<len; i++)
+		{
+			uint8_t c = reverse ? data[len-1-i] : data[i];
+			put(hex[c>>4]);
+			put(hex[c&15]);
+		}
 	}
 
-};
-
-static void logSignatureFormat(uint32_t ret,FILE *fph)
-{
-	if ( ret & BlockChain::SF_ABNORMAL ) fprintf(fph,"SF_ABNORMAL ");
-	if ( ret & BlockChain::SF_COINBASE ) fprintf(fph,"SF_COINBASE ");
-	if ( ret & BlockChain::SF_DER_ONLY ) fprintf(fph,"SF_DER_ONLY ");
-	if ( ret & BlockChain::SF_SIGHASH_ZERO ) fprintf(fph,"SF_SIGHASH_ZERO ");
-	if ( ret & BlockChain::SF_SIGHASH_ALL ) fprintf(fph,"SF_SIGHASH_ALL ");
-	if ( ret & BlockChain::SF_SIGHASH_NONE ) fprintf(fph,"SF_SIGHASH_NONE ");
-	if ( ret & BlockChain::SF_WEIRD_90_00 ) fprintf(fph,"SF_WEIRD_90_00 ");
-	if ( ret & BlockChain::SF_NORMAL_SIGNATURE_PUSH41 ) fprintf(fph,"SF_NORMAL_SIGNATURE_PUSH41 ");
-	if ( ret & BlockChain::SF_NORMAL_SIGNATURE_PUSH21 ) fprintf(fph,"SF_NORMAL_SIGNATURE_PUSH21 ");
-	if ( ret & BlockChain::SF_SIGNATURE_LEADING_ZERO ) fprintf(fph,"SF_SIGNATURE_LEADING_ZERO ");
-	if ( ret & BlockChain::SF_SIGNATURE_LEADING_STRANGE ) fprintf(fph,"SF_SIGNATURE_LEADING_STRANGE ");
-	if ( ret & BlockChain::SF_SIGNATURE_21 ) fprintf(fph,"SF_SIGNATURE_21 ");
-	if ( ret & BlockChain::SF_SIGNATURE_41 ) fprintf(fph,"SF_SIGNATURE_41 ");
-	if ( ret & BlockChain::SF_PUSHDATA1 ) fprintf(fph,"SF_PUSHDATA1 ");
-	if ( ret & BlockChain::SF_PUSHDATA0 ) fprintf(fph,"SF_PUSHDATA0 ");
-	if ( ret & BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH ) fprintf(fph,"SF_UNUSUAL_SIGNATURE_LENGTH ");
-	if ( ret & BlockChain::SF_EXTRA_STUFF ) fprintf(fph,"SF_EXTRA_STUFF ");
-	if ( ret & BlockChain::SF_SIGHASH_PAY_ANY_ALL ) fprintf(fph,"SF_SIGHASH_PAY_ANY_ALL ");
-	if ( ret & BlockChain::SF_SIGHASH_PAY_ANY_SINGLE ) fprintf(fph,"SF_SIGHASH_PAY_ANY_SINGLE ");
-	if ( ret & BlockChain::SF_SIGHASH_SINGLE ) fprintf(fph,"SF_SIGHASH_SINGLE ");
-	if ( ret & BlockChain::SF_SIGHASH_PAY_ANY_NONE ) fprintf(fph,"SF_SIGHASH_PAY_ANY_NONE ");
-	if ( ret & BlockChain::SF_TRANSACTION_MALLEABILITY ) fprintf(fph,"**** SF_TRANSACTION_MALLEABILITY **** ");
-	if ( ret & BlockChain::SF_PUSHDATA2 ) fprintf(fph,"SF_PUSHDATA2 ");
-	if ( ret & BlockChain::SF_ASCII ) fprintf(fph,"SF_ASCII ");
-
-	if ( ret & BlockChain::SF_DER_X_1E ) fprintf(fph,"SF_DER_X_1E ");
-	if ( ret & BlockChain::SF_DER_X_1F ) fprintf(fph,"SF_DER_X_1F ");
-	if ( ret & BlockChain::SF_DER_X_20 ) fprintf(fph,"SF_DER_X_20 ");
-	if ( ret & BlockChain::SF_DER_X_21 ) fprintf(fph,"SF_DER_X_21 ");
-
-	if ( ret & BlockChain::SF_DER_Y_1E ) fprintf(fph,"SF_DER_Y_1E ");
-	if ( ret & BlockChain::SF_DER_Y_1F ) fprintf(fph,"SF_DER_Y_1F ");
-	if ( ret & BlockChain::SF_DER_Y_20 ) fprintf(fph,"SF_DER_Y_20 ");
-	if ( ret & BlockChain::SF_DER_Y_21 ) fprintf(fph,"SF_DER_Y_21 ");
-}
+	inline uint32_t getLength(void) const
+	{
+		return mLength;
+	}
 
-class ZombieFinder
-{
-public:
-	ZombieFinder(void)
+private:
+	inline void put(char c)
 	{
-		mLastBalance = NULL;
-		mLastAge = 0;
-		mLastDate = 0;
-		mAddress = NULL;
+		if ( mLength < mDestSize )
+		{
+			mDest[mLength] = c;
+		}
+		mLength++;
 	}
-	uint64_t		mLastBalance;
-	uint32_t		mLastDate;
-	uint32_t		mLastAge;
-	BitcoinAddress	*mAddress;
+
+	char		*mDest;
+	uint32_t	mDestSize;
+	uint32_t	mLength;
 };
 
+#define MAX_UNSPENT_ADDRESSES 128	// Addresses one '/unspent?active=' request may name
+
 class BitcoinTransactionFactory
 {
 public:
 	BitcoinTransactionFactory(void)
 	{
-		mTransactionReferences = NULL;
 		mTransactions = NULL;
 		mInputs = NULL;
 		mOutputs = NULL;
 		mBlocks = NULL;
+		mClustersDirty = false;
+		mOutputBegin = NULL;
+		mOutputBeginCount = 0;
+		mAddressTransactions = new AddressTransactionIndex;
+		mAddressTransactionsCount = 0;
 		mTransactionCount = 0;
 		mTotalInputCount = 0;
 		mTotalOutputCount = 0;
 		mBlockCount = 0;
+		mTransactionHighWater = 0;
+		mInputHighWater = 0;
+		mOutputHighWater = 0;
+		mBlockHighWater = 0;
 		mStatCount = 0;
 
 		mStatLimits[SS_ZERO] = 0;
@@ -3086,8 +7824,9 @@ public:
 		delete []mTransactions;
 		delete []mInputs;
 		delete []mOutputs;
-		delete []mTransactionReferences;
 		delete []mZombieFinder;
+		delete []mOutputBegin;
+		mSnapshots.retireIndex(mAddressTransactions);
 	}
 
 	void init(void)
@@ -3130,16 +7869,21 @@ public:
 		return ret;
 	}
 
-	BitcoinAddress * getAddress(const uint8_t from[20],uint32_t &adr)
+	// Finds or adds the address for a key: a 20 byte hash, or for P2WSH and P2TR a 32 byte witness program.
+	BitcoinAddress * getAddress(const uint8_t *key,uint32_t keyLength,uint8_t scriptType,uint32_t &adr)
 	{
 		BitcoinAddress *ret = NULL;
 
-		BitcoinAddress h(from);
+		BitcoinAddress h(key,scriptType);
 		ret = mAddresses.find(h);
 
 		if ( ret == NULL )
 		{
 			ret = mAddresses.insert(h);
+			if ( ret && keyLength == 32 )
+			{
+				mWitnessPrograms.add(mAddresses.getIndex(ret),key);
+			}
 		}
 		if ( ret )
 		{
@@ -3148,6 +7892,24 @@ public:
 		return ret;
 	}
 
+	// The key of an address id; 20 bytes, or 32 for P2WSH and P2TR addresses.
+	const uint8_t *getAddressKey(uint32_t a,uint32_t &keyLength) const
+	{
+		const BitcoinAddress *ba = mAddresses.getKey(a-1);
+		const uint8_t *ret = (const uint8_t *)ba;
+		keyLength = 20;
+		if ( ba->hasWideKey() )
+		{
+			const uint8_t *program = mWitnessPrograms.find(a-1);
+			if ( program )
+			{
+				ret = program;
+				keyLength = 32;
+			}
+		}
+		return ret;
+	}
+
 	uint32_t getAddressCount(void) const
 	{
 		return (uint32_t)mAddresses.size();
@@ -3214,17 +7976,244 @@ public:
 		return ret;
 	}
 
+	// Starts the undo record for a block; must be called before any of the block's transactions are allocated.
+	void beginBlock(uint32_t blockIndex)
+	{
+		BlockUndo &b = mUndoJournal.beginBlock();
+		b.mBlock = blockIndex;
+		b.mTransactionBase = mTransactionCount;
+		b.mInputBase = mTotalInputCount;
+		b.mOutputBase = mTotalOutputCount;
+		b.mAddressBase = mAddresses.size();
+	}
+
+	// Appends the balance history points of the block just processed: every address the block touched gets one point holding
+	// its balance once the whole block has been applied.  While snapshots are being served its transactions are also appended
+	// to the address transaction index, so readers find them without scanning.
+	void endBlock(void)
+	{
+		mHistory.resize(mAddresses.size());
+		uint32_t transactionCount;
+		const Transaction *transactions = mBlockCount ? getBlock(mBlockCount-1,transactionCount) : NULL;
+		if ( transactions && mSnapshots.isEnabled() )
+		{
+			uint32_t base = (uint32_t)(transactions-mTransactions);
+			for (uint32_t i=0; i<transactionCount && mAddressTransactions->append(transactions[i],base+i,mIndexAddresses); i++);
+		}
+		for (uint32_t i=0; transactions && i<transactionCount; i++)
+		{
+			const Transaction &t = transactions[i];
+			for (uint32_t j=0; j<t.mOutputCount; j++)
+			{
+				addHistoryPoint(t.mOutputs[j].mAddress,t.mBlock);
+			}
+			for (uint32_t j=0; j<t.mInputCount; j++)
+			{
+				if ( t.mInputs[j].mOutput )
+				{
+					addHistoryPoint(t.mInputs[j].mOutput->mAddress,t.mBlock);
+				}
+			}
+		}
+	}
+
+	inline void addHistoryPoint(uint32_t adr,uint32_t block)
+	{
+		BitcoinAddress *ba = getAddress(adr);
+		if ( ba )
+		{
+			mHistory.append(adr,block,ba->mTotalReceived-ba->mTotalSent);
+		}
+	}
+
+	// Takes the balance history points of this block, the newest one processed, back off; its transactions must still be
+	// in place.
+	void removeHistory(const BlockUndo &b)
+	{
+		for (uint32_t i=b.mTransactionBase; i<mTransactionCount; i++)
+		{
+			const Transaction &t = mTransactions[i];
+			for (uint32_t j=0; j<t.mOutputCount; j++)
+			{
+				mHistory.remove(t.mOutputs[j].mAddress,b.mBlock);
+			}
+			for (uint32_t j=0; j<t.mInputCount; j++)
+			{
+				if ( t.mInputs[j].mOutput )
+				{
+					mHistory.remove(t.mInputs[j].mOutput->mAddress,b.mBlock);
+				}
+			}
+		}
+	}
+
+	// Throws away the undo record beginBlock just started, for a block which could not be applied after all.  Nothing has
+	// been journaled for it yet, so a later disconnect must not find it.
+	void cancelBlock(void)
+	{
+		mUndoJournal.popLast();
+	}
+
+	// Credits an output to its address and journals the change.
+	void receive(uint32_t adr,uint64_t value,uint32_t time)
+	{
+		BitcoinAddress *ba = getAddress(adr);
+		if ( ba )
+		{
+			UndoEntry &e = mUndoJournal.addEntry();
+			e.mAddress = adr;
+			e.mOutput = 0xFFFFFFFF;
+			e.mValue = value;
+			e.mPreviousTime = ba->mLastOutputTime;
+			e.mPreviousFirstTime = ba->mFirstOutputTime;
+			ba->mTotalReceived+=value;
+			ba->mOutputCount++;
+			if ( time > ba->mLastOutputTime )
+			{
+				ba->mLastOutputTime = time;
+				if ( ba->mFirstOutputTime == 0 )
+				{
+					ba->mFirstOutputTime = time;
+				}
+			}
+			mSnapshots.update(adr-1,ba->mTotalReceived,ba->mTotalSent);
+		}
+	}
+
+	// Marks a previous output as spent by this transaction, debits its address and journals the change.
+	void spend(TransactionOutput *o,uint32_t spender,uint32_t time)
+	{
+		o->mSpentBy = spender;
+		uint32_t outputIndex = (uint32_t)(o-mOutputs);
+		BitcoinAddress *ba = getAddress(o->mAddress);
+		UndoEntry &e = mUndoJournal.addEntry();
+		e.mAddress = o->mAddress;
+		e.mOutput = outputIndex;
+		e.mValue = o->mValue;
+		e.mPreviousTime = ba ? ba->mLastInputTime : 0;
+		e.mPreviousFirstTime = 0;
+		if ( ba )
+		{
+			ba->mTotalSent+=o->mValue;
+			ba->mInputCount++;
+			if ( time > ba->mLastInputTime )
+			{
+				ba->mLastInputTime = time;
+			}
+			mSnapshots.update(o->mAddress-1,ba->mTotalReceived,ba->mTotalSent);
+		}
+	}
+
+	uint32_t getTransactionIndex(const Transaction *t) const
+	{
+		return (uint32_t)(t-mTransactions);
+	}
+
+	uint32_t getBlockCount(void) const
+	{
+		return mBlockCount;
+	}
+
+	uint32_t getUndoDepth(void) const
+	{
+		return mUndoJournal.getDepth();
+	}
+
+	// Disconnects up to 'count' of the most recently processed blocks, newest first, by replaying their journal entries backwards.
+	// The work is proportional to the size of the blocks undone.  Returns how many blocks were actually disconnected, which is
+	// less than requested if the journal does not reach back that far.
+	uint32_t disconnectBlocks(uint32_t count,uint32_t &transactionBase,uint32_t &inputsRemoved,uint32_t &outputsRemoved)
+	{
+		// Everything below is rolled back in place, so readers on other threads are drained first; they wait for a new
+		// snapshot until the caller is done.
+		mSnapshots.retract();
+		uint32_t ret = 0;
+		uint32_t inputCount = mTotalInputCount;
+		uint32_t outputCount = mTotalOutputCount;
+		while ( ret < count )
+		{
+			BlockUndo *b = mUndoJournal.getLast();
+			if ( b == NULL || mBlockCount == 0 )
+			{
+				break;
+			}
+			uint64_t sequence = b->mEntryEnd;
+			while ( sequence > b->mEntryBegin )
+			{
+				sequence--;
+				UndoEntry &e = mUndoJournal.getEntry(sequence);
+				BitcoinAddress *ba = getAddress(e.mAddress);
+				if ( e.mOutput != 0xFFFFFFFF )
+				{
+					mOutputs[e.mOutput].mSpentBy = 0xFFFFFFFF;
+					if ( ba )
+					{
+						ba->mTotalSent-=e.mValue;
+						ba->mInputCount--;
+						ba->mLastInputTime = e.mPreviousTime;
+						mSnapshots.update(e.mAddress-1,ba->mTotalReceived,ba->mTotalSent);
+					}
+				}
+				else if ( ba )
+				{
+					ba->mTotalReceived-=e.mValue;
+					ba->mOutputCount--;
+					ba->mLastOutputTime = e.mPreviousTime;
+					ba->mFirstOutputTime = e.mPreviousFirstTime;
+					mSnapshots.update(e.mAddress-1,ba->mTotalReceived,ba->mTotalSent);
+				}
+			}
+			removeHistory(*b);
+			// Addresses first seen in this block are the newest entries in the address table; pop them back off.
+			while ( mAddresses.size() > b->mAddressBase )
+			{
+				mZombieFinder[mAddresses.size()-1] = ZombieFinder();
+				mAddresses.removeLast();
+			}
+			mWitnessPrograms.truncate(mAddresses.size());
+			mHistory.resize(mAddresses.size());
+			updateHighWater();
+			mTransactionCount = b->mTransactionBase;
+			mTotalInputCount = b->mInputBase;
+			mTotalOutputCount = b->mOutputBase;
+			mBlockCount--;
+			mUndoJournal.popLast();
+			mClustersDirty = true; // unions can not be taken back once paths have been compressed through them
+			ret++;
+		}
+		if ( mOutputBeginCount > mTransactionCount )
+		{
+			mOutputBeginCount = mTransactionCount; // offsets below the rewound count are still valid
+		}
+		if ( mAddressTransactionsCount > mTransactionCount )
+		{
+			mAddressTransactionsCount = mTransactionCount; // indexed transactions past this point are gone
+		}
+		mAddressTransactions->truncate(mTransactionCount);
+		transactionBase = mTransactionCount;
+		inputsRemoved = inputCount - mTotalInputCount;
+		outputsRemoved = outputCount - mTotalOutputCount;
+		return ret;
+	}
+
 	const char *getKey(uint32_t a) const
 	{
 		static char scratch[256];
+		return getKey(a,scratch,256);
+	}
+
+	// Thread safe form of getKey; writes the ascii address into 'dest'.
+	const char *getKey(uint32_t a,char *dest,uint32_t destSize) const
+	{
 		const char *ret = "UNKNOWN ADDRESS";
 		if ( a )
 		{
-			BitcoinAddress *ba = mAddresses.getKey(a-1);
-			uint8_t address1[25];
-			BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinRIPEMD160ToAddress((const uint8_t *)ba,address1);
-			BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(address1,scratch,256);
-			ret = scratch;
+			uint32_t keyLength;
+			const uint8_t *key = getAddressKey(a,keyLength);
+			if ( BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinKeyToAscii(mAddresses.getKey(a-1)->mScriptType,key,keyLength,dest,destSize) )
+			{
+				ret = dest;
+			}
 		}
 		return ret;
 	}
@@ -3423,15 +8412,67 @@ public:
 		Transaction *t = getBlock(blockIndex,tcount);
 		if ( t )
 		{
-			logMessage("===================================================\r\n");
-			logMessage("Block #%s has %s transactions.\r\n", formatNumber(blockIndex), formatNumber(tcount) );
-			for (uint32_t j=0; j<tcount; j++)
-			{
-				printTransaction(j,t,0);
-				t++;
-			}
-			logMessage("===================================================\r\n");
-			logMessage("\r\n");
+			logMessage("===================================================\r\n");
+			logMessage("Block #%s has %s transactions.\r\n", formatNumber(blockIndex), formatNumber(tcount) );
+			for (uint32_t j=0; j<tcount; j++)
+			{
+				printTransaction(j,t,0);
+				t++;
+			}
+			logMessage("===================================================\r\n");
+			logMessage("\r\n");
+		}
+	}
+
+	// Blocks only ever come off the end when they are disconnected, so that is the only place the high water marks can be
+	// passed by the current counts.
+	void updateHighWater(void)
+	{
+		mTransactionHighWater = mTransactionCount > mTransactionHighWater ? mTransactionCount : mTransactionHighWater;
+		mInputHighWater = mTotalInputCount > mInputHighWater ? mTotalInputCount : mInputHighWater;
+		mOutputHighWater = mTotalOutputCount > mOutputHighWater ? mTotalOutputCount : mOutputHighWater;
+		mBlockHighWater = mBlockCount > mBlockHighWater ? mBlockCount : mBlockHighWater;
+	}
+
+	void reportMemory(MemoryReport &report)
+	{
+		updateHighWater();
+		report.addHash("addresses",mAddresses);
+		report.add("address zombie finder",mZombieFinder,sizeof(ZombieFinder),MAX_BITCOIN_ADDRESSES,mAddresses.size(),mAddresses.getHighWater());
+		mWitnessPrograms.reportMemory(report);
+		mClusters.reportMemory(report);
+		report.add("transactions",mTransactions,sizeof(Transaction),mTransactions ? MAX_TOTAL_TRANSACTIONS : 0,mTransactionCount,mTransactionHighWater);
+		report.add("inputs",mInputs,sizeof(TransactionInput),mInputs ? MAX_TOTAL_INPUTS : 0,mTotalInputCount,mInputHighWater);
+		report.add("outputs",mOutputs,sizeof(TransactionOutput),mOutputs ? MAX_TOTAL_OUTPUTS : 0,mTotalOutputCount,mOutputHighWater);
+		report.add("block transaction pointers",mBlocks,sizeof(Transaction *),mBlocks ? MAX_TOTAL_BLOCKS : 0,mBlockCount,mBlockHighWater);
+		report.add("output offsets",mOutputBegin,sizeof(uint32_t),mOutputBegin ? MAX_TOTAL_TRANSACTIONS : 0,mOutputBeginCount,mOutputBeginCount);
+		mUndoJournal.reportMemory(report);
+		mHistory.reportMemory(report);
+		uint64_t indexBytes = mAddressTransactions ? mAddressTransactions->getMemoryUsed() : 0;
+		report.add("address transaction index",NULL,1,indexBytes,indexBytes,indexBytes);
+
+		// The statistics rows are fixed; the address arrays hanging off them are allocated to size as each row is gathered
+		report.add("statistics rows",mStatistics,sizeof(StatRow),MAX_STAT_COUNT,mStatCount,mStatCount);
+		uint64_t addressCount = 0;
+		uint64_t deleteCount = 0;
+		for (uint32_t i=0; i<mStatCount; i++)
+		{
+			const StatRow &row = mStatistics[i];
+			addressCount+=(uint64_t)(row.mAddresses ? row.mAddressCount : 0)+(row.mNewAddresses ? row.mNewAddressCount : 0)+(row.mChangedAddresses ? row.mChangeAddressCount : 0);
+			deleteCount+= row.mDeletedAddresses ? row.mDeleteAddressCount : 0;
+		}
+		report.add("statistics addresses",NULL,sizeof(StatAddress),addressCount,addressCount,addressCount);
+		for (uint32_t i=0; i<mStatCount; i++)
+		{
+			const StatRow &row = mStatistics[i];
+			report.addRegion(row.mAddresses,sizeof(StatAddress)*(uint64_t)row.mAddressCount);
+			report.addRegion(row.mNewAddresses,sizeof(StatAddress)*(uint64_t)row.mNewAddressCount);
+			report.addRegion(row.mChangedAddresses,sizeof(StatAddress)*(uint64_t)row.mChangeAddressCount);
+		}
+		report.add("statistics deleted addresses",NULL,sizeof(uint32_t),deleteCount,deleteCount,deleteCount);
+		for (uint32_t i=0; i<mStatCount; i++)
+		{
+			report.addRegion(mStatistics[i].mDeletedAddresses,sizeof(uint32_t)*(uint64_t)mStatistics[i].mDeleteAddressCount);
 		}
 	}
 
@@ -3444,6 +8485,9 @@ public:
 			logMessage("%s inputs.\r\n", formatNumber(mTotalInputCount) );
 			logMessage("%s outputs.\r\n", formatNumber(mTotalOutputCount) );
 			logMessage("%s addresses.\r\n", formatNumber(mAddresses.size()) );
+			refreshClusters();
+			logMessage("%s address clusters.\r\n", formatNumber(mClusters.getClusterCount()) );
+			logMessage("%0.1f million address balance history points.\r\n", (float)mHistory.getPointCount()/1000000.0f );
 
 			enum StatType
 			{
@@ -3556,13 +8600,21 @@ public:
 		}
 
 		{
-			logMessage("Found %d unique input signature formats.\r\n", gSignatureStatCount );
-			for (uint32_t i=0; i<gSignatureStatCount; i++)
+			logMessage("Found %d unique input signature formats.\r\n", gSignatureStats.size() );
+			if ( gSignatureStats.getDroppedCount() )
 			{
-				SignatureStat &s = gSignatureStats[i];
+				logMessage("%llu inputs had formats beyond the first %d and were not counted.\r\n", (unsigned long long)gSignatureStats.getDroppedCount(), MAX_SIGNATURE_STAT );
+			}
+			for (uint32_t i=0; i<gSignatureStats.size(); i++)
+			{
+				const SignatureStat &s = gSignatureStats.get(i);
+				if ( s.mCount == 0 )
+				{
+					continue; // only seen in blocks which have since been disconnected
+				}
 
 				logMessage("===================================================================\r\n");
-				logMessage("Signature Format %d was encountered %s times and has the following states\r\n", i+1, formatNumber(s.mCount) );
+				logMessage("Signature Format %d was encountered %llu times and has the following states\r\n", i+1, (unsigned long long)s.mCount );
 				logMessage("Signatures inputs of this format referred to outputs totaling this much value. %0.9f\r\n", (float) s.mValue / ONE_BTC );
 
 				if ( s.mFlags & BlockChain::SF_ABNORMAL ) logMessage("SF_ABNORMAL\r\n");
@@ -3608,28 +8660,6 @@ public:
 	}
 
 
-	void gatherTransaction(BitcoinAddress *ba,Transaction *t,uint32_t tindex)
-	{
-		if ( ba && ba->mTransactionIndex != tindex )
-		{
-			ba->mTransactionIndex = tindex;
-			ba->mTransactions[ba->mTransactionCount] = t;
-			ba->mTransactionCount++;
-		}
-	}
-
-	void countTransaction(BitcoinAddress *ba,
-						  uint32_t tindex,
-						  uint32_t &transactionReferenceCount)
-	{
-		if ( ba && ba->mTransactionIndex != tindex )
-		{
-			ba->mTransactionIndex = tindex;
-			ba->mTransactionCount++;
-			transactionReferenceCount++;
-		}
-	}
-
 	BitcoinAddress *getAddress(uint32_t a)
 	{
 		BitcoinAddress *ret = NULL;
@@ -3643,8 +8673,7 @@ public:
 
 	void gatherAddresses(uint32_t refTime)
 	{
-		delete []mTransactionReferences;
-		mTransactionReferences = NULL;
+		PROFILE_SCOPE_ITEMS(PS_GATHER_ADDRESSES,mAddresses.size());
 
 //		printf("Gathering bitcoin addresses relative to this date: %s\r\n", getTimeString(refTime));
 
@@ -3654,19 +8683,21 @@ public:
 		{
 			BitcoinAddress *ba = mAddresses.getKey(i);
 
+			// Address balances are now maintained as blocks are processed, so the 'before' state is the snapshot taken at the end of the previous gather.
 			ZombieFinder &z = mZombieFinder[i];
 			if ( z.mAddress == NULL )
 			{
 				z.mAddress = ba;
+				z.mLastDate = 0;
+				z.mLastBalance = 0;
+			}
+			z.mLastAge = 0;
+			if ( z.mLastDate )
+			{
+				double seconds = difftime(time_t(refTime),time_t(z.mLastDate));
+				z.mLastAge = (uint32_t)(seconds/(60*60*24));	// the days since last used before we rebuild all of the transactions
 			}
 
-			z.mLastDate = ba->getLastUsedTime();
-			z.mLastAge = ba->getDaysSinceLastUsed(refTime);	// assign the days since last used before we rebuild all of the transactions
-			z.mLastBalance = ba->getBalance();				// assign the balance before we rebuild all of the transaction
-
-			ba->mTransactionCount = 0;
-			ba->mTransactionIndex = 0xFFFFFFFF;
-			ba->mTransactions = NULL;
 			ba->mLastInputTime = 0;
 			ba->mLastOutputTime = 0;
 			ba->mFirstOutputTime = 0;
@@ -3677,40 +8708,7 @@ public:
 			ba->mBitcoinAddressFlags = 0;
 		}
 
-		uint32_t transactionReferenceCount=0;
-
-		// ok..we.now it's time to add all transactions to all addresses...
-		for (uint32_t i=0; i<mTransactionCount; i++)
-		{
-			Transaction &t = mTransactions[i];
-			for (uint32_t j=0; j<t.mOutputCount; j++)
-			{
-				TransactionOutput &o = t.mOutputs[j];
-				BitcoinAddress *ba = getAddress(o.mAddress);
-				countTransaction(ba,i,transactionReferenceCount);
-			}
-			for (uint32_t j=0; j<t.mInputCount; j++)
-			{
-				TransactionInput &input = t.mInputs[j];
-				if ( input.mOutput )
-				{
-					TransactionOutput &o = *input.mOutput;
-					BitcoinAddress *ba = getAddress(o.mAddress);
-					countTransaction(ba,i,transactionReferenceCount);
-				}
-			}
-		}
-
-		mTransactionReferences = new Transaction*[transactionReferenceCount];
-		transactionReferenceCount=0;
-		for (uint32_t i=0; i<mAddresses.size(); i++)
-		{
-			BitcoinAddress *ba = mAddresses.getKey(i);
-			ba->mTransactions = &mTransactionReferences[transactionReferenceCount];
-			transactionReferenceCount+=ba->mTransactionCount;
-			ba->mTransactionIndex = 0xFFFFFFFF; // which transaction we have stored yet so far...
-			ba->mTransactionCount = 0;
-		}
+		refreshAddressTransactions();
 
 		// ok..we.now it's time to add all transactions to all addresses...
 		for (uint32_t i=0; i<mTransactionCount; i++)
@@ -3757,8 +8755,6 @@ public:
 						}
 					}
 
-					gatherTransaction(ba,&t,i);
-
 					ba->mTotalReceived+=o.mValue;
 					ba->mOutputCount++;
 					if ( t.mTime > ba->mLastOutputTime ) // if the transaction time is more recnet than the last output time..
@@ -3785,7 +8781,6 @@ public:
 					if ( ba )
 					{
 						ba->mBitcoinAddressFlags|=BitcoinAddress::BAT_HAS_SENDS;
-						gatherTransaction(ba,&t,i);
 						ba->mTotalSent+=o.mValue;
 						ba->mInputCount++;
 						if ( t.mTime > ba->mLastInputTime ) // if the transaction time is newer than the last input/spent time..
@@ -3866,6 +8861,15 @@ public:
 			fprintf(mZombieOutput,"\r\n");
 			fprintf(mZombieOutput,"\r\n");
 		}
+
+		// Snapshot the state the next gather will compare against.
+		for (uint32_t i=0; i<mAddresses.size(); i++)
+		{
+			BitcoinAddress *ba = mAddresses.getKey(i);
+			ZombieFinder &z = mZombieFinder[i];
+			z.mLastDate = ba->getLastUsedTime();
+			z.mLastBalance = ba->getBalance();
+		}
 	}
 
 	void printTopBalances(uint32_t tcount,float minBalance)
@@ -4087,52 +9091,491 @@ public:
 
 		if ( plotCount < tcount )
 		{
-			tcount = plotCount;
+			tcount = plotCount;
+		}
+		logMessage("Displaying the top %d addresses by age.\r\n", tcount );
+		logMessage("==============================================\r\n");
+		logMessage(" Address           : Balance  : Days Since Last Use\r\n");
+		logMessage("==============================================\r\n");
+		for (uint32_t i=0; i<tcount; i++)
+		{
+			BitcoinAddress *ba = sortPointers[i];
+			uint64_t balance = ba->mTotalReceived-ba->mTotalSent;
+			uint32_t lastUsed = ba->mLastInputTime; // the last time we sent money (not received because anyone can send us money).
+			if ( ba->mLastInputTime == 0 ) // if it has never had a spend.. then we use the time of first receive..
+			{
+				lastUsed = ba->mFirstOutputTime;
+			}
+			double seconds = difftime(currentTime,time_t(lastUsed));
+			double minutes = seconds/60;
+			double hours = minutes/60;
+			uint32_t days = (uint32_t) (hours/24);
+			uint32_t adr = mAddresses.getIndex(ba)+1;
+			logMessage("%40s,  %0.4f,  %4d\r\n", getKey(adr), (float) balance / ONE_BTC, days );
+		}
+		delete []sortPointers;
+	}
+
+	void printAddress(const char *adr)
+	{
+		uint32_t a = findAddress(adr);
+		if ( a )
+		{
+			printAddress(mAddresses.getKey(a-1));
+		}
+	}
+
+	// Runs an address query (see AddressQuery) and prints the matching rows; returns the total number of matches.
+	uint32_t query(const char *expression,uint32_t referenceTime)
+	{
+		AddressQuery q;
+		if ( !q.parse(expression,referenceTime) )
+		{
+			return 0;
+		}
+		q.plan(mAddresses,mAddresses.size());
+		uint32_t pointRow = 0xFFFFFFFF;
+		if ( q.getAddress() )
+		{
+			uint32_t adr = findAddress(q.getAddress());
+			if ( adr == 0 )
+			{
+				return 0;
+			}
+			pointRow = adr-1;
+		}
+		std::vector< uint32_t > rows;
+		uint32_t matchCount = q.execute(mAddresses,mAddresses.size(),pointRow,rows);
+		logMessage("Address                            :      Balance :     Received :         Sent : Transactions : Last Used\r\n");
+		for (size_t i=0; i<rows.size(); i++)
+		{
+			BitcoinAddress *ba = mAddresses.getKey(rows[i]);
+			logMessage("%-34s : %12.4f : %12.4f : %12.4f : %12d : %s\r\n",
+				getKey(rows[i]+1),
+				(double)ba->getBalance()/ONE_BTC,
+				(double)ba->mTotalReceived/ONE_BTC,
+				(double)ba->mTotalSent/ONE_BTC,
+				ba->mTransactionCount,
+				getTimeString(ba->getLastUsedTime()) );
+		}
+		logMessage("Query matched %s addresses; showing %s.\r\n", formatNumber(matchCount), formatNumber((uint32_t)rows.size()) );
+		return matchCount;
+	}
+
+	// Rebuilds the list of transactions each address appears in.  The index is built anew rather than in place, since readers
+	// on other threads may still be walking the previous one.
+	void rebuildAddressTransactions(void)
+	{
+		uint32_t threadCount = std::thread::hardware_concurrency();
+		if ( threadCount > 8 )
+		{
+			threadCount = 8;
+		}
+		AddressTransactionIndex *index = new AddressTransactionIndex;
+		index->build(mTransactions,mTransactionCount,mAddresses.size(),threadCount);
+		mSnapshots.retireIndex(mAddressTransactions);
+		mAddressTransactions = index;
+		mAddressTransactionsCount = mTransactionCount;
+	}
+
+	void refreshAddressTransactions(void)
+	{
+		rebuildAddressTransactions();
+		for (uint32_t i=0; i<mAddresses.size(); i++)
+		{
+			mAddresses.getKey(i)->mTransactionCount = mAddressTransactions->getCount(i);
+		}
+	}
+
+	// Publishes the current state for readers on other threads.  The caller must hold the lock which keeps other threads from
+	// publishing or processing blocks at the same time.
+	void publishSnapshot(void)
+	{
+		if ( !mSnapshots.isEnabled() )
+		{
+			mSnapshots.enable(mAddresses);
+		}
+		if ( mAddressTransactions->getEnd() != mTransactionCount || mTransactionCount-mAddressTransactionsCount > MAX_UNINDEXED_TRANSACTIONS )
+		{
+			rebuildAddressTransactions(); // the tail fell behind (snapshots were off, or it filled up) or has grown too long
+		}
+		mSnapshots.publish(mBlockCount,mTransactionCount,mAddresses.size(),mAddressTransactions,mAddressTransactionsCount);
+	}
+
+	// Called when a block has been processed, disconnected or the statistics gathered; publishes a snapshot right away if
+	// readers have been asking for one.
+	void commitSnapshot(void)
+	{
+		mSnapshots.bumpGeneration();
+		if ( mSnapshots.takeRequest() )
+		{
+			publishSnapshot();
+		}
+	}
+
+	inline AddressSnapshots &getSnapshots(void)
+	{
+		return mSnapshots;
+	}
+
+	// Collects the ascending indices of every transaction this address id appears in as of the snapshot, including those
+	// processed since the snapshot's address transaction index was built, which come from the index's tail.  Safe on any
+	// thread inside a read.
+	void getAddressTransactions(const AddressSnapshot &snapshot,uint32_t adr,std::vector< uint32_t > &list) const
+	{
+		list.clear();
+		if ( adr == 0 ) return;
+		uint32_t indexed = 0;
+		if ( snapshot.mAddressTransactions )
+		{
+			indexed = snapshot.mIndexedCount < snapshot.mTransactionCount ? snapshot.mIndexedCount : snapshot.mTransactionCount;
+			AddressTransactionIterator iter = snapshot.mAddressTransactions->getTransactions(adr-1);
+			uint32_t index;
+			while ( iter.next(index) && index < indexed )
+			{
+				list.push_back(index);
+			}
+			snapshot.mAddressTransactions->getAppended(adr-1,indexed,snapshot.mTransactionCount,list);
+		}
+	}
+
+	// Returns the hash of a transaction, which is the hash map entry with the same index since transactions are inserted into
+	// the map in order as their blocks are read.
+	static const uint8_t *getTransactionHash(TransactionHashMap &transactionMap,uint32_t index)
+	{
+		const uint8_t *ret = NULL;
+		if ( index < transactionMap.size() )
+		{
+			const FileLocation *f = transactionMap.getKey(index);
+			if ( f->mTransactionIndex == index )
+			{
+				ret = (const uint8_t *)f;
+			}
+		}
+		return ret;
+	}
+
+	// Renders the blockchain.info '/address/<adr>?format=json' document for this address id as of the snapshot, newest
+	// transactions first.  Returns the length of the whole document.  Safe on any thread inside a read.
+	uint32_t writeAddressJSON(const AddressSnapshot &snapshot,uint32_t adr,uint32_t offset,uint32_t limit,TransactionHashMap &transactionMap,char *dest,uint32_t destSize) const
+	{
+		JsonBuffer json(dest,destSize);
+		std::vector< uint32_t > list;
+		getAddressTransactions(snapshot,adr,list);
+		uint32_t keyLength;
+		const uint8_t *addressKey = getAddressKey(adr,keyLength);
+		uint64_t received = 0;
+		uint64_t sent = 0;
+		snapshot.getBalance(adr-1,received,sent);
+		char key[256];
+		json.append("{\"hash160\":\"");
+		json.appendHex(addressKey,keyLength,false);
+		json.appendf("\",\"address\":\"%s\",\"n_tx\":%u,\"total_received\":%llu,\"total_sent\":%llu,\"final_balance\":%llu,\"txs\":[",
+			getKey(adr,key,sizeof(key)),
+			(uint32_t)list.size(),
+			(unsigned long long)received,
+			(unsigned long long)sent,
+			(unsigned long long)(received-sent));
+		uint32_t end = offset < list.size() ? (uint32_t)list.size()-offset : 0;
+		uint32_t begin = end > limit ? end-limit : 0;
+		for (uint32_t i=end; i>begin; i--)
+		{
+			uint32_t index = list[i-1];
+			const Transaction &t = mTransactions[index];
+			json.append(i == end ? "{\"hash\":" : ",{\"hash\":");
+			const uint8_t *hash = getTransactionHash(transactionMap,index);
+			if ( hash )
+			{
+				json.append("\"");
+				json.appendHex(hash,32,true);
+				json.append("\"");
+			}
+			else
+			{
+				json.append("null");
+			}
+			json.appendf(",\"tx_index\":%u,\"block_height\":%u,\"time\":%u,\"inputs\":[", index, t.mBlock, t.mTime );
+			for (uint32_t j=0; j<t.mInputCount; j++)
+			{
+				const TransactionOutput *o = t.mInputs[j].mOutput;
+				if ( j ) json.append(",");
+				if ( o )
+				{
+					json.appendf("{\"prev_out\":{\"addr\":\"%s\",\"value\":%llu,\"spent\":true}}", getKey(o->mAddress,key,sizeof(key)), (unsigned long long)o->mValue );
+				}
+				else
+				{
+					json.append("{}"); // coinbase
+				}
+			}
+			json.append("],\"out\":[");
+			for (uint32_t j=0; j<t.mOutputCount; j++)
+			{
+				const TransactionOutput &o = t.mOutputs[j];
+				if ( j ) json.append(",");
+				json.appendf("{\"addr\":\"%s\",\"value\":%llu,\"n\":%u,\"spent\":%s}", getKey(o.mAddress,key,sizeof(key)), (unsigned long long)o.mValue, j, isSpent(snapshot,o) ? "true" : "false" );
+			}
+			json.append("]}");
+		}
+		json.append("]}");
+		return json.getLength();
+	}
+
+	// An output is spent in a snapshot if the transaction spending it is part of the snapshot.  The writer only ever changes
+	// mSpentBy from unspent to a transaction past the snapshot (or back, once readers have been drained), so either value
+	// a reader sees gives the same answer.
+	static inline bool isSpent(const AddressSnapshot &snapshot,const TransactionOutput &o)
+	{
+		return o.mSpentBy < snapshot.mTransactionCount;
+	}
+
+	// Appends the hex of the standard output script paying to an address of this type and key.
+	static void appendOutputScript(JsonBuffer &json,uint8_t scriptType,const uint8_t *key,uint32_t keyLength)
+	{
+		switch ( scriptType )
+		{
+			case BlockChain::ST_P2SH:
+				json.append("a914");
+				json.appendHex(key,keyLength,false);
+				json.append("87");
+				break;
+			case BlockChain::ST_P2WPKH:
+			case BlockChain::ST_P2WSH:
+				json.appendf("00%02x", keyLength);
+				json.appendHex(key,keyLength,false);
+				break;
+			case BlockChain::ST_P2TR:
+				json.appendf("51%02x", keyLength);
+				json.appendHex(key,keyLength,false);
+				break;
+			default:
+				json.append("76a914");
+				json.appendHex(key,keyLength,false);
+				json.append("88ac");
+				break;
+		}
+	}
+
+	// Renders the blockchain.info '/unspent?active=' document for these address ids as of the snapshot, oldest outputs first
+	// and at most 'limit' of them.  The output script is not kept, so it is given as the standard script for the type of the
+	// address.  Safe on any thread inside a read.
+	uint32_t writeUnspentJSON(const AddressSnapshot &snapshot,const uint32_t *addresses,uint32_t addressCount,uint32_t limit,TransactionHashMap &transactionMap,char *dest,uint32_t destSize,uint32_t &outputCount) const
+	{
+		JsonBuffer json(dest,destSize);
+		std::vector< uint32_t > list;
+		outputCount = 0;
+		json.append("{\"unspent_outputs\":[");
+		for (uint32_t a=0; a<addressCount && outputCount<limit; a++)
+		{
+			uint32_t adr = addresses[a];
+			getAddressTransactions(snapshot,adr,list);
+			uint32_t keyLength;
+			const uint8_t *key = getAddressKey(adr,keyLength);
+			uint8_t scriptType = mAddresses.getKey(adr-1)->mScriptType;
+			for (size_t i=0; i<list.size() && outputCount<limit; i++)
+			{
+				uint32_t index = list[i];
+				const Transaction &t = mTransactions[index];
+				const uint8_t *hash = getTransactionHash(transactionMap,index);
+				for (uint32_t j=0; j<t.mOutputCount && outputCount<limit; j++)
+				{
+					const TransactionOutput &o = t.mOutputs[j];
+					if ( o.mAddress != adr || isSpent(snapshot,o) || hash == NULL ) continue;
+					json.append(outputCount ? ",{\"tx_hash\":\"" : "{\"tx_hash\":\"");
+					json.appendHex(hash,32,false);
+					json.append("\",\"tx_hash_big_endian\":\"");
+					json.appendHex(hash,32,true);
+					json.appendf("\",\"tx_index\":%u,\"tx_output_n\":%u,\"script\":\"", index, j );
+					appendOutputScript(json,scriptType,key,keyLength);
+					json.appendf("\",\"value\":%llu,\"confirmations\":%u}", (unsigned long long)o.mValue, snapshot.mBlockCount-t.mBlock );
+					outputCount++;
+				}
+			}
+		}
+		json.append("]}");
+		return json.getLength();
+	}
+
+	// Returns the address id (index+1) for an ascii bitcoin address, or zero if it is invalid or has never been seen.
+	uint32_t findAddress(const char *adr,bool verbose=true)
+	{
+		uint32_t ret = 0;
+		uint32_t scriptType;
+		uint8_t key[40];
+		uint32_t keyLength;
+		if ( BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAsciiToKey(adr,scriptType,key,keyLength) )
+		{
+			BitcoinAddress ba(key,(uint8_t)scriptType);
+			BitcoinAddress *found = mAddresses.find(ba);
+			if ( found )
+			{
+				ret = mAddresses.getIndex(found)+1;
+			}
+			else if ( verbose )
+			{
+				logMessage("Failed to locate address: %s\r\n", adr );
+			}
+		}
+		else if ( verbose )
+		{
+			logMessage("Failed to decode address: %s\r\n", adr );
+		}
+		return ret;
+	}
+
+	// Balance of the address at the end of this block.  Returns false if the address is unknown.
+	bool getBalanceAtBlock(const char *address,uint32_t blockIndex,uint64_t &balance)
+	{
+		balance = 0;
+		uint32_t adr = findAddress(address);
+		if ( adr == 0 ) return false;
+		mHistory.getBalanceAtBlock(adr,blockIndex,balance);
+		return true;
+	}
+
+	// Called once the inputs of a transaction have been resolved.
+	inline void clusterInputs(const Transaction &t)
+	{
+		if ( !mClustersDirty )
+		{
+			mClusters.addTransaction(t);
+		}
+	}
+
+	void refreshClusters(void)
+	{
+		if ( mClustersDirty )
+		{
+			uint32_t threadCount = std::thread::hardware_concurrency();
+			if ( threadCount > 8 )
+			{
+				threadCount = 8;
+			}
+			logMessage("Rebuilding address clusters from %s transactions.\r\n", formatNumber(mTransactionCount) );
+			mClusters.build(mTransactions,mTransactionCount,mAddresses.size(),threadCount);
+			mClustersDirty = false;
+		}
+		mClusters.grow(mAddresses.size());
+	}
+
+	void printCluster(const char *address)
+	{
+		uint32_t adr = findAddress(address);
+		if ( adr == 0 ) return;
+		refreshClusters();
+		uint32_t id = mClusters.getClusterId(adr-1);
+		uint32_t count = 0;
+		uint64_t balance = 0;
+		logMessage("Cluster %s : owner of %s is also likely to control:\r\n", getKey(id+1), address );
+		for (uint32_t i=0; i<mAddresses.size(); i++)
+		{
+			if ( mClusters.getClusterId(i) == id )
+			{
+				BitcoinAddress *ba = mAddresses.getKey(i);
+				balance+=ba->getBalance();
+				if ( count < 32 )
+				{
+					logMessage("    %s : %0.4f\r\n", getKey(i+1), (float)ba->getBalance()/ONE_BTC );
+				}
+				count++;
+			}
+		}
+		if ( count > 32 )
+		{
+			logMessage("    ...and %s more.\r\n", formatNumber(count-32) );
+		}
+		logMessage("Cluster has %s addresses with a combined balance of %0.4f BTC\r\n", formatNumber(count), (float)balance/ONE_BTC );
+	}
+
+	bool saveClusters(const char *fname)
+	{
+		refreshClusters();
+		bool ret = mClusters.save(fname);
+		logMessage("%s %s address clusters to '%s'\r\n", ret ? "Saved" : "Failed to save", formatNumber(mClusters.getClusterCount()), fname );
+		return ret;
+	}
+
+	// The loaded clusters replace the current ones, including any rebuild pending after a disconnect.
+	bool loadClusters(const char *fname)
+	{
+		bool ret = mClusters.load(fname,mAddresses.size());
+		if ( ret )
+		{
+			mClustersDirty = false;
+			logMessage("Loaded address clusters from '%s'; %s clusters.\r\n", fname, formatNumber(mClusters.getClusterCount()) );
+		}
+		else
+		{
+			logMessage("Failed to load address clusters from '%s'\r\n", fname );
+		}
+		return ret;
+	}
+
+	// Extends the output row offsets to cover every processed transaction.
+	const uint32_t * getOutputBegin(void)
+	{
+		if ( mOutputBegin == NULL )
+		{
+			mOutputBegin = new uint32_t[MAX_TOTAL_TRANSACTIONS];
+		}
+		for (uint32_t i=mOutputBeginCount; i<mTransactionCount; i++)
+		{
+			mOutputBegin[i] = (uint32_t)(mTransactions[i].mOutputs - mOutputs);
+		}
+		mOutputBeginCount = mTransactionCount;
+		return mOutputBegin;
+	}
+
+	void traceTransaction(uint32_t transaction,uint32_t outputIndex,bool forward,TaintPolicy policy,uint32_t maxHops)
+	{
+		static const char *policyNames[3] = { "poison", "haircut", "fifo" };
+		if ( transaction >= mTransactionCount )
+		{
+			logMessage("Transaction has not been processed yet.\r\n");
+			return;
+		}
+		uint32_t threadCount = std::thread::hardware_concurrency();
+		if ( threadCount > 8 )
+		{
+			threadCount = 8;
 		}
-		logMessage("Displaying the top %d addresses by age.\r\n", tcount );
-		logMessage("==============================================\r\n");
-		logMessage(" Address           : Balance  : Days Since Last Use\r\n");
-		logMessage("==============================================\r\n");
-		for (uint32_t i=0; i<tcount; i++)
+		TaintTracer tracer(mTransactions,mTransactionCount,mInputs,mOutputs,getOutputBegin());
+		tracer.trace(transaction,outputIndex,forward,policy,maxHops,1024*1024*4,1024*1024,1000,threadCount);
+
+		const std::vector< TaintResult > &results = tracer.getResults();
+		uint64_t total = 0;
+		uint64_t endpoint = 0;
+		for (size_t i=0; i<results.size(); i++)
 		{
-			BitcoinAddress *ba = sortPointers[i];
-			uint64_t balance = ba->mTotalReceived-ba->mTotalSent;
-			uint32_t lastUsed = ba->mLastInputTime; // the last time we sent money (not received because anyone can send us money).
-			if ( ba->mLastInputTime == 0 ) // if it has never had a spend.. then we use the time of first receive..
+			total+=results[i].mAmount;
+			if ( results[i].mFlags )
 			{
-				lastUsed = ba->mFirstOutputTime;
+				endpoint+=results[i].mAmount;
 			}
-			double seconds = difftime(currentTime,time_t(lastUsed));
-			double minutes = seconds/60;
-			double hours = minutes/60;
-			uint32_t days = (uint32_t) (hours/24);
-			uint32_t adr = mAddresses.getIndex(ba)+1;
-			logMessage("%40s,  %0.4f,  %4d\r\n", getKey(adr), (float) balance / ONE_BTC, days );
 		}
-		delete []sortPointers;
-	}
-
-	void printAddress(const char *adr)
-	{
-		BitcoinAddress ba;
-		uint8_t output[25];
-		if ( BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAsciiToAddress(adr,output) )
+		logMessage("Traced %s using the %s policy: %s hops, %s transactions expanded, %s addresses reached.\r\n",
+			forward ? "forward" : "backward", policyNames[policy], formatNumber(tracer.getHopCount()), formatNumber((uint32_t)tracer.getExpandedCount()), formatNumber((uint32_t)results.size()) );
+		logMessage("%0.4f BTC %s.\r\n", (float)endpoint/ONE_BTC, forward ? "of tainted coins are still unspent" : "of the traced coins were newly mined" );
+		if ( tracer.isTruncated() )
 		{
-			memcpy(&ba.mWord0,&output[1],20);
-			BitcoinAddress *found = mAddresses.find(ba);
-			if ( found )
+			logMessage("The trace was truncated by the hop, frontier or result limit.\r\n");
+		}
+		if ( tracer.getDroppedAmount() )
+		{
+			logMessage("%0.4f BTC of taint was not followed to its end and is missing from the results.\r\n", (float)tracer.getDroppedAmount()/ONE_BTC );
+		}
+		for (size_t i=0; i<results.size() && i<32; i++)
+		{
+			const TaintResult &r = results[i];
+			if ( r.mFlags & TaintResult::TR_COINBASE )
 			{
-				printAddress(found);
+				logMessage("    %-34s : %0.4f BTC\r\n", "newly mined", (float)r.mAmount/ONE_BTC );
 			}
 			else
 			{
-				logMessage("Failed to locate address: %s\r\n", adr );
+				logMessage("    %-34s : %0.4f BTC%s\r\n", r.mAddress ? getKey(r.mAddress) : "unknown", (float)r.mAmount/ONE_BTC, (r.mFlags & TaintResult::TR_UNSPENT) ? " (unspent)" : "" );
 			}
 		}
-		else
-		{
-			logMessage("Failed to decode address: %s\r\n", adr );
-		}
 	}
 
 	void printAddresses(void)
@@ -4170,9 +9613,11 @@ public:
 		{
 			logMessage("Last Output Time: %s\r\n", getTimeString(ba->mLastOutputTime) );
 		}
-		for (uint32_t j=0; j<ba->mTransactionCount; j++)
+		AddressTransactionIterator iter = mAddressTransactions->getTransactions(i);
+		uint32_t index;
+		for (uint32_t j=0; iter.next(index); j++)
 		{
-			printTransaction(j,ba->mTransactions[j],i+1);
+			printTransaction(j,&mTransactions[index],i+1);
 		}
 		logMessage("========================================\r\n");
 		logMessage("\r\n");
@@ -4950,6 +10395,7 @@ protected:
 	FILE						*mZombieOutput;
 	ZombieFinder				*mZombieFinder;
 	BitcoinAddressHashMap		mAddresses;				// A hash map of every single bitcoin address ever referenced to a much shorter integer to save memory
+	WitnessProgramStore			mWitnessPrograms;		// The full 32 byte keys of the P2WSH and P2TR addresses
 
 	uint32_t					mTransactionCount;
 	uint32_t					mTotalInputCount;
@@ -4959,7 +10405,20 @@ protected:
 	TransactionOutput			*mOutputs;
 	uint32_t					mBlockCount;
 	Transaction					**mBlocks;
-	Transaction					**mTransactionReferences;
+	AddressTransactionIndex		*mAddressTransactions;	// The transactions each address appears in; rebuilt by gatherAddresses
+	uint32_t					mAddressTransactionsCount;	// How many transactions mAddressTransactions was built from
+	std::vector< uint32_t >		mIndexAddresses;			// Scratch for appending to mAddressTransactions
+	AddressSnapshots			mSnapshots;			// Published state for readers on other threads
+	BlockUndoJournal			mUndoJournal;			// Lets the most recent blocks be disconnected again
+	AddressHistoryIndex			mHistory;				// Per-address balance history; appended to as blocks are processed and trimmed as they are undone
+	uint32_t					*mOutputBegin;			// Index of the first output of each transaction; the row offsets of the spend graph
+	uint32_t					mOutputBeginCount;		// Number of transactions mOutputBegin is valid for
+	AddressClusters				mClusters;				// Common-input ownership clusters, maintained as blocks are processed
+	bool						mClustersDirty;			// Set when blocks were undone; the clusters are rebuilt before the next query
+	uint32_t					mTransactionHighWater;	// The most transactions, inputs, outputs and blocks ever held; see updateHighWater
+	uint32_t					mInputHighWater;
+	uint32_t					mOutputHighWater;
+	uint32_t					mBlockHighWater;
 	uint32_t					mStatCount;
 	StatRow						mStatistics[MAX_STAT_COUNT];
 	const char					*mStatLabel[SS_COUNT];
@@ -4968,8 +10427,250 @@ protected:
 
 #pragma warning(pop)
 
+// Something which can read and parse a block on any thread; see BlockParsePool.
+class BlockLoader
+{
+public:
+	virtual bool loadBlock(BlockImpl &block,ScratchBuffer< uint8_t > &blockData,uint32_t blockIndex) = 0;
+};
+
+// Reads blocks ahead of the caller on a pool of worker threads.  Loading a block - reading it from disk, parsing it and hashing
+// its transactions - only touches the BlockImpl and the data buffer it is loaded into, so every slot of the parse-ahead window
+// has its own pair and any number of blocks can be loaded at once.  Blocks are handed back strictly in height order, so the
+// caller can apply them to the shared state one at a time just as if it had read them itself.
+class BlockParsePool
+{
+public:
+	BlockParsePool(void)
+	{
+		mLoader = NULL;
+		mSlotCount = 0;
+		mSlots = NULL;
+		mFirst = 0;
+		mNext = 0;
+		mEnd = 0;
+		mTaken = false;
+		mStop = false;
+	}
+
+	~BlockParsePool(void)
+	{
+		stop();
+		for (uint32_t i=0; i<mSlotCount; i++)
+		{
+			delete mSlots[i].mBlock;
+			delete mSlots[i].mData;
+		}
+		delete []mSlots;
+	}
+
+	bool isRunning(void) const
+	{
+		return !mThreads.empty();
+	}
+
+	// The block take expects next.
+	uint32_t getNext(void) const
+	{
+		return mTaken ? mFirst+1 : mFirst;
+	}
+
+	// Starts loading blocks [firstBlock,endBlock) with this many threads; each thread gets two slots of the window so it can
+	// move on to the next block while the caller is still applying the previous one.
+	void start(BlockLoader *loader,uint32_t firstBlock,uint32_t endBlock,uint32_t threadCount)
+	{
+		stop();
+		if ( threadCount == 0 )
+		{
+			threadCount = 1;
+		}
+		if ( mSlotCount < threadCount*2 )
+		{
+			Slot *slots = new Slot[threadCount*2];
+			for (uint32_t i=0; i<threadCount*2; i++)
+			{
+				if ( i < mSlotCount )
+				{
+					slots[i] = mSlots[i];
+				}
+				else
+				{
+					slots[i].mBlock = new BlockImpl;
+					slots[i].mData = new ScratchBuffer< uint8_t >;
+				}
+			}
+			delete []mSlots;
+			mSlots = slots;
+			mSlotCount = threadCount*2;
+		}
+		for (uint32_t i=0; i<mSlotCount; i++)
+		{
+			mSlots[i].mBlockIndex = 0xFFFFFFFF;
+			mSlots[i].mReady = false;
+		}
+		mLoader = loader;
+		mFirst = firstBlock;
+		mNext = firstBlock;
+		mEnd = endBlock;
+		mTaken = false;
+		mStop = false;
+		for (uint32_t i=0; i<threadCount; i++)
+		{
+			mThreads.push_back(std::thread(&BlockParsePool::workerThread,this));
+		}
+	}
+
+	// Returns block 'blockIndex', which must be getNext(), waiting for it to be loaded if need be.  The block stays valid until
+	// the next call to take or start.  Returns NULL if the block could not be loaded.
+	BlockImpl *take(uint32_t blockIndex)
+	{
+		BlockImpl *ret = NULL;
+		std::unique_lock< std::mutex > lock(mMutex);
+		if ( mTaken )
+		{
+			mFirst++;	// the caller is done with the previous block, so its slot can be reused
+			mTaken = false;
+			mWork.notify_all();
+		}
+		assert( blockIndex == mFirst );
+		if ( blockIndex == mFirst && blockIndex < mEnd )
+		{
+			Slot &slot = mSlots[blockIndex%mSlotCount];
+			mDone.wait(lock,[&slot,blockIndex]() { return slot.mReady && slot.mBlockIndex == blockIndex; });
+			mTaken = true;
+			if ( slot.mLoaded )
+			{
+				ret = slot.mBlock;
+			}
+		}
+		return ret;
+	}
+
+	// The buffers of every slot, as each worker recorded them when it last finished a block.  A worker may be growing its
+	// buffers right now, so the buffers themselves are never looked at from here; the resident count of a slot being loaded
+	// may therefore be a block out of date.
+	void reportMemory(MemoryReport &report)
+	{
+		std::lock_guard< std::mutex > lock(mMutex);
+		uint64_t dataBytes = 0;
+		uint64_t blockBytes = 0;
+		for (uint32_t i=0; i<mSlotCount; i++)
+		{
+			dataBytes+=mSlots[i].mDataBytes;
+			for (uint32_t j=0; j<SCRATCH_REGION_COUNT; j++)
+			{
+				blockBytes+=mSlots[i].mScratchBytes[j];
+			}
+		}
+		report.add("parse pool block data",NULL,1,dataBytes,dataBytes,dataBytes);
+		for (uint32_t i=0; i<mSlotCount; i++)
+		{
+			report.addRegion(mSlots[i].mDataRegion,mSlots[i].mDataBytes);
+		}
+		report.add("parse pool parsed blocks",NULL,1,blockBytes,blockBytes,blockBytes);
+		for (uint32_t i=0; i<mSlotCount; i++)
+		{
+			for (uint32_t j=0; j<SCRATCH_REGION_COUNT; j++)
+			{
+				report.addRegion(mSlots[i].mScratchRegions[j],mSlots[i].mScratchBytes[j]);
+			}
+		}
+	}
+
+	// Waits for the blocks being loaded and stops the workers; the block last taken stays valid.
+	void stop(void)
+	{
+		{
+			std::lock_guard< std::mutex > lock(mMutex);
+			mStop = true;
+		}
+		mWork.notify_all();
+		for (size_t i=0; i<mThreads.size(); i++)
+		{
+			mThreads[i].join();
+		}
+		mThreads.clear();
+	}
+
+private:
+	class Slot
+	{
+	public:
+		Slot(void)
+		{
+			mBlock = NULL;
+			mData = NULL;
+			mBlockIndex = 0xFFFFFFFF;
+			mReady = false;
+			mLoaded = false;
+			mDataRegion = NULL;
+			mDataBytes = 0;
+			for (uint32_t i=0; i<SCRATCH_REGION_COUNT; i++)
+			{
+				mScratchRegions[i] = NULL;
+				mScratchBytes[i] = 0;
+			}
+		}
+
+		// Copies where the buffers are and how big; called by the worker which owns them, with the pool lock held.
+		void recordMemory(void)
+		{
+			mDataRegion = mData->get();
+			mDataBytes = mData->getCapacity();
+			mBlock->getScratchRegions(mScratchRegions,mScratchBytes);
+		}
+
+		BlockImpl					*mBlock;
+		ScratchBuffer< uint8_t >	*mData;			// The raw block; the parsed block points into it
+		uint32_t					mBlockIndex;	// Which block the slot holds or is being loaded with
+		bool						mReady;			// Loading has finished
+		bool						mLoaded;		// ...and succeeded
+		const void					*mDataRegion;	// mData and the block's parse buffers as of the last load; guarded by the pool lock
+		uint64_t					mDataBytes;
+		const void					*mScratchRegions[SCRATCH_REGION_COUNT];
+		uint64_t					mScratchBytes[SCRATCH_REGION_COUNT];
+	};
+
+	void workerThread(void)
+	{
+		std::unique_lock< std::mutex > lock(mMutex);
+		for (;;)
+		{
+			mWork.wait(lock,[this]() { return mStop || (mNext < mEnd && mNext < mFirst+mSlotCount); });
+			if ( mStop )
+			{
+				break;
+			}
+			uint32_t blockIndex = mNext++;
+			Slot &slot = mSlots[blockIndex%mSlotCount];
+			slot.mBlockIndex = blockIndex;
+			slot.mReady = false;
+			lock.unlock();
+			bool loaded = mLoader->loadBlock(*slot.mBlock,*slot.mData,blockIndex);
+			lock.lock();
+			slot.recordMemory();
+			slot.mLoaded = loaded;
+			slot.mReady = true;
+			mDone.notify_all();
+		}
+	}
+
+	BlockLoader					*mLoader;
+	uint32_t					mSlotCount;
+	Slot						*mSlots;		// Block i is loaded into slot i%mSlotCount
+	uint32_t					mFirst;			// Oldest block the caller has not finished with
+	uint32_t					mNext;			// Next block for a worker to load
+	uint32_t					mEnd;
+	bool						mTaken;			// The caller holds block mFirst
+	bool						mStop;
+	std::mutex					mMutex;
+	std::condition_variable		mWork;			// A slot was freed, or stop
+	std::condition_variable		mDone;			// A block finished loading
+	std::vector< std::thread >	mThreads;
+};
+
 // This is the implementation of the BlockChain parser interface
-class BlockChainImpl : public BlockChain
+class BlockChainImpl : public BlockChain, public BlockLoader
 {
 public:
 	BlockChainImpl(const char *rootPath)
@@ -4979,9 +10680,9 @@ public:
 		mLastExportDay = 0xFFFFFFFF;
 		mLastExportTime = 0xFFFFFFFF;
 		mAnalyzeInputSignatures = false;
+		mComputeWitnessHashes = false;
 		mExportTransactions = false;
 		sprintf(mRootDir,"%s",rootPath);
-		mCurrentBlockData = mBlockDataBuffer;	// scratch buffers to read in up to 3 block.
 		mTransactionCount = 0;
 		mBlockIndex = 0;
 		mBlockBase = 0;
@@ -4994,16 +10695,30 @@ public:
 		mScanCount = 0;
 		mBlockHeaders = NULL;
 		mLastBlockHeaderCount = 0;
-		mLastBlockHeader = NULL;
+		mBestHeader = NULL;
+		mAttachStack = NULL;
+		mOrphanCount = 0;
+		mReorgForkBlock = 0;
+		mReorgDisconnectCount = 0;
+		mReorgConnectCount = 0;
+		mRejectedHeaderCount = 0;
+		mProofOfWorkLimit = POW_LIMIT_BITS;
 		mTotalInputCount = 0;
 		mTotalOutputCount = 0;
 		mTotalTransactionCount = 0;
+		mUnattributedOutputCount = 0;
+		mUnmappedTransactionCount = 0;
+		mResolvedInputCount = 0;
+		mFailedInputCount = 0;
+		memset(mScriptTypeTotals,0,sizeof(mScriptTypeTotals));
+		mLastReadBlock = 0xFFFFFFFF;
 		openBlock();	// open the input file
 	}
 
 	// Close all blockchain files which have been opended so far
 	virtual ~BlockChainImpl(void)
 	{
+		mParsePool.stop();
 		for (uint32_t i=0; i<mBlockIndex; i++)
 		{
 			if ( mBlockChain[i] )
@@ -5012,6 +10727,7 @@ public:
 			}
 		}
 		delete []mBlockHeaders;
+		delete []mAttachStack;
 		if ( mExportFile )
 		{
 			fclose(mExportFile);
@@ -5037,15 +10753,15 @@ public:
 			fseek(fph,0L,SEEK_SET);
 			mBlockChain[mBlockIndex] = fph;
 			ret = true;
-			logMessage("Successfully opened block-chain input file '%s'\r\n", scratch );
+			LOG_INFO("Successfully opened block-chain input file '%s'\r\n", scratch );
 		}
 		else
 		{
-			logMessage("Failed to open block-chain input file '%s'\r\n", scratch );
+			LOG_INFO("Failed to open block-chain input file '%s'\r\n", scratch );
 		}
 		if ( mBlockHeaderMap.size() )
 		{
-			logMessage("Scanned %s block headers so far, %s since last time.\r\n", formatNumber(mBlockHeaderMap.size()), formatNumber(mBlockHeaderMap.size()-mLastBlockHeaderCount));
+			LOG_INFO("Scanned %s block headers so far, %s since last time.\r\n", formatNumber(mBlockHeaderMap.size()), formatNumber(mBlockHeaderMap.size()-mLastBlockHeaderCount));
 		}
 
 		mLastBlockHeaderCount = mBlockHeaderMap.size();
@@ -5067,19 +10783,37 @@ public:
 	void processTransactions(Block &block)
 	{
 		mTotalTransactionCount+=block.transactionCount;
-		for (uint32_t i=0; i<block.transactionCount; i++)
+		// Claim the block's slots in one go; slot i of the map always holds transaction i (see getTransactionHash).  The inserts
+		// themselves stay on this thread: transaction indices are handed out in processing order and disconnectBlocks removes
+		// the newest entries, so they can not be made ahead of time on the parse threads.
+		mTransactionMap.init();
 		{
-			BlockTransaction &t = block.transactions[i];
-			Hash256 hash(t.transactionHash);
-			FileLocation f(hash,t.fileIndex,t.fileOffset,t.transactionLength,t.transactionIndex);
-			mTransactionMap.insert(f);
+			PROFILE_SCOPE_ITEMS(PS_MAP_INSERT,block.transactionCount);
+			uint32_t base = mTransactionMap.reserve(block.transactionCount);
+			assert( base != 0xFFFFFFFF );
+			if ( base == 0xFFFFFFFF )
+			{
+				mUnmappedTransactionCount+=block.transactionCount;
+				LOG_ERROR("Transaction hash map is full; the %s transactions of block #%d were not added and inputs spending them will not be found.\r\n", formatNumber(block.transactionCount), block.blockIndex );
+			}
+			for (uint32_t i=0; i<block.transactionCount && base != 0xFFFFFFFF; i++)
+			{
+				BlockTransaction &t = block.transactions[i];
+				assert( t.transactionIndex == base+i );
+				Hash256 hash(t.transactionHash);
+				FileLocation f(hash,t.fileIndex,t.fileOffset,t.transactionLength,t.transactionIndex);
+				mTransactionMap.insertAt(base+i,f);
+			}
 		}
 		// ok.. now make sure we can locate every input transaction!
+		PROFILE_SCOPE(PS_MAP_FIND);
+		uint64_t inputCount = 0;
 		for (uint32_t i=0; i<block.transactionCount; i++)
 		{
 			BlockTransaction &t = block.transactions[i];
 			mTotalInputCount+=t.inputCount;
 			mTotalOutputCount+=t.outputCount;
+			inputCount+=t.inputCount;
 			for (uint32_t j=0; j<t.inputCount; j++)
 			{
 				BlockInput &input = t.inputs[j];
@@ -5095,6 +10829,7 @@ public:
 				}
 			}
 		}
+		PROFILE_SET_ITEMS(inputCount);
 	}
 
 
@@ -5102,15 +10837,55 @@ public:
 	{
 		Block *ret = NULL;
 
-		if ( readBlock(mSingleReadBlock,blockIndex) )
+		if ( mParsePool.isRunning() && blockIndex == mParsePool.getNext() )
+		{
+			BlockImpl *block = mParsePool.take(blockIndex);
+			if ( block )
+			{
+				applyBlock(*block);
+				ret = block;
+			}
+		}
+		else if ( mLastReadBlock != 0xFFFFFFFF && blockIndex == mLastReadBlock+1 && blockIndex < mBlockCount )
+		{
+			// The chain is being read in order; have the workers read and parse the blocks ahead of us
+			uint32_t threadCount = std::thread::hardware_concurrency();
+			if ( threadCount > 8 )
+			{
+				threadCount = 8;
+			}
+			mParsePool.start(this,blockIndex,mBlockCount,threadCount);
+			BlockImpl *block = mParsePool.take(blockIndex);
+			if ( block )
+			{
+				applyBlock(*block);
+				ret = block;
+			}
+		}
+		else if ( readBlock(mSingleReadBlock,blockIndex) )
 		{
 			ret = &mSingleReadBlock;
 		}
+		mLastReadBlock = blockIndex;
 
 		return ret;
 	}
 
 	virtual bool readBlock(BlockImpl &block,uint32_t blockIndex)
+	{
+		bool ret = loadBlock(block,mBlockDataBuffer,blockIndex);
+		if ( ret )
+		{
+			applyBlock(block);
+		}
+		return ret;
+	}
+
+	// Reads, parses and hashes a block into 'block', and analyzes its input signatures if that is on, using 'blockData' to
+	// hold the raw block; it is grown to fit if need be.  Touches nothing but the block, the buffer, the file (under
+	// mFileMutex) and the signature report files (under gSignatureFileMutex), so it may run on any thread; the transactions
+	// are numbered from zero until applyBlock gives them their place in the chain.
+	virtual bool loadBlock(BlockImpl &block,ScratchBuffer< uint8_t > &blockBuffer,uint32_t blockIndex)
 	{
 		bool ret = false;
 
@@ -5121,15 +10896,15 @@ public:
 		{
 			block.blockIndex = blockIndex;
 			block.warning = false;
-			fseek(fph,header.mFileOffset,SEEK_SET);
-			gBlockIndex = blockIndex;
 			block.blockLength = header.mBlockLength;
 			block.blockReward = 0;
 			block.totalInputCount = 0;
 			block.totalOutputCount = 0;
 			block.fileIndex = header.mFileIndex;
 			block.fileOffset = header.mFileOffset;
-			block.blockLength = header.mBlockLength;
+			block.nextBlockHash = NULL;
+			block.mComputeWitnessHashes = mComputeWitnessHashes;
+			block.mAnalyzeSignatures = mAnalyzeInputSignatures;
 
 			if ( blockIndex < (mBlockCount-2) )
 			{
@@ -5137,64 +10912,56 @@ public:
 				block.nextBlockHash =  nextNext->mPreviousBlockHash;
 			}
 
-			uint8_t *blockData = mBlockDataBuffer;
-			size_t r = fread(blockData,block.blockLength,1,fph); // read the rest of the block (less the 8 byte header we have already consumed)
+			uint8_t *blockData = blockBuffer.reserve(block.blockLength);
+			size_t r;
+			{
+				PROFILE_SCOPE_ITEMS(PS_FILE_READ,block.blockLength);
+				std::lock_guard< std::mutex > lock(mFileMutex);
+				fseek(fph,header.mFileOffset,SEEK_SET);
+				r = fread(blockData,block.blockLength,1,fph); // read the rest of the block (less the 8 byte header we have already consumed)
+			}
 			if ( r == 1 )
 			{
 				BLOCKCHAIN_SHA256::computeSHA256(blockData,4+32+32+4+4+4,block.computedBlockHash);
 				BLOCKCHAIN_SHA256::computeSHA256(block.computedBlockHash,32,block.computedBlockHash);
-				ret = block.processBlockData(blockData,block.blockLength,mTransactionCount);
-				if ( ret )
+				uint32_t transactionIndex = 0;
 				{
-					processTransactions(block);
-					if ( mAnalyzeInputSignatures )
-					{
-						for (uint32_t j=0; j<block.transactionCount; j++)
-						{
-							BlockChain::BlockTransaction &transaction = block.transactions[j];
-							for (uint32_t i=0; i<transaction.inputCount; i++)
-							{
-								BlockChain::BlockInput &input = transaction.inputs[i];
-								input.signatureFormat = analyzeSignature(input.responseScript,input.responseScriptLength,j,i,input.transactionHash,transaction.transactionHash,input.inputValue);
-								bool found = false;
-								for (uint32_t i=0; i<gSignatureStatCount; i++)
-								{
-									if ( gSignatureStats[i].mFlags == input.signatureFormat )
-									{
-										gSignatureStats[i].mCount++;
-										gSignatureStats[i].mValue+=input.inputValue;
-										found = true;
-										break;
-									}
-								}
-								if ( !found )
-								{
-									if ( gSignatureStatCount < MAX_SIGNATURE_STAT )
-									{
-										gSignatureStats[gSignatureStatCount].mFlags = input.signatureFormat;
-										gSignatureStats[gSignatureStatCount].mCount = 1;
-										gSignatureStats[gSignatureStatCount].mValue = input.inputValue;
-										gSignatureStatCount++;
-									}
-								}
-							}
-						}
-					}
-
+					PROFILE_SCOPE(PS_PARSE);
+					ret = block.processBlockData(blockData,block.blockLength,transactionIndex);
+					PROFILE_SET_ITEMS(block.transactionCount);
+				}
+				if ( ret && block.mAnalyzeSignatures )
+				{
+					analyzeSignatures(block);
 				}
 			}
 			else
 			{
-				logMessage("Failed to read input block.  BlockChain corrupted.\r\n");
+				LOG_ERROR("Failed to read input block.  BlockChain corrupted.\r\n");
 			}
 		}
-		block.warning = gIsWarning;
-		gIsWarning = false;
 		return ret;
 	}
 
-
-
+	// Applies a loaded block, in chain order, to the transaction hash map and the signature statistics.
+	void applyBlock(BlockImpl &block)
+	{
+		for (uint32_t i=0; i<block.transactionCount; i++)
+		{
+			block.transactions[i].transactionIndex+=mTransactionCount;
+		}
+		mTransactionCount+=block.transactionCount;
+		for (uint32_t i=0; i<ST_COUNT; i++)
+		{
+			mScriptTypeTotals[i]+=block.mScriptTypeCounts[i];
+		}
+		processTransactions(block);
+		if ( block.mAnalyzeSignatures )
+		{
+			gSignatureStats.merge(block.mSignatureStats);
+		}
+		mStatJournal.push(block.blockIndex,block.mScriptTypeCounts,block.mAnalyzeSignatures ? &block.mSignatureStats : NULL);
+	}
 
 	virtual void printBlock(const Block *block) // prints the contents of the block to the console for debugging purposes
 	{
@@ -5239,6 +11006,16 @@ public:
 			logMessage("TransactionHash: ");
 			printReverseHash(t.transactionHash);
 			logMessage("\r\n");
+			if ( t.witnessLength )
+			{
+				logMessage("WitnessLength: %s\r\n", formatNumber(t.witnessLength) );
+				if ( mComputeWitnessHashes )
+				{
+					logMessage("WitnessHash: ");
+					printReverseHash(t.witnessHash);
+					logMessage("\r\n");
+				}
+			}
 			for (uint32_t i=0; i<t.inputCount; i++)
 			{
 				const BlockInput &input = t.inputs[i];
@@ -5265,17 +11042,7 @@ public:
 							if ( o.publicKey )
 							{
 								char scratch[256];
-								bool ok=true;
-								if ( o.isRipeMD160 )
-								{
-									uint8_t temp[25];
-									BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinRIPEMD160ToAddress(o.publicKey,temp);
-									BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(temp,scratch,256);
-								}
-								else
-								{
-									ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAscii(o.publicKey,scratch,256);
-								}
+								bool ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinKeyToAscii(o.scriptType,o.publicKey,o.keyLength,scratch,256);
 								if ( ok )
 								{
 									logMessage("     Spending From Public Key: %s in the amount of: %0.4f\r\n", scratch, (float)o.value / ONE_BTC );
@@ -5304,20 +11071,10 @@ public:
 				if ( output.publicKey )
 				{
 					char scratch[256];
-					bool ok=true;
-					if ( output.isRipeMD160 )
-					{
-						uint8_t temp[25];
-						BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinRIPEMD160ToAddress(output.publicKey,temp);
-						BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(temp,scratch,256);
-					}
-					else
-					{
-						ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAscii(output.publicKey,scratch,256);
-					}
+					bool ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinKeyToAscii(output.scriptType,output.publicKey,output.keyLength,scratch,256);
 					if ( ok )
 					{
-						logMessage("PublicKey: %s : %s\r\n", scratch, output.isRipeMD160 ? "RIPEMD160" : "ECDSA" );
+						logMessage("PublicKey: %s : %s\r\n", scratch, getScriptTypeName(output.scriptType) );
 					}
 					else
 					{
@@ -5326,7 +11083,7 @@ public:
 				}
 				else
 				{
-					logMessage("ERROR: Unable to derive a public key for this output!\r\n");
+					logMessage("No address for this %s output.\r\n", getScriptTypeName(output.scriptType) );
 				}
 			}
 		}
@@ -5345,6 +11102,7 @@ public:
 			mSingleReadBlock.totalOutputCount = 0;
 			mSingleReadBlock.fileIndex = 0;
 			mSingleReadBlock.fileOffset =  0;
+			mSingleReadBlock.mComputeWitnessHashes = mComputeWitnessHashes;
 			uint32_t transactionIndex=0;
 			mSingleReadBlock.processBlockData(blockData,blockLength,transactionIndex);
 			ret = static_cast< Block *>(&mSingleReadBlock);
@@ -5363,6 +11121,7 @@ public:
 			mSingleTransactionBlock.totalOutputCount = 0;
 			mSingleTransactionBlock.fileIndex = 0;
 			mSingleTransactionBlock.fileOffset =  0;
+			mSingleTransactionBlock.mComputeWitnessHashes = mComputeWitnessHashes;
 			ret = mSingleTransactionBlock.processTransactionData(transactionData,transactionLength);
 		}
 		return ret;
@@ -5378,9 +11137,8 @@ public:
 		FileLocation *found = mTransactionMap.find(key);
 		if ( found == NULL )
 		{
-			logMessage("ERROR: Unable to locate this transaction hash:");
-			printReverseHash(transactionHash);
-			logMessage("\r\n");
+			char scratch[65];
+			logMessage("ERROR: Unable to locate this transaction hash:%s\r\n", formatReverseHash(transactionHash,scratch) );
 			return NULL; 
 		}
 		const FileLocation &f = *found;
@@ -5391,12 +11149,13 @@ public:
 		if ( fileIndex < MAX_BLOCK_FILES && mBlockChain[fileIndex] && transactionLength < MAX_BLOCK_SIZE )
 		{
 			FILE *fph = mBlockChain[fileIndex];
+			std::lock_guard< std::mutex > lock(mFileMutex);	// the parse workers may be reading blocks from this file
 			uint32_t saveLocation = (uint32_t)ftell(fph);
 			fseek(fph,fileOffset,SEEK_SET);
 			uint32_t s = (uint32_t)ftell(fph);
 			if ( s == fileOffset )
 			{
-				uint8_t *blockData = mTransactionBlockBuffer;
+				uint8_t *blockData = mTransactionBlockBuffer.reserve(transactionLength);
 				size_t r = fread(blockData,transactionLength,1,fph);
 				if ( r == 1 ) // if we successfully read in the entire transaction
 				{
@@ -5430,9 +11189,16 @@ public:
 	virtual void processTransactions(const Block *block) // process the transactions in this block and assign them to individual wallets
 	{
 		if ( !block ) return;
+		std::lock_guard< std::mutex > lock(mStateMutex);
+		PROFILE_SCOPE_ITEMS(PS_PROCESS,block->transactionCount);
 
+		mTransactionFactory.beginBlock(block->blockIndex);
 		Transaction *transactions = mTransactionFactory.getTransactions(block->transactionCount);
-		if ( !transactions ) return;
+		if ( !transactions )
+		{
+			mTransactionFactory.cancelBlock();
+			return;
+		}
 
 		mTransactionFactory.markBlock(transactions);
 
@@ -5461,21 +11227,24 @@ public:
 
 				uint32_t adr = 0;
 
-				if ( output.publicKey )
+				if ( output.keyLength == 20 || output.keyLength == 32 )
 				{
-					if ( output.isRipeMD160 )
-					{
-						mTransactionFactory.getAddress(output.publicKey,adr);
-					}
-					else
-					{
-						uint8_t address[25];
-						BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAddress(output.publicKey,address);
-						mTransactionFactory.getAddress(&address[1],adr);
-					}
+					PROFILE_SCOPE(PS_ADDRESS_LOOKUP);
+					mTransactionFactory.getAddress(output.publicKey,output.keyLength,getAddressScriptType(output.scriptType),adr);
+				}
+				else if ( output.keyHash )
+				{
+					PROFILE_SCOPE(PS_ADDRESS_LOOKUP);
+					mTransactionFactory.getAddress(output.keyHash,20,BlockChain::ST_P2PKH,adr);
+				}
+				if ( adr == 0 && output.scriptType != ST_NULL_DATA )
+				{
+					mUnattributedOutputCount++;
 				}
 				to.mAddress = adr;
 				to.mValue = output.value;
+				to.mSpentBy = 0xFFFFFFFF;
+				mTransactionFactory.receive(adr,to.mValue,trans.mTime);
 			}
 
 			for (uint32_t i=0; i<t.inputCount; i++)
@@ -5489,7 +11258,11 @@ public:
 				{
 					Hash256 h(input.transactionHash);
 					FileLocation key(h,0,0,0,0);
-					FileLocation *found = mTransactionMap.find(key);
+					FileLocation *found;
+					{
+						PROFILE_SCOPE(PS_MAP_FIND);
+						found = mTransactionMap.find(key);
+					}
 					//assert(found);
 					if ( found )
 					{
@@ -5504,42 +11277,238 @@ public:
 							if ( input.transactionIndex < previousTransaction->mOutputCount )
 							{
 								tin.mOutput = &previousTransaction->mOutputs[input.transactionIndex];
-								mTransactionFactory.getAddress(tin.mOutput->mAddress);
+								mTransactionFactory.spend(tin.mOutput,mTransactionFactory.getTransactionIndex(&trans),trans.mTime);
 							}
 						}
 					}
 					else
 					{
-						logMessage("ERROR: FAILED TO LOOKUP RESULTS FOR TRANSACTION HASH : ");
-						printReverseHash(input.transactionHash);
-						logMessage("\r\n");
+						char scratch[65];
+						LOG_ERROR("FAILED TO LOOKUP RESULTS FOR TRANSACTION HASH : %s\r\n", formatReverseHash(input.transactionHash,scratch) );
+					}
+					if ( tin.mOutput )
+					{
+						mResolvedInputCount++;
+					}
+					else
+					{
+						mFailedInputCount++;
 					}
 				}
 			}
+			mTransactionFactory.clusterInputs(trans);
+		}
+		mTransactionFactory.endBlock();
+		mTransactionFactory.commitSnapshot();
+
+		if ( mExportTransactions )
+		{
+			exportTransactions(block);
+		}
+
+	}
+
+	// Undoes the most recently processed blocks, newest first.  Transactions those blocks introduced are removed from the
+	// transaction hash map as well, so the blocks can be read and processed again once the new chain has been built.
+	virtual uint32_t disconnectBlocks(uint32_t count)
+	{
+		std::lock_guard< std::mutex > lock(mStateMutex);
+		uint32_t transactionBase;
+		uint32_t inputsRemoved;
+		uint32_t outputsRemoved;
+		uint32_t processed = mTransactionFactory.getBlockCount();
+		uint32_t ret = mTransactionFactory.disconnectBlocks(count,transactionBase,inputsRemoved,outputsRemoved);
+		for (uint32_t i=0; i<ret; i++)
+		{
+			if ( !mStatJournal.pop(processed-1-i,mScriptTypeTotals,gSignatureStats) )
+			{
+				LOG_ERROR("No statistics recorded for block %s; script type and signature totals still count it.\r\n", formatNumber(processed-1-i) );
+				break;
+			}
+		}
+		if ( ret )
+		{
+			// Transaction hashes were inserted in transaction order, so the ones to remove are the newest entries in the map.
+			while ( mTransactionMap.size() )
+			{
+				FileLocation *f = mTransactionMap.getKey(mTransactionMap.size()-1);
+				if ( f->mTransactionIndex < transactionBase )
+				{
+					break;
+				}
+				mTransactionMap.removeLast();
+			}
+			mTotalTransactionCount-=(mTransactionCount-transactionBase);
+			mTotalInputCount-=inputsRemoved;
+			mTotalOutputCount-=outputsRemoved;
+			mTransactionCount = transactionBase;
+			logMessage("Disconnected %s blocks; %s blocks remain processed.\r\n", formatNumber(ret), formatNumber(mTransactionFactory.getBlockCount()) );
+		}
+		mTransactionFactory.commitSnapshot();
+		return ret;
+	}
+
+	virtual bool getBalanceAtBlock(const char *address,uint32_t blockIndex,uint64_t &balance)
+	{
+		return mTransactionFactory.getBalanceAtBlock(address,blockIndex,balance);
+	}
+
+	// Balance of the address as of this time; i.e. at the end of the last processed block whose (monotonic) time is not later.
+	virtual bool getBalanceAtTime(const char *address,uint32_t timeStamp,uint64_t &balance,uint32_t &blockIndex)
+	{
+		bool ret = false;
+		balance = 0;
+		blockIndex = mBlockTimeIndex.getBlockAtTime(timeStamp);
+		uint32_t processed = mTransactionFactory.getBlockCount();
+		if ( blockIndex != 0xFFFFFFFF && blockIndex >= processed )
+		{
+			blockIndex = processed ? processed-1 : 0xFFFFFFFF;
+		}
+		if ( blockIndex == 0xFFFFFFFF )
+		{
+			ret = mTransactionFactory.findAddress(address) ? true : false;
+		}
+		else
+		{
+			ret = mTransactionFactory.getBalanceAtBlock(address,blockIndex,balance);
 		}
+		return ret;
+	}
 
-		if ( mExportTransactions )
+	// Returns the time of this block on the active chain, corrected so that it never precedes its parent.
+	virtual uint32_t getBlockTime(uint32_t blockIndex)
+	{
+		return mBlockTimeIndex.getBlockTime(blockIndex);
+	}
+
+	// Returns how many blocks of the active chain fall in the time window [startTime,endTime) and the first of them.
+	virtual uint32_t getBlockRange(uint32_t startTime,uint32_t endTime,uint32_t &firstBlock)
+	{
+		return mBlockTimeIndex.getBlockRange(startTime,endTime,firstBlock);
+	}
+
+	// Follows the coins of one transaction (or one of its outputs) forward to where they went, or backward to where they came from.
+	virtual bool traceTransaction(const char *transactionHash,uint32_t outputIndex,bool forward,const char *policy,uint32_t maxHops)
+	{
+		bool ret = false;
+		Hash256 h;
+		TaintPolicy p = TP_HAIRCUT;
+		if ( policy && strcmp(policy,"poison") == 0 )
 		{
-			exportTransactions(block);
+			p = TP_POISON;
+		}
+		else if ( policy && strcmp(policy,"fifo") == 0 )
+		{
+			p = TP_FIFO;
+		}
+		if ( !parseReverseHash(transactionHash,(uint8_t *)&h) )
+		{
+			logMessage("Invalid transaction hash: %s\r\n", transactionHash );
+		}
+		else
+		{
+			FileLocation key(h,0,0,0,0);
+			FileLocation *found = mTransactionMap.find(key);
+			if ( found )
+			{
+				mTransactionFactory.traceTransaction(found->mTransactionIndex,outputIndex,forward,p,maxHops);
+				ret = true;
+			}
+			else
+			{
+				logMessage("Failed to locate transaction: %s\r\n", transactionHash );
+			}
 		}
+		return ret;
+	}
+
+	// Searches the address table with a query expression; ages are measured from the time of the last processed block.
+	virtual uint32_t query(const char *expression)
+	{
+		uint32_t processed = mTransactionFactory.getBlockCount();
+		uint32_t referenceTime = processed ? mBlockTimeIndex.getBlockTime(processed-1) : 0;
+		return mTransactionFactory.query(expression,referenceTime);
+	}
+
+	virtual void printCluster(const char *address)
+	{
+		mTransactionFactory.printCluster(address);
+	}
+
+	virtual bool saveClusters(const char *fname)
+	{
+		return mTransactionFactory.saveClusters(fname);
+	}
+
+	virtual bool loadClusters(const char *fname)
+	{
+		return mTransactionFactory.loadClusters(fname);
+	}
 
+	// Returns the number of blocks whose transactions have been applied to the address state.
+	virtual uint32_t getProcessedBlockCount(void)
+	{
+		return mTransactionFactory.getBlockCount();
 	}
 
 	virtual uint32_t gatherAddresses(uint32_t refTime)
 	{
+		std::lock_guard< std::mutex > lock(mStateMutex);
 		mTransactionFactory.gatherAddresses(refTime);
+		mTransactionFactory.commitSnapshot();
 		return mTransactionFactory.getAddressCount();
 	}
 
+	virtual void reportMemory(void)
+	{
+		MemoryReport report;
+		report.addHash("block headers",mBlockHeaderMap);
+		report.add("active chain headers",mBlockHeaders,sizeof(BlockHeader *),mBlockHeaders ? MAX_TOTAL_BLOCKS : 0,mBlockCount,mBlockCount);
+		mBlockTimeIndex.reportMemory(report);
+		report.add("orphan attach stack",mAttachStack,sizeof(BlockHeader *),mAttachStack ? MAX_TOTAL_BLOCKS : 0,0,0);
+		report.addHash("orphan headers",mOrphanHeaderMap);
+		report.addHash("transaction locations",mTransactionMap);
+		report.addScratch("block read buffer",mBlockDataBuffer);
+		report.addScratch("single transaction buffer",mTransactionBlockBuffer);
+		uint64_t blockBytes = mSingleReadBlock.getScratchBytes()+mSingleTransactionBlock.getScratchBytes();
+		report.add("single read parsed blocks",NULL,1,blockBytes,blockBytes,blockBytes);
+		mSingleReadBlock.addScratchRegions(report);
+		mSingleTransactionBlock.addScratchRegions(report);
+		mParsePool.reportMemory(report);
+		{
+			std::lock_guard< std::mutex > lock(mStateMutex);
+			mTransactionFactory.reportMemory(report);
+		}
+		report.print();
+	}
+
 	virtual void reportCounts(void)
 	{
 		logMessage("Total Blocks: %s\r\n", formatNumber(mBlockCount) );
 		logMessage("Total Transactions: %s\r\n", formatNumber(mTotalTransactionCount));
 		logMessage("Total Inputs: %s\r\n", formatNumber(mTotalInputCount));
 		logMessage("Total Outputs: %s\r\n", formatNumber(mTotalOutputCount));
+		for (uint32_t i=0; i<ST_COUNT; i++)
+		{
+			logMessage("    %-12s: %llu\r\n", getScriptTypeName(i), (unsigned long long)mScriptTypeTotals[i] );
+		}
+		logMessage("Outputs not credited to any address: %llu\r\n", (unsigned long long)mUnattributedOutputCount );
+		logMessage("Inputs resolved to the output they spend: %llu\r\n", (unsigned long long)mResolvedInputCount );
+		logMessage("Inputs whose spent output could not be found: %llu\r\n", (unsigned long long)mFailedInputCount );
+		if ( mUnmappedTransactionCount )
+		{
+			logMessage("Transactions not added to the full transaction hash map: %llu\r\n", (unsigned long long)mUnmappedTransactionCount );
+		}
 		mTransactionFactory.reportCounts();
 	}
 
+	virtual void getInputLookupCounts(uint64_t &resolved,uint64_t &failed)
+	{
+		std::lock_guard< std::mutex > lock(mStateMutex);
+		resolved = mResolvedInputCount;
+		failed = mFailedInputCount;
+	}
+
 	virtual void printTransactions(uint32_t blockIndex)
 	{
 		mTransactionFactory.printTransactions(blockIndex);
@@ -5547,11 +11516,15 @@ public:
 
 	virtual void gatherStatistics(uint32_t stime,uint32_t zombieDate,bool record_addresses)
 	{
+		std::lock_guard< std::mutex > lock(mStateMutex);
+		PROFILE_SCOPE(PS_STATISTICS);
 		mTransactionFactory.gatherStatistics(stime,zombieDate,record_addresses);
+		mTransactionFactory.commitSnapshot();
 	}
 
 	virtual void saveStatistics(bool record_addresses,float minBalance)
 	{
+		PROFILE_SCOPE(PS_STATISTICS);
 		mTransactionFactory.saveStatistics(record_addresses,minBalance);
 	}
 
@@ -5591,7 +11564,7 @@ public:
 			if ( r == 1 && magicID != MAGIC_ID )
 			{
 				fseek(fph,lastBlockRead,SEEK_SET);
-				logMessage("Warning: Missing block-header; scanning for next one.\r\n");
+				LOG_WARNING("Missing block-header; scanning for next one.\r\n");
 				uint8_t *temp = (uint8_t *)::malloc(MAX_BLOCK_SIZE);
 				memset(temp,0,MAX_BLOCK_SIZE);
 				uint32_t c = (uint32_t)fread(temp,1,MAX_BLOCK_SIZE,fph);
@@ -5660,13 +11633,30 @@ public:
 						{
 							Hash256 *blockHash = static_cast< Hash256 *>(&header);
 							memcpy(header.mPreviousBlockHash,prefix.mPreviousBlock,32);
+							header.mBits = prefix.mBits;
+							header.mTimeStamp = prefix.mTimeStamp;
 							BLOCKCHAIN_SHA256::computeSHA256((uint8_t *)&prefix,sizeof(prefix),(uint8_t *)blockHash);
 							BLOCKCHAIN_SHA256::computeSHA256((uint8_t *)blockHash,32,(uint8_t *)blockHash);
 							uint32_t currentFileOffset = ftell(fph); // get the current file offset.
 							uint32_t advance = header.mBlockLength - sizeof(BlockPrefix);
 							currentFileOffset+=advance;
 							fseek(fph,currentFileOffset,SEEK_SET); // skip past the block to get to the next header.
-							mLastBlockHeader = mBlockHeaderMap.insert(header);
+							// A header whose hash does not meet its own target (or claims a target easier than the network limit) can never
+							// be part of a valid chain; drop it here so a bad fork never even enters the header map.
+							if ( mBlockHeaderMap.find(*blockHash) )
+							{
+								// The same block can be stored more than once in the data files; the first copy wins.
+							}
+							else if ( checkProofOfWork(*blockHash,header.mBits,mProofOfWorkLimit) )
+							{
+								connectHeader(mBlockHeaderMap.insert(header));
+							}
+							else
+							{
+								mRejectedHeaderCount++;
+								char scratch[65];
+								LOG_WARNING("Rejected block header with invalid proof of work in file %d at offset %s : %s\r\n", header.mFileIndex, formatNumber(header.mFileOffset), formatReverseHash((const uint8_t *)blockHash,scratch) );
+							}
 							ok = true;
 						}
 					}
@@ -5692,8 +11682,138 @@ public:
 		}
 	}
 
+	// Attaches a header whose parent is known (or which is a root) to the header tree, giving it a height and cumulative work.
+	// The best tip is tracked as headers arrive, so building the chain never has to look at every header again.
+	void attachHeader(BlockHeader *header,BlockHeader *parent)
+	{
+		header->mParent = parent;
+		getBlockWork(header->mBits,header->mChainWork);
+		if ( parent )
+		{
+			header->mChainWork.add(parent->mChainWork);
+			header->mHeight = parent->mHeight+1;
+		}
+		else
+		{
+			header->mHeight = 0;
+		}
+		// On equal work the header seen first keeps the tip, just like the reference client.
+		if ( mBestHeader == NULL || header->mChainWork.compare(mBestHeader->mChainWork) > 0 )
+		{
+			mBestHeader = header;
+		}
+	}
+
+	// Attaches this header and every orphan which was waiting on it (directly or indirectly).
+	void attachHeaderTree(BlockHeader *header,BlockHeader *parent)
+	{
+		attachHeader(header,parent);
+		mAttachStack[0] = header;
+		uint32_t stackCount = 1;
+		while ( stackCount )
+		{
+			stackCount--;
+			BlockHeader *h = mAttachStack[stackCount];
+			OrphanHeaders *waiting = mOrphanHeaderMap.find(*h);
+			if ( waiting )
+			{
+				BlockHeader *child = waiting->mFirst;
+				waiting->mFirst = NULL;
+				while ( child )
+				{
+					BlockHeader *next = child->mNextOrphan;
+					child->mNextOrphan = NULL;
+					assert( mOrphanCount );
+					mOrphanCount--;
+					attachHeader(child,h);
+					mAttachStack[stackCount] = child;
+					stackCount++;
+					child = next;
+				}
+			}
+		}
+	}
+
+	void connectHeader(BlockHeader *header)
+	{
+		if ( header == NULL )
+		{
+			return;
+		}
+		if ( mAttachStack == NULL )
+		{
+			mAttachStack = new BlockHeader *[MAX_TOTAL_BLOCKS];
+		}
+		Hash256 prevBlock(header->mPreviousBlockHash);
+		BlockHeader *parent = mBlockHeaderMap.find(prevBlock);
+		bool isGenesis = prevBlock.mWord0 == 0 && prevBlock.mWord1 == 0 && prevBlock.mWord2 == 0 && prevBlock.mWord3 == 0;
+		if ( (parent && parent->isConnected()) || isGenesis )
+		{
+			attachHeaderTree(header,parent);
+		}
+		else
+		{
+			// The parent has not been read yet (or is itself waiting); park this header until it shows up.
+			OrphanHeaders *waiting = mOrphanHeaderMap.find(prevBlock);
+			if ( waiting == NULL )
+			{
+				waiting = mOrphanHeaderMap.insert(OrphanHeaders(prevBlock));
+			}
+			if ( waiting )
+			{
+				header->mNextOrphan = waiting->mFirst;
+				waiting->mFirst = header;
+				mOrphanCount++;
+			}
+		}
+	}
+
+	// If the data directory does not start at the genesis block nothing will ever connect; in that case treat every header
+	// whose parent is missing as the root of its own branch, which is how the chain was built before the header tree existed.
+	void promoteOrphanRoots(void)
+	{
+		for (uint32_t i=0; i<mBlockHeaderMap.size(); i++)
+		{
+			BlockHeader *h = mBlockHeaderMap.getKey(i);
+			if ( !h->isConnected() )
+			{
+				Hash256 prevBlock(h->mPreviousBlockHash);
+				if ( mBlockHeaderMap.find(prevBlock) == NULL )
+				{
+					OrphanHeaders *waiting = mOrphanHeaderMap.find(prevBlock);
+					if ( waiting && waiting->mFirst )
+					{
+						// Detach every header parked on this missing parent and make each the root of a branch.
+						BlockHeader *root = waiting->mFirst;
+						waiting->mFirst = NULL;
+						while ( root )
+						{
+							BlockHeader *next = root->mNextOrphan;
+							root->mNextOrphan = NULL;
+							mOrphanCount--;
+							attachHeaderTree(root,NULL);
+							root = next;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Describes how the active chain moved during the last buildBlockChain call.  Blocks [forkBlock, forkBlock+disconnectCount)
+	// of the previous chain must be undone (highest first) and blocks [forkBlock, forkBlock+connectCount) of the new chain applied.
+	// A plain extension of the chain reports a disconnectCount of zero.
+	virtual bool getChainReorg(uint32_t &forkBlock,uint32_t &disconnectCount,uint32_t &connectCount)
+	{
+		forkBlock = mReorgForkBlock;
+		disconnectCount = mReorgDisconnectCount;
+		connectCount = mReorgConnectCount;
+		return mReorgDisconnectCount ? true : false;
+	}
+
 	virtual uint32_t buildBlockChain(void) 
 	{
+		mParsePool.stop();	// the blocks being parsed ahead may no longer be on the chain
 		if ( mScanCount )
 		{
 
@@ -5703,28 +11823,58 @@ public:
 			logMessage("Building complete block-chain.\r\n");
 			// need to count the total number of blocks...
 
-			if ( mLastBlockHeader )
+			if ( mBestHeader == NULL && mOrphanCount )
+			{
+				promoteOrphanRoots();
+			}
+			mReorgForkBlock = mBlockCount;
+			mReorgDisconnectCount = 0;
+			mReorgConnectCount = 0;
+			if ( mBestHeader && mBestHeader->mHeight < MAX_TOTAL_BLOCKS )
 			{
-				mBlockCount = 0;
-				const BlockHeader *scan = mLastBlockHeader;
-				while ( scan )
+				if ( mBlockHeaders == NULL )
 				{
-					Hash256 prevBlock(scan->mPreviousBlockHash);
-					scan = mBlockHeaderMap.find(prevBlock);
-					mBlockCount++;
+					mBlockHeaders = new BlockHeader *[MAX_TOTAL_BLOCKS];
 				}
-				logMessage("Found %s blocks and skipped %s orphan blocks.\r\n", formatNumber(mBlockCount), formatNumber(mBlockHeaderMap.size()-mBlockCount));
-				mBlockHeaders = new BlockHeader *[mBlockCount];
-				uint32_t index = mBlockCount-1;
-				scan = mLastBlockHeader;
-				while ( scan )
+				// Walk back from the best tip until we reach a header which is already part of the active chain; everything
+				// above that fork point is replaced.  For the usual case of new blocks on top of the old tip this only visits the new blocks.
+				uint32_t oldCount = mBlockCount;
+				uint32_t newCount = mBestHeader->mHeight+1;
+				BlockHeader *scan = mBestHeader;
+				while ( scan && !(scan->mHeight < oldCount && mBlockHeaders[scan->mHeight] == scan) )
 				{
-					mBlockHeaders[index] = (BlockHeader *)scan;
-					Hash256 prevBlock(scan->mPreviousBlockHash);
-					scan = mBlockHeaderMap.find(prevBlock);
-					index--;
+					mBlockHeaders[scan->mHeight] = scan;
+					scan = scan->mParent;
+				}
+				uint32_t forkBlock = scan ? scan->mHeight+1 : 0;
+				mReorgForkBlock = forkBlock;
+				mReorgDisconnectCount = oldCount > forkBlock ? oldCount-forkBlock : 0;
+				mReorgConnectCount = newCount-forkBlock;
+				mBlockCount = newCount;
+				mBlockTimeIndex.update(mBlockHeaders,forkBlock,newCount);
+
+				logMessage("Found %s blocks and skipped %s orphan or stale blocks.\r\n", formatNumber(mBlockCount), formatNumber(mBlockHeaderMap.size()-mBlockCount));
+				logMessage("Selected the chain with the most cumulative work: %0.4e hashes.\r\n", mBestHeader->mChainWork.getDouble() );
+				if ( mReorgDisconnectCount )
+				{
+					logMessage("Chain reorganization at block %s : %s blocks disconnected and %s blocks connected.\r\n", formatNumber(forkBlock), formatNumber(mReorgDisconnectCount), formatNumber(mReorgConnectCount) );
+				}
+				else if ( oldCount )
+				{
+					logMessage("Extended the block-chain by %s blocks.\r\n", formatNumber(mReorgConnectCount) );
+				}
+				if ( mOrphanCount )
+				{
+					logMessage("%s block headers are still waiting for their parent block.\r\n", formatNumber(mOrphanCount) );
+				}
+				if ( mRejectedHeaderCount )
+				{
+					logMessage("Rejected %s block headers which failed proof-of-work validation.\r\n", formatNumber(mRejectedHeaderCount) );
 				}
-
+			}
+			else if ( mBestHeader )
+			{
+				logMessage("ERROR: The block-chain is longer than the maximum of %s blocks this build supports.\r\n", formatNumber(MAX_TOTAL_BLOCKS) );
 			}
 			mScanCount = 0;
 		}
@@ -5732,8 +11882,15 @@ public:
 		return mBlockCount;
 	}
 
+	// Sets the easiest target a block header may claim; defaults to the main network limit.  Test networks and synthetic chains use an easier one.
+	virtual void setProofOfWorkLimit(uint32_t limitBits)
+	{
+		mProofOfWorkLimit = limitBits;
+	}
+
 	virtual bool readBlockHeaders(uint32_t maxBlock,uint32_t &blockCount)
 	{
+		mParsePool.stop();	// scanning moves the file positions around
 		if ( readBlockHeader() && mScanCount < maxBlock )
 		{
 			mScanCount++;
@@ -5746,9 +11903,98 @@ public:
 
 	virtual void printAddress(const char *address) 
 	{
+		std::lock_guard< std::mutex > lock(mStateMutex);
 		mTransactionFactory.printAddress(address);
 	}
 
+	// Starts a lock free read of the address state on another thread and returns the snapshot to read from; finish with
+	// endRead.  The snapshot is the state after the last completed block, or the one before it if a block is being processed.
+	const AddressSnapshot *beginRead(uint32_t &slot)
+	{
+		AddressSnapshots &snapshots = mTransactionFactory.getSnapshots();
+		snapshots.request();
+		for (;;)
+		{
+			// Nothing is being processed right now; publish the latest state ourselves rather than wait for the next block.
+			if ( snapshots.isStale() && mStateMutex.try_lock() )
+			{
+				if ( snapshots.isStale() )
+				{
+					mTransactionFactory.publishSnapshot();
+				}
+				mStateMutex.unlock();
+			}
+			slot = snapshots.enterRead();
+			const AddressSnapshot *s = snapshots.getCurrent();
+			if ( s )
+			{
+				return s;
+			}
+			// None has been published yet, or blocks are being disconnected; wait for the writer.
+			snapshots.leaveRead(slot);
+			std::lock_guard< std::mutex > lock(mStateMutex);
+			if ( snapshots.isStale() )
+			{
+				mTransactionFactory.publishSnapshot();
+			}
+		}
+	}
+
+	void endRead(uint32_t slot)
+	{
+		mTransactionFactory.getSnapshots().leaveRead(slot);
+	}
+
+	// Renders the blockchain.info style address document; returns its length (which may exceed destSize, in which case the
+	// caller should retry with a larger buffer), or zero if the address is unknown.  Safe to call from other threads while
+	// blocks are being processed.
+	virtual uint32_t getAddressJSON(const char *address,uint32_t offset,uint32_t limit,char *dest,uint32_t destSize)
+	{
+		uint32_t ret = 0;
+		uint32_t slot;
+		const AddressSnapshot *s = beginRead(slot);
+		uint32_t adr = mTransactionFactory.findAddress(address,false);
+		if ( adr && adr <= s->mAddressCount )
+		{
+			ret = mTransactionFactory.writeAddressJSON(*s,adr,offset,limit,mTransactionMap,dest,destSize);
+		}
+		endRead(slot);
+		return ret;
+	}
+
+	// Renders the blockchain.info style unspent output document for a '|' or ',' separated list of addresses; unknown
+	// addresses are skipped.  Returns its length as getAddressJSON does.  Safe to call from other threads while blocks are
+	// being processed.
+	virtual uint32_t getUnspentJSON(const char *addresses,uint32_t limit,char *dest,uint32_t destSize,uint32_t &outputCount)
+	{
+		uint32_t slot;
+		const AddressSnapshot *s = beginRead(slot);
+		uint32_t ids[MAX_UNSPENT_ADDRESSES];
+		uint32_t idCount = 0;
+		char scratch[128];
+		const char *scan = addresses;
+		while ( scan && *scan && idCount < MAX_UNSPENT_ADDRESSES )
+		{
+			uint32_t len = 0;
+			while ( scan[len] && scan[len] != '|' && scan[len] != ',' ) len++;
+			if ( len < sizeof(scratch) )
+			{
+				memcpy(scratch,scan,len);
+				scratch[len] = 0;
+				uint32_t adr = mTransactionFactory.findAddress(scratch,false);
+				if ( adr && adr <= s->mAddressCount )
+				{
+					ids[idCount++] = adr;
+				}
+			}
+			scan+=len;
+			if ( *scan ) scan++;
+		}
+		uint32_t ret = mTransactionFactory.writeUnspentJSON(*s,ids,idCount,limit,mTransactionMap,dest,destSize,outputCount);
+		endRead(slot);
+		return ret;
+	}
+
 	virtual void printTopBalances(uint32_t tcount,float minBalance) 
 	{
 		mTransactionFactory.printTopBalances(tcount,minBalance);
@@ -5764,7 +12010,14 @@ public:
 		mTransactionFactory.zombieReport(referenceTime,zdays,minBalance,report);
 	}
 
-	inline bool isSigHash(uint8_t c,uint32_t &flags) const
+	// The byte 'offset' bytes into the script from 'scan', or 0x100, which matches none of the bytes the signature tail is
+	// compared against, if that is past the end of the script.
+	static inline uint32_t peekByte(const uint8_t *scan,const uint8_t *eos,uint32_t offset)
+	{
+		return offset < (uint32_t)(eos-scan) ? scan[offset] : 0x100;
+	}
+
+	inline bool isSigHash(uint32_t c,uint32_t &flags) const
 	{
 		if ( c == 0x01 ) flags|=BlockChain::SF_SIGHASH_ALL;
 		if ( c == 0x02 ) flags|=BlockChain::SF_SIGHASH_NONE;
@@ -5777,43 +12030,48 @@ public:
 		return c == 0x01 || c == 0x02 || c == 0x03 || c == 0x81 || c == 0x82 || c == 0x83;
 	}
 
-	uint32_t analyzeSignature(const uint8_t *_inputScript,uint32_t _inputLength,uint32_t transactionIndex,uint32_t inputNumber,const uint8_t *inputHash,const uint8_t *transactionHash,uint64_t value)
+	// The SF_DER_X_1E..21 or SF_DER_Y_1E..21 flag for the length of one of the signature's integers.  Any other length is
+	// unusual.
+	static inline uint32_t getDerLengthFlag(uint32_t length,bool y)
 	{
-		uint32_t ret = BlockChain::SF_ABNORMAL;
-
-
-		const uint8_t *sigHash = NULL;
-
-		bool report = false;
-
-		if ( gBlockIndex == 278309 || gBlockIndex == 278306 )
+		switch ( length )
 		{
-			report = true;
+			case 0x1E: return y ? BlockChain::SF_DER_Y_1E : BlockChain::SF_DER_X_1E;
+			case 0x1F: return y ? BlockChain::SF_DER_Y_1F : BlockChain::SF_DER_X_1F;
+			case 0x20: return y ? BlockChain::SF_DER_Y_20 : BlockChain::SF_DER_X_20;
+			case 0x21: return y ? BlockChain::SF_DER_Y_21 : BlockChain::SF_DER_X_21;
 		}
+		return BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH;
+	}
 
-		// Search for more than 16 characters of ASCII text in a row
-		uint32_t acount = 0;
-		for (uint32_t i=0; i<_inputLength; i++)
+	// Works out the signature format of every input of a freshly loaded block and counts them in the block's own table; runs
+	// on the thread which loaded the block.
+	void analyzeSignatures(BlockImpl &block)
+	{
+		block.mSignatureStats.clear();
+		for (uint32_t j=0; j<block.transactionCount; j++)
 		{
-			uint8_t c = _inputScript[i];
-			if ( c >= 32 && c < 126 )
-			{
-				acount++;
-				if ( acount >= 16 )
-				{
-					ret|=BlockChain::SF_ASCII;
-					break;
-				}
-			}
-			else
+			BlockChain::BlockTransaction &transaction = block.transactions[j];
+			for (uint32_t i=0; i<transaction.inputCount; i++)
 			{
-				acount = 0;
+				BlockChain::BlockInput &input = transaction.inputs[i];
+				input.signatureFormat = analyzeSignature(block,input.responseScript,input.responseScriptLength,j,i,input.transactionHash,transaction.transactionHash,input.inputValue);
+				block.mSignatureStats.add(input.signatureFormat,1,input.inputValue);
 			}
 		}
+	}
+
+	uint32_t analyzeSignature(const Block &block,const uint8_t *_inputScript,uint32_t _inputLength,uint32_t transactionIndex,uint32_t inputNumber,const uint8_t *inputHash,const uint8_t *transactionHash,uint64_t value)
+	{
+		uint32_t ret = BlockChain::SF_ABNORMAL;
+
+
+		const uint8_t *sigHash = NULL;
 
-		if ( gBlockIndex == 260788 && transactionIndex == 24 && inputNumber == 139 )
+		// Search for more than 16 characters of ASCII text in a row
+		if ( SCRIPT_ANALYZER::hasAsciiRun(_inputScript,_inputLength) )
 		{
-			//			logMessage("debug me");
+			ret|=BlockChain::SF_ASCII;
 		}
 
 		// If it's the coinbase transaction, and we accept pretty much any input as valid
@@ -5823,7 +12081,7 @@ public:
 			ret&=~BlockChain::SF_ABNORMAL; // remove the abnormal bit
 			ret|= BlockChain::SF_COINBASE; // mark it as coinbase
 		}
-		else if ( _inputScript )
+		else if ( _inputScript && _inputLength )
 		{
 			const uint8_t *inputScript = _inputScript;
 			uint32_t inputLength = _inputLength;
@@ -5833,23 +12091,27 @@ public:
 			if ( inputScript[0] == 0 ) // if it has a push-data length of zero... (essentially a no-op)
 			{
 				ret|=BlockChain::SF_PUSHDATA0;
-				keyLength = inputScript[1];
+				keyLength = inputLength > 1 ? inputScript[1] : 0;
 				inputScript++;
 				inputLength--;
 			}
 
-			if ( inputScript[0] < OP_PUSHDATA1 )
+			if ( inputLength == 0 )
+			{
+				// nothing pushed
+			}
+			else if ( inputScript[0] < OP_PUSHDATA1 )
 			{
 				keyLength = inputScript[0];
 			}
-			else if ( inputScript[0] == OP_PUSHDATA1 )
+			else if ( inputScript[0] == OP_PUSHDATA1 && inputLength > 1 )
 			{
 				ret|=BlockChain::SF_PUSHDATA1;
 				keyLength = inputScript[1];
 				inputScript++;
 				inputLength--;
 			}
-			else if ( inputScript[0] == OP_PUSHDATA2 )
+			else if ( inputScript[0] == OP_PUSHDATA2 && inputLength > 2 )
 			{
 				ret|=BlockChain::SF_PUSHDATA2;
 				keyLength = inputScript[1];
@@ -5857,180 +12119,124 @@ public:
 				inputLength-=2;
 			}
 
-			if ( keyLength > 0 )
+			if ( keyLength > 0 && keyLength < inputLength ) // the length of the key must be less than the length of the inputscript!
 			{
-				if ( keyLength < inputLength ) // the length of the key must be less than the length of the inputscript!
+				SCRIPT_ANALYZER::DerShape shape;
+				uint32_t stage = SCRIPT_ANALYZER::decodeDerShape(inputScript,inputLength,shape);
+				if ( stage >= SCRIPT_ANALYZER::DER_X )
+				{
+					ret|=getDerLengthFlag(shape.mXLength,false);
+				}
+				if ( stage >= SCRIPT_ANALYZER::DER_Y )
+				{
+					ret|=getDerLengthFlag(shape.mYLength,true);
+				}
+				if ( stage == SCRIPT_ANALYZER::DER_COMPLETE )
 				{
-					const uint8_t *scan = inputScript;
-					if ( scan[1] == 0x30 ) // then it is the sequence number as we normally expect!
+					const uint8_t *scan = inputScript+shape.mSigHashOffset;
+					uint32_t scanLength = shape.mSigHashOffset;
+					const uint8_t *eos = inputScript+inputLength;
+					sigHash = scan;
+					if ( peekByte(scan,eos,0) == 0x2a ) // pretty damned unsual situation!
 					{
-						uint32_t sequenceLength = scan[2]; // get the sequence length.
-						if ( scan[3] == 0x02 ) // it's an integer type, as expected.
+						ret|=BlockChain::SF_SIGNATURE_LEADING_STRANGE;
+						while ( scan < eos && !isSigHash(peekByte(scan,eos,0),ret) )
 						{
-
-							uint32_t length1 = scan[4]; // get the length of the first part....
-
-							if ( length1 == 0x1E )
-							{
-								ret|=BlockChain::SF_DER_X_1E;
-							}
-							else if ( length1 == 0x1F )
-							{
-								ret|=BlockChain::SF_DER_X_1F;
-							}
-							else if ( length1 == 0x20 )
+							scanLength++;
+							scan++;
+						}
+					}
+					if ( peekByte(scan,eos,0) == 0x90 && peekByte(scan,eos,1) == 00 )
+					{
+						ret|=BlockChain::SF_WEIRD_90_00;
+						scanLength+=2;
+						scan+=2;
+					}
+					if ( isSigHash(peekByte(scan,eos,0),ret) || peekByte(scan,eos,0) == 0x00 ) // If should end with a sequence number of 01 or 00
+					{
+						if ( peekByte(scan,eos,0) == 0x00 )
+						{
+							ret|=BlockChain::SF_SIGHASH_ZERO;
+						}
+						scan++;
+						scanLength++;
+						if ( scanLength == inputLength )
+						{
+							ret&=~BlockChain::SF_ABNORMAL; // accepted as a valid signature.
+							ret|=BlockChain::SF_DER_ONLY;
+						}
+						else
+						{
+							while ( (scan+1) < eos && peekByte(scan,eos,0) == 0x00 && peekByte(scan,eos,1) == 0x00 )
 							{
-								ret|=BlockChain::SF_DER_X_20;
+								ret|=BlockChain::SF_SIGNATURE_LEADING_ZERO;
+								scan++;
+								scanLength++;
 							}
-							else if ( length1 == 0x21 )
+							if ( peekByte(scan,eos,0) == 0 && isSigHash(peekByte(scan,eos,1),ret) )
 							{
-								ret|=BlockChain::SF_DER_X_21;
+								ret|=BlockChain::SF_SIGNATURE_LEADING_ZERO;
+								scan++;
+								scanLength++;
 							}
-							else
+
+							if ( isSigHash(peekByte(scan,eos,0),ret) )
 							{
-								ret|=BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH;
+								scan++;
+								scanLength++;
 							}
 
-							if ( length1 < sequenceLength )
+							if ( peekByte(scan,eos,0) == 0x41 ) /// PUSHDATA41
 							{
-								scan+=5; // ok, now pointing at the first integer...
-								scan+=length1;
-								if ( scan[0] == 0x02 )
+								ret|=BlockChain::SF_SIGNATURE_41;
+								if ( peekByte(scan,eos,1) == 0x04 )
 								{
-									uint32_t length2 = scan[1]; // next integer...
-
-									if ( length2 == 0x1E )
-									{
-										ret|=BlockChain::SF_DER_Y_1E;
-									}
-									else if ( length2 == 0x1F )
+									scanLength+=0x42;
+									if ( scanLength == inputLength )
 									{
-										ret|=BlockChain::SF_DER_Y_1F;
+										ret&=~BlockChain::SF_ABNORMAL; // accepted as a valid signature
 									}
-									else if ( length2 == 0x20 )
-									{
-										ret|=BlockChain::SF_DER_Y_20;
-									}
-									else if ( length2 == 0x21 )
-									{
-										ret|=BlockChain::SF_DER_Y_21;
-									}
-									else
+								}
+							}
+							else if ( peekByte(scan,eos,0) == 0x4D )
+							{
+								ret|=BlockChain::SF_TRANSACTION_MALLEABILITY;
+								if ( peekByte(scan,eos,1) == 0x41 && peekByte(scan,eos,2) == 0x00 && peekByte(scan,eos,3) == 0x04 )
+								{
+									scanLength+=0x44;
+									if ( scanLength == inputLength )
 									{
-										ret|=BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH;
+										ret&=~BlockChain::SF_ABNORMAL; // mark it as a valid signature.
 									}
-									scan+=2;
-									scan+=length2;
-									if ( (length1 + length2 + 4) == sequenceLength ) 
+								}
+							}
+							else if ( peekByte(scan,eos,0) == 0x21 )
+							{
+								ret|=BlockChain::SF_SIGNATURE_21;
+								if ( peekByte(scan,eos,1) == 0x02 || peekByte(scan,eos,1) == 0x03 )
+								{
+									scanLength+=0x22;
+									if ( scanLength == inputLength )
 									{
-										sigHash = scan;
-										uint32_t scanLength = (uint32_t)(scan-inputScript);
-										const uint8_t *eos = inputScript+inputLength;
-										if ( scan[0] == 0x2a ) // pretty damned unsual situation!
-										{
-											ret|=BlockChain::SF_SIGNATURE_LEADING_STRANGE;
-											while ( scan < eos && !isSigHash(scan[0],ret) )
-											{
-												scanLength++;
-												scan++;
-											}
-										}
-										if ( scan[0] == 0x90 && scan[1] == 00 )
-										{
-											ret|=BlockChain::SF_WEIRD_90_00;
-											scanLength+=2;
-											scan+=2;
-										}
-										if ( isSigHash(scan[0],ret) || scan[0] == 0x00 ) // If should end with a sequence number of 01 or 00
-										{
-											if ( scan[0] == 0x00 )
-											{
-												ret|=BlockChain::SF_SIGHASH_ZERO;
-											}
-											scan++;
-											scanLength++;
-											if ( scanLength == inputLength )
-											{
-												ret&=~BlockChain::SF_ABNORMAL; // accepted as a valid signature.
-												ret|=BlockChain::SF_DER_ONLY;
-											}
-											else
-											{
-												while ( (scan+1) < eos && scan[0] == 0x00 && scan[1] == 0x00 )
-												{
-													ret|=BlockChain::SF_SIGNATURE_LEADING_ZERO;
-													scan++;
-													scanLength++;
-												}
-												if ( scan[0] == 0 && isSigHash(scan[1],ret) )
-												{
-													ret|=BlockChain::SF_SIGNATURE_LEADING_ZERO;
-													scan++;
-													scanLength++;
-												}
-
-												if ( isSigHash(scan[0],ret) )
-												{
-													scan++;
-													scanLength++;
-												}
-
-												if ( scan[0] == 0x41 ) /// PUSHDATA41
-												{
-													ret|=BlockChain::SF_SIGNATURE_41;
-													if ( scan[1] == 0x04 )
-													{
-														scanLength+=0x42;
-														if ( scanLength == inputLength )
-														{
-															ret&=~BlockChain::SF_ABNORMAL; // accepted as a valid signature
-														}
-													}
-												}
-												else if ( scan[0] == 0x4D )
-												{
-													ret|=BlockChain::SF_TRANSACTION_MALLEABILITY;
-													if ( scan[1] == 0x41 && scan[2] == 0x00 && scan[3] == 0x04 )
-													{
-														scanLength+=0x44;
-														if ( scanLength == inputLength )
-														{
-															ret&=~BlockChain::SF_ABNORMAL; // mark it as a valid signature.
-														}
-													}
-												}
-												else if ( scan[0] == 0x21 )
-												{
-													ret|=BlockChain::SF_SIGNATURE_21;
-													if ( scan[1] == 0x02 || scan[1] == 0x03 )
-													{
-														scanLength+=0x22;
-														if ( scanLength == inputLength )
-														{
-															ret&=~BlockChain::SF_ABNORMAL; // mark it as a valid signature.
-														}
-													}
-												}
-												else
-												{
-													ret|=BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH;
-													uint32_t sigLen = scan[0]+1;
-													scanLength+=sigLen;
-													if ( scanLength == inputLength )
-													{
-														ret&=~BlockChain::SF_ABNORMAL; // mark it as a valid signature.
-													}
-													else if ( scanLength < inputLength )
-													{
-														ret|=BlockChain::SF_EXTRA_STUFF;
-														ret&=~BlockChain::SF_ABNORMAL; // mark it that we 'understand' it (don't report it as unable to decode, but it's not valid either.
-													}
-												}
-											}
-										}
+										ret&=~BlockChain::SF_ABNORMAL; // mark it as a valid signature.
 									}
 								}
 							}
+							else
+							{
+								ret|=BlockChain::SF_UNUSUAL_SIGNATURE_LENGTH;
+								uint32_t sigLen = peekByte(scan,eos,0)+1;
+								scanLength+=sigLen;
+								if ( scanLength == inputLength )
+								{
+									ret&=~BlockChain::SF_ABNORMAL; // mark it as a valid signature.
+								}
+								else if ( scanLength < inputLength )
+								{
+									ret|=BlockChain::SF_EXTRA_STUFF;
+									ret&=~BlockChain::SF_ABNORMAL; // mark it that we 'understand' it (don't report it as unable to decode, but it's not valid either.
+								}
+							}
 						}
 					}
 				}
@@ -6038,9 +12244,9 @@ public:
 		}
 
 
-		if ( (ret & (BlockChain::SF_ABNORMAL | BlockChain::SF_ASCII | BlockChain::SF_TRANSACTION_MALLEABILITY)) || report )
+		if ( ret & (BlockChain::SF_ABNORMAL | BlockChain::SF_ASCII | BlockChain::SF_TRANSACTION_MALLEABILITY) )
 		{
-
+			std::lock_guard< std::mutex > lock(gSignatureFileMutex);	// blocks are analyzed on several threads at once
 			if ( gWeirdSignatureFile == NULL )
 			{
 				gWeirdSignatureFile = fopen ( "WeirdSignature.csv", "wb" );
@@ -6052,9 +12258,9 @@ public:
 				fprintf(gAsciiSignatureFile,"BlockNumber,BlockTime,TransactionHash,TransactionIndex,InputHash,InputIndex,InputLength,Value,HeaderBytes,SigBytes,SigFlags,ASCII,Hex\r\n");
 			}
 			FILE *fph = NULL;
-			if ( (ret & (BlockChain::SF_ABNORMAL | BlockChain::SF_TRANSACTION_MALLEABILITY)) || report  )
+			if ( ret & (BlockChain::SF_ABNORMAL | BlockChain::SF_TRANSACTION_MALLEABILITY) )
 			{
-				logMessage("Unusual input script: Block #%d : Transaction #%d : Input #%d : Input Length: %d\r\n", gBlockIndex, transactionIndex, inputNumber, _inputLength );
+				LOG_WARNING("Unusual input script: Block #%d : Transaction #%d : Input #%d : Input Length: %d\r\n", block.blockIndex, transactionIndex, inputNumber, _inputLength );
 				fph = gWeirdSignatureFile;
 			}
 			else
@@ -6064,9 +12270,9 @@ public:
 			if ( fph )
 			{
 				// Print the block #
-				fprintf(fph,"%d,", gBlockIndex );
+				fprintf(fph,"%d,", block.blockIndex );
 				// Print the block time
-				const char *ts = getTimeString(gBlockTime);
+				const char *ts = getTimeString(block.timeStamp);
 				fprintf(fph,"\"%s\",", ts );
 				// Print the transaction hash
 				fprintReverseHash (fph , transactionHash);
@@ -6171,8 +12377,15 @@ public:
 		return ret;
 	}
 
+	virtual void setComputeWitnessHashes(bool state)
+	{
+		mParsePool.stop();	// the workers read the setting as they load blocks
+		mComputeWitnessHashes = state;
+	}
+
 	virtual void setAnalyzeInputSignatures(bool state) 
 	{
+		mParsePool.stop();	// the workers read the setting as they load blocks
 		mAnalyzeInputSignatures = state;
 	}
 
@@ -6336,17 +12549,7 @@ public:
 									const BlockOutput &o = t->outputs[input.transactionIndex];
 									if ( o.publicKey )
 									{
-										bool ok=true;
-										if ( o.isRipeMD160 )
-										{
-											uint8_t temp[25];
-											BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinRIPEMD160ToAddress(o.publicKey,temp);
-											BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(temp,scratch,256);
-										}
-										else
-										{
-											ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAscii(o.publicKey,scratch,256);
-										}
+										bool ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinKeyToAscii(o.scriptType,o.publicKey,o.keyLength,scratch,256);
 										if ( ok )
 										{
 											inputValue = o.value;
@@ -6399,17 +12602,7 @@ public:
 						scratch[0] = 0;
 						if ( output.publicKey )
 						{
-							bool ok=true;
-							if ( output.isRipeMD160 )
-							{
-								uint8_t temp[25];
-								BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinRIPEMD160ToAddress(output.publicKey,temp);
-								BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinAddressToAscii(temp,scratch,256);
-							}
-							else
-							{
-								ok = BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinPublicKeyToAscii(output.publicKey,scratch,256);
-							}
+							BLOCKCHAIN_BITCOIN_ADDRESS::bitcoinKeyToAscii(output.scriptType,output.publicKey,output.keyLength,scratch,256);
 						}
 						fprintf(mExportFile,"\"%s\",", scratch );
 						fprintf(mExportFile,"\"%0.9f\",", (float)output.value / ONE_BTC );
@@ -6455,6 +12648,7 @@ public:
 	uint32_t					mExportTransactionCount;
 
 	bool						mAnalyzeInputSignatures;
+	bool						mComputeWitnessHashes;
 	bool						mExportTransactions;
 
 	char						mRootDir[512];					// The root directory name where the block chain is stored
@@ -6470,22 +12664,41 @@ public:
 	BlockImpl					mSingleReadBlock;
 	BlockImpl					mSingleTransactionBlock;
 
+	BlockParsePool				mParsePool;			// Reads and parses blocks ahead while the chain is read in order
+	std::mutex					mFileMutex;			// Held while seeking and reading the block files
+	uint32_t					mLastReadBlock;		// The block readBlock returned last
+
 	uint32_t					mReadCount;
-	uint8_t						*mCurrentBlockData;
-	uint8_t						mBlockDataBuffer[MAX_BLOCK_SIZE];	// Holds one block of data
-	uint8_t						mTransactionBlockBuffer[MAX_BLOCK_SIZE];
+	ScratchBuffer< uint8_t >	mBlockDataBuffer;		// Holds one block of data
+	ScratchBuffer< uint8_t >	mTransactionBlockBuffer;	// Holds the transaction readSingleTransaction reads
 	uint32_t					mTransactionCount;
 	TransactionHashMap			mTransactionMap;	// A hash map to the seek file location of all transactions (by hash)
+	std::mutex					mStateMutex;		// Held while the address and transaction state is changed or a snapshot of it published
 	uint32_t					mLastBlockHeaderCount;
 
 	uint32_t					mTotalTransactionCount;
 	uint32_t					mTotalInputCount;
 	uint32_t					mTotalOutputCount;
+	uint64_t					mScriptTypeTotals[ST_COUNT];	// Outputs of each script type over every block read
+	BlockStatJournal			mStatJournal;					// What the newest blocks added to mScriptTypeTotals and gSignatureStats
+	uint64_t					mUnattributedOutputCount;		// Outputs (other than OP_RETURN) which could not be credited to an address
+	uint64_t					mUnmappedTransactionCount;		// Transactions which did not fit in the transaction hash map
+	uint64_t					mResolvedInputCount;			// Non-coinbase inputs processed whose spent output was found
+	uint64_t					mFailedInputCount;				// Non-coinbase inputs processed whose spent output was not found
 	uint32_t					mScanCount;
 	uint32_t					mBlockCount;
-	BlockHeader					*mLastBlockHeader;
+	BlockHeader					*mBestHeader;			// The header with the most cumulative work seen so far
+	BlockHeader					**mAttachStack;			// Scratch stack used while attaching orphaned headers
+	uint32_t					mOrphanCount;			// Number of headers waiting for their parent
+	uint32_t					mReorgForkBlock;		// First block which changed during the last buildBlockChain
+	uint32_t					mReorgDisconnectCount;	// Blocks of the previous chain which were replaced
+	uint32_t					mReorgConnectCount;		// Blocks of the new chain starting at mReorgForkBlock
+	uint32_t					mRejectedHeaderCount;	// Number of headers dropped because they failed proof-of-work validation
+	uint32_t					mProofOfWorkLimit;		// The easiest compact target a header may claim
 	BlockHeader					**mBlockHeaders;
 	BlockHeaderMap				mBlockHeaderMap;		// A hash-map of all of the block headers
+	BlockTimeIndex				mBlockTimeIndex;		// Time of each block on the active chain
+	OrphanHeaderMap				mOrphanHeaderMap;		// Headers waiting for a parent we have not read yet, keyed by that parent's hash
 	BitcoinTransactionFactory	mTransactionFactory;	// the factory that accumulates all transactions on a per-address basis
 };
 
@@ -1,6 +1,11 @@
+import os
+
+# Point this at a local BlockLens query server ('serve' command), e.g. http://127.0.0.1:8080
+BLOCKCHAIN_INFO_URL = os.environ.get("BLOCKCHAIN_INFO_URL", "https://blockchain.info")
+
 def payments_for_address(bitcoin_address):
     "return an array of (TX ids, net_payment)"
-    URL = "https://blockchain.info/address/%s?format=json" % bitcoin_address
+    URL = "%s/address/%s?format=json" % (BLOCKCHAIN_INFO_URL, bitcoin_address)
     d = urlopen(URL).read()
     json_response = json.loads(d.decode("utf8"))
     response = []
@@ -19,7 +24,7 @@ def coin_sources_for_address(bitcoin_address):
         (tx_hash, tx_output_index, tx_out)
         tx_out is a TxOut item with attrs "value" & "script"
     """
-    URL = "https://blockchain.info/unspent?active=%s&format=json" % (bitcoin_address)
+    URL = "%s/unspent?active=%s&format=json" % (BLOCKCHAIN_INFO_URL, bitcoin_address)
     result = urlfetch.fetch(URL)
     if result.status_code != 200:
       return []
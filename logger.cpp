@@ -0,0 +1,523 @@
+#include "Logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#define LOG_SLOT_COUNT 4096						// Ring buffer slots; *MUST* be a power of 2
+#define LOG_SLOT_SIZE 256						// Text bytes per slot; longer messages take several consecutive slots
+#define MAX_LOG_MESSAGE 2048					// Longest message; anything beyond is cut off
+#define LOG_BATCH_SIZE (64*1024)				// The writer copies up to this much out of the ring per write
+#define LOG_WRITER_SLEEP_MS 10					// How long the idle writer sleeps before looking at the ring again
+#define DEFAULT_RATE_LIMIT 20
+
+namespace LOGGER
+{
+
+// A message starts in the slot at its position and continues in the slots after it.  A slot is free for position p when its
+// sequence is p, and the first slot of a message holds p+1 once the message is complete.  The writer hands slots back by
+// setting their sequence to p+LOG_SLOT_COUNT, always in position order, so a producer which finds the last slot it needs free
+// knows the ones before it are free as well.
+class LogSlot
+{
+public:
+	std::atomic< uint64_t >	mSequence;
+	uint32_t				mLength;		// whole message, in the first slot only
+	uint32_t				mSlotCount;		// slots the message spans, in the first slot only
+	char					mText[LOG_SLOT_SIZE];
+};
+
+static const char *gLevelNames[LL_LAST] = { "debug", "info", "warning", "error" };
+
+// What a site message of each level starts with; call sites do not spell the level out themselves.
+static const char *gLevelPrefixes[LL_LAST] = { "", "", "Warning: ", "ERROR: " };
+
+class LoggerImpl
+{
+public:
+	LoggerImpl(void)
+	{
+		mSlots = new LogSlot[LOG_SLOT_COUNT];
+		for (uint32_t i=0; i<LOG_SLOT_COUNT; i++)
+		{
+			mSlots[i].mSequence.store(i,std::memory_order_relaxed);
+		}
+		mHead.store(0,std::memory_order_relaxed);
+		mTail = 0;
+		mFlushed.store(0,std::memory_order_relaxed);
+		mLevel.store(LL_INFO,std::memory_order_relaxed);
+		mCountersOnly.store(false,std::memory_order_relaxed);
+		mRateLimit.store(DEFAULT_RATE_LIMIT,std::memory_order_relaxed);
+		mDropped.store(0,std::memory_order_relaxed);
+		mWaits.store(0,std::memory_order_relaxed);
+		mBatches.store(0,std::memory_order_relaxed);
+		mBytes.store(0,std::memory_order_relaxed);
+		mSites.store(NULL,std::memory_order_relaxed);
+		mRunning.store(false,std::memory_order_relaxed);
+		mSleeping.store(false,std::memory_order_relaxed);
+		mFlushWaiters = 0;
+		mStop = false;
+		mAtExit = false;
+		mThread = NULL;
+		mLogFile = NULL;
+		mBatch = new char[LOG_BATCH_SIZE];
+	}
+
+	void print(LogSite *site,const char *fmt,va_list arg)
+	{
+		char message[MAX_LOG_MESSAGE];
+		uint32_t length;
+		if ( site )
+		{
+			if ( !admit(*site) )
+			{
+				return;
+			}
+			uint32_t prefixLength = (uint32_t)strlen(gLevelPrefixes[site->mLevel]);
+			memcpy(message,gLevelPrefixes[site->mLevel],prefixLength);
+			length = prefixLength+format(message+prefixLength,MAX_LOG_MESSAGE-prefixLength,fmt,arg);
+			uint64_t skipped = site->mPendingSuppressed.load(std::memory_order_relaxed) ? site->mPendingSuppressed.exchange(0,std::memory_order_relaxed) : 0;
+			if ( skipped && length < MAX_LOG_MESSAGE-1 )
+			{
+				int n = snprintf(message+length,MAX_LOG_MESSAGE-length,"    (%llu more from %s:%d not shown; rate limit %d per second)\r\n",
+					(unsigned long long)skipped, getFileName(site->mFile), site->mLine, mRateLimit.load(std::memory_order_relaxed) );
+				length = n > 0 ? std::min< uint32_t >(length+(uint32_t)n,MAX_LOG_MESSAGE-1) : length;
+			}
+			if ( enqueue(message,length,false) )
+			{
+				site->mWritten.fetch_add(1,std::memory_order_relaxed);
+			}
+			else
+			{
+				site->mSuppressed.fetch_add(1,std::memory_order_relaxed);
+				mDropped.fetch_add(1,std::memory_order_relaxed);
+			}
+		}
+		else
+		{
+			length = format(message,MAX_LOG_MESSAGE,fmt,arg);
+			enqueue(message,length,true);
+		}
+	}
+
+	void flush(void)
+	{
+		uint64_t target = mHead.load(std::memory_order_acquire);
+		if ( !mRunning.load(std::memory_order_acquire) )
+		{
+			return;
+		}
+		std::unique_lock< std::mutex > lock(mMutex);
+		mFlushWaiters++;
+		mWake.notify_one();
+		mFlushDone.wait(lock,[this,target]() { return mFlushed.load(std::memory_order_acquire) >= target || !mRunning.load(std::memory_order_acquire); });
+		mFlushWaiters--;
+	}
+
+	void shutdown(void)
+	{
+		// mThread stays set until the writer is gone, so nothing can start a second writer while the first one drains the ring
+		std::thread *thread = NULL;
+		{
+			std::lock_guard< std::mutex > lock(mMutex);
+			if ( mThread && !mStop )
+			{
+				mStop = true;
+				thread = mThread;
+			}
+			mWake.notify_one();
+		}
+		if ( thread )
+		{
+			thread->join();
+			std::lock_guard< std::mutex > lock(mMutex);
+			delete mThread;
+			mThread = NULL;
+			mStop = false;
+			mRunning.store(false,std::memory_order_release);
+			mFlushDone.notify_all();
+		}
+	}
+
+	void report(void)
+	{
+		std::vector< LogSite * > sites;
+		for (LogSite *s=mSites.load(std::memory_order_acquire); s; s=s->mNext)
+		{
+			sites.push_back(s);
+		}
+		std::sort(sites.begin(),sites.end(),[](const LogSite *a,const LogSite *b)
+		{
+			return a->mCount.load(std::memory_order_relaxed) > b->mCount.load(std::memory_order_relaxed);
+		});
+		uint32_t rate = mRateLimit.load(std::memory_order_relaxed);
+		logPrint(NULL,"Log level: %s  Counters only: %s  Rate limit: ", gLevelNames[mLevel.load(std::memory_order_relaxed)], mCountersOnly.load(std::memory_order_relaxed) ? "on" : "off" );
+		if ( rate )
+		{
+			logPrint(NULL,"%d messages per second per site\r\n", rate );
+		}
+		else
+		{
+			logPrint(NULL,"none\r\n");
+		}
+		logPrint(NULL,"Ring buffer: %d slots of %d bytes.  %llu bytes written in %llu batches; %llu messages dropped while full, %llu waits for room.\r\n",
+			LOG_SLOT_COUNT, LOG_SLOT_SIZE,
+			(unsigned long long)mBytes.load(std::memory_order_relaxed),
+			(unsigned long long)mBatches.load(std::memory_order_relaxed),
+			(unsigned long long)mDropped.load(std::memory_order_relaxed),
+			(unsigned long long)mWaits.load(std::memory_order_relaxed) );
+		logPrint(NULL,"%-32s %-8s %14s %14s %14s\r\n", "Site", "Level", "Count", "Written", "Suppressed" );
+		for (size_t i=0; i<sites.size(); i++)
+		{
+			const LogSite &s = *sites[i];
+			char where[512];
+			snprintf(where,sizeof(where),"%s:%d", getFileName(s.mFile), s.mLine );
+			logPrint(NULL,"%-32s %-8s %14llu %14llu %14llu\r\n", where, gLevelNames[s.mLevel],
+				(unsigned long long)s.mCount.load(std::memory_order_relaxed),
+				(unsigned long long)s.mWritten.load(std::memory_order_relaxed),
+				(unsigned long long)s.mSuppressed.load(std::memory_order_relaxed) );
+		}
+		if ( sites.empty() )
+		{
+			logPrint(NULL,"No diagnostic messages logged yet.\r\n");
+		}
+	}
+
+	std::atomic< uint32_t >	mLevel;
+	std::atomic< bool >		mCountersOnly;
+	std::atomic< uint32_t >	mRateLimit;
+
+private:
+
+	static const char *getFileName(const char *path)
+	{
+		const char *ret = path;
+		for (const char *scan=path; *scan; scan++)
+		{
+			if ( *scan == '/' || *scan == '\\' )
+			{
+				ret = scan+1;
+			}
+		}
+		return ret;
+	}
+
+	static uint32_t format(char *message,uint32_t size,const char *fmt,va_list arg)
+	{
+		int n = vsnprintf(message,size,fmt,arg);
+		if ( n < 0 )
+		{
+			message[0] = 0;
+			n = 0;
+		}
+		return (uint32_t)n < size ? (uint32_t)n : size-1;
+	}
+
+	// Counts the call and decides whether the message is written at all, before anything is formatted.
+	bool admit(LogSite &site)
+	{
+		site.mCount.fetch_add(1,std::memory_order_relaxed);
+		if ( !site.mRegistered.load(std::memory_order_relaxed) && !site.mRegistered.exchange(true,std::memory_order_relaxed) )
+		{
+			LogSite *head = mSites.load(std::memory_order_relaxed);
+			do
+			{
+				site.mNext = head;
+			} while ( !mSites.compare_exchange_weak(head,&site,std::memory_order_release,std::memory_order_relaxed) );
+		}
+		if ( (uint32_t)site.mLevel < mLevel.load(std::memory_order_relaxed) || mCountersOnly.load(std::memory_order_relaxed) )
+		{
+			site.mSuppressed.fetch_add(1,std::memory_order_relaxed);
+			return false;
+		}
+		uint32_t limit = mRateLimit.load(std::memory_order_relaxed);
+		if ( limit )
+		{
+			uint32_t now = (uint32_t)std::chrono::duration_cast< std::chrono::seconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
+			uint32_t window = site.mWindow.load(std::memory_order_relaxed);
+			if ( window != now && site.mWindow.compare_exchange_strong(window,now,std::memory_order_relaxed) )
+			{
+				site.mWindowCount.store(0,std::memory_order_relaxed);
+			}
+			if ( site.mWindowCount.fetch_add(1,std::memory_order_relaxed) >= limit )
+			{
+				site.mSuppressed.fetch_add(1,std::memory_order_relaxed);
+				site.mPendingSuppressed.fetch_add(1,std::memory_order_relaxed);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Copies a message into the ring.  When the ring is full, either waits for the writer to make room or gives up.
+	bool enqueue(const char *message,uint32_t length,bool wait)
+	{
+		if ( !mRunning.load(std::memory_order_acquire) )
+		{
+			start();
+		}
+		uint32_t slotCount = length ? (length+LOG_SLOT_SIZE-1)/LOG_SLOT_SIZE : 1;
+		uint64_t pos = mHead.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			uint64_t last = pos+slotCount-1;
+			uint64_t sequence = mSlots[last & (LOG_SLOT_COUNT-1)].mSequence.load(std::memory_order_acquire);
+			if ( sequence == last )
+			{
+				if ( mHead.compare_exchange_weak(pos,pos+slotCount,std::memory_order_relaxed) )
+				{
+					break;
+				}
+			}
+			else if ( sequence < last && mHead.load(std::memory_order_relaxed) == pos )
+			{
+				// Full; the writer has not handed the slot back yet
+				if ( !wait )
+				{
+					return false;
+				}
+				mWaits.fetch_add(1,std::memory_order_relaxed);
+				wake();
+				std::this_thread::yield();
+				pos = mHead.load(std::memory_order_relaxed);
+			}
+			else
+			{
+				pos = mHead.load(std::memory_order_relaxed);	// somebody else claimed it
+			}
+		}
+		LogSlot &first = mSlots[pos & (LOG_SLOT_COUNT-1)];
+		first.mLength = length;
+		first.mSlotCount = slotCount;
+		for (uint32_t i=0; i<slotCount; i++)
+		{
+			uint32_t offset = i*LOG_SLOT_SIZE;
+			uint32_t count = std::min< uint32_t >(LOG_SLOT_SIZE,length-offset);
+			memcpy(mSlots[(pos+i) & (LOG_SLOT_COUNT-1)].mText,message+offset,count);
+		}
+		first.mSequence.store(pos+1,std::memory_order_seq_cst);
+		if ( mSleeping.load(std::memory_order_seq_cst) )
+		{
+			wake();
+		}
+		return true;
+	}
+
+	// The writer holds the mutex from announcing it sleeps until it waits, so taking it here means the notify cannot be missed.
+	void wake(void)
+	{
+		if ( mSleeping.exchange(false,std::memory_order_seq_cst) )
+		{
+			{
+				std::lock_guard< std::mutex > lock(mMutex);
+			}
+			mWake.notify_one();
+		}
+	}
+
+	void start(void)
+	{
+		std::lock_guard< std::mutex > lock(mMutex);
+		if ( mThread == NULL )
+		{
+			mThread = new std::thread([this]() { writerThread(); });
+			mRunning.store(true,std::memory_order_release);
+			if ( !mAtExit )
+			{
+				mAtExit = true;
+				atexit(logShutdown);
+			}
+		}
+	}
+
+	bool ready(void) const
+	{
+		return mSlots[mTail & (LOG_SLOT_COUNT-1)].mSequence.load(std::memory_order_seq_cst) == mTail+1;
+	}
+
+	// Copies complete messages out of the ring into the batch buffer, handing their slots back, until the ring is empty or the
+	// batch is full.  Returns the number of bytes copied.
+	uint32_t drain(void)
+	{
+		uint32_t ret = 0;
+		while ( ready() )
+		{
+			LogSlot &first = mSlots[mTail & (LOG_SLOT_COUNT-1)];
+			uint32_t length = first.mLength;
+			uint32_t slotCount = first.mSlotCount;
+			if ( ret+length > LOG_BATCH_SIZE )
+			{
+				break;
+			}
+			for (uint32_t i=0; i<slotCount; i++)
+			{
+				LogSlot &slot = mSlots[(mTail+i) & (LOG_SLOT_COUNT-1)];
+				uint32_t offset = i*LOG_SLOT_SIZE;
+				memcpy(mBatch+ret+offset,slot.mText,std::min< uint32_t >(LOG_SLOT_SIZE,length-offset));
+			}
+			for (uint32_t i=0; i<slotCount; i++)
+			{
+				mSlots[(mTail+i) & (LOG_SLOT_COUNT-1)].mSequence.store(mTail+i+LOG_SLOT_COUNT,std::memory_order_release);
+			}
+			mTail+=slotCount;
+			ret+=length;
+		}
+		return ret;
+	}
+
+	void writerThread(void)
+	{
+		bool dirty = false;
+		for (;;)
+		{
+			uint32_t length = drain();
+			if ( length )
+			{
+				if ( mLogFile == NULL )
+				{
+					mLogFile = fopen("blockchain.txt", "wb");
+				}
+				fwrite(mBatch,1,length,stdout);
+				if ( mLogFile )
+				{
+					fwrite(mBatch,1,length,mLogFile);
+				}
+				mBytes.fetch_add(length,std::memory_order_relaxed);
+				mBatches.fetch_add(1,std::memory_order_relaxed);
+				dirty = true;
+				continue;
+			}
+			// The ring is empty: flush once for the whole batch and let anybody waiting in logFlush go
+			if ( dirty )
+			{
+				fflush(stdout);
+				if ( mLogFile )
+				{
+					fflush(mLogFile);
+				}
+				dirty = false;
+			}
+			std::unique_lock< std::mutex > lock(mMutex);
+			mFlushed.store(mTail,std::memory_order_release);
+			if ( mFlushWaiters )
+			{
+				mFlushDone.notify_all();
+			}
+			if ( mStop && !ready() && mHead.load(std::memory_order_acquire) == mTail )
+			{
+				break;
+			}
+			mSleeping.store(true,std::memory_order_seq_cst);
+			if ( !ready() && !mStop )
+			{
+				mWake.wait_for(lock,std::chrono::milliseconds(LOG_WRITER_SLEEP_MS));
+			}
+			mSleeping.store(false,std::memory_order_relaxed);
+		}
+	}
+
+	LogSlot						*mSlots;
+	std::atomic< uint64_t >		mHead;			// next position to claim
+	uint64_t					mTail;			// next position the writer reads; only the writer touches it
+	std::atomic< uint64_t >		mFlushed;		// everything before this position has been written and flushed
+	std::atomic< uint64_t >		mDropped;
+	std::atomic< uint64_t >		mWaits;
+	std::atomic< uint64_t >		mBatches;
+	std::atomic< uint64_t >		mBytes;
+	std::atomic< LogSite * >	mSites;
+	std::atomic< bool >			mRunning;
+	std::atomic< bool >			mSleeping;
+	std::mutex					mMutex;			// guards starting and stopping the writer, and the flush hand-off
+	std::condition_variable		mWake;
+	std::condition_variable		mFlushDone;
+	uint32_t					mFlushWaiters;	// threads in logFlush
+	bool						mStop;
+	bool						mAtExit;
+	std::thread					*mThread;
+	FILE						*mLogFile;
+	char						*mBatch;
+};
+
+// Never destroyed, so logging from other threads or from atexit handlers stays safe until the process is gone.
+static LoggerImpl &getLogger(void)
+{
+	static LoggerImpl *gLogger = new LoggerImpl;
+	return *gLogger;
+}
+
+}; // end of namespace
+
+void logPrint(LogSite *site,const char *fmt,...)
+{
+	va_list arg;
+	va_start(arg,fmt);
+	LOGGER::getLogger().print(site,fmt,arg);
+	va_end(arg);
+}
+
+void logPrintV(LogSite *site,const char *fmt,va_list arg)
+{
+	LOGGER::getLogger().print(site,fmt,arg);
+}
+
+void logSetLevel(LogLevel level)
+{
+	if ( level < LL_LAST )
+	{
+		LOGGER::getLogger().mLevel.store(level,std::memory_order_relaxed);
+	}
+}
+
+LogLevel logGetLevel(void)
+{
+	return (LogLevel)LOGGER::getLogger().mLevel.load(std::memory_order_relaxed);
+}
+
+const char *logGetLevelName(LogLevel level)
+{
+	return level < LL_LAST ? LOGGER::gLevelNames[level] : "unknown";
+}
+
+void logSetCountersOnly(bool state)
+{
+	LOGGER::getLogger().mCountersOnly.store(state,std::memory_order_relaxed);
+}
+
+bool logGetCountersOnly(void)
+{
+	return LOGGER::getLogger().mCountersOnly.load(std::memory_order_relaxed);
+}
+
+void logSetRateLimit(uint32_t messagesPerSecond)
+{
+	LOGGER::getLogger().mRateLimit.store(messagesPerSecond,std::memory_order_relaxed);
+}
+
+uint32_t logGetRateLimit(void)
+{
+	return LOGGER::getLogger().mRateLimit.load(std::memory_order_relaxed);
+}
+
+void logFlush(void)
+{
+	LOGGER::getLogger().flush();
+}
+
+void logReport(void)
+{
+	LOGGER::getLogger().report();
+	LOGGER::getLogger().flush();
+}
+
+void logShutdown(void)
+{
+	LOGGER::getLogger().shutdown();
+}
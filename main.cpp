@@ -1,3 +1,7 @@
+#include "Logger.h"
+#include "Profiler.h"
+#include "QueryServer.h"
+
 static const char *getTimeString(uint32_t timeStamp)
 {
         static char scratch[1024];
@@ -48,9 +52,11 @@ public:
                 mAbsoluteTime = false;
                 mDebugVisualize = NULL;
                 mAnalyze = false;
+                mWitnessHashes = false;
                 mExportTransactions = false;
                 mBlockChain = createBlockChain(dataPath);       // Create the block-chain parser using this root path
                 mStatResolution = SR_YEAR;
+                mStatBoundaryBlock = 0xFFFFFFFF;
                 mMaxBlock = 500000;
                 printf("Welcome to the BlockChain command parser.  Written by John W. Ratcliff on January 4, 2014 : TipJar: 1BT66EoaGySkbY9J6MugvQRhMMXDwPxPya\r\n");
                 printf("Registered DataDirectory: %s to scan for the blockchain.\r\n", dataPath );
@@ -60,12 +66,14 @@ public:
                 mLastBlockScan = 0;
                 mLastBlockPrint = 0;
                 mFinishedScanning = false;
+                mReorgFailed = false;
                 mCurrentBlock = NULL;
                 mLastTime = 0;
                 mSatoshiTime = 0;
                 mMinBalance = 1;
                 mRecordAddresses = false;
                 mAddresses = NULL;
+                mQueryServer = NULL;
                 mMode = CM_NONE;
 
                 if ( mBlockChain )
@@ -81,6 +89,10 @@ public:
 
         ~BlockChainCommand(void)
         {
+                if ( mQueryServer )
+                {
+                        mQueryServer->release();        // stop answering queries before the block-chain goes away
+                }
                 if ( mAddresses )
                 {
                         mAddresses->release();
@@ -101,6 +113,7 @@ public:
                 printf("\r\n");
 
                 printf("max_blocks            : Specifies the maximum number of blocks to read.\r\n");
+                printf("pow_limit <bits>      : Sets the easiest compact target (in hex) a block header may claim; 207fffff for chains written by benchmarks/generate_blocks.\r\n");
                 printf("scan                  : Toggles scanning the blockchain headers pressing a key will pause or abort the scan.\r\n");
                 printf("process               : Toggle processing all blocks; warning uses a lot of memory!..\r\n");
                 printf("statistics            : Enables gathering detailed address/transaction statistics on the block chain\r\n");
@@ -108,6 +121,7 @@ public:
                 printf("stop_scan             : Stop's the scan of the blockchain headers and just builds the blockchain from where we are at so far.\r\n");
                 printf("block <number>        : Will print the contents of this block.\r\n");
                 printf("counts                : Report block and transaction counts.\r\n");
+                printf("undo <n>              : Disconnects the last <n> processed blocks, rolling back address balances.\r\n");
                 printf("by_day                : Reports statistics by day.\r\n");
                 printf("by_month              : Reports statistics by month.\r\n");
                 printf("by_year               : Reports statistics by year.\r\n");
@@ -115,14 +129,26 @@ public:
                 printf("min_balance <n>       : Specifies the minimum balance to use when generating a report. Default is 1BTC\r\n");
                 printf("oldest <n>            : Outputs the <n> oldest addresses higher than min_balance\r\n");
                 printf("adr <n>               : Outputs the transaction history relative to a specific bitcoinaddres.\r\n");
+                printf("balance <adr> <block> : Outputs the balance of an address at the end of this block.\r\n");
+                printf("balance_at <adr> <t>  : Outputs the balance of an address as of this time (seconds since 1970, UTC).\r\n");
+                printf("cluster <adr>         : Outputs the addresses which have co-signed transactions with this address.\r\n");
+                printf("query <terms>         : Lists addresses matching all terms, e.g. balance>10 lastused<2012-01-01 coinbase:50 txcount>=3 sort:balance limit:50 explain\r\n");
+                printf("serve [port] [threads]: Serves /address/<adr>?format=json and /unspent?active=<adr> on 127.0.0.1 (default port 8080); 'serve stop' stops it.\r\n");
+                printf("save_clusters <file>  : Saves the address cluster ids; default 'AddressClusters.bin'.\r\n");
+                printf("load_clusters <file>  : Loads previously saved address cluster ids; default 'AddressClusters.bin'.\r\n");
+                printf("trace <tx> <dir> <policy> [hops] [output] : Traces coins of a transaction 'forward' or 'backward' using the 'poison', 'haircut' or 'fifo' policy.\r\n");
                 printf("zombie <days>         : Report statitics about zombie coins; contents of addresses not used since this many days.\r\n");
                 printf("record_addresses      : Toggles whether or not to record addresses when computing statistics.\r\n");
                 printf("load_record           : Debugging feature, tries to load previously recorded addresses.\r\n");
                 printf("row                   : Prints out addresses for current row.\r\n");
                 printf("analyze               : Analyze transaction input signatures.\r\n");
+                printf("wtxid                 : Toggles computing the witness transaction id (wtxid) of segwit transactions.\r\n");
                 printf("export                : Export all transactions to a series of CSV files; one per day.\r\n");
                 printf("dump                  : Writes out *every* single bitcoin public key to two files called 'DumpByBalance.csv' and 'DumpByAge.csv' with a value greater than or equal to min-balance.  A min-balance of zero is valid!\r\n");
                 printf("usage                 : Gets the usage statistics\r\n");
+                printf("perf [reset|file <name> <seconds>|file off] : Shows where the time went by stage and thread, starts counting again, or appends the totals as JSON lines to a file every <n> seconds (default 'perf_stats.json', 10).\r\n");
+                printf("memory                : Shows the reserved, used, high water and resident memory of every large pool and hash table, with hash chain lengths.\r\n");
+                printf("log [level|counters|rate <n>] : Shows the log counters, sets the level (debug, info, warning, error), toggles counting warnings without printing them, or limits messages per second per site (0 = none).\r\n");
                 printf("help                  : Repeat these commands.\r\n");
                 printf("relative_time         : Default : Compute statistics relative to the time of the last block processed.\r\n");
                 printf("absolute_time         : Compute statistics relative to the *current* absolute time.h\r\n");
@@ -134,10 +160,68 @@ public:
                 mFinishedScanning = true;
                 mMode = CM_NONE; // done scanning.
                 mLastBlockScan = mBlockChain->buildBlockChain();
+                handleReorg();
                 mCurrentBlock = mBlockChain->readBlock(0);
                 printf("Stopped scanning block headers early. Built block-chain with %d blocks found..\r\n", mLastBlockScan);
         }
 
+        // Returns the first block of the statistics period following the one this block falls in.  The calendar conversion
+        // happens once per period; the block itself is found by a binary search of the block time index.
+        uint32_t getPeriodEndBlock(uint32_t blockIndex)
+        {
+                time_t t(mBlockChain->getBlockTime(blockIndex));
+                struct tm period = *localtime(&t);
+                period.tm_hour = 0;
+                period.tm_min = 0;
+                period.tm_sec = 0;
+                period.tm_isdst = -1;
+                switch ( mStatResolution )
+                {
+                        case SR_DAY:
+                                period.tm_mday++;
+                                break;
+                        case SR_MONTH:
+                                period.tm_mday = 1;
+                                period.tm_mon++;
+                                break;
+                        default:
+                                period.tm_mday = 1;
+                                period.tm_mon = 0;
+                                period.tm_year++;
+                                break;
+                }
+                time_t boundary = mktime(&period); // mktime normalizes the day/month overflow
+                uint32_t firstBlock;
+                mBlockChain->getBlockRange((uint32_t)boundary,0xFFFFFFFF,firstBlock);
+                return firstBlock;
+        }
+
+        // If rebuilding the block-chain replaced blocks we have already processed, roll the address state back to the fork point
+        // so processing resumes on the new chain.  If not every replaced block can be undone the address state still holds
+        // transactions from the abandoned chain; processing the new chain on top of that would silently produce wrong balances,
+        // so the reorganization is abandoned and processing refused until the tool is restarted and re-processes from the start.
+        void handleReorg(void)
+        {
+                uint32_t forkBlock,disconnectCount,connectCount;
+                if ( mBlockChain->getChainReorg(forkBlock,disconnectCount,connectCount) )
+                {
+                        uint32_t processed = mBlockChain->getProcessedBlockCount();
+                        printf("Chain reorganization at block #%d : %d blocks replaced by %d.\r\n", forkBlock, disconnectCount, connectCount );
+                        if ( processed > forkBlock )
+                        {
+                                uint32_t undone = mBlockChain->disconnectBlocks(processed-forkBlock);
+                                mProcessBlock = mBlockChain->getProcessedBlockCount();
+                                mStatBoundaryBlock = 0xFFFFFFFF;
+                                if ( undone < (processed-forkBlock) )
+                                {
+                                        printf("ERROR: only %d of %d processed blocks could be undone; the address state no longer matches any chain.  Restart the tool to re-process from the start.\r\n", undone, processed-forkBlock );
+                                        mReorgFailed = true;
+                                        mMode = CM_NONE;
+                                }
+                        }
+                }
+        }
+
         bool process(void)
         {
                 uint32_t argc;
@@ -218,6 +302,12 @@ public:
                                 printf("Transaction Input Signature Analysis set to: %s\r\n", mAnalyze ? "true" : "false");
                                 mBlockChain->setAnalyzeInputSignatures(mAnalyze);
                         }
+                        else if ( strcmp(argv[0],"wtxid") == 0 )
+                        {
+                                mWitnessHashes = mWitnessHashes ? false : true;
+                                printf("Witness transaction ids set to: %s\r\n", mWitnessHashes ? "true" : "false");
+                                mBlockChain->setComputeWitnessHashes(mWitnessHashes);
+                        }
                         else if ( strcmp(argv[0],"export") == 0 )
                         {
                                 mExportTransactions = mExportTransactions ? false : true;
@@ -233,9 +323,19 @@ public:
                                         printf("Maximum block scan set to %d\r\n", mMaxBlock );
                                 }
                         }
+                        else if ( strcmp(argv[0],"pow_limit") == 0 )
+                        {
+                                if ( argc >= 2 )
+                                {
+                                        uint32_t bits = (uint32_t)strtoul(argv[1],NULL,16);
+                                        mBlockChain->setProofOfWorkLimit(bits);
+                                        printf("Proof of work limit set to %08x\r\n", bits );
+                                }
+                        }
                         else if ( strcmp(argv[0],"by_day") == 0 )
                         {
                                 mStatResolution = SR_DAY;
+                                mStatBoundaryBlock = 0xFFFFFFFF;
                                 printf("Will accumulate statistics on a per-day basis.\r\n");
                                 if ( !mProcessTransactions )
                                 {
@@ -245,6 +345,7 @@ public:
                         else if ( strcmp(argv[0],"by_month") == 0 )
                         {
                                 mStatResolution = SR_MONTH;
+                                mStatBoundaryBlock = 0xFFFFFFFF;
                                 printf("Will accumulate statistics on a monthly basis.\r\n");
                                 if ( !mProcessTransactions )
                                 {
@@ -254,6 +355,7 @@ public:
                         else if ( strcmp(argv[0],"by_year") == 0 )
                         {
                                 mStatResolution = SR_YEAR;
+                                mStatBoundaryBlock = 0xFFFFFFFF;
                                 printf("Will accumulate statistics on an annual basis.\r\n");
                                 if ( !mProcessTransactions )
                                 {
@@ -280,6 +382,119 @@ public:
                                         }
                                 }
                         }
+                        else if ( strcmp(argv[0],"cluster") == 0 )
+                        {
+                                if ( argc == 1 )
+                                {
+                                        printf("You must supply an address.\r\n");
+                                }
+                                for (uint32_t i=1; i<argc; i++)
+                                {
+                                        mBlockChain->printCluster(argv[i]);
+                                }
+                        }
+                        else if ( strcmp(argv[0],"trace") == 0 )
+                        {
+                                if ( argc < 4 )
+                                {
+                                        printf("Usage: trace <transaction hash> <forward|backward> <poison|haircut|fifo> [hops] [output index]\r\n");
+                                }
+                                else
+                                {
+                                        bool forward = strcmp(argv[2],"backward") != 0;
+                                        uint32_t hops = argc >= 5 ? (uint32_t)atoi(argv[4]) : 16;
+                                        uint32_t output = argc >= 6 ? (uint32_t)atoi(argv[5]) : 0xFFFFFFFF;
+                                        mBlockChain->traceTransaction(argv[1],output,forward,argv[3],hops);
+                                }
+                        }
+                        else if ( strcmp(argv[0],"query") == 0 )
+                        {
+                                if ( argc == 1 )
+                                {
+                                        printf("Usage: query <term> [term...]  e.g. query balance>10 lastused<2012-01-01 coinbase:50 sort:balance limit:50\r\n");
+                                }
+                                else
+                                {
+                                        char expression[2048];
+                                        expression[0] = 0;
+                                        for (uint32_t i=1; i<argc; i++)
+                                        {
+                                                if ( strlen(expression)+strlen(argv[i])+2 > sizeof(expression) ) break;
+                                                strcat(expression,argv[i]);
+                                                strcat(expression," ");
+                                        }
+                                        mBlockChain->query(expression);
+                                }
+                        }
+                        else if ( strcmp(argv[0],"serve") == 0 )
+                        {
+                                if ( mQueryServer )
+                                {
+                                        uint64_t requestCount;
+                                        uint32_t connectionCount;
+                                        mQueryServer->getStats(requestCount,connectionCount);
+                                        if ( argc >= 2 && strcmp(argv[1],"stop") == 0 )
+                                        {
+                                                mQueryServer->release();
+                                                mQueryServer = NULL;
+                                                printf("Stopped the query server after %llu requests.\r\n", (unsigned long long)requestCount );
+                                        }
+                                        else
+                                        {
+                                                printf("Query server is running on port %d; %llu requests answered, %d connections open.\r\n", mQueryServer->getPort(), (unsigned long long)requestCount, connectionCount );
+                                        }
+                                }
+                                else if ( argc >= 2 && strcmp(argv[1],"stop") == 0 )
+                                {
+                                        printf("The query server is not running.\r\n");
+                                }
+                                else
+                                {
+                                        uint16_t port = argc >= 2 ? (uint16_t)atoi(argv[1]) : 8080;
+                                        uint32_t threads = argc >= 3 ? (uint32_t)atoi(argv[2]) : 0;
+                                        mQueryServer = createQueryServer(mBlockChain,port,threads);
+                                }
+                        }
+                        else if ( strcmp(argv[0],"save_clusters") == 0 )
+                        {
+                                mBlockChain->saveClusters( argc >= 2 ? argv[1] : "AddressClusters.bin" );
+                        }
+                        else if ( strcmp(argv[0],"load_clusters") == 0 )
+                        {
+                                mBlockChain->loadClusters( argc >= 2 ? argv[1] : "AddressClusters.bin" );
+                        }
+                        else if ( strcmp(argv[0],"balance") == 0 || strcmp(argv[0],"balance_at") == 0 )
+                        {
+                                if ( argc != 3 )
+                                {
+                                        printf("Usage: %s <address> %s\r\n", argv[0], strcmp(argv[0],"balance") == 0 ? "<block>" : "<time>" );
+                                }
+                                else
+                                {
+                                        uint64_t balance = 0;
+                                        uint32_t blockIndex = (uint32_t)strtoul(argv[2],NULL,10);
+                                        bool ok;
+                                        if ( strcmp(argv[0],"balance") == 0 )
+                                        {
+                                                ok = mBlockChain->getBalanceAtBlock(argv[1],blockIndex,balance);
+                                        }
+                                        else
+                                        {
+                                                ok = mBlockChain->getBalanceAtTime(argv[1],blockIndex,balance,blockIndex);
+                                        }
+                                        if ( ok )
+                                        {
+                                                if ( blockIndex == 0xFFFFFFFF )
+                                                {
+                                                        printf("No blocks were processed at or before that time.\r\n");
+                                                }
+                                                else
+                                                {
+                                                        printf("Balance of %s at the end of block #%d : %0.8f BTC\r\n", argv[1], blockIndex, (double)balance/100000000.0 );
+                                                }
+                                        }
+                                }
+                        }
                         else if ( strcmp(argv[0],"process") == 0 )
                         {
                                 if ( mMode == CM_PROCESS )
@@ -293,11 +508,18 @@ public:
                                         {
                                                 stopScanning();
                                         }
-                                        mProcessBlock = 0;
-                                        mMode = CM_PROCESS;
-                                        printf("Beginning processing of %d blocks : Gathering Statistics=%s\r\n", 
-                                        mBlockChain->getBlockCount(), 
-                                        mProcessTransactions ? "true":"false");
+                                        if ( mReorgFailed )
+                                        {
+                                                printf("ERROR: a chain reorganization could not be undone; restart the tool to re-process from the start.\r\n");
+                                        }
+                                        else
+                                        {
+                                                mProcessBlock = mBlockChain->getProcessedBlockCount();
+                                                mMode = CM_PROCESS;
+                                                printf("Beginning processing of %d blocks : Gathering Statistics=%s\r\n", 
+                                                mBlockChain->getBlockCount(), 
+                                                mProcessTransactions ? "true":"false");
+                                        }
                                 }
                         }
                         else if ( strcmp(argv[0],"statistics") == 0 )
@@ -381,22 +603,48 @@ public:
                         else if ( strcmp(argv[0],"by_day") == 0 )
                         {
                                 mStatResolution = SR_DAY;
+                                mStatBoundaryBlock = 0xFFFFFFFF;
                                 printf("Gathering statistics every day.\r\n");
                         }
                         else if ( strcmp(argv[0],"by_month") == 0 )
                         {
                                 mStatResolution = SR_MONTH;
+                                mStatBoundaryBlock = 0xFFFFFFFF;
                                 printf("Gathering statistics every month.\r\n");
                         }
                         else if ( strcmp(argv[0],"by_year") == 0 )
                         {
                                 mStatResolution = SR_YEAR;
+                                mStatBoundaryBlock = 0xFFFFFFFF;
                                 printf("Gathering statistics every year.\r\n");
                         }
                         else if ( strcmp(argv[0],"counts") == 0 )
                         {
                                 mBlockChain->reportCounts();
                         }
+                        else if ( strcmp(argv[0],"log") == 0 )
+                        {
+                                processLog(argc,argv);
+                        }
+                        else if ( strcmp(argv[0],"perf") == 0 )
+                        {
+                                processPerf(argc,argv);
+                        }
+                        else if ( strcmp(argv[0],"memory") == 0 )
+                        {
+                                mBlockChain->reportMemory();
+                        }
+                        else if ( strcmp(argv[0],"undo") == 0 )
+                        {
+                                uint32_t count = 1;
+                                if ( argc >= 2 )
+                                {
+                                        count = (uint32_t)atoi(argv[1]);
+                                }
+                                uint32_t undone = mBlockChain->disconnectBlocks(count);
+                                mProcessBlock = mBlockChain->getProcessedBlockCount();
+                                printf("Disconnected %d blocks; processing will resume at block #%d\r\n", undone, mProcessBlock );
+                        }
                         else if ( strcmp(argv[0],"block") == 0 )
                         {
                                 if ( argc == 1 )
@@ -420,6 +668,7 @@ public:
                                         }
                                 }
                         }
+                        logFlush(); // so the next prompt comes after everything the command logged
                 }
                 switch ( mMode )
                 {
@@ -432,42 +681,25 @@ public:
 
                                                 if ( mLastTime == 0 )
                                                 {
-                                                        mLastTime = mCurrentBlock->timeStamp;
+                                                        mLastTime = mBlockChain->getBlockTime(mProcessBlock);
                                                         mSatoshiTime = mCurrentBlock->timeStamp;
+                                                        mStatBoundaryBlock = getPeriodEndBlock(mProcessBlock);
                                                 }
                                                 else
                                                 {
-                                                        uint32_t currentTime = mCurrentBlock->timeStamp;
-                                                        time_t tnow(currentTime);
-                                                        struct tm beg;
-                                                        beg = *localtime(&tnow);
-                                                        time_t tbefore(mLastTime);
-                                                        struct tm before;
-                                                        before = *localtime(&tbefore);
-                                                        bool getStats = false;
-                                                        switch ( mStatResolution )
+                                                        if ( mStatBoundaryBlock == 0xFFFFFFFF ) // the period of the previous block decides whether this one starts a new period
                                                         {
-                                                                case SR_DAY:
-                                                                        if ( beg.tm_yday != before.tm_yday )
-                                                                        {
-                                                                                getStats = true;
-                                                                        }
-                                                                        break;
-                                                                case SR_MONTH:
-                                                                        if ( beg.tm_mon != before.tm_mon )
-                                                                        {
-                                                                                getStats = true;
-                                                                        }
-                                                                        break;
-                                                                case SR_YEAR:
-                                                                        if ( beg.tm_year != before.tm_year )
-                                                                        {
-                                                                                getStats = true;
-                                                                        }
-                                                                        break;
+                                                                mStatBoundaryBlock = getPeriodEndBlock(mProcessBlock ? mProcessBlock-1 : 0);
                                                         }
-                                                        if ( getStats )
+                                                        uint32_t currentTime = mBlockChain->getBlockTime(mProcessBlock);
+                                                        if ( mProcessBlock >= mStatBoundaryBlock )
                                                         {
+                                                                time_t tnow(currentTime);
+                                                                struct tm beg;
+                                                                beg = *localtime(&tnow);
+                                                                time_t tbefore(mLastTime);
+                                                                struct tm before;
+                                                                before = *localtime(&tbefore);
                                                                 const char *months[12] = { "January", "February", "March", "April", "May", "June", "July", "August", "September", "October", "November", "December" };
                                                                 printf("Gathering statistics for %s %d, %d to %s %d, %d\r\n", 
                                                                         months[before.tm_mon], before.tm_mday, before.tm_year+1900,
@@ -475,6 +707,7 @@ public:
                                                                 mBlockChain->gatherStatistics(mLastTime,(uint32_t)zombieDate,mRecordAddresses);
                                                                 mLastTime = currentTime;
                                                                 processUsage();
+                                                                mStatBoundaryBlock = getPeriodEndBlock(mProcessBlock);
                                                         }
                                                         else
                                                         {
@@ -512,6 +745,7 @@ public:
                                                 mFinishedScanning = true;
                                                 mMode = CM_NONE; // done scanning.
                                                 mLastBlockScan = mBlockChain->buildBlockChain();
+                                                handleReorg();
                                                 printf("Finished scanning block headers. Built block-chain with %d blocks found..\r\n", mLastBlockScan);
                                                 printf("To resolve transactions you must execute the 'process' command.\r\n");
                                                 printf("To gather statistics so you can ouput balances of individual addresses, you must execute the 'statistics' command prior to running the process command.\r\n");
@@ -522,6 +756,82 @@ public:
                 return mMode != CM_EXIT;
         }
 
+        void processLog(uint32_t argc,const char **argv)
+        {
+                if ( argc >= 2 )
+                {
+                        if ( strcmp(argv[1],"counters") == 0 )
+                        {
+                                logSetCountersOnly(!logGetCountersOnly());
+                                printf("Counting diagnostic messages without printing them set to: %s\r\n", logGetCountersOnly() ? "true" : "false" );
+                        }
+                        else if ( strcmp(argv[1],"rate") == 0 && argc >= 3 )
+                        {
+                                logSetRateLimit((uint32_t)atoi(argv[2]));
+                                printf("Diagnostic messages limited to %d per second per site (0 means no limit).\r\n", logGetRateLimit() );
+                        }
+                        else
+                        {
+                                uint32_t level = 0;
+                                while ( level < LL_LAST && strcmp(argv[1],logGetLevelName((LogLevel)level)) != 0 )
+                                {
+                                        level++;
+                                }
+                                if ( level < LL_LAST )
+                                {
+                                        logSetLevel((LogLevel)level);
+                                        printf("Log level set to: %s\r\n", logGetLevelName(logGetLevel()) );
+                                }
+                                else
+                                {
+                                        printf("Usage: log [debug|info|warning|error|counters|rate <n>]\r\n");
+                                }
+                        }
+                }
+                else
+                {
+                        logReport();
+                }
+        }
+
+        void processPerf(uint32_t argc,const char **argv)
+        {
+                if ( argc >= 2 && strcmp(argv[1],"reset") == 0 )
+                {
+                        profileReset();
+                        printf("Stage timers and counters start from zero again.\r\n");
+                }
+                else if ( argc >= 2 && strcmp(argv[1],"file") == 0 )
+                {
+                        if ( argc >= 3 && strcmp(argv[2],"off") == 0 )
+                        {
+                                profileSetStatsFile(NULL,0);
+                                printf("Stopped writing the stats file.\r\n");
+                        }
+                        else
+                        {
+                                const char *fname = argc >= 3 ? argv[2] : "perf_stats.json";
+                                uint32_t seconds = argc >= 4 ? (uint32_t)atoi(argv[3]) : 10;
+                                if ( seconds == 0 )
+                                {
+                                        seconds = 10;
+                                }
+                                if ( profileSetStatsFile(fname,seconds) )
+                                {
+                                        printf("Appending stage totals to '%s' every %d seconds.\r\n", fname, seconds );
+                                }
+                                else
+                                {
+                                        printf("Failed to open file '%s' for write access.\r\n", fname );
+                                }
+                        }
+                }
+                else
+                {
+                        profileReport();
+                }
+        }
+
         const BlockChain::Block *getBlock(uint32_t index)
         {
                 mCurrentBlock = mBlockChain->readBlock(index);
@@ -609,11 +919,14 @@ public:
         CommandMode                             mMode;
         bool                                    mExportTransactions;
         bool                                    mAnalyze;
+        bool                                    mWitnessHashes;
         bool                                    mRecordAddresses;
         bool                                    mFinishedScanning;
+        bool                                    mReorgFailed;           // A reorganization left blocks of the abandoned chain processed
         bool                                    mProcessTransactions;
         StatResolution                  mStatResolution;
         uint32_t                                mProcessBlock;
+        uint32_t                                mStatBoundaryBlock;     // First block of the next statistics period; 0xFFFFFFFF when it must be recomputed
         uint32_t                                mMaxBlock;
         uint32_t                                mLastBlockScan;
         uint32_t                                mLastBlockPrint;
@@ -624,6 +937,7 @@ public:
         float                                   mMinBalance;
         BlockChainAddresses             *mAddresses;
         DebugVisualize                  *mDebugVisualize;
+        QueryServer                     *mQueryServer;
         bool                                    mAbsoluteTime;
 };
 
@@ -666,6 +980,8 @@ int main(int argc,const char **argv)
 
         while ( bc.process() );
 
+        profileSetStatsFile(NULL,0); // writes the final totals
+        logShutdown();
 
         return 0;
 }
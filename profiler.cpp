@@ -0,0 +1,384 @@
+#include "Profiler.h"
+#include "Logger.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+
+thread_local ProfileCounters *gProfileCounters = nullptr;
+
+namespace PROFILER
+{
+
+static const char *gStageNames[PS_LAST] =
+{
+	"file_read",
+	"parse",
+	"txid_hash",
+	"hash160",
+	"map_insert",
+	"map_find",
+	"address_lookup",
+	"process",
+	"gather_addresses",
+	"statistics"
+};
+
+// Totals for one stage, in ticks.
+class StageTotal
+{
+public:
+	StageTotal(void)
+	{
+		mTicks = 0;
+		mCalls = 0;
+		mItems = 0;
+	}
+
+	uint64_t	mTicks;
+	uint64_t	mCalls;
+	uint64_t	mItems;
+};
+
+// The values of one thread's counters at the last reset.
+class ThreadBase
+{
+public:
+	StageTotal	mStages[PS_LAST];
+};
+
+// Hands a thread's counters back when it exits.  Only touched when a thread registers, so the fast path in profileAdd
+// never pays for the guard of a thread_local with a destructor.
+class ThreadExit
+{
+public:
+	ThreadExit(void)
+	{
+		mCounters = NULL;
+	}
+
+	~ThreadExit(void)
+	{
+		if ( mCounters )
+		{
+			gProfileCounters = NULL;
+			mCounters->mInUse.store(false,std::memory_order_release);
+		}
+	}
+
+	ProfileCounters	*mCounters;
+};
+
+static thread_local ThreadExit gThreadExit;
+
+class Profiler
+{
+public:
+	Profiler(void)
+	{
+		mCounters.store(NULL,std::memory_order_relaxed);
+		mThreadCount = 0;
+		mStartTicks = profileTicks();
+		mStartTime = std::chrono::steady_clock::now();
+		mStatsFile = NULL;
+		mStatsThread = NULL;
+		mStatsSeconds = 0;
+		mStop = false;
+	}
+
+	ProfileCounters *registerThread(void)
+	{
+		ProfileCounters *ret = NULL;
+		// Take over the counters of a thread which has exited; their totals carry on under the new thread
+		for (ProfileCounters *c=mCounters.load(std::memory_order_acquire); c && ret == NULL; c=c->mNext)
+		{
+			bool inUse = false;
+			if ( c->mInUse.compare_exchange_strong(inUse,true,std::memory_order_acquire) )
+			{
+				ret = c;
+			}
+		}
+		if ( ret == NULL )
+		{
+			ret = new ProfileCounters;
+			for (uint32_t i=0; i<PS_LAST; i++)
+			{
+				ret->mTicks[i].store(0,std::memory_order_relaxed);
+				ret->mCalls[i].store(0,std::memory_order_relaxed);
+				ret->mItems[i].store(0,std::memory_order_relaxed);
+			}
+			ret->mInUse.store(true,std::memory_order_relaxed);
+			{
+				std::lock_guard< std::mutex > lock(mMutex);
+				ret->mThreadNumber = mThreadCount++;
+				mBase.resize(mThreadCount);
+			}
+			ProfileCounters *head = mCounters.load(std::memory_order_relaxed);
+			do
+			{
+				ret->mNext = head;
+			} while ( !mCounters.compare_exchange_weak(head,ret,std::memory_order_release,std::memory_order_relaxed) );
+		}
+		gThreadExit.mCounters = ret;
+		gProfileCounters = ret;
+		return ret;
+	}
+
+	// The counters of one thread since the last reset.
+	void getThread(const ProfileCounters &c,StageTotal *stages)
+	{
+		const ThreadBase &base = mBase[c.mThreadNumber];
+		for (uint32_t i=0; i<PS_LAST; i++)
+		{
+			stages[i].mTicks = c.mTicks[i].load(std::memory_order_relaxed)-base.mStages[i].mTicks;
+			stages[i].mCalls = c.mCalls[i].load(std::memory_order_relaxed)-base.mStages[i].mCalls;
+			stages[i].mItems = c.mItems[i].load(std::memory_order_relaxed)-base.mStages[i].mItems;
+		}
+	}
+
+	// Sums every thread; also returns how many threads recorded something for each stage.  Call with mMutex held.
+	void getTotals(StageTotal *totals,uint32_t *threads)
+	{
+		for (uint32_t i=0; i<PS_LAST; i++)
+		{
+			totals[i] = StageTotal();
+			threads[i] = 0;
+		}
+		for (ProfileCounters *c=mCounters.load(std::memory_order_acquire); c; c=c->mNext)
+		{
+			StageTotal stages[PS_LAST];
+			getThread(*c,stages);
+			for (uint32_t i=0; i<PS_LAST; i++)
+			{
+				totals[i].mTicks+=stages[i].mTicks;
+				totals[i].mCalls+=stages[i].mCalls;
+				totals[i].mItems+=stages[i].mItems;
+				if ( stages[i].mCalls )
+				{
+					threads[i]++;
+				}
+			}
+		}
+	}
+
+	// Ticks per second, measured against the steady clock since the profiler started.  Right after start up the interval is
+	// too short to be accurate, so it is stretched a little.
+	double getTicksPerSecond(void)
+	{
+		double elapsed = getElapsed();
+		if ( elapsed < 0.05 )
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			elapsed = getElapsed();
+		}
+		return (double)(profileTicks()-mStartTicks)/elapsed;
+	}
+
+	double getElapsed(void) const
+	{
+		return std::chrono::duration< double >(std::chrono::steady_clock::now()-mStartTime).count();
+	}
+
+	void report(void)
+	{
+		std::lock_guard< std::mutex > lock(mMutex);
+		double tps = getTicksPerSecond();
+		StageTotal totals[PS_LAST];
+		uint32_t threads[PS_LAST];
+		getTotals(totals,threads);
+		logPrint(NULL,"Profile over %0.1f seconds; %s ticks, %0.0f MHz.  Stages nest, see Profiler.h.\r\n", getElapsed(), PROFILE_RDTSC ? "time stamp counter" : "steady clock", tps/1e6 );
+		logPrint(NULL,"%-18s %14s %16s %12s %12s %14s %8s\r\n", "Stage", "Calls", "Items", "Seconds", "us/call", "Items/s", "Threads" );
+		for (uint32_t i=0; i<PS_LAST; i++)
+		{
+			const StageTotal &t = totals[i];
+			double seconds = (double)t.mTicks/tps;
+			logPrint(NULL,"%-18s %14llu %16llu %12.3f %12.2f %14.0f %8d\r\n", gStageNames[i],
+				(unsigned long long)t.mCalls, (unsigned long long)t.mItems, seconds,
+				t.mCalls ? seconds*1e6/(double)t.mCalls : 0.0,
+				seconds > 0 ? (double)t.mItems/seconds : 0.0,
+				threads[i] );
+		}
+		for (ProfileCounters *c=mCounters.load(std::memory_order_acquire); c; c=c->mNext)
+		{
+			StageTotal stages[PS_LAST];
+			getThread(*c,stages);
+			char line[1024];
+			uint32_t length = 0;
+			for (uint32_t i=0; i<PS_LAST && length < sizeof(line); i++)
+			{
+				if ( stages[i].mCalls )
+				{
+					int n = snprintf(line+length,sizeof(line)-length," %s %0.3fs", gStageNames[i], (double)stages[i].mTicks/tps );
+					length+= n > 0 ? (uint32_t)n : 0;
+				}
+			}
+			if ( length )
+			{
+				logPrint(NULL,"    Thread #%d%s:%s\r\n", c->mThreadNumber, c->mInUse.load(std::memory_order_relaxed) ? "" : " (exited)", line );
+			}
+		}
+		logFlush();
+	}
+
+	void reset(void)
+	{
+		std::lock_guard< std::mutex > lock(mMutex);
+		for (ProfileCounters *c=mCounters.load(std::memory_order_acquire); c; c=c->mNext)
+		{
+			ThreadBase &base = mBase[c->mThreadNumber];
+			for (uint32_t i=0; i<PS_LAST; i++)
+			{
+				base.mStages[i].mTicks = c->mTicks[i].load(std::memory_order_relaxed);
+				base.mStages[i].mCalls = c->mCalls[i].load(std::memory_order_relaxed);
+				base.mStages[i].mItems = c->mItems[i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void getStage(ProfileStage stage,uint64_t &calls,uint64_t &items,double &seconds)
+	{
+		std::lock_guard< std::mutex > lock(mMutex);
+		double tps = getTicksPerSecond();
+		StageTotal totals[PS_LAST];
+		uint32_t threads[PS_LAST];
+		getTotals(totals,threads);
+		calls = totals[stage].mCalls;
+		items = totals[stage].mItems;
+		seconds = (double)totals[stage].mTicks/tps;
+	}
+
+	bool setStatsFile(const char *fileName,uint32_t seconds)
+	{
+		stopStats();
+		if ( fileName == NULL || seconds == 0 )
+		{
+			return true;
+		}
+		mStatsFile = fopen(fileName,"ab");	// lines of earlier runs are kept; every line carries its own time
+		if ( mStatsFile == NULL )
+		{
+			return false;
+		}
+		mStatsSeconds = seconds;
+		mStop = false;
+		mStatsThread = new std::thread([this]() { statsThread(); });
+		return true;
+	}
+
+	void stopStats(void)
+	{
+		if ( mStatsThread )
+		{
+			{
+				std::lock_guard< std::mutex > lock(mStatsMutex);
+				mStop = true;
+			}
+			mStatsWake.notify_one();
+			mStatsThread->join();
+			delete mStatsThread;
+			mStatsThread = NULL;
+		}
+		if ( mStatsFile )
+		{
+			fclose(mStatsFile);
+			mStatsFile = NULL;
+		}
+	}
+
+private:
+
+	void statsThread(void)
+	{
+		std::unique_lock< std::mutex > lock(mStatsMutex);
+		while ( !mStop )
+		{
+			mStatsWake.wait_for(lock,std::chrono::seconds(mStatsSeconds));
+			writeStats();	// a last line when stopped, so the file always ends with the final totals
+		}
+	}
+
+	// One line of JSON: {"time":..,"elapsed":..,"stages":{"file_read":{"calls":..,"items":..,"seconds":..},..}}
+	void writeStats(void)
+	{
+		StageTotal totals[PS_LAST];
+		uint32_t threads[PS_LAST];
+		double tps;
+		{
+			std::lock_guard< std::mutex > lock(mMutex);
+			tps = getTicksPerSecond();
+			getTotals(totals,threads);
+		}
+		fprintf(mStatsFile,"{\"time\":%llu,\"elapsed\":%0.3f,\"stages\":{", (unsigned long long)time(NULL), getElapsed() );
+		for (uint32_t i=0; i<PS_LAST; i++)
+		{
+			fprintf(mStatsFile,"%s\"%s\":{\"calls\":%llu,\"items\":%llu,\"seconds\":%0.6f,\"threads\":%d}", i ? "," : "", gStageNames[i],
+				(unsigned long long)totals[i].mCalls, (unsigned long long)totals[i].mItems, (double)totals[i].mTicks/tps, threads[i] );
+		}
+		fprintf(mStatsFile,"}}\n");
+		fflush(mStatsFile);
+	}
+
+	std::atomic< ProfileCounters * >	mCounters;
+	uint32_t							mThreadCount;
+	std::vector< ThreadBase >			mBase;			// indexed by thread number
+	std::mutex							mMutex;			// guards mBase and the thread numbering
+	uint64_t							mStartTicks;
+	std::chrono::steady_clock::time_point	mStartTime;
+	FILE								*mStatsFile;
+	std::thread							*mStatsThread;
+	uint32_t							mStatsSeconds;
+	bool								mStop;
+	std::mutex							mStatsMutex;
+	std::condition_variable				mStatsWake;
+};
+
+// Never destroyed, so threads still recording at exit have something to record into.
+static Profiler &getProfiler(void)
+{
+	static Profiler *gProfiler = new Profiler;
+	return *gProfiler;
+}
+
+}; // end of namespace
+
+ProfileCounters *profileRegisterThread(void)
+{
+	return PROFILER::getProfiler().registerThread();
+}
+
+const char *profileGetStageName(ProfileStage stage)
+{
+	return stage < PS_LAST ? PROFILER::gStageNames[stage] : "unknown";
+}
+
+void profileReport(void)
+{
+	PROFILER::getProfiler().report();
+}
+
+void profileReset(void)
+{
+	PROFILER::getProfiler().reset();
+}
+
+void profileGetStage(ProfileStage stage,uint64_t &calls,uint64_t &items,double &seconds)
+{
+	calls = 0;
+	items = 0;
+	seconds = 0;
+	if ( stage < PS_LAST )
+	{
+		PROFILER::getProfiler().getStage(stage,calls,items,seconds);
+	}
+}
+
+bool profileSetStatsFile(const char *fileName,uint32_t seconds)
+{
+	return PROFILER::getProfiler().setStatsFile(fileName,seconds);
+}
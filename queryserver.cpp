@@ -0,0 +1,712 @@
+#include "QueryServer.h"
+#include "BlockChain.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <strings.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+
+#define MAX_REQUEST_SIZE 8192					// Longest request (line plus headers) we accept
+#define MIN_BODY_SIZE (64*1024)					// Initial size of a connection's response buffer
+#define MAX_BODY_SIZE (256*1024*1024)			// Largest response we will render
+#define MAX_EPOLL_EVENTS 256
+#define DEFAULT_ADDRESS_LIMIT 50				// Transactions per '/address' page, as blockchain.info
+#define DEFAULT_UNSPENT_LIMIT 250				// Outputs per '/unspent' request, as blockchain.info
+#define MAX_RESULT_LIMIT 1000
+
+namespace QUERY_SERVER
+{
+
+// One client socket.  EPOLLONESHOT guarantees that only one thread (the event loop or a single worker) owns a connection at
+// any time, so it needs no lock of its own.
+class Connection
+{
+public:
+	Connection(int s)
+	{
+		mSocket = s;
+		mRequestLength = 0;
+		mRequestEnd = 0;
+		mHeaderLength = 0;
+		mBody = NULL;
+		mBodyCapacity = 0;
+		mBodyData = NULL;
+		mBodyLength = 0;
+		mSent = 0;
+		mKeepAlive = false;
+		mSending = false;
+	}
+
+	~Connection(void)
+	{
+		delete []mBody;
+	}
+
+	// Makes sure the response buffer holds at least this many bytes; the contents are not preserved.
+	bool reserve(uint32_t size)
+	{
+		if ( size > mBodyCapacity )
+		{
+			if ( size > MAX_BODY_SIZE )
+			{
+				return false;
+			}
+			uint32_t capacity = mBodyCapacity ? mBodyCapacity : MIN_BODY_SIZE;
+			while ( capacity < size )
+			{
+				capacity*=2;
+			}
+			delete []mBody;
+			mBody = new char[capacity];
+			mBodyCapacity = capacity;
+		}
+		return true;
+	}
+
+	int			mSocket;
+	char		mRequest[MAX_REQUEST_SIZE+1];
+	uint32_t	mRequestLength;			// Bytes received into mRequest
+	uint32_t	mRequestEnd;			// Length of the request being answered; pipelined bytes past it are kept
+	char		mHeader[256];
+	uint32_t	mHeaderLength;
+	char		*mBody;					// Response buffer, reused for every request on this connection
+	uint32_t	mBodyCapacity;
+	const char	*mBodyData;				// What is sent as the body; mBody or a constant string
+	uint32_t	mBodyLength;
+	uint32_t	mSent;					// Bytes of header plus body sent so far
+	bool		mKeepAlive;
+	bool		mSending;				// Waiting for the socket to become writable to finish a response
+};
+
+class QueryServerImpl : public QueryServer
+{
+public:
+	QueryServerImpl(BlockChain *blockChain)
+	{
+		mBlockChain = blockChain;
+		mListenSocket = -1;
+		mEpoll = -1;
+		mWake = -1;
+		mPort = 0;
+		mQuit = false;
+		mRequestCount = 0;
+		mConnectionCount = 0;
+	}
+
+	virtual ~QueryServerImpl(void)
+	{
+		if ( mWake >= 0 )
+		{
+			uint64_t one = 1;
+			ssize_t r = write(mWake,&one,sizeof(one));
+			(void)r;
+		}
+		if ( mLoopThread.joinable() )
+		{
+			mLoopThread.join();
+		}
+		{
+			std::lock_guard< std::mutex > lock(mQueueMutex);
+			mQuit = true;
+		}
+		mQueueReady.notify_all();
+		for (size_t i=0; i<mWorkers.size(); i++)
+		{
+			mWorkers[i].join();
+		}
+		for (std::unordered_set< Connection * >::iterator i=mConnections.begin(); i!=mConnections.end(); ++i)
+		{
+			close((*i)->mSocket);
+			delete *i;
+		}
+		if ( mListenSocket >= 0 ) close(mListenSocket);
+		if ( mWake >= 0 ) close(mWake);
+		if ( mEpoll >= 0 ) close(mEpoll);
+	}
+
+	bool start(uint16_t port,uint32_t workerCount)
+	{
+		mListenSocket = socket(AF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+		if ( mListenSocket < 0 )
+		{
+			printf("QueryServer: failed to create a socket (%s)\r\n", strerror(errno) );
+			return false;
+		}
+		int on = 1;
+		setsockopt(mListenSocket,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+		sockaddr_in addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		if ( bind(mListenSocket,(sockaddr *)&addr,sizeof(addr)) != 0 || listen(mListenSocket,SOMAXCONN) != 0 )
+		{
+			printf("QueryServer: failed to listen on 127.0.0.1:%d (%s)\r\n", port, strerror(errno) );
+			return false;
+		}
+		socklen_t len = sizeof(addr);
+		getsockname(mListenSocket,(sockaddr *)&addr,&len);
+		mPort = ntohs(addr.sin_port);
+
+		mEpoll = epoll_create1(EPOLL_CLOEXEC);
+		mWake = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+		if ( mEpoll < 0 || mWake < 0 )
+		{
+			printf("QueryServer: failed to create the event loop (%s)\r\n", strerror(errno) );
+			return false;
+		}
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &mListenSocket;
+		epoll_ctl(mEpoll,EPOLL_CTL_ADD,mListenSocket,&ev);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &mWake;
+		epoll_ctl(mEpoll,EPOLL_CTL_ADD,mWake,&ev);
+
+		if ( workerCount == 0 )
+		{
+			workerCount = std::thread::hardware_concurrency();
+			if ( workerCount > 8 ) workerCount = 8;
+			if ( workerCount == 0 ) workerCount = 1;
+		}
+		for (uint32_t i=0; i<workerCount; i++)
+		{
+			mWorkers.push_back(std::thread(&QueryServerImpl::workerThread,this));
+		}
+		mLoopThread = std::thread(&QueryServerImpl::loopThread,this);
+		printf("QueryServer: listening on http://127.0.0.1:%d with %d workers.\r\n", mPort, workerCount );
+		return true;
+	}
+
+	virtual uint16_t getPort(void) const
+	{
+		return mPort;
+	}
+
+	virtual void getStats(uint64_t &requestCount,uint32_t &connectionCount) const
+	{
+		requestCount = mRequestCount;
+		connectionCount = mConnectionCount;
+	}
+
+	virtual void release(void)
+	{
+		delete this;
+	}
+
+private:
+	void loopThread(void)
+	{
+		epoll_event events[MAX_EPOLL_EVENTS];
+		for (;;)
+		{
+			int n = epoll_wait(mEpoll,events,MAX_EPOLL_EVENTS,-1);
+			if ( n < 0 )
+			{
+				if ( errno == EINTR ) continue;
+				printf("QueryServer: epoll_wait failed (%s)\r\n", strerror(errno) );
+				break;
+			}
+			for (int i=0; i<n; i++)
+			{
+				void *p = events[i].data.ptr;
+				if ( p == &mWake )
+				{
+					return;
+				}
+				else if ( p == &mListenSocket )
+				{
+					acceptConnections();
+				}
+				else
+				{
+					Connection *c = (Connection *)p;
+					if ( c->mSending )
+					{
+						if ( events[i].events & (EPOLLERR | EPOLLHUP) )
+						{
+							closeConnection(c);
+						}
+						else
+						{
+							sendResponse(c);
+						}
+					}
+					else
+					{
+						receiveRequest(c);
+					}
+				}
+			}
+		}
+	}
+
+	void acceptConnections(void)
+	{
+		for (;;)
+		{
+			int s = accept4(mListenSocket,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if ( s < 0 )
+			{
+				break;
+			}
+			int on = 1;
+			setsockopt(s,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+			Connection *c = new Connection(s);
+			{
+				std::lock_guard< std::mutex > lock(mConnectionMutex);
+				mConnections.insert(c);
+			}
+			mConnectionCount++;
+			epoll_event ev;
+			ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+			ev.data.ptr = c;
+			epoll_ctl(mEpoll,EPOLL_CTL_ADD,s,&ev);
+		}
+	}
+
+	void rearm(Connection *c,uint32_t events)
+	{
+		epoll_event ev;
+		ev.events = events | EPOLLRDHUP | EPOLLONESHOT;
+		ev.data.ptr = c;
+		epoll_ctl(mEpoll,EPOLL_CTL_MOD,c->mSocket,&ev);
+	}
+
+	void closeConnection(Connection *c)
+	{
+		epoll_ctl(mEpoll,EPOLL_CTL_DEL,c->mSocket,NULL);
+		close(c->mSocket);
+		{
+			std::lock_guard< std::mutex > lock(mConnectionMutex);
+			mConnections.erase(c);
+		}
+		mConnectionCount--;
+		delete c;
+	}
+
+	// Returns the length of the first complete request in the buffer, or zero if it has not all arrived yet.
+	static uint32_t findRequestEnd(const Connection *c)
+	{
+		for (uint32_t i=3; i<c->mRequestLength; i++)
+		{
+			if ( c->mRequest[i-3] == '\r' && c->mRequest[i-2] == '\n' && c->mRequest[i-1] == '\r' && c->mRequest[i] == '\n' )
+			{
+				return i+1;
+			}
+		}
+		return 0;
+	}
+
+	void receiveRequest(Connection *c)
+	{
+		for (;;)
+		{
+			if ( c->mRequestLength == MAX_REQUEST_SIZE )
+			{
+				break;
+			}
+			ssize_t r = recv(c->mSocket,c->mRequest+c->mRequestLength,MAX_REQUEST_SIZE-c->mRequestLength,0);
+			if ( r > 0 )
+			{
+				c->mRequestLength+=(uint32_t)r;
+			}
+			else if ( r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+			{
+				break;
+			}
+			else if ( r < 0 && errno == EINTR )
+			{
+				continue;
+			}
+			else
+			{
+				closeConnection(c); // closed by the client, or failed
+				return;
+			}
+		}
+		c->mRequestEnd = findRequestEnd(c);
+		if ( c->mRequestEnd )
+		{
+			queueRequest(c);
+		}
+		else if ( c->mRequestLength == MAX_REQUEST_SIZE )
+		{
+			closeConnection(c); // request too large
+		}
+		else
+		{
+			rearm(c,EPOLLIN);
+		}
+	}
+
+	// Hands a connection with a complete request in mRequest[0,mRequestEnd) to the workers.
+	void queueRequest(Connection *c)
+	{
+		std::lock_guard< std::mutex > lock(mQueueMutex);
+		mQueue.push_back(c);
+		mQueueReady.notify_one();
+	}
+
+	void workerThread(void)
+	{
+		for (;;)
+		{
+			Connection *c;
+			{
+				std::unique_lock< std::mutex > lock(mQueueMutex);
+				while ( !mQuit && mQueue.empty() )
+				{
+					mQueueReady.wait(lock);
+				}
+				if ( mQuit )
+				{
+					return;
+				}
+				c = mQueue.front();
+				mQueue.pop_front();
+			}
+			answerRequest(c);
+			sendResponse(c);
+		}
+	}
+
+	// Writes as much of the response as the socket takes.  When it is all sent the connection goes back to reading, or back
+	// to the workers if a pipelined request is already waiting; otherwise it waits for the socket to become writable.  This
+	// runs on the event loop as well as on the workers, so it never answers a request itself.
+	void sendResponse(Connection *c)
+	{
+		uint32_t total = c->mHeaderLength+c->mBodyLength;
+		while ( c->mSent < total )
+		{
+			iovec iov[2];
+			int count = 0;
+			if ( c->mSent < c->mHeaderLength )
+			{
+				iov[count].iov_base = c->mHeader+c->mSent;
+				iov[count].iov_len = c->mHeaderLength-c->mSent;
+				count++;
+				iov[count].iov_base = (void *)c->mBodyData;
+				iov[count].iov_len = c->mBodyLength;
+				count++;
+			}
+			else
+			{
+				iov[count].iov_base = (void *)(c->mBodyData+(c->mSent-c->mHeaderLength));
+				iov[count].iov_len = total-c->mSent;
+				count++;
+			}
+			msghdr msg;
+			memset(&msg,0,sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			ssize_t r = sendmsg(c->mSocket,&msg,MSG_NOSIGNAL);
+			if ( r > 0 )
+			{
+				c->mSent+=(uint32_t)r;
+			}
+			else if ( r < 0 && errno == EINTR )
+			{
+				continue;
+			}
+			else if ( r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+			{
+				c->mSending = true;
+				rearm(c,EPOLLOUT);
+				return;
+			}
+			else
+			{
+				closeConnection(c);
+				return;
+			}
+		}
+		c->mSending = false;
+		if ( !c->mKeepAlive )
+		{
+			closeConnection(c);
+			return;
+		}
+		// Drop the answered request, keeping any pipelined bytes which followed it.
+		c->mRequestLength-=c->mRequestEnd;
+		memmove(c->mRequest,c->mRequest+c->mRequestEnd,c->mRequestLength);
+		c->mRequestEnd = findRequestEnd(c);
+		if ( c->mRequestEnd == 0 )
+		{
+			rearm(c,EPOLLIN);
+			return;
+		}
+		queueRequest(c);
+	}
+
+	void setResponse(Connection *c,uint32_t status,const char *contentType,const char *body,uint32_t bodyLength)
+	{
+		const char *reason = "OK";
+		switch ( status )
+		{
+			case 400: reason = "Bad Request"; break;
+			case 404: reason = "Not Found"; break;
+			case 405: reason = "Method Not Allowed"; break;
+			case 500: reason = "Internal Server Error"; break;
+		}
+		c->mBodyData = body;
+		c->mBodyLength = bodyLength;
+		c->mHeaderLength = (uint32_t)snprintf(c->mHeader,sizeof(c->mHeader),
+			"HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: %s\r\n\r\n",
+			status, reason, contentType, bodyLength, c->mKeepAlive ? "keep-alive" : "close" );
+		c->mSent = 0;
+	}
+
+	// Error responses point straight at the constant text.
+	void setError(Connection *c,uint32_t status,const char *text)
+	{
+		setResponse(c,status,"text/plain",text,(uint32_t)strlen(text));
+	}
+
+	// Copies the value of 'name' out of a query string, undoing the percent and '+' encoding.
+	static bool getParameter(const char *query,const char *name,char *dest,uint32_t destSize)
+	{
+		size_t nameLength = strlen(name);
+		const char *scan = query;
+		while ( scan && *scan )
+		{
+			if ( strncmp(scan,name,nameLength) == 0 && scan[nameLength] == '=' )
+			{
+				decode(scan+nameLength+1,'&',dest,destSize);
+				return true;
+			}
+			scan = strchr(scan,'&');
+			if ( scan ) scan++;
+		}
+		return false;
+	}
+
+	static uint32_t getHexDigit(char c)
+	{
+		if ( c >= '0' && c <= '9' ) return (uint32_t)(c-'0');
+		if ( c >= 'a' && c <= 'f' ) return (uint32_t)(c-'a'+10);
+		if ( c >= 'A' && c <= 'F' ) return (uint32_t)(c-'A'+10);
+		return 16;
+	}
+
+	static void decode(const char *src,char terminator,char *dest,uint32_t destSize)
+	{
+		uint32_t len = 0;
+		while ( *src && *src != terminator && len+1 < destSize )
+		{
+			char c = *src++;
+			if ( c == '%' && getHexDigit(src[0]) < 16 && getHexDigit(src[1]) < 16 )
+			{
+				c = (char)(getHexDigit(src[0])*16+getHexDigit(src[1]));
+				src+=2;
+			}
+			else if ( c == '+' )
+			{
+				c = ' ';
+			}
+			dest[len++] = c;
+		}
+		dest[len] = 0;
+	}
+
+	static uint32_t getLimit(const char *query,const char *name,uint32_t defaultValue,uint32_t maxValue)
+	{
+		char scratch[32];
+		uint32_t ret = defaultValue;
+		if ( getParameter(query,name,scratch,sizeof(scratch)) )
+		{
+			ret = (uint32_t)strtoul(scratch,NULL,10);
+			if ( ret > maxValue ) ret = maxValue;
+		}
+		return ret;
+	}
+
+	// Parses the request in c->mRequest[0,mRequestEnd) and renders its response.
+	void answerRequest(Connection *c)
+	{
+		mRequestCount++;
+		char *request = c->mRequest;
+		char saved = request[c->mRequestEnd];
+		request[c->mRequestEnd] = 0;
+
+		// HTTP/1.1 connections stay open unless the client says otherwise; HTTP/1.0 ones close unless it asks.
+		const char *eol = strstr(request,"\r\n");
+		bool http10 = eol && eol-request >= 8 && strncmp(eol-8,"HTTP/1.0",8) == 0;
+		c->mKeepAlive = !http10;
+		for (const char *h=eol; h && h[2]; h=strstr(h+2,"\r\n"))
+		{
+			if ( strncasecmp(h+2,"Connection:",11) == 0 )
+			{
+				const char *v = h+13;
+				while ( *v == ' ' ) v++;
+				if ( strncasecmp(v,"close",5) == 0 ) c->mKeepAlive = false;
+				else if ( strncasecmp(v,"keep-alive",10) == 0 ) c->mKeepAlive = true;
+			}
+		}
+
+		char path[1024];
+		char query[2048];
+		path[0] = 0;
+		query[0] = 0;
+		if ( strncmp(request,"GET ",4) != 0 )
+		{
+			c->mKeepAlive = false;
+			setError(c,405,"Only GET is supported\n");
+		}
+		else
+		{
+			const char *target = request+4;
+			uint32_t len = 0;
+			while ( target[len] && target[len] != ' ' && target[len] != '?' && len+1 < sizeof(path) )
+			{
+				path[len] = target[len];
+				len++;
+			}
+			path[len] = 0;
+			if ( target[len] == '?' )
+			{
+				const char *q = target+len+1;
+				uint32_t qlen = 0;
+				while ( q[qlen] && q[qlen] != ' ' && qlen+1 < sizeof(query) )
+				{
+					query[qlen] = q[qlen];
+					qlen++;
+				}
+				query[qlen] = 0;
+			}
+			route(c,path,query);
+		}
+		request[c->mRequestEnd] = saved;
+	}
+
+	void route(Connection *c,const char *path,const char *query)
+	{
+		const char *address = NULL;
+		if ( strncmp(path,"/address/",9) == 0 )
+		{
+			address = path+9;
+		}
+		else if ( strncmp(path,"/rawaddr/",9) == 0 )
+		{
+			address = path+9;
+		}
+		if ( address )
+		{
+			char adr[128];
+			decode(address,0,adr,sizeof(adr));
+			uint32_t limit = getLimit(query,"limit",DEFAULT_ADDRESS_LIMIT,MAX_RESULT_LIMIT);
+			uint32_t offset = getLimit(query,"offset",0,0xFFFFFFFF);
+			uint32_t length;
+			// The chain may grow between calls; render again until the document fits.
+			for (;;)
+			{
+				length = mBlockChain->getAddressJSON(adr,offset,limit,c->mBody,c->mBodyCapacity);
+				if ( length <= c->mBodyCapacity || !c->reserve(length) ) break;
+			}
+			if ( length == 0 )
+			{
+				setError(c,404,"Unknown or invalid address\n");
+			}
+			else if ( length > c->mBodyCapacity )
+			{
+				setError(c,500,"Response too large\n");
+			}
+			else
+			{
+				setResponse(c,200,"application/json",c->mBody,length);
+			}
+		}
+		else if ( strcmp(path,"/unspent") == 0 )
+		{
+			char active[MAX_REQUEST_SIZE];
+			if ( !getParameter(query,"active",active,sizeof(active)) || active[0] == 0 )
+			{
+				setError(c,500,"No active addresses\n");
+				return;
+			}
+			uint32_t limit = getLimit(query,"limit",DEFAULT_UNSPENT_LIMIT,MAX_RESULT_LIMIT);
+			uint32_t outputCount = 0;
+			uint32_t length;
+			for (;;)
+			{
+				length = mBlockChain->getUnspentJSON(active,limit,c->mBody,c->mBodyCapacity,outputCount);
+				if ( length <= c->mBodyCapacity || !c->reserve(length) ) break;
+			}
+			if ( outputCount == 0 )
+			{
+				setError(c,500,"No free outputs to spend\n"); // what blockchain.info answers, and what blockchain_info.py expects
+			}
+			else if ( length > c->mBodyCapacity )
+			{
+				setError(c,500,"Response too large\n");
+			}
+			else
+			{
+				setResponse(c,200,"application/json",c->mBody,length);
+			}
+		}
+		else
+		{
+			setError(c,404,"Not found\n");
+		}
+	}
+
+	BlockChain							*mBlockChain;
+	int									mListenSocket;
+	int									mEpoll;
+	int									mWake;			// eventfd which stops the event loop
+	uint16_t							mPort;
+	std::thread							mLoopThread;
+	std::vector< std::thread >			mWorkers;
+	std::mutex							mQueueMutex;
+	std::condition_variable				mQueueReady;
+	std::deque< Connection * >			mQueue;			// Connections with a complete request waiting for a worker
+	bool								mQuit;
+	std::mutex							mConnectionMutex;
+	std::unordered_set< Connection * >	mConnections;	// Every open connection, so they can be closed on release
+	std::atomic< uint64_t >				mRequestCount;
+	std::atomic< uint32_t >				mConnectionCount;
+};
+
+}; // end of QUERY_SERVER namespace
+
+QueryServer *createQueryServer(BlockChain *blockChain,uint16_t port,uint32_t workerCount)
+{
+	QUERY_SERVER::QueryServerImpl *ret = new QUERY_SERVER::QueryServerImpl(blockChain);
+	if ( !ret->start(port,workerCount) )
+	{
+		ret->release();
+		ret = NULL;
+	}
+	return ret;
+}
+
+#else
+
+QueryServer *createQueryServer(BlockChain * /*blockChain*/,uint16_t /*port*/,uint32_t /*workerCount*/)
+{
+	printf("QueryServer: the query server needs epoll and is only available on Linux.\r\n");
+	return NULL;
+}
+
+#endif